@@ -0,0 +1,16 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BENCH_LEDGER_H
+#define BENCH_LEDGER_H
+
+// Registers the server benchmarks which are run at each of the ledger sizes
+// given by --ledger_sizes.  Must be called after the flags are parsed.
+void RegisterLedgerBenchmarks();
+
+#endif // BENCH_LEDGER_H
+
+// End of File
@@ -0,0 +1,916 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Load generator for webcashd.  A population of simulated wallets pass
+// webcash between themselves with replace requests, occasionally burning or
+// health checking their outputs, while miner threads supply mining reports.
+//
+// Requests are issued on a Poisson schedule fixed in advance, whether or not
+// the server keeps up, and latency is measured from the time each request was
+// scheduled rather than the time it was actually sent.  Otherwise a server
+// that stalls would also stall the generator, and the requests which would
+// have been queued behind the stall would never be measured (coordinated
+// omission).
+
+#include <iostream>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include <drogon/HttpClient.h>
+#include <trantor/net/EventLoopThreadPool.h>
+
+#include "async.h"
+#include "crypto/sha256.h"
+#include "random.h"
+#include "uint256.h"
+#include "util/hex.h"
+#include "util/pow.h"
+#include "webcash.h"
+
+ABSL_FLAG(std::string, server, "http://127.0.0.1:8000", "server endpoint");
+ABSL_FLAG(unsigned, connections, 64, "number of HTTP connections to spread requests over");
+ABSL_FLAG(unsigned, wallets, 1000, "number of simulated wallets");
+ABSL_FLAG(unsigned, miners, 0, "number of threads mining reports to submit");
+ABSL_FLAG(std::string, seed, "", "secret webcash to fund the wallets with, instead of mining a report");
+ABSL_FLAG(double, replace_rate, 200.0, "replace requests per second");
+ABSL_FLAG(double, burn_rate, 2.0, "burn requests per second");
+ABSL_FLAG(double, health_check_rate, 50.0, "health check requests per second");
+ABSL_FLAG(double, mining_report_rate, 0.0, "mining reports per second, as fast as the miners allow");
+ABSL_FLAG(double, zipf, 1.5, "exponent of the Zipf distribution of the number of inputs and outputs of each request");
+ABSL_FLAG(unsigned, max_outputs, 32, "largest number of inputs or outputs in a single request");
+ABSL_FLAG(double, transfer_fraction, 0.5, "fraction of replace outputs paid to another wallet");
+ABSL_FLAG(double, warmup, 5.0, "seconds of load before measurement starts");
+ABSL_FLAG(double, duration, 30.0, "seconds of load to measure");
+ABSL_FLAG(double, timeout, 30.0, "seconds to wait for each response");
+
+enum Endpoint {
+    REPLACE,
+    BURN,
+    HEALTH_CHECK,
+    MINING_REPORT,
+    NUM_ENDPOINTS,
+};
+
+static const char* const k_endpoint_names[NUM_ENDPOINTS] = {
+    "replace",
+    "burn",
+    "health_check",
+    "mining_report",
+};
+
+static const char* const k_endpoint_paths[NUM_ENDPOINTS] = {
+    "/api/v1/replace",
+    "/api/v1/burn",
+    "/api/v1/health_check",
+    "/api/v1/mining_report",
+};
+
+enum Outcome {
+    SUCCESS,      // 200 OK
+    REJECTED,     // Any other response; the request had no effect
+    NO_RESPONSE,  // The request may or may not have had effect
+};
+
+struct EndpointStats {
+    std::mutex mutex;
+    // Latency of each successful request, in microseconds from the time it
+    // was scheduled.
+    std::vector<int64_t> latencies;
+    uint64_t errors = 0;
+    uint64_t failures = 0;
+    // Arrivals for which there was nothing to send: no wallet with funds
+    // became idle within the timeout, or no mined report was ready.
+    uint64_t skipped = 0;
+};
+
+EndpointStats g_stats[NUM_ENDPOINTS];
+
+// Only requests scheduled within this window are recorded.
+absl::Time g_measure_begin{absl::InfiniteFuture()};
+absl::Time g_measure_end{absl::InfiniteFuture()};
+
+bool is_measured(absl::Time scheduled)
+{
+    return g_measure_begin <= scheduled && scheduled < g_measure_end;
+}
+
+void record(Endpoint endpoint, absl::Time scheduled, absl::Time finished, Outcome outcome)
+{
+    if (!is_measured(scheduled)) {
+        return;
+    }
+    EndpointStats& stats = g_stats[endpoint];
+    const std::lock_guard<std::mutex> lock(stats.mutex);
+    switch (outcome) {
+        case SUCCESS: stats.latencies.push_back(absl::ToInt64Microseconds(finished - scheduled)); break;
+        case REJECTED: ++stats.errors; break;
+        case NO_RESPONSE: ++stats.failures; break;
+    }
+}
+
+void record_skipped(Endpoint endpoint, absl::Time scheduled)
+{
+    if (!is_measured(scheduled)) {
+        return;
+    }
+    EndpointStats& stats = g_stats[endpoint];
+    const std::lock_guard<std::mutex> lock(stats.mutex);
+    ++stats.skipped;
+}
+
+/** A fixed set of asynchronous connections to the server, each with its own
+ *  queue of requests.  New requests go to whichever connection has the
+ *  fewest outstanding. */
+class ClientPool {
+public:
+    typedef std::function<void(drogon::ReqResult, const drogon::HttpResponsePtr&)> Callback;
+
+    ClientPool(const std::string& server, unsigned connections, unsigned threads, double timeout)
+        : m_loops(threads, "loadgen")
+        , m_in_flight(new std::atomic<int>[connections])
+        , m_timeout(timeout)
+    {
+        m_loops.start();
+        for (unsigned i = 0; i < connections; ++i) {
+            m_clients.push_back(drogon::HttpClient::newHttpClient(server, m_loops.getNextLoop()));
+            m_in_flight[i] = 0;
+        }
+    }
+
+    void Request(drogon::HttpMethod method, const std::string& path, std::string body, Callback callback)
+    {
+        size_t best = 0;
+        for (size_t i = 1; i < m_clients.size(); ++i) {
+            if (m_in_flight[i] < m_in_flight[best]) {
+                best = i;
+            }
+        }
+        ++m_in_flight[best];
+        ++m_total_in_flight;
+
+        auto req = drogon::HttpRequest::newHttpRequest();
+        req->setMethod(method);
+        req->setPath(path);
+        if (method == drogon::Post) {
+            req->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+            req->setBody(std::move(body));
+        }
+        m_clients[best]->sendRequest(req, [this, best, callback = std::move(callback)](drogon::ReqResult result, const drogon::HttpResponsePtr& resp) {
+            callback(result, resp);
+            --m_in_flight[best];
+            if (--m_total_in_flight == 0) {
+                const std::lock_guard<std::mutex> lock(m_mutex);
+                m_cv.notify_all();
+            }
+        }, m_timeout);
+    }
+
+    /** Sends a request and records its outcome against an endpoint. */
+    void Send(Endpoint endpoint, std::string body, absl::Time scheduled, std::function<void(Outcome, const drogon::HttpResponsePtr&)> done)
+    {
+        Request(drogon::Post, k_endpoint_paths[endpoint], std::move(body), [endpoint, scheduled, done = std::move(done)](drogon::ReqResult result, const drogon::HttpResponsePtr& resp) {
+            const absl::Time finished = absl::Now();
+            Outcome outcome = NO_RESPONSE;
+            if (result == drogon::ReqResult::Ok && resp) {
+                outcome = resp->getStatusCode() == drogon::k200OK ? SUCCESS : REJECTED;
+            }
+            record(endpoint, scheduled, finished, outcome);
+            if (done) {
+                done(outcome, resp);
+            }
+        });
+    }
+
+    /** Sends a request and waits for the response, which is returned if it
+     *  is 200 OK.  For setting up, not for generating load. */
+    std::optional<Json::Value> Call(drogon::HttpMethod method, const std::string& path, std::string body)
+    {
+        std::promise<std::optional<Json::Value>> promise;
+        Request(method, path, std::move(body), [&promise, &path](drogon::ReqResult result, const drogon::HttpResponsePtr& resp) {
+            if (result != drogon::ReqResult::Ok || !resp) {
+                std::cerr << "Error: no response to " << path << " request: result=" << static_cast<int>(result) << std::endl;
+                promise.set_value(std::nullopt);
+                return;
+            }
+            if (resp->getStatusCode() != drogon::k200OK || !resp->getJsonObject()) {
+                std::cerr << "Error: returned invalid response to " << path << " request: status_code=" << resp->getStatusCode() << ", text='" << resp->getBody() << "'" << std::endl;
+                promise.set_value(std::nullopt);
+                return;
+            }
+            promise.set_value(*resp->getJsonObject());
+        });
+        return promise.get_future().get();
+    }
+
+    /** Waits until there are no requests outstanding, or the timeout
+     *  expires.  Returns the number still outstanding. */
+    int Drain(absl::Duration timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait_for(lock, absl::ToChronoSeconds(timeout), [this] { return m_total_in_flight == 0; });
+        return m_total_in_flight;
+    }
+
+private:
+    trantor::EventLoopThreadPool m_loops;
+    std::vector<drogon::HttpClientPtr> m_clients;
+    std::unique_ptr<std::atomic<int>[]> m_in_flight;
+    std::atomic<int> m_total_in_flight{0};
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    double m_timeout;
+};
+
+SecretWebcash new_secret(FastRandomContext& rng, Amount amount)
+{
+    const uint256 sk = rng.rand256();
+    SecretWebcash esk;
+    esk.amount = amount;
+    esk.sk.resize(64);
+    HexEncode32(&esk.sk[0], sk.begin());
+    return esk;
+}
+
+std::string legalese_json()
+{
+    return "\"legalese\": {\"terms\": true}";
+}
+
+std::string json_list(const std::vector<std::string>& items)
+{
+    std::string ret = "[";
+    for (size_t i = 0; i < items.size(); ++i) {
+        absl::StrAppend(&ret, i ? ", \"" : "\"", items[i], "\"");
+    }
+    ret.push_back(']');
+    return ret;
+}
+
+std::vector<std::string> secret_strings(const std::vector<SecretWebcash>& coins)
+{
+    std::vector<std::string> ret;
+    ret.reserve(coins.size());
+    for (const SecretWebcash& esk : coins) {
+        ret.emplace_back(to_string(esk).c_str());
+    }
+    return ret;
+}
+
+/** The webcash held by each simulated wallet.  A wallet is busy while it has
+ *  a replace or burn outstanding, so that a wallet only ever has one spend in
+ *  flight; payments to it are accepted at any time. */
+class WalletPool {
+public:
+    explicit WalletPool(size_t n) : m_coins(n), m_busy(n, false) {}
+
+    size_t size() const { return m_coins.size(); }
+
+    /** Picks an idle wallet with funds and marks it busy, or returns -1 if
+     *  there are none. */
+    int Acquire(FastRandomContext& rng)
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t start = rng.randrange(m_coins.size());
+        for (size_t i = 0; i < m_coins.size(); ++i) {
+            const size_t w = (start + i) % m_coins.size();
+            if (!m_busy[w] && !m_coins[w].empty()) {
+                m_busy[w] = true;
+                return w;
+            }
+        }
+        return -1;
+    }
+
+    void Release(int w)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            m_busy[w] = false;
+            ++m_changes;
+        }
+        m_changed.notify_all();
+    }
+
+    /** Counts the releases and deposits so far, for WaitForChange(). */
+    uint64_t Changes()
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        return m_changes;
+    }
+
+    /** Waits until a wallet has been released or funded since Changes()
+     *  returned seen, or until the deadline. */
+    void WaitForChange(uint64_t seen, absl::Time deadline)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait_for(lock, absl::ToChronoNanoseconds(std::max(deadline - absl::Now(), absl::ZeroDuration())), [this, seen] { return m_changes != seen; });
+    }
+
+    /** Removes up to n coins, chosen at random, from a wallet. */
+    std::vector<SecretWebcash> Take(int w, size_t n, FastRandomContext& rng)
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<SecretWebcash>& coins = m_coins[w];
+        std::vector<SecretWebcash> ret;
+        while (ret.size() < n && !coins.empty()) {
+            const size_t k = rng.randrange(coins.size());
+            ret.push_back(std::move(coins[k]));
+            coins[k] = std::move(coins.back());
+            coins.pop_back();
+        }
+        return ret;
+    }
+
+    /** The public webcash of up to n coins, chosen at random, from a random
+     *  wallet with funds. */
+    std::vector<std::string> Sample(size_t n, FastRandomContext& rng)
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<std::string> ret;
+        const size_t start = rng.randrange(m_coins.size());
+        for (size_t i = 0; i < m_coins.size() && ret.empty(); ++i) {
+            const std::vector<SecretWebcash>& coins = m_coins[(start + i) % m_coins.size()];
+            for (size_t j = 0; j < n && j < coins.size(); ++j) {
+                ret.push_back(to_string(PublicWebcash(coins[rng.randrange(coins.size())])));
+            }
+        }
+        return ret;
+    }
+
+    void Deposit(int w, SecretWebcash esk)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            m_coins[w].push_back(std::move(esk));
+            ++m_changes;
+        }
+        m_changed.notify_all();
+    }
+
+    void Deposit(int w, std::vector<SecretWebcash> coins)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            for (SecretWebcash& esk : coins) {
+                m_coins[w].push_back(std::move(esk));
+            }
+            ++m_changes;
+        }
+        m_changed.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::vector<std::vector<SecretWebcash>> m_coins;
+    std::vector<bool> m_busy;
+    uint64_t m_changes = 0;
+};
+
+struct Solution {
+    unsigned difficulty;
+    std::string preimage;
+    SecretWebcash keep;
+};
+
+std::atomic<bool> g_stop{false};
+
+// The current mining target, as last fetched from the server.
+std::atomic<unsigned> g_difficulty{0};
+std::atomic<int64_t> g_mining_amount{0};
+std::atomic<int64_t> g_subsidy_amount{0};
+
+std::mutex g_solutions_mutex;
+std::condition_variable g_solutions_cv;
+std::deque<Solution> g_solutions;
+
+// Miners pause once this many solutions are waiting to be reported.
+static const size_t k_max_solutions = 1000;
+
+/** Sets the mining difficulty, dropping any solutions which no longer meet
+ *  it. */
+void set_difficulty(unsigned difficulty)
+{
+    if (g_difficulty.exchange(difficulty) < difficulty) {
+        // Reports mined at the old difficulty would be rejected.
+        const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+        g_solutions.erase(std::remove_if(g_solutions.begin(), g_solutions.end(), [difficulty](const Solution& s) { return s.difficulty < difficulty; }), g_solutions.end());
+        g_solutions_cv.notify_all();
+    }
+}
+
+bool update_target(const Json::Value& o)
+{
+    if (!o.isObject() || !o["difficulty_target_bits"].isUInt() || !o["mining_amount"].isString() || !o["mining_subsidy_amount"].isString()) {
+        std::cerr << "Error: unexpected response to target request: " << o.toStyledString() << std::endl;
+        return false;
+    }
+    Amount mining_amount, subsidy_amount;
+    if (!mining_amount.parse(o["mining_amount"].asString()) || !subsidy_amount.parse(o["mining_subsidy_amount"].asString())) {
+        std::cerr << "Error: unable to parse mining amounts: " << o.toStyledString() << std::endl;
+        return false;
+    }
+    g_mining_amount = mining_amount.i64;
+    g_subsidy_amount = subsidy_amount.i64;
+    set_difficulty(o["difficulty_target_bits"].asUInt());
+    return true;
+}
+
+void mining_thread_func()
+{
+    using std::to_string;
+
+    // The base64 encodings of the three-digit nonces 000 to 999.
+    std::string nonces;
+    for (int n = 0; n < 1000; ++n) {
+        nonces += absl::Base64Escape(absl::StrFormat("%03d", n));
+    }
+    static const char final[] = "fQ==";
+
+    FastRandomContext rng;
+    while (!g_stop) {
+        {
+            std::unique_lock<std::mutex> lock(g_solutions_mutex);
+            g_solutions_cv.wait(lock, [] { return g_stop || g_solutions.size() < k_max_solutions; });
+        }
+        if (g_stop) {
+            break;
+        }
+
+        const unsigned difficulty = g_difficulty;
+        const Amount mining_amount(g_mining_amount.load());
+        const Amount subsidy_amount(g_subsidy_amount.load());
+        SecretWebcash keep = new_secret(rng, mining_amount - subsidy_amount);
+        const std::string keep_str(to_string(keep).c_str());
+        const std::string subsidy_str(to_string(new_secret(rng, subsidy_amount)).c_str());
+        // Laid out exactly as webminer does it, so that only the nonce needs
+        // to be hashed for each attempt.
+        std::string prefix = absl::StrCat("{\"legalese\": {\"terms\": true}, \"webcash\": [\"", keep_str, "\", \"", subsidy_str, "\"], \"subsidy\": [\"", subsidy_str, "\"], \"difficulty\": ", difficulty, ", \"timestamp\": ", to_string(absl::ToDoubleSeconds(absl::Now() - absl::UnixEpoch())), ", \"nonce\": ");
+        prefix.resize(48 * (1 + prefix.size() / 48), ' ');
+        prefix.back() = '1';
+        const std::string prefix_b64 = absl::Base64Escape(prefix);
+        CSHA256 midstate;
+        midstate.Write((const unsigned char*)prefix_b64.data(), prefix_b64.size());
+
+        // A solution is taken only if it is found within the first batch
+        // that has one, after which new secrets are generated.
+        const int W = 25*8;
+        unsigned char hashes[W*32];
+        bool found = false;
+        for (int i = 0; i < 1000 && !found && !g_stop; ++i) {
+            for (int j = 0; j < 1000 && !found; j += W) {
+                for (int k = 0; k < W; k += 8) {
+                    midstate.WriteAndFinalize8((const unsigned char*)nonces.data() + 4*i, (const unsigned char*)nonces.data() + 4*(j+k), (const unsigned char*)final, hashes + k*32);
+                }
+                const size_t k = FindProofOfWork(hashes, W, difficulty);
+                if (k < W) {
+                    std::string preimage = absl::StrCat(prefix_b64, absl::string_view(nonces.data() + 4*i, 4), absl::string_view(nonces.data() + 4*(j+k), 4), final);
+                    const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+                    g_solutions.push_back({difficulty, std::move(preimage), std::move(keep)});
+                    g_solutions_cv.notify_all();
+                    found = true;
+                }
+            }
+        }
+    }
+}
+
+std::optional<Solution> pop_solution()
+{
+    const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+    if (g_solutions.empty()) {
+        return std::nullopt;
+    }
+    Solution soln = std::move(g_solutions.front());
+    g_solutions.pop_front();
+    g_solutions_cv.notify_all();
+    return soln;
+}
+
+std::string mining_report_body(const Solution& soln)
+{
+    return absl::StrCat("{\"preimage\": \"", soln.preimage, "\", ", legalese_json(), "}");
+}
+
+/** Generates the load, one arrival at a time. */
+class LoadGenerator {
+public:
+    LoadGenerator(ClientPool& pool, WalletPool& wallets)
+        : m_pool(pool)
+        , m_wallets(wallets)
+        , m_transfer_fraction(absl::GetFlag(FLAGS_transfer_fraction))
+        , m_timeout(absl::Seconds(absl::GetFlag(FLAGS_timeout)))
+    {
+        const double s = absl::GetFlag(FLAGS_zipf);
+        std::vector<double> weights;
+        for (unsigned k = 1; k <= std::max(absl::GetFlag(FLAGS_max_outputs), 1u); ++k) {
+            weights.push_back(std::pow(k, -s));
+        }
+        m_zipf = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+
+    void Dispatch(Endpoint endpoint, absl::Time scheduled)
+    {
+        bool sent = false;
+        switch (endpoint) {
+            case REPLACE:
+            case BURN:
+                // These wait for a wallet, behind any earlier arrivals which
+                // are already waiting, so that a server slow to respond
+                // shows up in their latency rather than as skipped requests.
+                m_waiting.emplace_back(endpoint, scheduled);
+                SendWaiting();
+                return;
+            case HEALTH_CHECK: sent = HealthCheck(scheduled); break;
+            case MINING_REPORT: sent = MiningReport(scheduled); break;
+            default: break;
+        }
+        if (!sent) {
+            record_skipped(endpoint, scheduled);
+        }
+    }
+
+    /** Sends the arrivals waiting for a wallet as wallets become available,
+     *  until the deadline. */
+    void RunUntil(absl::Time deadline)
+    {
+        for (;;) {
+            const uint64_t seen = m_wallets.Changes();
+            SendWaiting();
+            if (absl::Now() >= deadline) {
+                return;
+            }
+            if (m_waiting.empty()) {
+                absl::SleepFor(deadline - absl::Now());
+                return;
+            }
+            m_wallets.WaitForChange(seen, std::min(deadline, m_waiting.front().second + m_timeout));
+        }
+    }
+
+    /** Waits for the arrivals still waiting for a wallet to be sent, or to
+     *  time out. */
+    void Finish()
+    {
+        while (!m_waiting.empty()) {
+            RunUntil(m_waiting.front().second + m_timeout);
+        }
+    }
+
+private:
+    size_t Zipf() { return 1 + m_zipf(m_rng); }
+
+    /** Sends the waiting arrivals, in order, for as long as there are idle
+     *  wallets with funds.  Those which have waited longer than the timeout
+     *  are given up on. */
+    void SendWaiting()
+    {
+        const absl::Time now = absl::Now();
+        while (!m_waiting.empty()) {
+            const Endpoint endpoint = m_waiting.front().first;
+            const absl::Time scheduled = m_waiting.front().second;
+            const int w = m_wallets.Acquire(m_rng);
+            if (w < 0) {
+                if (now - scheduled < m_timeout) {
+                    return;
+                }
+                record_skipped(endpoint, scheduled);
+            } else if (endpoint == REPLACE) {
+                Replace(w, scheduled);
+            } else {
+                Burn(w, scheduled);
+            }
+            m_waiting.pop_front();
+        }
+    }
+
+    void Replace(int w, absl::Time scheduled)
+    {
+        auto inputs = std::make_shared<std::vector<SecretWebcash>>(m_wallets.Take(w, Zipf(), m_rng));
+        int64_t total = 0;
+        for (const SecretWebcash& esk : *inputs) {
+            total += esk.amount.i64;
+        }
+
+        // The amount is split evenly, with any remainder going to the first
+        // output.  Some of the outputs are payments to other wallets, and the
+        // rest are change.
+        const int64_t n = std::min<int64_t>(Zipf(), total);
+        auto outputs = std::make_shared<std::vector<std::pair<int, SecretWebcash>>>();
+        for (int64_t i = 0; i < n; ++i) {
+            const Amount amount(total / n + (i ? 0 : total % n));
+            int owner = w;
+            if (m_wallets.size() > 1 && m_rng.randrange(1000000) < m_transfer_fraction * 1000000) {
+                owner = m_rng.randrange(m_wallets.size());
+            }
+            outputs->emplace_back(owner, new_secret(m_rng, amount));
+        }
+
+        std::vector<SecretWebcash> new_coins;
+        for (const auto& output : *outputs) {
+            new_coins.push_back(output.second);
+        }
+        std::string body = absl::StrCat("{", legalese_json(), ", \"webcashes\": ", json_list(secret_strings(*inputs)), ", \"new_webcashes\": ", json_list(secret_strings(new_coins)), "}");
+
+        WalletPool& wallets = m_wallets;
+        m_pool.Send(REPLACE, std::move(body), scheduled, [&wallets, w, inputs, outputs](Outcome outcome, const drogon::HttpResponsePtr&) {
+            if (outcome == SUCCESS) {
+                for (auto& output : *outputs) {
+                    wallets.Deposit(output.first, std::move(output.second));
+                }
+            } else if (outcome == REJECTED) {
+                wallets.Deposit(w, std::move(*inputs));
+            }
+            // With no response at all, it is not known which of the inputs
+            // and outputs are valid, so both are dropped.
+            wallets.Release(w);
+        });
+    }
+
+    void Burn(int w, absl::Time scheduled)
+    {
+        auto inputs = std::make_shared<std::vector<SecretWebcash>>(m_wallets.Take(w, 1, m_rng));
+        std::string body = absl::StrCat("{", legalese_json(), ", \"destroy_webcash\": ", json_list(secret_strings(*inputs)), "}");
+
+        WalletPool& wallets = m_wallets;
+        m_pool.Send(BURN, std::move(body), scheduled, [&wallets, w, inputs](Outcome outcome, const drogon::HttpResponsePtr&) {
+            if (outcome == REJECTED) {
+                wallets.Deposit(w, std::move(*inputs));
+            }
+            wallets.Release(w);
+        });
+    }
+
+    bool HealthCheck(absl::Time scheduled)
+    {
+        const std::vector<std::string> pks = m_wallets.Sample(Zipf(), m_rng);
+        if (pks.empty()) {
+            return false;
+        }
+        m_pool.Send(HEALTH_CHECK, json_list(pks), scheduled, nullptr);
+        return true;
+    }
+
+    bool MiningReport(absl::Time scheduled)
+    {
+        std::optional<Solution> soln = pop_solution();
+        if (!soln) {
+            return false;
+        }
+        auto keep = std::make_shared<SecretWebcash>(std::move(soln->keep));
+        const int w = m_rng.randrange(m_wallets.size());
+
+        WalletPool& wallets = m_wallets;
+        m_pool.Send(MINING_REPORT, mining_report_body(*soln), scheduled, [&wallets, w, keep](Outcome outcome, const drogon::HttpResponsePtr& resp) {
+            if (outcome == SUCCESS) {
+                wallets.Deposit(w, std::move(*keep));
+                if (resp && resp->getJsonObject()) {
+                    const Json::Value& o = *resp->getJsonObject();
+                    if (o["difficulty_target"].isUInt()) {
+                        set_difficulty(o["difficulty_target"].asUInt());
+                    }
+                }
+            }
+        });
+        return true;
+    }
+
+    ClientPool& m_pool;
+    WalletPool& m_wallets;
+    FastRandomContext m_rng;
+    std::discrete_distribution<size_t> m_zipf;
+    double m_transfer_fraction;
+    // Arrivals waiting for an idle wallet with funds, oldest first, and how
+    // long they may wait.
+    std::deque<std::pair<Endpoint, absl::Time>> m_waiting;
+    absl::Duration m_timeout;
+};
+
+/** Splits the initial funds evenly over the wallets. */
+bool fund_wallets(ClientPool& pool, WalletPool& wallets, SecretWebcash treasury)
+{
+    const int64_t share = treasury.amount.i64 / wallets.size();
+    if (share < 1) {
+        std::cerr << "Error: " << to_string(treasury.amount) << " is too little to fund " << wallets.size() << " wallets." << std::endl;
+        return false;
+    }
+    FastRandomContext rng;
+    static const size_t k_batch = 64;
+    for (size_t w = 0; w < wallets.size(); w += k_batch) {
+        std::vector<std::pair<int, SecretWebcash>> outputs;
+        int64_t change = treasury.amount.i64;
+        for (size_t i = w; i < std::min(w + k_batch, wallets.size()); ++i) {
+            outputs.emplace_back(i, new_secret(rng, Amount(share)));
+            change -= share;
+        }
+        SecretWebcash next;
+        std::vector<SecretWebcash> new_coins;
+        for (const auto& output : outputs) {
+            new_coins.push_back(output.second);
+        }
+        if (change > 0) {
+            next = new_secret(rng, Amount(change));
+            new_coins.push_back(next);
+        }
+        std::string body = absl::StrCat("{", legalese_json(), ", \"webcashes\": ", json_list(secret_strings({treasury})), ", \"new_webcashes\": ", json_list(secret_strings(new_coins)), "}");
+        if (!pool.Call(drogon::Post, k_endpoint_paths[REPLACE], std::move(body))) {
+            std::cerr << "Error: unable to fund wallets; the unspent funds are in " << to_string(treasury) << std::endl;
+            return false;
+        }
+        for (auto& output : outputs) {
+            wallets.Deposit(output.first, std::move(output.second));
+        }
+        treasury = std::move(next);
+    }
+    return true;
+}
+
+void print_report(absl::Duration duration, absl::Duration max_lag)
+{
+    std::cout << absl::StrFormat("%-14s %9s %9s %7s %7s %8s %9s %9s %9s %9s %9s %9s", "endpoint", "requests", "ok", "errors", "failed", "skipped", "ok/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms") << std::endl;
+    for (int e = 0; e < NUM_ENDPOINTS; ++e) {
+        EndpointStats& stats = g_stats[e];
+        const std::lock_guard<std::mutex> lock(stats.mutex);
+        std::vector<int64_t>& lat = stats.latencies;
+        std::sort(lat.begin(), lat.end());
+        auto percentile = [&lat](double p) {
+            if (lat.empty()) {
+                return 0.0;
+            }
+            return lat[std::min<size_t>(lat.size() - 1, p * lat.size())] / 1000.0;
+        };
+        const uint64_t requests = lat.size() + stats.errors + stats.failures;
+        std::cout << absl::StrFormat("%-14s %9d %9d %7d %7d %8d %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f", k_endpoint_names[e], requests, lat.size(), stats.errors, stats.failures, stats.skipped, lat.size() / absl::ToDoubleSeconds(duration), percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), lat.empty() ? 0.0 : lat.back() / 1000.0) << std::endl;
+    }
+    std::cout << "Latencies are measured from each request's scheduled arrival time.  The generator fell at most " << absl::FormatDuration(max_lag) << " behind schedule." << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    absl::SetProgramUsageMessage(absl::StrCat("Open-loop load generator for the webcash server.\n", argv[0]));
+    absl::ParseCommandLine(argc, argv);
+
+    const std::string algo = SHA256AutoDetect();
+    std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
+    const std::string hex_algo = HexAutoDetect();
+    std::cout << "Using hex algorithm '" << hex_algo << "'." << std::endl;
+    const std::string pow_algo = ProofOfWorkAutoDetect();
+    std::cout << "Using proof-of-work check '" << pow_algo << "'." << std::endl;
+
+    const unsigned num_wallets = absl::GetFlag(FLAGS_wallets);
+    const unsigned num_miners = absl::GetFlag(FLAGS_miners);
+    const std::string seed = absl::GetFlag(FLAGS_seed);
+    if (num_wallets == 0 || absl::GetFlag(FLAGS_connections) == 0) {
+        std::cerr << "Error: --wallets and --connections must be positive." << std::endl;
+        return 1;
+    }
+    if (seed.empty() && num_miners == 0) {
+        std::cerr << "Error: either --seed or --miners is needed to fund the wallets." << std::endl;
+        return 1;
+    }
+    if (absl::GetFlag(FLAGS_mining_report_rate) > 0.0 && num_miners == 0) {
+        std::cerr << "Error: --mining_report_rate requires --miners." << std::endl;
+        return 1;
+    }
+    double rates[NUM_ENDPOINTS];
+    rates[REPLACE] = absl::GetFlag(FLAGS_replace_rate);
+    rates[BURN] = absl::GetFlag(FLAGS_burn_rate);
+    rates[HEALTH_CHECK] = absl::GetFlag(FLAGS_health_check_rate);
+    rates[MINING_REPORT] = absl::GetFlag(FLAGS_mining_report_rate);
+    double total_rate = 0.0;
+    for (double rate : rates) {
+        if (rate < 0.0) {
+            std::cerr << "Error: request rates cannot be negative." << std::endl;
+            return 1;
+        }
+        total_rate += rate;
+    }
+    if (total_rate <= 0.0) {
+        std::cerr << "Error: at least one request rate must be positive." << std::endl;
+        return 1;
+    }
+
+    // The pool is never destroyed: requests which are still outstanding when
+    // the report is printed are abandoned with the process.
+    ClientPool* pool = new ClientPool(absl::GetFlag(FLAGS_server), absl::GetFlag(FLAGS_connections), get_num_workers(), absl::GetFlag(FLAGS_timeout));
+    WalletPool wallets(num_wallets);
+
+    std::optional<Json::Value> target = pool->Call(drogon::Get, "/api/v1/target", "");
+    if (!target || !update_target(*target)) {
+        return 1;
+    }
+    std::cout << "Server difficulty is " << g_difficulty << " bits." << std::endl;
+
+    SecretWebcash treasury;
+    if (!seed.empty() && !treasury.parse(seed)) {
+        std::cerr << "Error: unable to parse --seed as secret webcash." << std::endl;
+        return 1;
+    }
+
+    // The miners have to be stopped and joined before returning, even on
+    // error, since destroying a joinable thread terminates the process.
+    std::vector<std::thread> miners;
+    for (unsigned i = 0; i < num_miners; ++i) {
+        miners.emplace_back(mining_thread_func);
+    }
+    const auto stop_miners = [&miners]() {
+        g_stop = true;
+        g_solutions_cv.notify_all();
+        for (std::thread& miner : miners) {
+            miner.join();
+        }
+        miners.clear();
+    };
+
+    if (seed.empty()) {
+        std::cout << "Mining a report to fund the wallets..." << std::endl;
+        for (;;) {
+            std::optional<Solution> soln;
+            {
+                std::unique_lock<std::mutex> lock(g_solutions_mutex);
+                g_solutions_cv.wait(lock, [] { return !g_solutions.empty(); });
+            }
+            soln = pop_solution();
+            if (soln && pool->Call(drogon::Post, k_endpoint_paths[MINING_REPORT], mining_report_body(*soln))) {
+                treasury = std::move(soln->keep);
+                break;
+            }
+        }
+    }
+    std::cout << "Funding " << num_wallets << " wallets from " << to_string(treasury.amount) << " webcash." << std::endl;
+    if (!fund_wallets(*pool, wallets, std::move(treasury))) {
+        stop_miners();
+        return 1;
+    }
+
+    LoadGenerator generator(*pool, wallets);
+    FastRandomContext rng;
+    std::exponential_distribution<double> interarrival(total_rate);
+    std::discrete_distribution<int> which(rates, rates + NUM_ENDPOINTS);
+
+    const absl::Time start = absl::Now();
+    g_measure_begin = start + absl::Seconds(absl::GetFlag(FLAGS_warmup));
+    g_measure_end = g_measure_begin + absl::Seconds(absl::GetFlag(FLAGS_duration));
+    std::cout << "Generating " << total_rate << " requests per second for " << absl::FormatDuration(g_measure_end - start) << "..." << std::endl;
+
+    absl::Time next_target_fetch = start + absl::Seconds(5);
+    absl::Duration max_lag = absl::ZeroDuration();
+    for (absl::Time scheduled = start + absl::Seconds(interarrival(rng)); scheduled < g_measure_end; scheduled += absl::Seconds(interarrival(rng))) {
+        absl::Time now = absl::Now();
+        if (now < scheduled) {
+            generator.RunUntil(scheduled);
+        } else if (is_measured(scheduled)) {
+            max_lag = std::max(max_lag, now - scheduled);
+        }
+        if (next_target_fetch <= scheduled) {
+            pool->Request(drogon::Get, "/api/v1/target", "", [](drogon::ReqResult result, const drogon::HttpResponsePtr& resp) {
+                if (result == drogon::ReqResult::Ok && resp && resp->getJsonObject()) {
+                    update_target(*resp->getJsonObject());
+                }
+            });
+            next_target_fetch = scheduled + absl::Seconds(5);
+        }
+        generator.Dispatch(static_cast<Endpoint>(which(rng)), scheduled);
+    }
+    generator.Finish();
+    stop_miners();
+
+    const int outstanding = pool->Drain(absl::Seconds(absl::GetFlag(FLAGS_timeout)));
+    if (outstanding) {
+        std::cerr << "Warning: " << outstanding << " requests still outstanding." << std::endl;
+    }
+    print_report(g_measure_end - g_measure_begin, max_lag);
+
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,45 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "support/lockedpool.h"
+
+// A single secret allocated and freed in a loop, from every thread.
+static void LockedPool_alloc_free(benchmark::State& state) {
+    LockedPoolManager& pool = LockedPoolManager::Instance();
+    const size_t size = state.range(0);
+    for (auto _ : state) {
+        void* ptr = pool.alloc(size);
+        benchmark::DoNotOptimize(ptr);
+        pool.free(ptr);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(LockedPool_alloc_free)->Arg(32)->Arg(96)->Arg(1024)->ThreadRange(1, 8);
+
+// Many secrets of a few different sizes, as in a wallet or a request, freed
+// in a different order than they were allocated.
+static void LockedPool_alloc_free_mixed(benchmark::State& state) {
+    static const size_t k_sizes[] = {32, 65, 96, 16, 128, 80};
+    static const size_t k_count = 256;
+    LockedPoolManager& pool = LockedPoolManager::Instance();
+    std::vector<void*> ptrs(k_count);
+    for (auto _ : state) {
+        for (size_t i = 0; i < k_count; ++i) {
+            ptrs[i] = pool.alloc(k_sizes[i % 6]);
+        }
+        for (size_t i = 0; i < k_count; ++i) {
+            pool.free(ptrs[(i * 97) % k_count]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * k_count);
+}
+BENCHMARK(LockedPool_alloc_free_mixed)->ThreadRange(1, 8);
+
+// End of File
@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+
+#include "absl/strings/str_cat.h"
+
+#include "bench/ledger.h"
+#include "crypto/chacha20.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+#include "util/hex.h"
+#include "util/pow.h"
+
+int main(int argc, char **argv)
+{
+    // Google Benchmark removes the arguments it recognizes, leaving the rest
+    // to be parsed as our own flags.
+    benchmark::Initialize(&argc, argv);
+    absl::SetProgramUsageMessage(absl::StrCat("Webcash benchmarks.\n", argv[0]));
+    absl::ParseCommandLine(argc, argv);
+    RegisterLedgerBenchmarks();
+    // The implementations are chosen once, before any benchmark threads are
+    // running, since switching them while others are hashing is a data race.
+    SHA256AutoDetect();
+    SHA512AutoDetect();
+    ChaCha20AutoDetect();
+    HexAutoDetect();
+    ProofOfWorkAutoDetect();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
+
+// End of File
@@ -0,0 +1,189 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "bench/postgres.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_replace.h"
+
+#include "boost/filesystem.hpp"
+
+#include "crypto/sha256.h"
+#include "util/hex.h"
+
+using drogon::orm::DrogonDbException;
+
+static std::string ShellQuote(const std::string& str)
+{
+    return absl::StrCat("'", absl::StrReplaceAll(str, {{"'", "'\\''"}}), "'");
+}
+
+static bool RunCommand(const std::string& cmd)
+{
+    const int status = system(cmd.c_str());
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+TempPostgres::TempPostgres(const std::string& bindir, bool fsync)
+    : m_bindir(bindir)
+{
+    if (geteuid() == 0) {
+        throw std::runtime_error("PostgreSQL refuses to run as root; run the benchmarks as an unprivileged user.");
+    }
+
+    if (m_bindir.empty()) {
+        if (FILE* pipe = popen("pg_config --bindir 2>/dev/null", "r")) {
+            char buf[4096];
+            if (fgets(buf, sizeof(buf), pipe)) {
+                m_bindir = std::string(absl::StripAsciiWhitespace(buf));
+            }
+            pclose(pipe);
+        }
+        // Client-only installs have pg_config but no server binaries, in
+        // which case they might still be found on the PATH.
+        if (!m_bindir.empty() && access((m_bindir + "/initdb").c_str(), X_OK) != 0) {
+            m_bindir.clear();
+        }
+    }
+
+    const char* tmpdir = getenv("TMPDIR");
+    std::string dir = absl::StrCat(tmpdir && *tmpdir ? tmpdir : "/tmp", "/webcash-postgres-XXXXXX");
+    if (!mkdtemp(&dir[0])) {
+        throw std::runtime_error(absl::StrCat("Unable to create temporary directory ", dir, "."));
+    }
+    m_dir = dir;
+
+    // Only the owner of the cluster can connect, and it needs no password.
+    // The cluster doesn't need to survive a crash, so initdb needn't wait
+    // for its files to reach the disk either.
+    const std::string data = m_dir + "/data";
+    if (!RunCommand(absl::StrCat(Command("initdb"), " -D ", ShellQuote(data), " -U postgres -A trust -E UTF8 --no-sync >", ShellQuote(LogFile()), " 2>&1"))) {
+        throw std::runtime_error(absl::StrCat("Unable to initialize PostgreSQL cluster.  See ", LogFile(), " for details."));
+    }
+
+    // No TCP listener: the socket directory is private to this cluster, so
+    // the default port number can't conflict with anything.
+    std::string options = absl::StrCat("-c listen_addresses='' -k ", m_dir, " -p ", port());
+    if (!fsync) {
+        absl::StrAppend(&options, " -c fsync=off -c synchronous_commit=off -c full_page_writes=off");
+    }
+    if (!RunCommand(absl::StrCat(Command("pg_ctl"), " -D ", ShellQuote(data), " -l ", ShellQuote(LogFile()), " -o ", ShellQuote(options), " -w -t 60 start >/dev/null"))) {
+        throw std::runtime_error(absl::StrCat("Unable to start PostgreSQL cluster.  See ", LogFile(), " for details."));
+    }
+    m_running = true;
+}
+
+TempPostgres::~TempPostgres()
+{
+    if (m_running) {
+        // Nothing in the cluster is worth keeping, so there's no need to wait
+        // for a clean shutdown.
+        if (!RunCommand(absl::StrCat(Command("pg_ctl"), " -D ", ShellQuote(m_dir + "/data"), " -m immediate -w stop >/dev/null"))) {
+            std::cerr << "Warning: Unable to stop PostgreSQL cluster in " << m_dir << "; leaving it in place." << std::endl;
+            return;
+        }
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(m_dir, ec);
+    if (ec) {
+        std::cerr << "Warning: Unable to remove " << m_dir << ": " << ec.message() << std::endl;
+    }
+}
+
+std::string TempPostgres::Command(const std::string& name) const
+{
+    return m_bindir.empty() ? name : ShellQuote(m_bindir + "/" + name);
+}
+
+std::string TempPostgres::LogFile() const
+{
+    return m_dir + "/postgres.log";
+}
+
+// The secret of the i'th seeded output is the hex encoded hash of this prefix
+// followed by i in decimal, which the database can compute as well.  The
+// spent hashes are made the same way from a different prefix.
+static const char k_seed_prefix[] = "webcash-bench-";
+static const char k_spent_prefix[] = "webcash-bench-spent-";
+
+// Seeded replacements are given negative ids, so that they can never collide
+// with the ids the server assigns from the table's sequence.  They were all
+// received a second apart, starting from 2022-01-01.
+static const int64_t k_seed_epoch_ns = INT64_C(1640995200000000000);
+
+SecretWebcash SeededSecret(uint64_t i)
+{
+    const std::string preimage = absl::StrCat(k_seed_prefix, i);
+    unsigned char hash[32];
+    CSHA256().Write((const unsigned char*)preimage.data(), preimage.size()).Finalize(hash);
+    return SecretWebcash(HexStr32(hash), k_seeded_amount);
+}
+
+static bool ExecSql(const drogon::orm::DbClientPtr& db, const std::string& sql)
+{
+    try {
+        db->execSqlSync(sql);
+    } catch (const DrogonDbException &e) {
+        std::cerr << "error: " << e.base().what() << std::endl;
+        std::cerr << "error: Offending SQL: " << sql << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/** SQL for the hash of the public webcash whose secret is derived from
+ *  prefix and i. */
+static std::string PublicHashSql(const char* prefix)
+{
+    return absl::StrCat("sha256(convert_to(encode(sha256(convert_to('", prefix, "' || i, 'UTF8')), 'hex'), 'UTF8'))");
+}
+
+bool SeedLedger(const drogon::orm::DbClientPtr& db, uint64_t from, uint64_t to)
+{
+    // Inserted in batches, so that no one statement runs for too long.
+    static const uint64_t k_batch = 1000000;
+    for (uint64_t first = from; first < to; first += k_batch) {
+        const uint64_t last = std::min(first + k_batch, to) - 1;
+        // A replacement half-filled by the previous batch already exists.
+        const uint64_t first_replacement = SeededReplacements(first);
+        const uint64_t last_replacement = SeededReplacements(last + 1) - 1;
+        if (first_replacement <= last_replacement && !ExecSql(db, absl::StrCat(
+                "INSERT INTO \"Replacements\" (\"id\", \"received\") "
+                "SELECT -1 - r, ", k_seed_epoch_ns, " + r * 1000000000 "
+                "FROM generate_series(", first_replacement, ", ", last_replacement, ") AS r"))) {
+            return false;
+        }
+        if (!ExecSql(db, absl::StrCat(
+                "WITH \"Seed\" AS ("
+                    "SELECT i, ", PublicHashSql(k_seed_prefix), " AS \"unspent\", ", PublicHashSql(k_spent_prefix), " AS \"spent\" "
+                    "FROM generate_series(", first, ", ", last, ") AS i), "
+                "\"SeedUnspent\" AS (INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") SELECT \"unspent\", ", k_seeded_amount.i64, " FROM \"Seed\"), "
+                "\"SeedSpent\" AS (INSERT INTO \"SpentHashes\" (\"hash\") SELECT \"spent\" FROM \"Seed\"), "
+                "\"SeedInputs\" AS (INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT -1 - i / 2, \"spent\", ", k_seeded_amount.i64, " FROM \"Seed\") "
+                "INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT -1 - i / 2, \"unspent\", ", k_seeded_amount.i64, " FROM \"Seed\""))) {
+            return false;
+        }
+    }
+    // Give the query planner statistics for the new rows.
+    for (const char* table : {"UnspentOutputs", "SpentHashes", "Replacements", "ReplacementInputs", "ReplacementOutputs"}) {
+        if (!ExecSql(db, absl::StrCat("ANALYZE \"", table, "\""))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// End of File
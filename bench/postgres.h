@@ -0,0 +1,74 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BENCH_POSTGRES_H
+#define BENCH_POSTGRES_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include <drogon/orm/DbClient.h>
+
+#include "webcash.h"
+
+/** A throwaway PostgreSQL cluster.  It is created with initdb in a new
+ *  temporary directory and listens only on a unix socket within that
+ *  directory, so that benchmark runs are isolated from each other and from
+ *  any other database on the machine.  The cluster is shut down and its
+ *  directory removed when the object is destroyed.
+ *
+ *  The initdb and pg_ctl executables are taken from bindir if it is not
+ *  empty, or else from the directory reported by pg_config, or else from
+ *  PATH.  With fsync disabled the cluster trades durability for results
+ *  that depend less on the disk.  Throws std::runtime_error if the cluster
+ *  can't be started. */
+class TempPostgres {
+public:
+    TempPostgres(const std::string& bindir, bool fsync);
+    ~TempPostgres();
+
+    TempPostgres(const TempPostgres&) = delete;
+    TempPostgres& operator=(const TempPostgres&) = delete;
+
+    // The host and port to give to the database client.  As the host is a
+    // directory, the connection is made over the unix socket within it.
+    const std::string& host() const { return m_dir; }
+    unsigned short port() const { return 5432; }
+
+private:
+    std::string m_bindir;
+    std::string m_dir;
+    bool m_running = false;
+
+    std::string Command(const std::string& name) const;
+    std::string LogFile() const;
+};
+
+/** The amount of each output created by SeedLedger. */
+static const Amount k_seeded_amount{100000000};
+
+/** The claim code of the i'th unspent output created by SeedLedger, counting
+ *  from zero. */
+SecretWebcash SeededSecret(uint64_t i);
+
+/** The number of replacements recorded by SeedLedger for a ledger of n
+ *  outputs. */
+inline uint64_t SeededReplacements(uint64_t n) { return (n + 1) / 2; }
+
+/** Bulk loads a synthetic ledger, growing one made by an earlier call from
+ *  `from` to `to` unspent outputs, or creating one if `from` is zero.  Each
+ *  output i comes with a spent hash, and every two outputs are recorded in
+ *  the audit log as a replacement of the two spent hashes, so that all of
+ *  the tables a replacement touches are of similar size.  The contents
+ *  depend only on the size.  The rows are generated by the database server
+ *  itself, so that seeding millions of outputs isn't limited by the client.
+ *  Returns false on error. */
+bool SeedLedger(const drogon::orm::DbClientPtr& db, uint64_t from, uint64_t to);
+
+#endif // BENCH_POSTGRES_H
+
+// End of File
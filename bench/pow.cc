@@ -0,0 +1,40 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "uint256.h"
+#include "util/pow.h"
+
+static void get_apparent_difficulty(benchmark::State& state) {
+    const uint256 hash = uint256S("000000159e4bd0b4ba6a51b4cd7a4cbb7a10e0a2cbe4e41e62a2cd28ee9e0b3c");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(get_apparent_difficulty(hash));
+    }
+}
+BENCHMARK(get_apparent_difficulty);
+
+// A batch the size of the miner's, none of which meets the difficulty, so
+// that every hash has to be looked at.
+static void FindProofOfWork_200(benchmark::State& state) {
+    std::vector<unsigned char> hashes(200 * CSHA256::OUTPUT_SIZE);
+    for (size_t i = 0; i < 200; ++i) {
+        unsigned char n[8];
+        WriteLE64(n, i);
+        CSHA256().Write(n, sizeof(n)).Finalize(hashes.data() + i * CSHA256::OUTPUT_SIZE);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(FindProofOfWork(hashes.data(), 200, 30));
+    }
+    state.SetItemsProcessed(state.iterations() * 200);
+}
+BENCHMARK(FindProofOfWork_200);
+
+// End of File
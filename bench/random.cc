@@ -0,0 +1,68 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "crypto/chacha20.h"
+#include "crypto/sha512.h"
+#include "random.h"
+
+static void CSHA512_1024(benchmark::State& state) {
+    unsigned char buf[1024] = {0};
+    unsigned char hash[CSHA512::OUTPUT_SIZE];
+    for (auto _ : state) {
+        CSHA512().Write(buf, sizeof(buf)).Finalize(hash);
+        benchmark::DoNotOptimize(hash);
+    }
+    state.SetBytesProcessed(state.iterations() * sizeof(buf));
+}
+BENCHMARK(CSHA512_1024);
+
+static void GetStrongRandBytes_32(benchmark::State& state) {
+    unsigned char buf[32];
+    for (auto _ : state) {
+        GetStrongRandBytes(buf, sizeof(buf));
+        benchmark::DoNotOptimize(buf);
+    }
+    state.SetBytesProcessed(state.iterations() * sizeof(buf));
+}
+BENCHMARK(GetStrongRandBytes_32)->ThreadRange(1, 8);
+
+static void GetSecretRandBytes_32(benchmark::State& state) {
+    unsigned char buf[32];
+    for (auto _ : state) {
+        GetSecretRandBytes(buf, sizeof(buf));
+        benchmark::DoNotOptimize(buf);
+    }
+    state.SetBytesProcessed(state.iterations() * sizeof(buf));
+}
+BENCHMARK(GetSecretRandBytes_32)->ThreadRange(1, 8);
+
+static void GetSecretRandBytes_4096(benchmark::State& state) {
+    unsigned char buf[4096];
+    for (auto _ : state) {
+        GetSecretRandBytes(buf, sizeof(buf));
+        benchmark::DoNotOptimize(buf);
+    }
+    state.SetBytesProcessed(state.iterations() * sizeof(buf));
+}
+BENCHMARK(GetSecretRandBytes_4096);
+
+static void ChaCha20_Keystream(benchmark::State& state) {
+    static const unsigned char key[32] = {0};
+    ChaCha20 rng(key, sizeof(key));
+    std::vector<unsigned char> buf(state.range(0));
+    for (auto _ : state) {
+        rng.Keystream(buf.data(), buf.size());
+        benchmark::DoNotOptimize(buf.data());
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(ChaCha20_Keystream)->Arg(64)->Arg(1024)->Arg(65536);
+
+// End of File
@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Mark Friedenbach
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+"""Runs the benchmarks pinned to a fixed set of CPUs, and compares the
+results against those saved from an earlier run.
+
+Each group of benchmarks is run as a separate invocation of bench_webcash,
+with its results written as Google Benchmark JSON to the output directory.
+The median of the repetitions of each benchmark is compared against the
+baseline, and if any have lost more throughput than the threshold allows,
+or are missing from the results altogether, the differences are printed and
+the script exits with a non-zero status.
+
+The server benchmarks run against a throwaway PostgreSQL cluster, so
+nothing needs to be running beforehand, but the PostgreSQL server binaries
+have to be installed and the script must not be run as root.
+
+Baselines are only meaningful on the machine which recorded them.  The
+first run on a machine saves its results as the baseline, and later runs
+replace it only if asked to with --update_baseline.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+
+# The benchmarks run by each group, as a --benchmark_filter regex, and any
+# further flags they need.
+GROUPS = {
+    'sha256': (
+        '^(SecretWebcash_hash_|PublicWebcash_from_secret|FindProofOfWork_|get_apparent_difficulty)',
+        [],
+    ),
+    'webcash': (
+        '^(Amount_|Hex_|(Secret|Public)Webcash_(to_|parse|round_trip))',
+        [],
+    ),
+    'random': (
+        '^(CSHA512_1024|ChaCha20_Keystream|GetSecretRandBytes_|GetStrongRandBytes_32)',
+        [],
+    ),
+    'lockedpool': (
+        '^LockedPool_',
+        [],
+    ),
+    'wallet': (
+        '^Wallet_',
+        [],
+    ),
+    'server': (
+        '^Server_',
+        [
+            '--embedded_postgres',
+            '--ledger_sizes=100000',
+            '--mining_reports=512',
+        ],
+    ),
+}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--groups', default=','.join(GROUPS),
+                        help='comma-separated benchmark groups to run, from: %s (default: all)' % ', '.join(GROUPS))
+    parser.add_argument('--cpus', default=None,
+                        help='CPUs to pin the benchmarks to, in taskset -c format (default: the first four)')
+    parser.add_argument('--repetitions', type=int, default=5,
+                        help='number of times to repeat each benchmark; the median is compared (default: 5)')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='percentage loss of throughput counted as a regression (default: 10)')
+    parser.add_argument('--out_dir', default='bench-results',
+                        help='directory to write the results of this run to (default: bench-results)')
+    parser.add_argument('--baseline_dir', default='bench-baseline',
+                        help='directory the baseline results are kept in (default: bench-baseline)')
+    parser.add_argument('--update_baseline', action='store_true',
+                        help='replace the baseline with the results of this run')
+    parser.add_argument('--bench_binary', default=None,
+                        help='benchmark binary to run, instead of building bench_webcash with bazel')
+    args = parser.parse_args()
+
+    args.groups = [g for g in args.groups.split(',') if g]
+    for group in args.groups:
+        if group not in GROUPS:
+            parser.error('unknown benchmark group %r' % group)
+    if args.cpus is None:
+        args.cpus = '0-%d' % (min(os.cpu_count() or 1, 4) - 1)
+    if args.repetitions < 1:
+        parser.error('--repetitions must be at least 1')
+    return args
+
+
+def count_cpus(cpus):
+    """The number of CPUs in a taskset -c style list."""
+    count = 0
+    for part in cpus.split(','):
+        first, _, last = part.partition('-')
+        count += int(last) - int(first) + 1 if last else 1
+    return count
+
+
+def build():
+    """Builds bench_webcash, and returns the path to the binary."""
+    subprocess.run(['bazel', 'build', '-c', 'opt', 'bench_webcash'], check=True)
+    info = subprocess.run(['bazel', 'info', '-c', 'opt', 'bazel-bin'], check=True, stdout=subprocess.PIPE, universal_newlines=True)
+    return os.path.join(info.stdout.strip(), 'bench_webcash')
+
+
+def run_group(binary, group, args):
+    """Runs one group of benchmarks, and returns the path of its results, or
+    None if the benchmarks failed to run."""
+    regex, flags = GROUPS[group]
+    out = os.path.join(args.out_dir, group + '.json')
+    cmd = [
+        'taskset', '-c', args.cpus,
+        binary,
+        '--benchmark_filter=' + regex,
+        '--benchmark_repetitions=%d' % args.repetitions,
+        '--benchmark_report_aggregates_only=true',
+        '--benchmark_out=' + out,
+        '--benchmark_out_format=json',
+        '--workers=%d' % count_cpus(args.cpus),
+    ] + flags
+    print('Running %s benchmarks: %s' % (group, ' '.join(cmd)), flush=True)
+    try:
+        subprocess.run(cmd, check=True)
+    except subprocess.CalledProcessError as e:
+        print('Error: the %s benchmarks exited with status %d.' % (group, e.returncode), flush=True)
+        return None
+    except OSError as e:
+        print('Error: unable to run the %s benchmarks: %s' % (group, e), flush=True)
+        return None
+    return out
+
+
+def time_in_seconds(value, unit):
+    return value * {'ns': 1e-9, 'us': 1e-6, 'ms': 1e-3, 's': 1.0}[unit]
+
+
+def load_throughput(path):
+    """Reads a Google Benchmark JSON file, and returns the throughput of each
+    benchmark in it, along with the unit it is measured in.  Throughput is
+    items (or bytes) per second for benchmarks that count them, and
+    iterations per second otherwise."""
+    with open(path) as f:
+        data = json.load(f)
+    results = {}
+    for b in data.get('benchmarks', []):
+        if b.get('error_occurred'):
+            continue
+        if b.get('run_type') == 'aggregate':
+            if b.get('aggregate_name') != 'median':
+                continue
+            name = b['run_name']
+        else:
+            name = b['name']
+        if 'items_per_second' in b:
+            results[name] = (b['items_per_second'], 'items/s')
+        elif 'bytes_per_second' in b:
+            results[name] = (b['bytes_per_second'], 'B/s')
+        else:
+            results[name] = (1.0 / time_in_seconds(b['real_time'], b['time_unit']), 'iter/s')
+    return data.get('context', {}), results
+
+
+def format_rate(value, unit):
+    for scale, prefix in ((1e9, 'G'), (1e6, 'M'), (1e3, 'k')):
+        if value >= scale:
+            return '%.3f %s%s' % (value / scale, prefix, unit)
+    return '%.3f %s' % (value, unit)
+
+
+def compare(group, baseline_path, current_path, threshold):
+    """Prints the differences between two sets of results, and returns the
+    number of benchmarks which regressed.  If current_path is None, the group
+    failed to run, and all of its benchmarks are missing."""
+    base_context, base = load_throughput(baseline_path)
+    if current_path is None:
+        print()
+        print('The %s benchmarks failed to run, so all %d of them are missing.' % (group, len(base)))
+        for name in sorted(base):
+            print('    %s  REGRESSION' % name)
+        return len(base)
+    context, current = load_throughput(current_path)
+
+    for key in ('host_name', 'num_cpus', 'library_build_type'):
+        if base_context.get(key) != context.get(key):
+            print('Warning: %s differs from the baseline (%r, was %r), so the comparison may be meaningless.' % (key, context.get(key), base_context.get(key)))
+    if context.get('library_build_type') == 'debug':
+        print('Warning: the benchmark library was built in debug mode.')
+    if context.get('cpu_scaling_enabled'):
+        print('Warning: CPU frequency scaling is enabled, so results will be noisy.')
+
+    names = sorted(set(base) | set(current))
+    title = group + ' benchmark'
+    width = max([len(n) for n in names] + [len(title)])
+    print()
+    print('%-*s  %20s  %20s  %8s' % (width, title, 'Baseline', 'Current', 'Change'))
+    regressions = 0
+    for name in names:
+        if name not in current:
+            # A benchmark which failed or was dropped has lost all of its
+            # throughput, as far as anyone relying on it is concerned.
+            print('%-*s  %20s  %20s  %8s  REGRESSION' % (width, name, format_rate(*base[name]), '(missing)', ''))
+            regressions += 1
+            continue
+        if name not in base:
+            print('%-*s  %20s  %20s  %8s' % (width, name, '(new)', format_rate(*current[name]), ''))
+            continue
+        old, unit = base[name]
+        new, _ = current[name]
+        change = 100.0 * (new - old) / old
+        mark = ''
+        if change < -threshold:
+            mark = '  REGRESSION'
+            regressions += 1
+        print('%-*s  %20s  %20s  %+7.1f%%%s' % (width, name, format_rate(old, unit), format_rate(new, unit), change, mark))
+    print()
+    return regressions
+
+
+def main():
+    args = parse_args()
+    binary = args.bench_binary or build()
+    os.makedirs(args.out_dir, exist_ok=True)
+    os.makedirs(args.baseline_dir, exist_ok=True)
+
+    results = [(group, run_group(binary, group, args)) for group in args.groups]
+
+    # The comparisons are only printed once everything has run, so that they
+    # aren't lost among the output of the benchmarks.
+    regressions = 0
+    failed = [group for group, current in results if current is None]
+    for group, current in results:
+        baseline = os.path.join(args.baseline_dir, group + '.json')
+        if current is None and not os.path.exists(baseline):
+            print('The %s benchmarks failed to run, and there is no baseline for them.' % group)
+            continue
+        if not os.path.exists(baseline):
+            print('No baseline for the %s benchmarks; saving these results as the baseline.' % group)
+            shutil.copyfile(current, baseline)
+            continue
+        regressions += compare(group, baseline, current, args.threshold)
+        if args.update_baseline and current is not None:
+            shutil.copyfile(current, baseline)
+
+    if failed:
+        print('The %s benchmarks failed to run.' % ', '.join(failed))
+    if regressions:
+        print('%d benchmark(s) lost more than %g%% of their baseline throughput, or are missing.' % (regressions, args.threshold))
+    if failed or regressions:
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
+
+# End of File
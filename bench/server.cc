@@ -6,14 +6,30 @@
 
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
+#include <array>
+#include <cstdlib>
 #include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "absl/flags/flag.h"
+
 #include "absl/strings/escaping.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/string_view.h"
 
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
 #include <drogon/HttpAppFramework.h>
 
 #include <httplib.h>
@@ -21,16 +37,59 @@
 #include <json/json.h>
 
 #include "async.h"
+#include "bench/postgres.h"
+#include "bench/ledger.h"
 #include "crypto/sha256.h"
 #include "random.h"
 #include "server.h"
+#include "util/hex.h"
+#include "util/pow.h"
 #include "webcash.h"
 
 using Json::ValueType::objectValue;
 
+ABSL_FLAG(bool, embedded_postgres, false, "run the server benchmarks against a throwaway PostgreSQL cluster instead of the one at localhost:5432");
+ABSL_FLAG(std::string, postgres_bindir, "", "directory containing initdb and pg_ctl for --embedded_postgres (default: ask pg_config, then search PATH)");
+ABSL_FLAG(bool, postgres_fsync, false, "have the --embedded_postgres cluster flush writes to disk");
+ABSL_FLAG(uint64_t, seed_utxos, 0, "size of the ledger, in unspent outputs, to load into the database before running the server benchmarks");
+ABSL_FLAG(unsigned, mining_reports, 1024, "number of mining reports submitted by each run of the Server_ledger_mining_report benchmark, which are all mined beforehand");
+ABSL_FLAG(std::vector<std::string>, ledger_sizes, (std::vector<std::string>{"1000000", "10000000"}), "ledger sizes, in unspent outputs, at which to run the Server_ledger benchmarks (100000000 is also worth measuring, given the time and disk space)");
+
 std::thread g_event_loop_thread;
 std::atomic<bool> g_event_loop_setup = false;
 std::vector<SecretWebcash> g_utxos;
+std::unique_ptr<TempPostgres> g_postgres;
+
+// The size of the synthetic ledger in the database, and which of its seeded
+// outputs the benchmarks have spent.
+std::mutex g_ledger_mutex;
+uint64_t g_ledger_size = 0;
+uint64_t g_ledger_unspent = 0;
+std::vector<bool> g_ledger_spent;
+
+// Grows the synthetic ledger to the given size.  Must hold g_ledger_mutex.
+static void GrowLedger(uint64_t size) {
+    if (size <= g_ledger_size) {
+        return;
+    }
+    if (!SeedLedger(drogon::app().getDbClient(), g_ledger_size, size)) {
+        std::cerr << "Error: Unable to seed database with a ledger of " << size << " unspent outputs." << std::endl;
+        std::exit(1);
+    }
+    webcash::state().num_unspent += size - g_ledger_size;
+    webcash::state().num_replace += SeededReplacements(size) - SeededReplacements(g_ledger_size);
+    g_ledger_unspent += size - g_ledger_size;
+    g_ledger_spent.resize(size, false);
+    g_ledger_size = size;
+}
+
+// Clears the database, leaving an empty ledger.  Must hold g_ledger_mutex.
+static void ResetLedger() {
+    webcash::resetDb();
+    g_ledger_size = 0;
+    g_ledger_unspent = 0;
+    g_ledger_spent.clear();
+}
 
 static void TeardownServer();
 static void SetupServer(const benchmark::State& state) {
@@ -39,22 +98,35 @@ static void SetupServer(const benchmark::State& state) {
     if (already_setup) {
         return;
     }
+    // Start a private database cluster, if requested.
+    std::string db_host = "localhost";
+    unsigned short db_port = 5432;
+    if (absl::GetFlag(FLAGS_embedded_postgres)) {
+        try {
+            g_postgres.reset(new TempPostgres(absl::GetFlag(FLAGS_postgres_bindir), absl::GetFlag(FLAGS_postgres_fsync)));
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            std::exit(1);
+        }
+        db_host = g_postgres->host();
+        db_port = g_postgres->port();
+    }
     // Create a promise which will only be fulfilled after starting the main
     // event loop.
     std::promise<void> p1;
     std::future<void> f1 = p1.get_future();
-    g_event_loop_thread = std::thread([&]() {
+    g_event_loop_thread = std::thread([&, db_host, db_port]() {
         // Disable logging
         webcash::state().logging = false;
         // Create the database connection
         int num_workers = get_num_workers();
         drogon::app().createDbClient(
             "postgresql", // dbType
-            "localhost", // host
-            5432,        // port
+            db_host,     // host
+            db_port,     // port
             "postgres",  // databaseName
             "postgres",  // username
-            "mysecretpassword", // password
+            "mysecretpassword", // password (ignored by an embedded cluster)
             num_workers, // connectionNum
             "bench_webcash", // filename
             "default",   // name
@@ -76,12 +148,14 @@ static void SetupServer(const benchmark::State& state) {
         // Start the main event loop.
         drogon::app().run();
     });
-    // While that is starting up, detect which sha256 engine we should use.
-    SHA256AutoDetect();
     // Wait for the event loop to begin processing.
     f1.get();
-    // Clear the database
-    webcash::resetDb();
+    // Clear the database, and preload the ledger, if requested.
+    {
+        const std::lock_guard<std::mutex> lock(g_ledger_mutex);
+        ResetLedger();
+        GrowLedger(absl::GetFlag(FLAGS_seed_utxos));
+    }
     // Schedule server to be shut down
     std::atexit(TeardownServer);
 }
@@ -92,6 +166,8 @@ static void TeardownServer() {
         drogon::app().quit();
     });
     g_event_loop_thread.join();
+    // Shut down and delete the private database cluster, if any.
+    g_postgres.reset();
 }
 
 static void Server_stats(benchmark::State& state) {
@@ -235,4 +311,329 @@ static void Server_replace(benchmark::State& state) {
 }
 BENCHMARK(Server_replace)->Setup(SetupServer)->ThreadRange(1, get_num_workers());
 
+// Brings the synthetic ledger to the size given by the benchmark argument.
+// The ledger benchmarks are registered in order of increasing size, so that
+// it only ever has to grow unless some are filtered out.
+static void SetupLedger(const benchmark::State& state) {
+    SetupServer(state);
+    const uint64_t size = state.range(0);
+    const std::lock_guard<std::mutex> lock(g_ledger_mutex);
+    if (size < g_ledger_size) {
+        ResetLedger();
+    }
+    GrowLedger(size);
+}
+
+// Picks a random seeded output that no benchmark has spent yet, and marks it
+// spent.  Returns false if there are none left.
+static bool TakeSeededOutput(FastRandomContext& rng, uint64_t& i) {
+    const std::lock_guard<std::mutex> lock(g_ledger_mutex);
+    if (!g_ledger_unspent) {
+        return false;
+    }
+    do {
+        i = rng.randrange(g_ledger_size);
+    } while (g_ledger_spent[i]);
+    g_ledger_spent[i] = true;
+    --g_ledger_unspent;
+    return true;
+}
+
+static void Server_ledger_replace(benchmark::State& state) {
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    FastRandomContext rng;
+
+    // Each replacement spends two seeded outputs from random places in the
+    // ledger, and creates two new ones of the same value.
+    for (auto _ : state) {
+        uint64_t in[2];
+        if (!TakeSeededOutput(rng, in[0]) || !TakeSeededOutput(rng, in[1])) {
+            state.SkipWithError("Ran out of seeded outputs to spend.");
+            break;
+        }
+        const std::string out0 = absl::StrCat("e", to_string(k_seeded_amount), ":secret:", HexStr32(rng.rand256().begin()));
+        const std::string out1 = absl::StrCat("e", to_string(k_seeded_amount), ":secret:", HexStr32(rng.rand256().begin()));
+        auto r = cli.Post(
+            "/api/v1/replace",
+            absl::StrCat("{"
+                "\"legalese\": {"
+                    "\"terms\": true"
+                "},"
+                "\"webcashes\": ["
+                    "\"", to_string(SeededSecret(in[0])).c_str(), "\","
+                    "\"", to_string(SeededSecret(in[1])).c_str(), "\""
+                "],"
+                "\"new_webcashes\": ["
+                    "\"", out0, "\","
+                    "\"", out1, "\""
+                "]"
+            "}"),
+            "application/json");
+        if (!r || r->status != 200) {
+            state.SkipWithError("Replacement failed.");
+            break;
+        }
+    }
+}
+
+static void Server_ledger_health_check(benchmark::State& state) {
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    FastRandomContext rng;
+    const uint64_t size = state.range(0);
+
+    // Each request checks a batch of seeded outputs from random places in the
+    // ledger, whether or not they have since been spent.
+    static const size_t k_batch = 32;
+    for (auto _ : state) {
+        std::vector<std::string> pks;
+        for (size_t i = 0; i < k_batch; ++i) {
+            pks.push_back(absl::StrCat("\"", to_string(PublicWebcash(SeededSecret(rng.randrange(size)))), "\""));
+        }
+        auto r = cli.Post(
+            "/api/v1/health_check",
+            absl::StrCat("[", absl::StrJoin(pks, ","), "]"),
+            "application/json");
+        if (!r || r->status != 200) {
+            state.SkipWithError("Health check failed.");
+            break;
+        }
+    }
+}
+
+// The mining report benchmark starts the difficulty over from here, low
+// enough that it can mine all the reports it needs during setup.
+static const unsigned k_bench_difficulty = 8;
+
+// The reports to be submitted by the current run of the mining report
+// benchmark, and the index of the next one to be sent.
+std::vector<std::string> g_mining_reports;
+std::atomic<size_t> g_next_mining_report = 0;
+
+// The economy's settings from before the mining report benchmark lowered
+// them, put back once each run is done.
+unsigned g_saved_min_report_bits = 0;
+unsigned g_saved_initial_difficulty = 0;
+
+// Mines count mining reports with all available cores, each of which meets
+// the given difficulty and claims the current mining amount and subsidy.
+static std::vector<std::string> MineReports(size_t count, unsigned difficulty) {
+    // The base64 encodings of the three-digit nonces 000 to 999.
+    std::string nonces;
+    for (int n = 0; n < 1000; ++n) {
+        nonces += absl::Base64Escape(absl::StrFormat("%03d", n));
+    }
+    static const char final[] = "fQ==";
+
+    const Amount mining_amount = webcash::state().getMiningAmount();
+    const Amount subsidy_amount = webcash::state().getSubsidyAmount();
+    std::vector<std::string> reports(count);
+    std::atomic<size_t> next = 0;
+    auto mine = [&]() {
+        FastRandomContext rng;
+        const int W = 25*8;
+        unsigned char hashes[W*32];
+        for (size_t n = next++; n < count; n = next++) {
+            while (reports[n].empty()) {
+                const std::string keep = absl::StrCat("e", to_string(mining_amount - subsidy_amount), ":secret:", HexStr32(rng.rand256().begin()));
+                const std::string subsidy = absl::StrCat("e", to_string(subsidy_amount), ":secret:", HexStr32(rng.rand256().begin()));
+                // Laid out exactly as webminer does it, so that only the
+                // nonce needs to be hashed for each attempt.
+                std::string prefix = absl::StrCat("{\"legalese\": {\"terms\": true}, \"webcash\": [\"", keep, "\", \"", subsidy, "\"], \"subsidy\": [\"", subsidy, "\"], \"difficulty\": ", difficulty, ", \"timestamp\": ", absl::ToUnixSeconds(absl::Now()), ", \"nonce\": ");
+                prefix.resize(48 * (1 + prefix.size() / 48), ' ');
+                prefix.back() = '1';
+                const std::string prefix_b64 = absl::Base64Escape(prefix);
+                CSHA256 midstate;
+                midstate.Write((const unsigned char*)prefix_b64.data(), prefix_b64.size());
+                for (int i = 0; i < 1000 && reports[n].empty(); ++i) {
+                    for (int j = 0; j < 1000 && reports[n].empty(); j += W) {
+                        for (int k = 0; k < W; k += 8) {
+                            midstate.WriteAndFinalize8((const unsigned char*)nonces.data() + 4*i, (const unsigned char*)nonces.data() + 4*(j+k), (const unsigned char*)final, hashes + k*32);
+                        }
+                        const size_t k = FindProofOfWork(hashes, W, difficulty);
+                        if (k < W) {
+                            reports[n] = absl::StrCat(prefix_b64, absl::string_view(nonces.data() + 4*i, 4), absl::string_view(nonces.data() + 4*(j+k), 4), final);
+                        }
+                    }
+                }
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < get_num_workers(); ++i) {
+        threads.emplace_back(mine);
+    }
+    mine();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return reports;
+}
+
+// Starts the server's mining history over at a low difficulty, and mines the
+// reports for the next run of the mining report benchmark.
+static void SetupMiningReports(const benchmark::State& state) {
+    SetupLedger(state);
+    static const std::string sql = "DELETE FROM \"MiningReports\"";
+    try {
+        drogon::app().getDbClient()->execSqlSync(sql);
+    } catch (const drogon::orm::DrogonDbException& e) {
+        std::cerr << "Error: " << e.base().what() << std::endl;
+        std::cerr << "Error: Offending SQL: " << sql << std::endl;
+        std::exit(1);
+    }
+    g_saved_min_report_bits = webcash::state().min_report_bits.exchange(0);
+    g_saved_initial_difficulty = webcash::state().initial_difficulty.exchange(k_bench_difficulty);
+    webcash::state().difficulty = k_bench_difficulty;
+    webcash::state().num_reports = 0;
+    // The reports all arrive early, so the difficulty goes up by one at the
+    // end of every interval, or maybe one more if reports at the end of an
+    // interval race each other.
+    const unsigned count = std::max<unsigned>(absl::GetFlag(FLAGS_mining_reports), state.threads());
+    g_mining_reports = MineReports(count, k_bench_difficulty + count / WebcashEconomy::k_reports_per_interval + 1);
+    g_next_mining_report = 0;
+    for (unsigned i = 0; i < WebcashEconomy::k_mining_report_stages; ++i) {
+        webcash::state().mining_report_nanos[i] = 0;
+        webcash::state().mining_report_count[i] = 0;
+    }
+    webcash::state().profiling = true;
+}
+
+// Puts back the settings SetupMiningReports changed, so that benchmarks run
+// afterwards see the economy as configured.
+static void TeardownMiningReports(const benchmark::State& state) {
+    webcash::state().profiling = false;
+    webcash::state().min_report_bits = g_saved_min_report_bits;
+    webcash::state().initial_difficulty = g_saved_initial_difficulty;
+}
+
+// Checks the difficulty recorded with each mining report since the last
+// reset, and returns the number of reports which are inconsistent with those
+// before them, plus one if the server's current difficulty doesn't match.
+static unsigned CheckDifficultyAdjustments() {
+    static const std::string sql = "SELECT \"difficulty\", \"next_difficulty\" FROM \"MiningReports\" ORDER BY \"id\" ASC";
+    drogon::orm::Result r;
+    try {
+        r = drogon::app().getDbClient()->execSqlSync(sql);
+    } catch (const drogon::orm::DrogonDbException& e) {
+        std::cerr << "Error: " << e.base().what() << std::endl;
+        std::cerr << "Error: Offending SQL: " << sql << std::endl;
+        std::exit(1);
+    }
+    unsigned errors = 0;
+    unsigned expected = k_bench_difficulty;
+    for (size_t i = 0; i < r.size(); ++i) {
+        const unsigned difficulty = r[i][0].as<unsigned>();
+        const unsigned next_difficulty = r[i][1].as<unsigned>();
+        // Each report must meet the difficulty set by the one before it,
+        // which only changes at the end of an interval, and then by one.
+        bool ok = difficulty == expected;
+        if ((i + 1) % WebcashEconomy::k_reports_per_interval == 0) {
+            ok = ok && next_difficulty + 1 >= difficulty && next_difficulty <= difficulty + 1;
+        } else {
+            ok = ok && next_difficulty == difficulty;
+        }
+        if (!ok) {
+            ++errors;
+        }
+        expected = next_difficulty;
+    }
+    if (expected != webcash::state().getDifficulty()) {
+        ++errors;
+    }
+    return errors;
+}
+
+static void Server_ledger_mining_report(benchmark::State& state) {
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+
+    int64_t accepted = 0;
+    int64_t rejected = 0;
+    for (auto _ : state) {
+        const size_t n = g_next_mining_report++;
+        if (n >= g_mining_reports.size()) {
+            state.SkipWithError("Ran out of mining reports.");
+            break;
+        }
+        auto r = cli.Post(
+            "/api/v1/mining_report",
+            absl::StrCat("{"
+                "\"preimage\": \"", g_mining_reports[n], "\","
+                "\"legalese\": {"
+                    "\"terms\": true"
+                "}"
+            "}"),
+            "application/json");
+        if (!r) {
+            state.SkipWithError("No response to mining report.");
+            break;
+        }
+        if (r->status == 200) {
+            ++accepted;
+        } else {
+            ++rejected;
+        }
+    }
+    state.SetItemsProcessed(accepted);
+    state.counters["rejected"] = rejected;
+
+    // Every thread is done by now, so the first reports the results of the
+    // whole run: the mean time each accepted report spent in each stage of
+    // processing, and whether the difficulty was adjusted correctly.
+    if (state.thread_index() == 0) {
+        webcash::state().profiling = false;
+        static const std::array<const char*, WebcashEconomy::k_mining_report_stages> stages = {
+            "parse_us", "last_report_us", "check_preimage_us", "check_outputs_us", "create_outputs_us", "record_us", "commit_us",
+        };
+        for (unsigned i = 0; i < WebcashEconomy::k_mining_report_stages; ++i) {
+            const uint64_t count = webcash::state().mining_report_count[i];
+            if (count) {
+                state.counters[stages[i]] = webcash::state().mining_report_nanos[i] / 1000.0 / count;
+            }
+        }
+        state.counters["difficulty"] = webcash::state().getDifficulty();
+        const unsigned errors = CheckDifficultyAdjustments();
+        state.counters["difficulty_errors"] = errors;
+        if (errors) {
+            std::cerr << "Warning: " << errors << " mining reports were recorded with the wrong difficulty." << std::endl;
+        }
+    }
+}
+
+void RegisterLedgerBenchmarks() {
+    std::vector<uint64_t> sizes;
+    for (const std::string& str : absl::GetFlag(FLAGS_ledger_sizes)) {
+        uint64_t size;
+        if (!absl::SimpleAtoi(str, &size) || size < 2) {
+            std::cerr << "Error: Invalid ledger size '" << str << "'." << std::endl;
+            std::exit(1);
+        }
+        sizes.push_back(size);
+    }
+    std::sort(sizes.begin(), sizes.end());
+    const int num_reports = absl::GetFlag(FLAGS_mining_reports);
+    if (num_reports < 1) {
+        std::cerr << "Error: --mining_reports must be at least 1." << std::endl;
+        std::exit(1);
+    }
+    for (uint64_t size : sizes) {
+        benchmark::RegisterBenchmark("Server_ledger_replace", Server_ledger_replace)->ArgName("ledger")->Arg(size)->Setup(SetupLedger)->ThreadRange(1, get_num_workers());
+        benchmark::RegisterBenchmark("Server_ledger_health_check", Server_ledger_health_check)->ArgName("ledger")->Arg(size)->Setup(SetupLedger)->ThreadRange(1, get_num_workers());
+        // Each run submits the same number of reports in total, however many
+        // threads share them, with the thread counts chosen as ThreadRange
+        // would.
+        for (int threads = 1; ; threads = std::min(2 * threads, get_num_workers())) {
+            benchmark::RegisterBenchmark("Server_ledger_mining_report", Server_ledger_mining_report)->ArgName("ledger")->Arg(size)->Setup(SetupMiningReports)->Teardown(TeardownMiningReports)->Threads(threads)->Iterations(std::max(num_reports / threads, 1))->UseRealTime();
+            if (threads >= get_num_workers()) {
+                break;
+            }
+        }
+    }
+}
+
 // End of File
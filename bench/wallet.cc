@@ -0,0 +1,118 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "boost/filesystem.hpp"
+
+#include "random.h"
+#include "util/hex.h"
+#include "wallet.h"
+#include "webcash.h"
+
+// Nothing listens on this port, so the wallets' sweeps fail straight away and
+// leave the inserted outputs queued, without touching any real server.
+ABSL_FLAG(std::string, server, "http://127.0.0.1:1", "server endpoint the benchmark wallets send their sweeps to");
+
+static SecretWebcash NewSecret(int64_t amount) {
+    unsigned char bytes[32];
+    GetSecretRandBytes(bytes, sizeof(bytes));
+    return SecretWebcash(HexStr32(bytes), Amount(amount));
+}
+
+// Exposes the wallet's internals, to fill it with outputs directly.
+class BenchWallet : public Wallet {
+public:
+    explicit BenchWallet(const boost::filesystem::path& path) : Wallet(path, WalletStorage::WRITE_AHEAD_LOG) {}
+
+    // Adds count unspent outputs of 1 to count webcash directly to the
+    // database, as if they had already been swept, so that they can be
+    // selected.
+    bool AddOutputs(size_t count) {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        Savepoint tx(*this, "bench_outputs");
+        const absl::Time timestamp = absl::Now();
+        for (size_t i = 0; i < count; ++i) {
+            const SecretWebcash sk = NewSecret(1 + i);
+            const int secret_id = AddSecretToWallet(timestamp, sk.sk, true, false);
+            if (!secret_id || !AddOutputToWallet(timestamp, PublicWebcash(sk), secret_id, false)) {
+                return false;
+            }
+        }
+        return tx.Commit();
+    }
+};
+
+// A wallet in a temporary directory, which is removed once the wallet is
+// closed.
+struct TempWallet {
+    boost::filesystem::path dir;
+    std::unique_ptr<BenchWallet> wallet;
+
+    TempWallet()
+        : dir(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("webcash-bench-%%%%-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(dir);
+        wallet = std::make_unique<BenchWallet>(dir / "wallet");
+    }
+
+    ~TempWallet() {
+        wallet.reset();
+        boost::filesystem::remove_all(dir);
+    }
+};
+
+// Batches of new secrets inserted at once, each synced to the recovery file
+// and queued for sweeping in a single transaction.
+static void Wallet_InsertMany(benchmark::State& state) {
+    TempWallet tmp;
+    BenchWallet& wallet = *tmp.wallet;
+    const size_t batch = state.range(0);
+    std::vector<SecretWebcash> sks(batch);
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (size_t i = 0; i < batch; ++i) {
+            sks[i] = NewSecret(1 + i);
+        }
+        state.ResumeTiming();
+        if (!wallet.InsertMany(sks, true)) {
+            state.SkipWithError("Unable to insert secrets into the wallet.");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(Wallet_InsertMany)->Arg(1)->Arg(16)->Arg(256)->UseRealTime();
+
+// Coin selection for targets spread over the wallet's range, from a wallet
+// holding the given number of unspent outputs.
+static void Wallet_SelectCoins(benchmark::State& state) {
+    TempWallet tmp;
+    BenchWallet& wallet = *tmp.wallet;
+    const size_t count = state.range(0);
+    if (!wallet.AddOutputs(count)) {
+        state.SkipWithError("Unable to add outputs to the wallet.");
+        return;
+    }
+    FastRandomContext rng(true);
+    for (auto _ : state) {
+        const Amount target(1 + rng.randrange(2 * count));
+        benchmark::DoNotOptimize(wallet.SelectCoins(target));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(Wallet_SelectCoins)->Arg(1000)->Arg(10000);
+
+// End of File
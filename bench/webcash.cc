@@ -8,31 +8,154 @@
 
 #include "webcash.h"
 
+#include "util/hex.h"
+
+#include "absl/strings/string_view.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Count calls to the global allocator, so that each benchmark can report how
+// many heap allocations it makes per iteration.  (SecureString memory comes
+// from the locked pool, so only the pool's own bookkeeping is counted.)
+static std::atomic<uint64_t> g_allocations{0};
+
+// Not inlined, so that the compiler doesn't pair up malloc() and free() with
+// new and delete expressions and warn about a mismatch.
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    ++g_allocations;
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// Reports the allocations made since construction as an "allocs" counter,
+// averaged over the benchmark's iterations.
+class AllocationCounter
+{
+protected:
+    benchmark::State& m_state;
+    uint64_t m_start;
+
+public:
+    explicit AllocationCounter(benchmark::State& state) : m_state(state), m_start(g_allocations) {}
+    ~AllocationCounter() {
+        m_state.counters["allocs"] = benchmark::Counter(g_allocations - m_start, benchmark::Counter::kAvgIterations);
+    }
+};
+
+static void Amount_to_string(benchmark::State& state) {
+    using std::to_string;
+    std::string amt_str;
+    Amount amt(19000012345678);
+    AllocationCounter allocs(state);
+    for (auto _ : state) {
+        amt_str = to_string(amt);
+        benchmark::DoNotOptimize(amt_str);
+    }
+}
+BENCHMARK(Amount_to_string);
+
+static void Amount_to_chars(benchmark::State& state) {
+    char buf[k_max_amount_chars];
+    Amount amt(19000012345678);
+    AllocationCounter allocs(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_chars(buf, buf + sizeof(buf), amt));
+    }
+}
+BENCHMARK(Amount_to_chars);
+
+static void Amount_parse(benchmark::State& state) {
+    const std::string amt_str = "190000.12345678";
+    Amount amt;
+    AllocationCounter allocs(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(amt.parse(amt_str));
+    }
+}
+BENCHMARK(Amount_parse);
+
 // Benchmark serialization and deserialization of SecretWebcash
 static void SecretWebcash_to_string(benchmark::State& state) {
     using std::to_string;
     std::string wc_str;
     SecretWebcash wc;
-    assert(wc.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089"));
+    if (!wc.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089")) {
+        state.SkipWithError("Unable to parse webcash");
+    }
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc_str = to_string(wc);
     }
 }
 BENCHMARK(SecretWebcash_to_string);
 
+static void SecretWebcash_to_chars(benchmark::State& state) {
+    char buf[128];
+    SecretWebcash wc;
+    if (!wc.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089")) {
+        state.SkipWithError("Unable to parse webcash");
+    }
+    AllocationCounter allocs(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_chars(buf, buf + sizeof(buf), wc));
+    }
+}
+BENCHMARK(SecretWebcash_to_chars);
+
 static void SecretWebcash_parse(benchmark::State& state) {
     std::string wc_str = "e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
     SecretWebcash wc;
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc.parse(wc_str);
     }
 }
 BENCHMARK(SecretWebcash_parse);
 
+// Each secret is allocated from and returned to the shared LockedPool.
+static void SecretWebcash_parse_shared_pool(benchmark::State& state) {
+    const std::string wc_str = "e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
+    for (auto _ : state) {
+        SecretWebcash wc;
+        benchmark::DoNotOptimize(wc.parse(wc_str));
+    }
+}
+BENCHMARK(SecretWebcash_parse_shared_pool)->ThreadRange(1, 8);
+
+// Each secret is allocated from and returned to the thread's locked arena.
+static void SecretWebcash_parse_local_arena(benchmark::State& state) {
+    const std::string wc_str = "e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
+    LocalLockedArena::Scope scope;
+    for (auto _ : state) {
+        SecretWebcash wc;
+        benchmark::DoNotOptimize(wc.parse(wc_str));
+    }
+}
+BENCHMARK(SecretWebcash_parse_local_arena)->ThreadRange(1, 8);
+
 static void SecretWebcash_round_trip(benchmark::State& state) {
     using std::to_string;
     std::string wc_str = "e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
     SecretWebcash wc;
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc.parse(wc_str);
         wc_str = to_string(wc);
@@ -40,20 +163,65 @@ static void SecretWebcash_round_trip(benchmark::State& state) {
 }
 BENCHMARK(SecretWebcash_round_trip);
 
+// The public hashes of a batch of secrets, one at a time...
+static void SecretWebcash_hash_each(benchmark::State& state) {
+    const std::string sk = "f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
+    std::vector<SecretWebcash> wc(state.range(0), SecretWebcash(sk, Amount(190000)));
+    for (auto _ : state) {
+        for (const auto& esk : wc) {
+            benchmark::DoNotOptimize(PublicWebcash(esk));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(SecretWebcash_hash_each)->Arg(1)->Arg(8)->Arg(64);
+
+// ...and all together, spread across the lanes of the multi-way transform.
+static void SecretWebcash_hash_many(benchmark::State& state) {
+    const std::string sk = "f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089";
+    std::vector<SecretWebcash> wc(state.range(0), SecretWebcash(sk, Amount(190000)));
+    std::vector<absl::string_view> sks(wc.size());
+    std::transform(wc.begin(), wc.end(), sks.begin(), [](const SecretWebcash& esk) { return absl::string_view(esk.sk); });
+    std::vector<unsigned char> hashes(wc.size() * CSHA256::OUTPUT_SIZE);
+    for (auto _ : state) {
+        SHA256Many(hashes.data(), sks);
+        benchmark::DoNotOptimize(hashes.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(SecretWebcash_hash_many)->Arg(1)->Arg(8)->Arg(64);
+
 static void PublicWebcash_to_string(benchmark::State& state) {
     using std::to_string;
     std::string wc_str;
     PublicWebcash wc;
-    assert(wc.parse("e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf"));
+    if (!wc.parse("e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf")) {
+        state.SkipWithError("Unable to parse webcash");
+    }
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc_str = to_string(wc);
     }
 }
 BENCHMARK(PublicWebcash_to_string);
 
+static void PublicWebcash_to_chars(benchmark::State& state) {
+    char buf[k_max_public_webcash_chars];
+    PublicWebcash wc;
+    if (!wc.parse("e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf")) {
+        state.SkipWithError("Unable to parse webcash");
+    }
+    AllocationCounter allocs(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_chars(buf, buf + sizeof(buf), wc));
+    }
+}
+BENCHMARK(PublicWebcash_to_chars);
+
 static void PublicWebcash_parse(benchmark::State& state) {
     std::string wc_str = "e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
     PublicWebcash wc;
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc.parse(wc_str);
     }
@@ -64,6 +232,7 @@ static void PublicWebcash_round_trip(benchmark::State& state) {
     using std::to_string;
     std::string wc_str = "e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
     PublicWebcash wc;
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         wc.parse(wc_str);
         wc_str = to_string(wc);
@@ -72,14 +241,36 @@ static void PublicWebcash_round_trip(benchmark::State& state) {
 BENCHMARK(PublicWebcash_round_trip);
 
 static void PublicWebcash_from_secret(benchmark::State& state) {
-    SHA256AutoDetect();
     SecretWebcash sk;
     PublicWebcash pk;
-    assert(sk.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089"));
+    if (!sk.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089")) {
+        state.SkipWithError("Unable to parse webcash");
+    }
+    AllocationCounter allocs(state);
     for (auto _ : state) {
         pk = PublicWebcash(sk);
     }
 }
 BENCHMARK(PublicWebcash_from_secret);
 
+static void Hex_encode32(benchmark::State& state) {
+    unsigned char bytes[32] = {0x9a, 0x8a, 0x1a, 0xc2};
+    char str[64];
+    for (auto _ : state) {
+        HexEncode32(str, bytes);
+        benchmark::DoNotOptimize(str);
+    }
+}
+BENCHMARK(Hex_encode32);
+
+static void Hex_decode32(benchmark::State& state) {
+    const char* str = "9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
+    unsigned char bytes[32];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(HexDecode32(bytes, str));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(Hex_decode32);
+
 // End of File
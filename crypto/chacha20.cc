@@ -11,8 +11,45 @@
 #include "crypto/common.h"
 #include "crypto/chacha20.h"
 
+#include <assert.h>
 #include <string.h>
 
+#include "compat/cpuid.h"
+
+#if defined(__x86_64__) || defined(__amd64__)
+namespace chacha20_sse2
+{
+void Keystream_4way(const uint32_t input[16], unsigned char* out, size_t blocks);
+}
+
+namespace chacha20_avx2
+{
+void Keystream_8way(const uint32_t input[16], unsigned char* out, size_t blocks);
+}
+
+namespace chacha20_avx512
+{
+void Keystream_16way(const uint32_t input[16], unsigned char* out, size_t blocks);
+}
+#endif
+
+#if defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+namespace chacha20_neon
+{
+void Keystream_4way(const uint32_t input[16], unsigned char* out, size_t blocks);
+}
+#endif
+
+namespace
+{
+typedef void (*KeystreamMultiFn)(const uint32_t[16], unsigned char*, size_t);
+
+// Generates a multiple of keystream_blocks blocks at a time, or nothing if
+// only the standard implementation is available.
+KeystreamMultiFn KeystreamMulti = nullptr;
+size_t keystream_blocks = 0;
+} // namespace
+
 constexpr static inline uint32_t rotl32(uint32_t v, int c) { return (v << c) | (v >> (32 - c)); }
 
 #define QUARTERROUND(a,b,c,d) \
@@ -84,6 +121,19 @@ void ChaCha20::Keystream(unsigned char* c, size_t bytes)
 
     if (!bytes) return;
 
+    // Whole groups of blocks are generated in parallel, if possible, and the
+    // standard implementation below takes care of whatever is left over.
+    if (keystream_blocks && bytes >= 64 * keystream_blocks) {
+        const size_t blocks = bytes / (64 * keystream_blocks) * keystream_blocks;
+        KeystreamMulti(input, c, blocks);
+        const uint64_t counter = (input[12] | (uint64_t)input[13] << 32) + blocks;
+        input[12] = counter;
+        input[13] = counter >> 32;
+        c += 64 * blocks;
+        bytes -= 64 * blocks;
+        if (!bytes) return;
+    }
+
     j0 = input[0];
     j1 = input[1];
     j2 = input[2];
@@ -312,4 +362,104 @@ void ChaCha20::Crypt(const unsigned char* m, unsigned char* c, size_t bytes)
     }
 }
 
+namespace
+{
+#ifndef NDEBUG
+bool SelfTest()
+{
+    // A keystream long enough to use every implementation, with a remainder
+    // left over, must match the standard implementation generating one block
+    // at a time.  The counter is set so that it carries into the high word
+    // partway through.
+    static const unsigned char key[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    };
+    unsigned char expected[64 * 37];
+    unsigned char out[64 * 37];
+
+    ChaCha20 ref(key, 32);
+    ref.SetIV(0x0706050403020100);
+    ref.Seek(0xfffffffd);
+    for (size_t i = 0; i < sizeof(expected); i += 64) {
+        ref.Keystream(expected + i, 64);
+    }
+
+    ChaCha20 rng(key, 32);
+    rng.SetIV(0x0706050403020100);
+    rng.Seek(0xfffffffd);
+    rng.Keystream(out, sizeof(out));
+    if (memcmp(out, expected, sizeof(out)) != 0) {
+        return false;
+    }
+    // The stream must continue from the right block afterwards.
+    ref.Keystream(expected, 64);
+    rng.Keystream(out, 64);
+    return memcmp(out, expected, 64) == 0;
+}
+#endif // NDEBUG
+} // namespace
+
+std::string ChaCha20AutoDetect(size_t max_blocks)
+{
+    std::string ret = "standard";
+    KeystreamMulti = nullptr;
+    keystream_blocks = 0;
+    if (max_blocks < 4) {
+        return ret;
+    }
+#if defined(__x86_64__) || defined(__amd64__)
+    // SSE2 is part of the x86-64 baseline.
+    KeystreamMulti = chacha20_sse2::Keystream_4way;
+    keystream_blocks = 4;
+    ret = "sse2(4way)";
+#if defined(HAVE_GETCPUID)
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool have_avx512 = false;
+    bool enabled_avx = false;
+    bool enabled_avx512 = false;
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(0, 0, eax, ebx, ecx, edx);
+    const uint32_t max_leaf = eax;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        uint32_t a, d;
+        __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        enabled_avx = (a & 6) == 6;
+        // The opmask and upper ZMM state must be enabled as well.
+        enabled_avx512 = (a & 0xe6) == 0xe6;
+    }
+    if (max_leaf >= 7) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_avx512 = (ebx >> 16) & 1;
+    }
+
+    if (have_avx2 && have_avx && enabled_avx && max_blocks >= 8) {
+        KeystreamMulti = chacha20_avx2::Keystream_8way;
+        keystream_blocks = 8;
+        ret = "avx2(8way)";
+    }
+    if (have_avx512 && have_avx && enabled_avx512 && max_blocks >= 16) {
+        KeystreamMulti = chacha20_avx512::Keystream_16way;
+        keystream_blocks = 16;
+        ret = "avx512(16way)";
+    }
+#endif
+#elif defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+    // Advanced SIMD is a mandatory part of ARMv8-A.
+    KeystreamMulti = chacha20_neon::Keystream_4way;
+    keystream_blocks = 4;
+    ret = "neon(4way)";
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
 // End of File
@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <string>
+
 /** A class for ChaCha20 256-bit stream cipher developed by Daniel J. Bernstein
     https://cr.yp.to/chacha/chacha-20080128.pdf */
 class ChaCha20
@@ -34,6 +36,13 @@ public:
     void Crypt(const unsigned char* input, unsigned char* output, size_t bytes);
 };
 
+/** Autodetect the best available ChaCha20 implementation generating at most
+ *  max_blocks blocks at a time.  Returns the name of the implementation.
+ *  Until this is called only the standard implementation is used, so it
+ *  should be called at startup, before any other threads are running.
+ */
+std::string ChaCha20AutoDetect(size_t max_blocks = SIZE_MAX);
+
 #endif // BITCOIN_CRYPTO_CHACHA20_H
 
 // End of File
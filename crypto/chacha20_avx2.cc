@@ -0,0 +1,103 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Eight ChaCha20 blocks at a time, one per 32-bit lane of each vector.  The
+// functions are compiled for AVX2 individually, so that nothing else in the
+// library can end up using instructions the CPU might not have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+namespace chacha20_avx2 {
+namespace {
+
+AVX2 __m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+AVX2 __m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+template <int N> AVX2 __m256i inline Rotl(__m256i x) { return _mm256_or_si256(_mm256_slli_epi32(x, N), _mm256_srli_epi32(x, 32 - N)); }
+template <> AVX2 __m256i inline Rotl<16>(__m256i x) { return _mm256_shuffle_epi8(x, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13)); }
+template <> AVX2 __m256i inline Rotl<8>(__m256i x) { return _mm256_shuffle_epi8(x, _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14)); }
+
+AVX2 void inline QuarterRound(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+{
+    a = Add(a, b); d = Rotl<16>(Xor(d, a));
+    c = Add(c, d); b = Rotl<12>(Xor(b, c));
+    a = Add(a, b); d = Rotl<8>(Xor(d, a));
+    c = Add(c, d); b = Rotl<7>(Xor(b, c));
+}
+
+/** Transpose four vectors within each 128-bit half. */
+AVX2 void inline Transpose(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(a, b);
+    __m256i t1 = _mm256_unpacklo_epi32(c, d);
+    __m256i t2 = _mm256_unpackhi_epi32(a, b);
+    __m256i t3 = _mm256_unpackhi_epi32(c, d);
+    a = _mm256_unpacklo_epi64(t0, t1);
+    b = _mm256_unpackhi_epi64(t0, t1);
+    c = _mm256_unpacklo_epi64(t2, t3);
+    d = _mm256_unpackhi_epi64(t2, t3);
+}
+
+} // namespace
+
+AVX2 void Keystream_8way(const uint32_t input[16], unsigned char* out, size_t blocks)
+{
+    uint64_t counter = input[12] | (uint64_t)input[13] << 32;
+    for (; blocks >= 8; blocks -= 8, out += 8 * 64, counter += 8) {
+        __m256i j[16];
+        for (int i = 0; i < 16; ++i) {
+            j[i] = _mm256_set1_epi32(input[i]);
+        }
+        uint32_t lo[8], hi[8];
+        for (int k = 0; k < 8; ++k) {
+            lo[k] = counter + k;
+            hi[k] = (counter + k) >> 32;
+        }
+        j[12] = _mm256_loadu_si256((const __m256i*)lo);
+        j[13] = _mm256_loadu_si256((const __m256i*)hi);
+
+        __m256i x[16];
+        for (int i = 0; i < 16; ++i) {
+            x[i] = j[i];
+        }
+        for (int i = 0; i < 10; ++i) {
+            QuarterRound(x[0], x[4], x[8], x[12]);
+            QuarterRound(x[1], x[5], x[9], x[13]);
+            QuarterRound(x[2], x[6], x[10], x[14]);
+            QuarterRound(x[3], x[7], x[11], x[15]);
+            QuarterRound(x[0], x[5], x[10], x[15]);
+            QuarterRound(x[1], x[6], x[11], x[12]);
+            QuarterRound(x[2], x[7], x[8], x[13]);
+            QuarterRound(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            x[i] = Add(x[i], j[i]);
+        }
+
+        // After transposing, x[i + k] holds words i..i+3 of block k in its
+        // low half, and of block k + 4 in its high half.
+        for (int i = 0; i < 16; i += 4) {
+            Transpose(x[i], x[i + 1], x[i + 2], x[i + 3]);
+        }
+        for (int k = 0; k < 4; ++k) {
+            _mm256_storeu_si256((__m256i*)(out + 64 * k), _mm256_permute2x128_si256(x[k], x[4 + k], 0x20));
+            _mm256_storeu_si256((__m256i*)(out + 64 * k + 32), _mm256_permute2x128_si256(x[8 + k], x[12 + k], 0x20));
+            _mm256_storeu_si256((__m256i*)(out + 64 * (k + 4)), _mm256_permute2x128_si256(x[k], x[4 + k], 0x31));
+            _mm256_storeu_si256((__m256i*)(out + 64 * (k + 4) + 32), _mm256_permute2x128_si256(x[8 + k], x[12 + k], 0x31));
+        }
+    }
+}
+
+} // namespace chacha20_avx2
+
+#endif
+
+// End of File
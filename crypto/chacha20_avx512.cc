@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Sixteen ChaCha20 blocks at a time, one per 32-bit lane of each vector.  The
+// functions are compiled for AVX-512 individually, so that nothing else in the
+// library can end up using instructions the CPU might not have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+// GCC's AVX-512 intrinsics initialize their don't-care operands from
+// themselves, which -Wmaybe-uninitialized reports once they are inlined.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#define AVX512 __attribute__((target("avx512f")))
+
+namespace chacha20_avx512 {
+namespace {
+
+AVX512 __m512i inline Add(__m512i x, __m512i y) { return _mm512_add_epi32(x, y); }
+AVX512 __m512i inline Xor(__m512i x, __m512i y) { return _mm512_xor_si512(x, y); }
+template <int N> AVX512 __m512i inline Rotl(__m512i x) { return _mm512_rol_epi32(x, N); }
+
+AVX512 void inline QuarterRound(__m512i& a, __m512i& b, __m512i& c, __m512i& d)
+{
+    a = Add(a, b); d = Rotl<16>(Xor(d, a));
+    c = Add(c, d); b = Rotl<12>(Xor(b, c));
+    a = Add(a, b); d = Rotl<8>(Xor(d, a));
+    c = Add(c, d); b = Rotl<7>(Xor(b, c));
+}
+
+/** Transpose four vectors within each 128-bit quarter. */
+AVX512 void inline Transpose(__m512i& a, __m512i& b, __m512i& c, __m512i& d)
+{
+    __m512i t0 = _mm512_unpacklo_epi32(a, b);
+    __m512i t1 = _mm512_unpacklo_epi32(c, d);
+    __m512i t2 = _mm512_unpackhi_epi32(a, b);
+    __m512i t3 = _mm512_unpackhi_epi32(c, d);
+    a = _mm512_unpacklo_epi64(t0, t1);
+    b = _mm512_unpackhi_epi64(t0, t1);
+    c = _mm512_unpacklo_epi64(t2, t3);
+    d = _mm512_unpackhi_epi64(t2, t3);
+}
+
+} // namespace
+
+AVX512 void Keystream_16way(const uint32_t input[16], unsigned char* out, size_t blocks)
+{
+    uint64_t counter = input[12] | (uint64_t)input[13] << 32;
+    for (; blocks >= 16; blocks -= 16, out += 16 * 64, counter += 16) {
+        __m512i j[16];
+        for (int i = 0; i < 16; ++i) {
+            j[i] = _mm512_set1_epi32(input[i]);
+        }
+        uint32_t lo[16], hi[16];
+        for (int k = 0; k < 16; ++k) {
+            lo[k] = counter + k;
+            hi[k] = (counter + k) >> 32;
+        }
+        j[12] = _mm512_loadu_si512(lo);
+        j[13] = _mm512_loadu_si512(hi);
+
+        __m512i x[16];
+        for (int i = 0; i < 16; ++i) {
+            x[i] = j[i];
+        }
+        for (int i = 0; i < 10; ++i) {
+            QuarterRound(x[0], x[4], x[8], x[12]);
+            QuarterRound(x[1], x[5], x[9], x[13]);
+            QuarterRound(x[2], x[6], x[10], x[14]);
+            QuarterRound(x[3], x[7], x[11], x[15]);
+            QuarterRound(x[0], x[5], x[10], x[15]);
+            QuarterRound(x[1], x[6], x[11], x[12]);
+            QuarterRound(x[2], x[7], x[8], x[13]);
+            QuarterRound(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            x[i] = Add(x[i], j[i]);
+        }
+
+        // After transposing, quarter m of x[i + k] holds words i..i+3 of
+        // block k + 4m.  The quarters for each block are then gathered from
+        // the four groups of words.
+        for (int i = 0; i < 16; i += 4) {
+            Transpose(x[i], x[i + 1], x[i + 2], x[i + 3]);
+        }
+        for (int k = 0; k < 4; ++k) {
+            __m512i u0 = _mm512_shuffle_i32x4(x[k], x[4 + k], 0x44);
+            __m512i u1 = _mm512_shuffle_i32x4(x[k], x[4 + k], 0xee);
+            __m512i v0 = _mm512_shuffle_i32x4(x[8 + k], x[12 + k], 0x44);
+            __m512i v1 = _mm512_shuffle_i32x4(x[8 + k], x[12 + k], 0xee);
+            _mm512_storeu_si512(out + 64 * k, _mm512_shuffle_i32x4(u0, v0, 0x88));
+            _mm512_storeu_si512(out + 64 * (k + 4), _mm512_shuffle_i32x4(u0, v0, 0xdd));
+            _mm512_storeu_si512(out + 64 * (k + 8), _mm512_shuffle_i32x4(u1, v1, 0x88));
+            _mm512_storeu_si512(out + 64 * (k + 12), _mm512_shuffle_i32x4(u1, v1, 0xdd));
+        }
+    }
+}
+
+} // namespace chacha20_avx512
+
+#endif
+
+// End of File
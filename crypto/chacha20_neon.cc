@@ -0,0 +1,95 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Four ChaCha20 blocks at a time, one per 32-bit lane of each vector.
+// Advanced SIMD is a mandatory part of ARMv8-A, so this needs no runtime
+// check.
+
+#if defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arm_neon.h>
+
+namespace chacha20_neon {
+namespace {
+
+uint32x4_t inline Add(uint32x4_t x, uint32x4_t y) { return vaddq_u32(x, y); }
+uint32x4_t inline Xor(uint32x4_t x, uint32x4_t y) { return veorq_u32(x, y); }
+template <int N> uint32x4_t inline Rotl(uint32x4_t x) { return vsliq_n_u32(vshrq_n_u32(x, 32 - N), x, N); }
+template <> uint32x4_t inline Rotl<16>(uint32x4_t x) { return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(x))); }
+
+void inline QuarterRound(uint32x4_t& a, uint32x4_t& b, uint32x4_t& c, uint32x4_t& d)
+{
+    a = Add(a, b); d = Rotl<16>(Xor(d, a));
+    c = Add(c, d); b = Rotl<12>(Xor(b, c));
+    a = Add(a, b); d = Rotl<8>(Xor(d, a));
+    c = Add(c, d); b = Rotl<7>(Xor(b, c));
+}
+
+/** Transpose four vectors, so that each holds one lane of all of them. */
+void inline Transpose(uint32x4_t& a, uint32x4_t& b, uint32x4_t& c, uint32x4_t& d)
+{
+    uint32x4x2_t ab = vtrnq_u32(a, b);
+    uint32x4x2_t cd = vtrnq_u32(c, d);
+    a = vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0]));
+    b = vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1]));
+    c = vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0]));
+    d = vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1]));
+}
+
+} // namespace
+
+void Keystream_4way(const uint32_t input[16], unsigned char* out, size_t blocks)
+{
+    uint64_t counter = input[12] | (uint64_t)input[13] << 32;
+    for (; blocks >= 4; blocks -= 4, out += 4 * 64, counter += 4) {
+        uint32x4_t j[16];
+        for (int i = 0; i < 16; ++i) {
+            j[i] = vdupq_n_u32(input[i]);
+        }
+        uint32_t lo[4], hi[4];
+        for (int k = 0; k < 4; ++k) {
+            lo[k] = counter + k;
+            hi[k] = (counter + k) >> 32;
+        }
+        j[12] = vld1q_u32(lo);
+        j[13] = vld1q_u32(hi);
+
+        uint32x4_t x[16];
+        for (int i = 0; i < 16; ++i) {
+            x[i] = j[i];
+        }
+        for (int i = 0; i < 10; ++i) {
+            QuarterRound(x[0], x[4], x[8], x[12]);
+            QuarterRound(x[1], x[5], x[9], x[13]);
+            QuarterRound(x[2], x[6], x[10], x[14]);
+            QuarterRound(x[3], x[7], x[11], x[15]);
+            QuarterRound(x[0], x[5], x[10], x[15]);
+            QuarterRound(x[1], x[6], x[11], x[12]);
+            QuarterRound(x[2], x[7], x[8], x[13]);
+            QuarterRound(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            x[i] = Add(x[i], j[i]);
+        }
+
+        // Each group of four words is transposed into four 16-byte pieces,
+        // one for each block.
+        for (int i = 0; i < 16; i += 4) {
+            Transpose(x[i], x[i + 1], x[i + 2], x[i + 3]);
+            for (int k = 0; k < 4; ++k) {
+                vst1q_u8(out + 64 * k + 4 * i, vreinterpretq_u8_u32(x[i + k]));
+            }
+        }
+    }
+}
+
+} // namespace chacha20_neon
+
+#endif
+
+// End of File
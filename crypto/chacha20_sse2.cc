@@ -0,0 +1,91 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Four ChaCha20 blocks at a time, one per 32-bit lane of each vector.  SSE2 is
+// part of the x86-64 baseline, so this needs no runtime check.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <emmintrin.h>
+
+namespace chacha20_sse2 {
+namespace {
+
+__m128i inline Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+__m128i inline Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+template <int N> __m128i inline Rotl(__m128i x) { return _mm_or_si128(_mm_slli_epi32(x, N), _mm_srli_epi32(x, 32 - N)); }
+template <> __m128i inline Rotl<16>(__m128i x) { return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1); }
+
+void inline QuarterRound(__m128i& a, __m128i& b, __m128i& c, __m128i& d)
+{
+    a = Add(a, b); d = Rotl<16>(Xor(d, a));
+    c = Add(c, d); b = Rotl<12>(Xor(b, c));
+    a = Add(a, b); d = Rotl<8>(Xor(d, a));
+    c = Add(c, d); b = Rotl<7>(Xor(b, c));
+}
+
+/** Transpose four vectors, so that each holds one lane of all of them. */
+void inline Transpose(__m128i& a, __m128i& b, __m128i& c, __m128i& d)
+{
+    __m128i t0 = _mm_unpacklo_epi32(a, b);
+    __m128i t1 = _mm_unpacklo_epi32(c, d);
+    __m128i t2 = _mm_unpackhi_epi32(a, b);
+    __m128i t3 = _mm_unpackhi_epi32(c, d);
+    a = _mm_unpacklo_epi64(t0, t1);
+    b = _mm_unpackhi_epi64(t0, t1);
+    c = _mm_unpacklo_epi64(t2, t3);
+    d = _mm_unpackhi_epi64(t2, t3);
+}
+
+} // namespace
+
+void Keystream_4way(const uint32_t input[16], unsigned char* out, size_t blocks)
+{
+    uint64_t counter = input[12] | (uint64_t)input[13] << 32;
+    for (; blocks >= 4; blocks -= 4, out += 4 * 64, counter += 4) {
+        __m128i j[16];
+        for (int i = 0; i < 16; ++i) {
+            j[i] = _mm_set1_epi32(input[i]);
+        }
+        j[12] = _mm_setr_epi32(counter, counter + 1, counter + 2, counter + 3);
+        j[13] = _mm_setr_epi32((counter) >> 32, (counter + 1) >> 32, (counter + 2) >> 32, (counter + 3) >> 32);
+
+        __m128i x[16];
+        for (int i = 0; i < 16; ++i) {
+            x[i] = j[i];
+        }
+        for (int i = 0; i < 10; ++i) {
+            QuarterRound(x[0], x[4], x[8], x[12]);
+            QuarterRound(x[1], x[5], x[9], x[13]);
+            QuarterRound(x[2], x[6], x[10], x[14]);
+            QuarterRound(x[3], x[7], x[11], x[15]);
+            QuarterRound(x[0], x[5], x[10], x[15]);
+            QuarterRound(x[1], x[6], x[11], x[12]);
+            QuarterRound(x[2], x[7], x[8], x[13]);
+            QuarterRound(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) {
+            x[i] = Add(x[i], j[i]);
+        }
+
+        // Each group of four words is transposed into four 16-byte pieces,
+        // one for each block.
+        for (int i = 0; i < 16; i += 4) {
+            Transpose(x[i], x[i + 1], x[i + 2], x[i + 3]);
+            for (int k = 0; k < 4; ++k) {
+                _mm_storeu_si128((__m128i*)(out + 64 * k + 4 * i), x[i + k]);
+            }
+        }
+    }
+}
+
+} // namespace chacha20_sse2
+
+#endif
+
+// End of File
@@ -7,6 +7,7 @@
 
 #include "crypto/sha256.h"
 #include "crypto/common.h"
+#include "support/cleanse.h"
 
 #include <array>
 
@@ -35,6 +36,7 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 namespace sha256multi_sse41
 {
 void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformLanes_4way(uint32_t* s, const unsigned char* const* in);
 }
 
 namespace sha256d64_sse41
@@ -45,6 +47,7 @@ void Transform_4way(unsigned char* out, const unsigned char* in);
 namespace sha256multi_avx2
 {
 void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformLanes_8way(uint32_t* s, const unsigned char* const* in);
 }
 namespace sha256d64_avx2
 {
@@ -449,6 +452,7 @@ void TransformD64(unsigned char* out, const unsigned char* in)
 typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
 typedef void (*TransformMultiType)(unsigned char*, const uint32_t*, const unsigned char*);
 typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+typedef void (*TransformLanesType)(uint32_t*, const unsigned char* const*);
 
 template<TransformType tr>
 void TransformD64Wrapper(unsigned char* out, const unsigned char* in)
@@ -497,6 +501,8 @@ TransformD64Type TransformD64 = sha256::TransformD64;
 TransformD64Type TransformD64_2way = nullptr;
 TransformD64Type TransformD64_4way = nullptr;
 TransformD64Type TransformD64_8way = nullptr;
+TransformLanesType TransformLanes_4way = nullptr;
+TransformLanesType TransformLanes_8way = nullptr;
 
 #ifndef NDEBUG
 bool SelfTest() {
@@ -581,6 +587,27 @@ bool SelfTest() {
         if (!std::equal(out, out + 256, result_d64)) return false;
     }
 
+    // Test TransformLanes_4way and TransformLanes_8way, if available, with
+    // lane i compressing block i onto the state after the blocks before it.
+    for (const auto& tr : {std::make_pair(TransformLanes_4way, 4), std::make_pair(TransformLanes_8way, 8)}) {
+        if (!tr.first) continue;
+        const int lanes = tr.second;
+        uint32_t state[64];
+        const unsigned char* blocks[8];
+        for (int i = 0; i < lanes; ++i) {
+            for (int j = 0; j < 8; ++j) {
+                state[lanes * j + i] = result[i][j];
+            }
+            blocks[i] = data + 1 + 64 * i;
+        }
+        tr.first(state, blocks);
+        for (int i = 0; i < lanes; ++i) {
+            for (int j = 0; j < 8; ++j) {
+                if (state[lanes * j + i] != result[i + 1][j]) return false;
+            }
+        }
+    }
+
     return true;
 }
 #endif // NDEBUG
@@ -597,9 +624,20 @@ bool AVXEnabled()
 } // namespace
 
 
-std::string SHA256AutoDetect()
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation)
 {
     std::string ret = "standard";
+    Transform = sha256::Transform;
+    Transform_2way = nullptr;
+    Transform_4way = nullptr;
+    Transform_8way = nullptr;
+    TransformD64 = sha256::TransformD64;
+    TransformD64_2way = nullptr;
+    TransformD64_4way = nullptr;
+    TransformD64_8way = nullptr;
+    TransformLanes_4way = nullptr;
+    TransformLanes_8way = nullptr;
+
 #if defined(HAVE_GETCPUID)
     bool have_sse4 = false;
     bool have_xsave = false;
@@ -631,7 +669,7 @@ std::string SHA256AutoDetect()
     }
 
 #if !defined(BUILD_BITCOIN_INTERNAL)
-    if (have_shani) {
+    if (have_shani && (use_implementation & sha256_implementation::USE_SHANI)) {
         Transform = sha256_shani::Transform;
         TransformD64 = TransformD64Wrapper<sha256_shani::Transform>;
         TransformD64_2way = sha256d64_shani::Transform_2way;
@@ -641,7 +679,7 @@ std::string SHA256AutoDetect()
     }
 #endif
 
-    if (have_sse4) {
+    if (have_sse4 && (use_implementation & sha256_implementation::USE_SSE4)) {
 #if defined(__x86_64__) || defined(__amd64__)
         Transform = sha256_sse4::Transform;
         TransformD64 = TransformD64Wrapper<sha256_sse4::Transform>;
@@ -650,14 +688,16 @@ std::string SHA256AutoDetect()
 #if !defined(BUILD_BITCOIN_INTERNAL)
         Transform_4way = sha256multi_sse41::Transform_4way;
         TransformD64_4way = sha256d64_sse41::Transform_4way;
+        TransformLanes_4way = sha256multi_sse41::TransformLanes_4way;
         ret += ",sse41(4way)";
 #endif
     }
 
 #if !defined(BUILD_BITCOIN_INTERNAL)
-    if (have_avx2 && have_avx && enabled_avx) {
+    if (have_avx2 && have_avx && enabled_avx && (use_implementation & sha256_implementation::USE_AVX2)) {
         Transform_8way = sha256multi_avx2::Transform_8way;
         TransformD64_8way = sha256d64_avx2::Transform_8way;
+        TransformLanes_8way = sha256multi_avx2::TransformLanes_8way;
         ret += ",avx2(8way)";
     }
 #endif
@@ -686,7 +726,7 @@ std::string SHA256AutoDetect()
     }
 #endif
 
-    if (have_arm_shani) {
+    if (have_arm_shani && (use_implementation & sha256_implementation::USE_SHANI)) {
         Transform = sha256_armv8::Transform;
         TransformD64 = TransformD64Wrapper<sha256_armv8::Transform>;
         TransformD64_2way = sha256d64_armv8::Transform_2way;
@@ -745,6 +785,28 @@ void CSHA256::WriteAndFinalize8(const unsigned char* nonce1, const unsigned char
     SHA256Midstate(hashes, s, blocks.data(), 8);
 }
 
+void CSHA256::WriteAndFinalizeMany(const unsigned char* tails, size_t tail_len, size_t count, unsigned char* hashes)
+{
+    assert(bytes % 64 == 0);
+    assert(tail_len <= 55);
+    std::array<unsigned char, 8*64> blocks;
+    while (count) {
+        const size_t n = std::min<size_t>(count, 8);
+        blocks.fill(0);
+        for (size_t i = 0; i < n; ++i) {
+            std::copy(tails, tails + tail_len, blocks.begin() + i*64);
+            blocks[i*64 + tail_len] = 0x80; // padding byte
+            WriteBE64(blocks.data() + i*64 + 56, (bytes + tail_len) << 3);
+            tails += tail_len;
+        }
+        SHA256Midstate(hashes, s, blocks.data(), n);
+        hashes += n * OUTPUT_SIZE;
+        count -= n;
+    }
+    // The tails may be secret.
+    memory_cleanse(blocks.data(), blocks.size());
+}
+
 void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
 {
     static const unsigned char pad[64] = {0x80};
@@ -842,4 +904,142 @@ void SHA256Midstate(unsigned char* out, const uint32_t* midstate, const unsigned
     }
 }
 
+namespace {
+
+/** A message being hashed in one lane of SHA256Many. */
+struct Lane {
+    const unsigned char* next; //!< the next block to compress
+    const unsigned char* end; //!< the end of the blocks in this stretch
+    bool in_tail; //!< whether next points into tail rather than the message
+    unsigned char tail[128]; //!< the end of the message, with its padding
+    size_t tail_len;
+    unsigned char* out; //!< where the hash goes, or nullptr if the lane is idle
+
+    void Start(const absl::string_view& msg, unsigned char* hash)
+    {
+        const size_t whole = msg.size() & ~size_t{63};
+        const size_t rest = msg.size() - whole;
+        memset(tail, 0, sizeof(tail));
+        if (rest) {
+            memcpy(tail, msg.data() + whole, rest);
+        }
+        tail[rest] = 0x80; // padding byte
+        tail_len = rest < 56 ? 64 : 128;
+        WriteBE64(tail + tail_len - 8, (uint64_t)msg.size() << 3);
+        next = (const unsigned char*)msg.data();
+        end = next + whole;
+        in_tail = false;
+        if (next == end) {
+            Skip();
+        }
+        out = hash;
+    }
+
+    /** Move on to the padded tail, once the whole blocks are done. */
+    void Skip()
+    {
+        next = tail;
+        end = tail + tail_len;
+        in_tail = true;
+    }
+
+    /** Step past the block at next, returning true if that was the last. */
+    bool Advance()
+    {
+        next += 64;
+        if (next != end) {
+            return false;
+        }
+        if (in_tail) {
+            return true;
+        }
+        Skip();
+        return false;
+    }
+};
+
+} // namespace
+
+void SHA256Many(unsigned char* out, absl::Span<const absl::string_view> in)
+{
+    static const unsigned char idle[64] = {};
+    // With fewer busy lanes than this it is quicker to finish the stragglers
+    // one at a time than to keep running the whole vector.
+    static const size_t k_min_busy_lanes = 3;
+    const TransformLanesType transform = TransformLanes_8way ? TransformLanes_8way : TransformLanes_4way;
+    const size_t lanes = TransformLanes_8way ? 8 : 4;
+
+    size_t pos = 0;
+    if (transform && in.size() >= k_min_busy_lanes) {
+        std::array<Lane, 8> lane;
+        std::array<uint32_t, 64> s;
+        std::array<const unsigned char*, 8> blocks;
+        size_t busy = 0;
+        auto start = [&](size_t j) {
+            lane[j].Start(in[pos], out + pos * CSHA256::OUTPUT_SIZE);
+            uint32_t init[8];
+            sha256::Initialize(init);
+            for (int i = 0; i < 8; ++i) {
+                s[lanes * i + j] = init[i];
+            }
+            ++pos;
+            ++busy;
+        };
+        for (size_t j = 0; j < lanes; ++j) {
+            lane[j].out = nullptr;
+            if (pos < in.size()) {
+                start(j);
+            }
+        }
+
+        while (busy >= k_min_busy_lanes) {
+            for (size_t j = 0; j < lanes; ++j) {
+                blocks[j] = lane[j].out ? lane[j].next : idle;
+            }
+            transform(s.data(), blocks.data());
+            for (size_t j = 0; j < lanes; ++j) {
+                if (!lane[j].out || !lane[j].Advance()) {
+                    continue;
+                }
+                for (int i = 0; i < 8; ++i) {
+                    WriteBE32(lane[j].out + 4 * i, s[lanes * i + j]);
+                }
+                lane[j].out = nullptr;
+                --busy;
+                if (pos < in.size()) {
+                    start(j);
+                }
+            }
+        }
+
+        // Finish whatever the lanes were still working on one at a time.
+        for (size_t j = 0; j < lanes; ++j) {
+            if (!lane[j].out) {
+                continue;
+            }
+            uint32_t state[8];
+            for (int i = 0; i < 8; ++i) {
+                state[i] = s[lanes * i + j];
+            }
+            if (!lane[j].in_tail) {
+                Transform(state, lane[j].next, (lane[j].end - lane[j].next) / 64);
+                lane[j].Skip();
+            }
+            Transform(state, lane[j].next, (lane[j].end - lane[j].next) / 64);
+            for (int i = 0; i < 8; ++i) {
+                WriteBE32(lane[j].out + 4 * i, state[i]);
+            }
+            memory_cleanse(state, sizeof(state));
+        }
+        for (size_t j = 0; j < lanes; ++j) {
+            memory_cleanse(lane[j].tail, sizeof(lane[j].tail));
+        }
+        memory_cleanse(s.data(), sizeof(s));
+    }
+
+    for (; pos < in.size(); ++pos) {
+        CSHA256().Write((const unsigned char*)in[pos].data(), in[pos].size()).Finalize(out + pos * CSHA256::OUTPUT_SIZE);
+    }
+}
+
 // End of File
@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <string>
 
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+
 /** A hasher class for SHA-256. */
 class CSHA256
 {
@@ -27,13 +30,31 @@ public:
     CSHA256& Write(const unsigned char* data, size_t len);
     void Finalize(unsigned char hash[OUTPUT_SIZE]);
     void WriteAndFinalize8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hash[OUTPUT_SIZE*8]);
+    /** Finalize count hashes which share everything written so far, each
+     *  followed by its own tail_len bytes of tails.  A whole number of
+     *  blocks must have been written, and tail_len must be at most 55 bytes
+     *  so that each tail fits in a single padded block.
+     */
+    void WriteAndFinalizeMany(const unsigned char* tails, size_t tail_len, size_t count, unsigned char* hashes);
     CSHA256& Reset();
 };
 
-/** Autodetect the best available SHA256 implementation.
- *  Returns the name of the implementation.
+namespace sha256_implementation {
+enum UseImplementation : uint8_t {
+    STANDARD = 0,
+    USE_SSE4 = 1 << 0,
+    USE_AVX2 = 1 << 1,
+    USE_SHANI = 1 << 2,
+    USE_SSE4_AND_AVX2 = USE_SSE4 | USE_AVX2,
+    USE_SSE4_AND_SHANI = USE_SSE4 | USE_SHANI,
+    USE_ALL = USE_SSE4 | USE_AVX2 | USE_SHANI,
+};
+}
+
+/** Autodetect the best available SHA256 implementation, using only those
+ *  permitted by use_implementation.  Returns the name of the implementation.
  */
-std::string SHA256AutoDetect();
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation = sha256_implementation::USE_ALL);
 
 /** Compute multiple double-SHA256's of 64-byte blobs.
  *  output:  pointer to a blocks*32 byte output buffer
@@ -44,6 +65,16 @@ void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks)
 
 void SHA256Midstate(unsigned char* out, const uint32_t* midstate, const unsigned char* in, size_t blocks);
 
+/** Compute the SHA256 of each of many short messages of any length.
+ *  out: pointer to an in.size()*32 byte output buffer
+ *  in:  the messages, each hashed on its own.
+ *
+ *  The messages are spread across the lanes of the multi-way transform, if
+ *  there is one, each lane taking the next message as soon as its last one is
+ *  done.
+ */
+void SHA256Many(unsigned char* out, absl::Span<const absl::string_view> in);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
 
 // End of File
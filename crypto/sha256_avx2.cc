@@ -5,40 +5,45 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+// The functions are compiled for AVX2 individually, so that nothing else in
+// the library can end up using instructions the CPU might not have.
+
 #if defined(__x86_64__) || defined(__amd64__)
 
 #include <stdint.h>
 #include <immintrin.h>
 
+#define AVX2 __attribute__((target("avx2")))
+
 #include "crypto/common.h"
 
 namespace {
 
-__m256i inline K(uint32_t x) { return _mm256_set1_epi32(x); }
-
-__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
-__m256i inline Add(__m256i x, __m256i y, __m256i z) { return Add(Add(x, y), z); }
-__m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w) { return Add(Add(x, y), Add(z, w)); }
-__m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w, __m256i v) { return Add(Add(x, y, z), Add(w, v)); }
-__m256i inline Inc(__m256i& x, __m256i y) { x = Add(x, y); return x; }
-__m256i inline Inc(__m256i& x, __m256i y, __m256i z) { x = Add(x, y, z); return x; }
-__m256i inline Inc(__m256i& x, __m256i y, __m256i z, __m256i w) { x = Add(x, y, z, w); return x; }
-__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
-__m256i inline Xor(__m256i x, __m256i y, __m256i z) { return Xor(Xor(x, y), z); }
-__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
-__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
-__m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
-__m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
-
-__m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
-__m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
-__m256i inline Sigma0(__m256i x) { return Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19)), Or(ShR(x, 22), ShL(x, 10))); }
-__m256i inline Sigma1(__m256i x) { return Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21)), Or(ShR(x, 25), ShL(x, 7))); }
-__m256i inline sigma0(__m256i x) { return Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14)), ShR(x, 3)); }
-__m256i inline sigma1(__m256i x) { return Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13)), ShR(x, 10)); }
+AVX2 __m256i inline K(uint32_t x) { return _mm256_set1_epi32(x); }
+
+AVX2 __m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+AVX2 __m256i inline Add(__m256i x, __m256i y, __m256i z) { return Add(Add(x, y), z); }
+AVX2 __m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w) { return Add(Add(x, y), Add(z, w)); }
+AVX2 __m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w, __m256i v) { return Add(Add(x, y, z), Add(w, v)); }
+AVX2 __m256i inline Inc(__m256i& x, __m256i y) { x = Add(x, y); return x; }
+AVX2 __m256i inline Inc(__m256i& x, __m256i y, __m256i z) { x = Add(x, y, z); return x; }
+AVX2 __m256i inline Inc(__m256i& x, __m256i y, __m256i z, __m256i w) { x = Add(x, y, z, w); return x; }
+AVX2 __m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+AVX2 __m256i inline Xor(__m256i x, __m256i y, __m256i z) { return Xor(Xor(x, y), z); }
+AVX2 __m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+AVX2 __m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+AVX2 __m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+AVX2 __m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+
+AVX2 __m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+AVX2 __m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+AVX2 __m256i inline Sigma0(__m256i x) { return Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19)), Or(ShR(x, 22), ShL(x, 10))); }
+AVX2 __m256i inline Sigma1(__m256i x) { return Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21)), Or(ShR(x, 25), ShL(x, 7))); }
+AVX2 __m256i inline sigma0(__m256i x) { return Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14)), ShR(x, 3)); }
+AVX2 __m256i inline sigma1(__m256i x) { return Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13)), ShR(x, 10)); }
 
 /** One round of SHA-256. */
-void inline __attribute__((always_inline)) Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i k)
+AVX2 void inline __attribute__((always_inline)) Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i k)
 {
     __m256i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
     __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
@@ -46,7 +51,7 @@ void inline __attribute__((always_inline)) Round(__m256i a, __m256i b, __m256i c
     h = Add(t1, t2);
 }
 
-__m256i inline Read8(const unsigned char* chunk, int offset) {
+AVX2 __m256i inline Read8(const unsigned char* chunk, int offset) {
     __m256i ret = _mm256_set_epi32(
         ReadLE32(chunk + 0 + offset),
         ReadLE32(chunk + 64 + offset),
@@ -60,7 +65,22 @@ __m256i inline Read8(const unsigned char* chunk, int offset) {
     return _mm256_shuffle_epi8(ret, _mm256_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL, 0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
 }
 
-void inline Write8(unsigned char* out, int offset, __m256i v) {
+/** Like Read8, but with each lane reading from its own block. */
+AVX2 __m256i inline Read8(const unsigned char* const* chunks, int offset) {
+    __m256i ret = _mm256_set_epi32(
+        ReadLE32(chunks[7] + offset),
+        ReadLE32(chunks[6] + offset),
+        ReadLE32(chunks[5] + offset),
+        ReadLE32(chunks[4] + offset),
+        ReadLE32(chunks[3] + offset),
+        ReadLE32(chunks[2] + offset),
+        ReadLE32(chunks[1] + offset),
+        ReadLE32(chunks[0] + offset)
+    );
+    return _mm256_shuffle_epi8(ret, _mm256_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL, 0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
+}
+
+AVX2 void inline Write8(unsigned char* out, int offset, __m256i v) {
     v = _mm256_shuffle_epi8(v, _mm256_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL, 0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
     WriteLE32(out + 0 + offset, _mm256_extract_epi32(v, 7));
     WriteLE32(out + 32 + offset, _mm256_extract_epi32(v, 6));
@@ -72,40 +92,29 @@ void inline Write8(unsigned char* out, int offset, __m256i v) {
     WriteLE32(out + 224 + offset, _mm256_extract_epi32(v, 0));
 }
 
-}
-
-namespace sha256multi_avx2 {
-
-void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+/** The 64 rounds of SHA-256 on one block per lane, with the message words
+ *  of each round supplied by read(offset). */
+template <typename Reader>
+AVX2 void inline __attribute__((always_inline)) Rounds(__m256i& a, __m256i& b, __m256i& c, __m256i& d, __m256i& e, __m256i& f, __m256i& g, __m256i& h, Reader read)
 {
-    // Transform 1
-    __m256i a = K(s[0]);
-    __m256i b = K(s[1]);
-    __m256i c = K(s[2]);
-    __m256i d = K(s[3]);
-    __m256i e = K(s[4]);
-    __m256i f = K(s[5]);
-    __m256i g = K(s[6]);
-    __m256i h = K(s[7]);
-
     __m256i w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
 
-    Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = Read8(in, 0)));
-    Round(h, a, b, c, d, e, f, g, Add(K(0x71374491ul), w1 = Read8(in, 4)));
-    Round(g, h, a, b, c, d, e, f, Add(K(0xb5c0fbcful), w2 = Read8(in, 8)));
-    Round(f, g, h, a, b, c, d, e, Add(K(0xe9b5dba5ul), w3 = Read8(in, 12)));
-    Round(e, f, g, h, a, b, c, d, Add(K(0x3956c25bul), w4 = Read8(in, 16)));
-    Round(d, e, f, g, h, a, b, c, Add(K(0x59f111f1ul), w5 = Read8(in, 20)));
-    Round(c, d, e, f, g, h, a, b, Add(K(0x923f82a4ul), w6 = Read8(in, 24)));
-    Round(b, c, d, e, f, g, h, a, Add(K(0xab1c5ed5ul), w7 = Read8(in, 28)));
-    Round(a, b, c, d, e, f, g, h, Add(K(0xd807aa98ul), w8 = Read8(in, 32)));
-    Round(h, a, b, c, d, e, f, g, Add(K(0x12835b01ul), w9 = Read8(in, 36)));
-    Round(g, h, a, b, c, d, e, f, Add(K(0x243185beul), w10 = Read8(in, 40)));
-    Round(f, g, h, a, b, c, d, e, Add(K(0x550c7dc3ul), w11 = Read8(in, 44)));
-    Round(e, f, g, h, a, b, c, d, Add(K(0x72be5d74ul), w12 = Read8(in, 48)));
-    Round(d, e, f, g, h, a, b, c, Add(K(0x80deb1feul), w13 = Read8(in, 52)));
-    Round(c, d, e, f, g, h, a, b, Add(K(0x9bdc06a7ul), w14 = Read8(in, 56)));
-    Round(b, c, d, e, f, g, h, a, Add(K(0xc19bf174ul), w15 = Read8(in, 60)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = read(0)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x71374491ul), w1 = read(4)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb5c0fbcful), w2 = read(8)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xe9b5dba5ul), w3 = read(12)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x3956c25bul), w4 = read(16)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x59f111f1ul), w5 = read(20)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x923f82a4ul), w6 = read(24)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xab1c5ed5ul), w7 = read(28)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xd807aa98ul), w8 = read(32)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x12835b01ul), w9 = read(36)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x243185beul), w10 = read(40)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x550c7dc3ul), w11 = read(44)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x72be5d74ul), w12 = read(48)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x80deb1feul), w13 = read(52)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x9bdc06a7ul), w14 = read(56)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc19bf174ul), w15 = read(60)));
     Round(a, b, c, d, e, f, g, h, Add(K(0xe49b69c1ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
     Round(h, a, b, c, d, e, f, g, Add(K(0xefbe4786ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
     Round(g, h, a, b, c, d, e, f, Add(K(0x0fc19dc6ul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
@@ -154,6 +163,25 @@ void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char*
     Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
     Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
     Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+}
+
+}
+
+namespace sha256multi_avx2 {
+
+AVX2 void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    // Transform 1
+    __m256i a = K(s[0]);
+    __m256i b = K(s[1]);
+    __m256i c = K(s[2]);
+    __m256i d = K(s[3]);
+    __m256i e = K(s[4]);
+    __m256i f = K(s[5]);
+    __m256i g = K(s[6]);
+    __m256i h = K(s[7]);
+
+    Rounds(a, b, c, d, e, f, g, h, [in](int offset) AVX2 { return Read8(in, offset); });
 
     // Output
     Write8(out, 0, Add(a, K(s[0])));
@@ -166,11 +194,36 @@ void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char*
     Write8(out, 28, Add(h, K(s[7])));
 }
 
+/** Compress one block in each lane, lane j taking in[j] and the state in
+ *  s[j], s[8 + j], ..., s[56 + j]. */
+AVX2 void TransformLanes_8way(uint32_t* s, const unsigned char* const* in)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s + 0));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s + 8));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(s + 16));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(s + 24));
+    __m256i e = _mm256_loadu_si256((const __m256i*)(s + 32));
+    __m256i f = _mm256_loadu_si256((const __m256i*)(s + 40));
+    __m256i g = _mm256_loadu_si256((const __m256i*)(s + 48));
+    __m256i h = _mm256_loadu_si256((const __m256i*)(s + 56));
+
+    Rounds(a, b, c, d, e, f, g, h, [in](int offset) AVX2 { return Read8(in, offset); });
+
+    _mm256_storeu_si256((__m256i*)(s + 0), Add(a, _mm256_loadu_si256((const __m256i*)(s + 0))));
+    _mm256_storeu_si256((__m256i*)(s + 8), Add(b, _mm256_loadu_si256((const __m256i*)(s + 8))));
+    _mm256_storeu_si256((__m256i*)(s + 16), Add(c, _mm256_loadu_si256((const __m256i*)(s + 16))));
+    _mm256_storeu_si256((__m256i*)(s + 24), Add(d, _mm256_loadu_si256((const __m256i*)(s + 24))));
+    _mm256_storeu_si256((__m256i*)(s + 32), Add(e, _mm256_loadu_si256((const __m256i*)(s + 32))));
+    _mm256_storeu_si256((__m256i*)(s + 40), Add(f, _mm256_loadu_si256((const __m256i*)(s + 40))));
+    _mm256_storeu_si256((__m256i*)(s + 48), Add(g, _mm256_loadu_si256((const __m256i*)(s + 48))));
+    _mm256_storeu_si256((__m256i*)(s + 56), Add(h, _mm256_loadu_si256((const __m256i*)(s + 56))));
+}
+
 }
 
 namespace sha256d64_avx2 {
 
-void Transform_8way(unsigned char* out, const unsigned char* in)
+AVX2 void Transform_8way(unsigned char* out, const unsigned char* in)
 {
     // Transform 1
     __m256i a = K(0x6a09e667ul);
@@ -5,40 +5,45 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+// The functions are compiled for SSE4.1 individually, so that nothing else in
+// the library can end up using instructions the CPU might not have.
+
 #if defined(__x86_64__) || defined(__amd64__)
 
 #include <stdint.h>
 #include <immintrin.h>
 
+#define SSE41 __attribute__((target("sse4.1")))
+
 #include "crypto/common.h"
 
 namespace {
 
-__m128i inline K(uint32_t x) { return _mm_set1_epi32(x); }
-
-__m128i inline Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
-__m128i inline Add(__m128i x, __m128i y, __m128i z) { return Add(Add(x, y), z); }
-__m128i inline Add(__m128i x, __m128i y, __m128i z, __m128i w) { return Add(Add(x, y), Add(z, w)); }
-__m128i inline Add(__m128i x, __m128i y, __m128i z, __m128i w, __m128i v) { return Add(Add(x, y, z), Add(w, v)); }
-__m128i inline Inc(__m128i& x, __m128i y) { x = Add(x, y); return x; }
-__m128i inline Inc(__m128i& x, __m128i y, __m128i z) { x = Add(x, y, z); return x; }
-__m128i inline Inc(__m128i& x, __m128i y, __m128i z, __m128i w) { x = Add(x, y, z, w); return x; }
-__m128i inline Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
-__m128i inline Xor(__m128i x, __m128i y, __m128i z) { return Xor(Xor(x, y), z); }
-__m128i inline Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
-__m128i inline And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
-__m128i inline ShR(__m128i x, int n) { return _mm_srli_epi32(x, n); }
-__m128i inline ShL(__m128i x, int n) { return _mm_slli_epi32(x, n); }
-
-__m128i inline Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
-__m128i inline Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
-__m128i inline Sigma0(__m128i x) { return Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19)), Or(ShR(x, 22), ShL(x, 10))); }
-__m128i inline Sigma1(__m128i x) { return Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21)), Or(ShR(x, 25), ShL(x, 7))); }
-__m128i inline sigma0(__m128i x) { return Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14)), ShR(x, 3)); }
-__m128i inline sigma1(__m128i x) { return Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13)), ShR(x, 10)); }
+SSE41 __m128i inline K(uint32_t x) { return _mm_set1_epi32(x); }
+
+SSE41 __m128i inline Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+SSE41 __m128i inline Add(__m128i x, __m128i y, __m128i z) { return Add(Add(x, y), z); }
+SSE41 __m128i inline Add(__m128i x, __m128i y, __m128i z, __m128i w) { return Add(Add(x, y), Add(z, w)); }
+SSE41 __m128i inline Add(__m128i x, __m128i y, __m128i z, __m128i w, __m128i v) { return Add(Add(x, y, z), Add(w, v)); }
+SSE41 __m128i inline Inc(__m128i& x, __m128i y) { x = Add(x, y); return x; }
+SSE41 __m128i inline Inc(__m128i& x, __m128i y, __m128i z) { x = Add(x, y, z); return x; }
+SSE41 __m128i inline Inc(__m128i& x, __m128i y, __m128i z, __m128i w) { x = Add(x, y, z, w); return x; }
+SSE41 __m128i inline Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+SSE41 __m128i inline Xor(__m128i x, __m128i y, __m128i z) { return Xor(Xor(x, y), z); }
+SSE41 __m128i inline Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+SSE41 __m128i inline And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+SSE41 __m128i inline ShR(__m128i x, int n) { return _mm_srli_epi32(x, n); }
+SSE41 __m128i inline ShL(__m128i x, int n) { return _mm_slli_epi32(x, n); }
+
+SSE41 __m128i inline Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+SSE41 __m128i inline Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+SSE41 __m128i inline Sigma0(__m128i x) { return Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19)), Or(ShR(x, 22), ShL(x, 10))); }
+SSE41 __m128i inline Sigma1(__m128i x) { return Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21)), Or(ShR(x, 25), ShL(x, 7))); }
+SSE41 __m128i inline sigma0(__m128i x) { return Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14)), ShR(x, 3)); }
+SSE41 __m128i inline sigma1(__m128i x) { return Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13)), ShR(x, 10)); }
 
 /** One round of SHA-256. */
-void inline __attribute__((always_inline)) Round(__m128i a, __m128i b, __m128i c, __m128i& d, __m128i e, __m128i f, __m128i g, __m128i& h, __m128i k)
+SSE41 void inline __attribute__((always_inline)) Round(__m128i a, __m128i b, __m128i c, __m128i& d, __m128i e, __m128i f, __m128i g, __m128i& h, __m128i k)
 {
     __m128i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
     __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
@@ -46,7 +51,7 @@ void inline __attribute__((always_inline)) Round(__m128i a, __m128i b, __m128i c
     h = Add(t1, t2);
 }
 
-__m128i inline Read4(const unsigned char* chunk, int offset) {
+SSE41 __m128i inline Read4(const unsigned char* chunk, int offset) {
     __m128i ret = _mm_set_epi32(
         ReadLE32(chunk + 0 + offset),
         ReadLE32(chunk + 64 + offset),
@@ -56,7 +61,18 @@ __m128i inline Read4(const unsigned char* chunk, int offset) {
     return _mm_shuffle_epi8(ret, _mm_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
 }
 
-void inline Write4(unsigned char* out, int offset, __m128i v) {
+/** Like Read4, but with each lane reading from its own block. */
+SSE41 __m128i inline Read4(const unsigned char* const* chunks, int offset) {
+    __m128i ret = _mm_set_epi32(
+        ReadLE32(chunks[3] + offset),
+        ReadLE32(chunks[2] + offset),
+        ReadLE32(chunks[1] + offset),
+        ReadLE32(chunks[0] + offset)
+    );
+    return _mm_shuffle_epi8(ret, _mm_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
+}
+
+SSE41 void inline Write4(unsigned char* out, int offset, __m128i v) {
     v = _mm_shuffle_epi8(v, _mm_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
     WriteLE32(out + 0 + offset, _mm_extract_epi32(v, 3));
     WriteLE32(out + 32 + offset, _mm_extract_epi32(v, 2));
@@ -64,40 +80,29 @@ void inline Write4(unsigned char* out, int offset, __m128i v) {
     WriteLE32(out + 96 + offset, _mm_extract_epi32(v, 0));
 }
 
-}
-
-namespace sha256multi_sse41 {
-
-void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+/** The 64 rounds of SHA-256 on one block per lane, with the message words
+ *  of each round supplied by read(offset). */
+template <typename Reader>
+SSE41 void inline __attribute__((always_inline)) Rounds(__m128i& a, __m128i& b, __m128i& c, __m128i& d, __m128i& e, __m128i& f, __m128i& g, __m128i& h, Reader read)
 {
-    // Transform 1
-    __m128i a = K(s[0]);
-    __m128i b = K(s[1]);
-    __m128i c = K(s[2]);
-    __m128i d = K(s[3]);
-    __m128i e = K(s[4]);
-    __m128i f = K(s[5]);
-    __m128i g = K(s[6]);
-    __m128i h = K(s[7]);
-
     __m128i w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
 
-    Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = Read4(in, 0)));
-    Round(h, a, b, c, d, e, f, g, Add(K(0x71374491ul), w1 = Read4(in, 4)));
-    Round(g, h, a, b, c, d, e, f, Add(K(0xb5c0fbcful), w2 = Read4(in, 8)));
-    Round(f, g, h, a, b, c, d, e, Add(K(0xe9b5dba5ul), w3 = Read4(in, 12)));
-    Round(e, f, g, h, a, b, c, d, Add(K(0x3956c25bul), w4 = Read4(in, 16)));
-    Round(d, e, f, g, h, a, b, c, Add(K(0x59f111f1ul), w5 = Read4(in, 20)));
-    Round(c, d, e, f, g, h, a, b, Add(K(0x923f82a4ul), w6 = Read4(in, 24)));
-    Round(b, c, d, e, f, g, h, a, Add(K(0xab1c5ed5ul), w7 = Read4(in, 28)));
-    Round(a, b, c, d, e, f, g, h, Add(K(0xd807aa98ul), w8 = Read4(in, 32)));
-    Round(h, a, b, c, d, e, f, g, Add(K(0x12835b01ul), w9 = Read4(in, 36)));
-    Round(g, h, a, b, c, d, e, f, Add(K(0x243185beul), w10 = Read4(in, 40)));
-    Round(f, g, h, a, b, c, d, e, Add(K(0x550c7dc3ul), w11 = Read4(in, 44)));
-    Round(e, f, g, h, a, b, c, d, Add(K(0x72be5d74ul), w12 = Read4(in, 48)));
-    Round(d, e, f, g, h, a, b, c, Add(K(0x80deb1feul), w13 = Read4(in, 52)));
-    Round(c, d, e, f, g, h, a, b, Add(K(0x9bdc06a7ul), w14 = Read4(in, 56)));
-    Round(b, c, d, e, f, g, h, a, Add(K(0xc19bf174ul), w15 = Read4(in, 60)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = read(0)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x71374491ul), w1 = read(4)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb5c0fbcful), w2 = read(8)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xe9b5dba5ul), w3 = read(12)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x3956c25bul), w4 = read(16)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x59f111f1ul), w5 = read(20)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x923f82a4ul), w6 = read(24)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xab1c5ed5ul), w7 = read(28)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xd807aa98ul), w8 = read(32)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x12835b01ul), w9 = read(36)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x243185beul), w10 = read(40)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x550c7dc3ul), w11 = read(44)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x72be5d74ul), w12 = read(48)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x80deb1feul), w13 = read(52)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x9bdc06a7ul), w14 = read(56)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc19bf174ul), w15 = read(60)));
     Round(a, b, c, d, e, f, g, h, Add(K(0xe49b69c1ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
     Round(h, a, b, c, d, e, f, g, Add(K(0xefbe4786ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
     Round(g, h, a, b, c, d, e, f, Add(K(0x0fc19dc6ul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
@@ -146,6 +151,25 @@ void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char*
     Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
     Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
     Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+}
+
+}
+
+namespace sha256multi_sse41 {
+
+SSE41 void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    // Transform 1
+    __m128i a = K(s[0]);
+    __m128i b = K(s[1]);
+    __m128i c = K(s[2]);
+    __m128i d = K(s[3]);
+    __m128i e = K(s[4]);
+    __m128i f = K(s[5]);
+    __m128i g = K(s[6]);
+    __m128i h = K(s[7]);
+
+    Rounds(a, b, c, d, e, f, g, h, [in](int offset) SSE41 { return Read4(in, offset); });
 
     // Output
     Write4(out, 0, Add(a, K(s[0])));
@@ -158,11 +182,36 @@ void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char*
     Write4(out, 28, Add(h, K(s[7])));
 }
 
+/** Compress one block in each lane, lane j taking in[j] and the state in
+ *  s[j], s[4 + j], ..., s[28 + j]. */
+SSE41 void TransformLanes_4way(uint32_t* s, const unsigned char* const* in)
+{
+    __m128i a = _mm_loadu_si128((const __m128i*)(s + 0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s + 4));
+    __m128i c = _mm_loadu_si128((const __m128i*)(s + 8));
+    __m128i d = _mm_loadu_si128((const __m128i*)(s + 12));
+    __m128i e = _mm_loadu_si128((const __m128i*)(s + 16));
+    __m128i f = _mm_loadu_si128((const __m128i*)(s + 20));
+    __m128i g = _mm_loadu_si128((const __m128i*)(s + 24));
+    __m128i h = _mm_loadu_si128((const __m128i*)(s + 28));
+
+    Rounds(a, b, c, d, e, f, g, h, [in](int offset) SSE41 { return Read4(in, offset); });
+
+    _mm_storeu_si128((__m128i*)(s + 0), Add(a, _mm_loadu_si128((const __m128i*)(s + 0))));
+    _mm_storeu_si128((__m128i*)(s + 4), Add(b, _mm_loadu_si128((const __m128i*)(s + 4))));
+    _mm_storeu_si128((__m128i*)(s + 8), Add(c, _mm_loadu_si128((const __m128i*)(s + 8))));
+    _mm_storeu_si128((__m128i*)(s + 12), Add(d, _mm_loadu_si128((const __m128i*)(s + 12))));
+    _mm_storeu_si128((__m128i*)(s + 16), Add(e, _mm_loadu_si128((const __m128i*)(s + 16))));
+    _mm_storeu_si128((__m128i*)(s + 20), Add(f, _mm_loadu_si128((const __m128i*)(s + 20))));
+    _mm_storeu_si128((__m128i*)(s + 24), Add(g, _mm_loadu_si128((const __m128i*)(s + 24))));
+    _mm_storeu_si128((__m128i*)(s + 28), Add(h, _mm_loadu_si128((const __m128i*)(s + 28))));
+}
+
 }
 
 namespace sha256d64_sse41 {
 
-void Transform_4way(unsigned char* out, const unsigned char* in)
+SSE41 void Transform_4way(unsigned char* out, const unsigned char* in)
 {
     // Transform 1
     __m128i a = K(0x6a09e667ul);
@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <string>
+
 /** A hasher class for SHA-512. */
 class CSHA512
 {
@@ -29,6 +31,12 @@ public:
     uint64_t Size() const { return bytes; }
 };
 
+/** Autodetect the best available SHA512 implementation, or select the
+ *  portable one if use_hardware is false.  Returns the name of the
+ *  implementation.
+ */
+std::string SHA512AutoDetect(bool use_hardware = true);
+
 #endif // BITCOIN_CRYPTO_SHA512_H
 
 // End of File
@@ -0,0 +1,125 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// SHA-512 using the ARMv8.2-A SHA512 instructions (FEAT_SHA512), which are
+// optional and so are only enabled for the functions in this file.  The caller
+// must check for support at runtime.
+
+#if defined(__aarch64__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arm_neon.h>
+
+#define SHA512_TARGET __attribute__((target("arch=armv8.2-a+sha3")))
+
+namespace {
+alignas(uint64x2_t) constexpr uint64_t K[80] =
+{
+    0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+    0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+    0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+    0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+    0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+    0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+    0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+    0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+    0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+    0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+    0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+    0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+    0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+    0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+    0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+    0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+    0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+    0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+    0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+    0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull,
+};
+
+/** Two rounds of SHA-512.  Each register holds two consecutive state words,
+ *  and afterwards gh holds the new (a, b) and cd the new (e, f), so the
+ *  caller rotates the roles of the registers for the next two rounds. */
+SHA512_TARGET void inline Round2(uint64x2_t ab, uint64x2_t& cd, uint64x2_t ef, uint64x2_t& gh, uint64x2_t wk)
+{
+    const uint64x2_t sum = vaddq_u64(vextq_u64(wk, wk, 1), gh);
+    const uint64x2_t t = vsha512hq_u64(sum, vextq_u64(ef, gh, 1), vextq_u64(cd, ef, 1));
+    gh = vsha512h2q_u64(t, cd, ab);
+    cd = vaddq_u64(cd, t);
+}
+
+/** Compute the next two words of the message schedule, in place of the
+ *  words from sixteen rounds before. */
+SHA512_TARGET void inline Schedule(uint64x2_t& m0, uint64x2_t m1, uint64x2_t m4, uint64x2_t m5, uint64x2_t m7)
+{
+    m0 = vsha512su1q_u64(vsha512su0q_u64(m0, m1), m7, vextq_u64(m4, m5, 1));
+}
+} // anonymous
+
+namespace sha512_armv8 {
+// Process multiple blocks.  The caller is responsible for setting the initial
+// state, and the caller is responsible for padding the final block.
+SHA512_TARGET void Transform(uint64_t* state, const unsigned char* data, size_t blocks)
+{
+    uint64x2_t ab = vld1q_u64(&state[0]);
+    uint64x2_t cd = vld1q_u64(&state[2]);
+    uint64x2_t ef = vld1q_u64(&state[4]);
+    uint64x2_t gh = vld1q_u64(&state[6]);
+
+    while (blocks--) {
+        const uint64x2_t ab_save = ab, cd_save = cd, ef_save = ef, gh_save = gh;
+
+        // Load and convert input data to Big Endian
+        uint64x2_t m0 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 0)));
+        uint64x2_t m1 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 16)));
+        uint64x2_t m2 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 32)));
+        uint64x2_t m3 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 48)));
+        uint64x2_t m4 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 64)));
+        uint64x2_t m5 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 80)));
+        uint64x2_t m6 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 96)));
+        uint64x2_t m7 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 112)));
+        data += 128;
+
+        for (int t = 0; t < 80; t += 16) {
+            Round2(ab, cd, ef, gh, vaddq_u64(m0, vld1q_u64(&K[t + 0])));
+            Round2(gh, ab, cd, ef, vaddq_u64(m1, vld1q_u64(&K[t + 2])));
+            Round2(ef, gh, ab, cd, vaddq_u64(m2, vld1q_u64(&K[t + 4])));
+            Round2(cd, ef, gh, ab, vaddq_u64(m3, vld1q_u64(&K[t + 6])));
+            Round2(ab, cd, ef, gh, vaddq_u64(m4, vld1q_u64(&K[t + 8])));
+            Round2(gh, ab, cd, ef, vaddq_u64(m5, vld1q_u64(&K[t + 10])));
+            Round2(ef, gh, ab, cd, vaddq_u64(m6, vld1q_u64(&K[t + 12])));
+            Round2(cd, ef, gh, ab, vaddq_u64(m7, vld1q_u64(&K[t + 14])));
+            if (t < 64) {
+                Schedule(m0, m1, m4, m5, m7);
+                Schedule(m1, m2, m5, m6, m0);
+                Schedule(m2, m3, m6, m7, m1);
+                Schedule(m3, m4, m7, m0, m2);
+                Schedule(m4, m5, m0, m1, m3);
+                Schedule(m5, m6, m1, m2, m4);
+                Schedule(m6, m7, m2, m3, m5);
+                Schedule(m7, m0, m3, m4, m6);
+            }
+        }
+
+        // Combine state
+        ab = vaddq_u64(ab, ab_save);
+        cd = vaddq_u64(cd, cd_save);
+        ef = vaddq_u64(ef, ef_save);
+        gh = vaddq_u64(gh, gh_save);
+    }
+
+    // Save state
+    vst1q_u64(&state[0], ab);
+    vst1q_u64(&state[2], cd);
+    vst1q_u64(&state[4], ef);
+    vst1q_u64(&state[6], gh);
+}
+} // namespace sha512_armv8
+
+#endif
+
+// End of File
@@ -29,8 +29,12 @@
 #include "absl/time/clock.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <new>
 #include <thread>
 
 #ifndef WIN32
@@ -592,8 +596,124 @@ static void ProcRand(unsigned char* out, int num, RNGLevel level) noexcept
     }
 }
 
+namespace {
+
+/** Per-thread state of GetSecretRandBytes(). */
+class ThreadRNG
+{
+public:
+    /** Reseed from the strong RNG after this many bytes of output... */
+    static const uint64_t RESEED_BYTES = 1024 * 1024;
+    /** ...or after this much time, whichever comes first. */
+    static constexpr std::chrono::seconds RESEED_INTERVAL{60};
+
+    ThreadRNG() noexcept
+    {
+        void* ptr = LockedPoolManager::Instance().alloc(sizeof(State));
+        if (ptr) {
+            state = new (ptr) State();
+        }
+    }
+
+    ~ThreadRNG()
+    {
+        if (state) {
+            state->~State();
+            memory_cleanse(state, sizeof(State));
+            LockedPoolManager::Instance().free(state);
+        }
+    }
+
+    ThreadRNG(const ThreadRNG&) = delete;
+    ThreadRNG& operator=(const ThreadRNG&) = delete;
+
+    void Generate(unsigned char* out, int num) noexcept
+    {
+        // Without locked memory to keep the state in, just use the strong
+        // RNG directly.
+        if (!state) {
+            while (num > 0) {
+                GetStrongRandBytes(out, std::min(num, 32));
+                out += 32;
+                num -= 32;
+            }
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (!state->seeded || state->bytes >= RESEED_BYTES || now - state->seeded_at >= RESEED_INTERVAL) {
+            GetStrongRandBytes(state->buffer, 32);
+            state->rng.SetKey(state->buffer, 32);
+            memory_cleanse(state->buffer, sizeof(state->buffer));
+            state->available = 0;
+            state->seeded = true;
+            state->seeded_at = now;
+            state->bytes = 0;
+        }
+        state->bytes += num;
+
+        // Requests larger than the buffer take their own keystream, and the
+        // buffer is then refilled so that the key which generated it is
+        // replaced.
+        if (num >= (int)sizeof(state->buffer)) {
+            state->rng.Keystream(out, num);
+            Refill();
+            return;
+        }
+
+        // Everything else is served from the buffer, which is wiped as it is
+        // handed out.
+        while (num > 0) {
+            if (!state->available) {
+                Refill();
+            }
+            const size_t pos = sizeof(state->buffer) - state->available;
+            const size_t n = std::min<size_t>(num, state->available);
+            memcpy(out, state->buffer + pos, n);
+            memory_cleanse(state->buffer + pos, n);
+            state->available -= n;
+            out += n;
+            num -= n;
+        }
+    }
+
+private:
+    /** Sixteen blocks, a multiple of the width of every multi-block ChaCha20
+     *  implementation, so that refills are generated a vector at a time. */
+    static const size_t BUFFER_SIZE = 16 * 64;
+
+    struct State {
+        ChaCha20 rng;
+        unsigned char buffer[BUFFER_SIZE];
+        size_t available = 0;
+        bool seeded = false;
+        std::chrono::steady_clock::time_point seeded_at;
+        uint64_t bytes = 0;
+    };
+
+    /** Refill the buffer with keystream.  Its first 32 bytes become the next
+     *  key ("fast key erasure"), so nothing left in the state can be used to
+     *  recover output already returned, and the rest is output to come. */
+    void Refill() noexcept
+    {
+        state->rng.Keystream(state->buffer, sizeof(state->buffer));
+        state->rng.SetKey(state->buffer, 32);
+        memory_cleanse(state->buffer, 32);
+        state->available = sizeof(state->buffer) - 32;
+    }
+
+    State* state = nullptr;
+};
+
+} // namespace
+
 void GetRandBytes(unsigned char* buf, int num) noexcept { ProcRand(buf, num, RNGLevel::FAST); }
 void GetStrongRandBytes(unsigned char* buf, int num) noexcept { ProcRand(buf, num, RNGLevel::SLOW); }
+void GetSecretRandBytes(unsigned char* buf, int num) noexcept
+{
+    static thread_local ThreadRNG rng;
+    rng.Generate(buf, num);
+}
 void RandAddPeriodic() noexcept { ProcRand(nullptr, 0, RNGLevel::PERIODIC); }
 void RandAddEvent(const uint32_t event_info) noexcept { GetRNGState().AddEvent(event_info); }
 
@@ -98,6 +98,28 @@ uint256 GetRandHash() noexcept;
  */
 void GetStrongRandBytes(unsigned char* buf, int num) noexcept;
 
+/**
+ * Generate secret random data from a per-thread ChaCha20 stream, for bulk
+ * generation of secrets without serializing on the global RNG state.
+ *
+ * Each thread's stream is keyed with 32 bytes from GetStrongRandBytes(), and
+ * rekeyed the same way after every 1 MiB of output or every minute, whichever
+ * comes first.  Keystream is generated sixteen blocks at a time, the first
+ * 32 bytes of which replace the key ("fast key erasure"), and the rest is
+ * handed out and wiped as requests come in, so the state left behind reveals
+ * nothing about output already returned.  For anyone who can't distinguish
+ * ChaCha20 from random, the output is therefore as unpredictable as that of
+ * GetStrongRandBytes(), and a compromise of the state only exposes output up
+ * to the next reseed.
+ * The state is kept in locked memory.
+ *
+ * The state is not reset by fork(), so a child process would repeat its
+ * parent's output until the next reseed.
+ *
+ * Thread-safe.
+ */
+void GetSecretRandBytes(unsigned char* buf, int num) noexcept;
+
 /**
  * Gather entropy from various expensive sources, and feed them to the PRNG state.
  *
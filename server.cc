@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <map>
@@ -18,6 +19,8 @@
 
 #include "absl/numeric/int128.h"
 
+#include "absl/strings/string_view.h"
+
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 
@@ -27,7 +30,9 @@
 
 #include <json/json.h>
 
+#include "support/lockedpool.h"
 #include "uint256.h"
+#include "util/hex.h"
 #include "webcash.h"
 
 using std::to_string;
@@ -215,7 +220,7 @@ static void _upgradeDb()
         static const std::string sql = "SELECT \"next_difficulty\" FROM \"MiningReports\" ORDER BY \"id\" DESC LIMIT 1";
         try {
             const Result r = db->execSqlSync(sql);
-            unsigned difficulty = webcash::state().difficulty.load(); // default value
+            unsigned difficulty = webcash::state().initial_difficulty.load(); // default value
             if (!r.empty() && r[0].size()) {
                 difficulty = r[0][0].as<unsigned>();
             }
@@ -387,24 +392,38 @@ bool check_legalese(
 
 bool parse_secret_webcashes(
     const Json::Value& array,
-    std::map<uint256, SecretWebcash>& _webcash
+    std::map<uint256, Amount>& _webcash
 ){
     _webcash.clear();
-    std::map<uint256, SecretWebcash> webcash;
+    std::map<uint256, Amount> webcash;
     if (!array.isArray()) {
         return false; // expected array
     }
+    // The secrets are only needed long enough to hash them, so they are kept
+    // in this thread's locked arena rather than the shared locked pool.
+    LocalLockedArena::Scope scope;
+    std::vector<SecretWebcash> secrets(array.size());
+    std::vector<absl::string_view> sks(array.size());
     for (unsigned int i = 0; i < array.size(); ++i) {
         auto& secret_str = array[i];
-        if (!secret_str.isString()) {
+        const char* begin;
+        const char* end;
+        if (!secret_str.getString(&begin, &end)) {
             return false; // must be string-encoded
         }
-        SecretWebcash secret;
-        if (!secret.parse(secret_str.asString())) {
+        if (!secrets[i].parse(absl::string_view(begin, end - begin))) {
             return false; // parser error
         }
-        PublicWebcash pub(secret);
-        auto res = webcash.insert({pub.pk, secret});
+        sks[i] = secrets[i].sk;
+    }
+    // All the secrets are hashed together, so that they can share the lanes
+    // of the multi-way SHA256 transform.
+    std::vector<unsigned char> hashes(array.size() * CSHA256::OUTPUT_SIZE);
+    SHA256Many(hashes.data(), sks);
+    for (unsigned int i = 0; i < array.size(); ++i) {
+        uint256 pk;
+        std::copy(hashes.begin() + i * CSHA256::OUTPUT_SIZE, hashes.begin() + (i + 1) * CSHA256::OUTPUT_SIZE, pk.begin());
+        auto res = webcash.insert({pk, secrets[i].amount});
         if (!res.second) {
             return false; // duplicate
         }
@@ -490,9 +509,10 @@ struct ReplacementState {
     std::shared_ptr<Json::Value> msg;
     // The system clock time when the replace request was received by us.
     absl::Time received = absl::UnixEpoch();
-    // The input and output webcash secrets, as provided by the caller.
-    std::map<uint256, SecretWebcash> inputs;
-    std::map<uint256, SecretWebcash> outputs;
+    // The amounts of the input and output webcash secrets provided by the
+    // caller, indexed by public hash.
+    std::map<uint256, Amount> inputs;
+    std::map<uint256, Amount> outputs;
     // A straight summation over the inputs and outputs.
     Amount total_in = Amount{0};
     Amount total_out = Amount{0};
@@ -591,13 +611,13 @@ void V1::replace(
     input_values_hash_only.reserve(state->inputs.size());
     for (const auto& item : state->inputs) {
         const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_in += wc.amount;
-        if (state->total_in < 1 || wc.amount < 1) {
+        const Amount& amount = item.second;
+        state->total_in += amount;
+        if (state->total_in < 1 || amount < 1) {
             return callback(JSONRPCError("overflow"));
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
+        std::string hash_hex = HexStr32(hash.data());
+        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(amount.i64), ")"));
         input_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
     }
 
@@ -615,13 +635,13 @@ void V1::replace(
     output_values_hash_only.reserve(state->outputs.size());
     for (const auto& item : state->outputs) {
         const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_out += wc.amount;
-        if (state->total_out < 1 || wc.amount < 1) {
+        const Amount& amount = item.second;
+        state->total_out += amount;
+        if (state->total_out < 1 || amount < 1) {
             return callback(JSONRPCError("overflow"));
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        output_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
+        std::string hash_hex = HexStr32(hash.data());
+        output_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(amount.i64), ")"));
         output_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
     }
 
@@ -862,8 +882,9 @@ struct BurnState {
     std::shared_ptr<Json::Value> msg;
     // The system clock time when the replace request was received by us.
     absl::Time received = absl::UnixEpoch();
-    // The inputs webcash secrets to be burnt, as provided by the caller.
-    std::map<uint256, SecretWebcash> inputs;
+    // The amounts of the input webcash secrets to be burnt, indexed by public
+    // hash.
+    std::map<uint256, Amount> inputs;
     // A straight summation over the inputs.
     Amount total_in = Amount{0};
     // Pre-constructed SQL statements.
@@ -936,13 +957,13 @@ void V1::burn(
     input_values_hash_only.reserve(state->inputs.size());
     for (const auto& item : state->inputs) {
         const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_in += wc.amount;
-        if (state->total_in < 1 || wc.amount < 1) {
+        const Amount& amount = item.second;
+        state->total_in += amount;
+        if (state->total_in < 1 || amount < 1) {
             return callback(JSONRPCError("overflow"));
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
+        std::string hash_hex = HexStr32(hash.data());
+        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(amount.i64), ")"));
         input_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
     }
 
@@ -1147,9 +1168,10 @@ struct MiningReportState {
     // If the parsed preimage contains a "timestamp" field, and its value.
     bool has_timestamp = false;
     absl::Time timestamp = absl::UnixEpoch();
-    // The "webcash" and "subsidy" fields of the preimage, indexed by public hash.
-    std::map<uint256, SecretWebcash> webcash;
-    std::map<uint256, SecretWebcash> subsidy;
+    // The amounts of the "webcash" and "subsidy" fields of the preimage,
+    // indexed by public hash.
+    std::map<uint256, Amount> webcash;
+    std::map<uint256, Amount> subsidy;
     // The calculated sum of the webcash and subsidy arrays. (cached)
     Amount webcash_sum = Amount{0};
     Amount subsidy_sum = Amount{0};
@@ -1167,6 +1189,8 @@ struct MiningReportState {
     unsigned last_difficulty = 0;
     unsigned current_difficulty = 0;
     double last_aggregate_work = 0.0;
+    // When the current stage of processing began, if profiling.
+    absl::Time stage_start;
 };
 
 // The async function for validating and recording a mining report.  Each
@@ -1210,6 +1234,7 @@ void V1::miningReport(
     absl::Time _received = absl::Now();
     auto state = std::make_shared<MiningReportState>();
     state->received = _received;
+    state->stage_start = _received;
 
     auto maybe_msg = req->getJsonObject();
     if (!maybe_msg || !maybe_msg->isObject()) {
@@ -1282,27 +1307,27 @@ void V1::miningReport(
     output_values_with_amount.reserve(state->webcash.size());
     output_values_hash_only.reserve(state->webcash.size());
     for (const auto& item : state->webcash) {
-        state->webcash_sum += item.second.amount;
-        if (state->webcash_sum < 1 || item.second.amount < 1) {
+        state->webcash_sum += item.second;
+        if (state->webcash_sum < 1 || item.second < 1) {
             return callback(JSONRPCError("overflow"));
         }
-        const std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)item.first.data(), 32));
-        output_values_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(item.second.amount.i64), ")"));
+        const std::string hash_hex = HexStr32(item.first.data());
+        output_values_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(item.second.i64), ")"));
         output_values_hash_only.push_back(absl::StrCat("'\\x", hash_hex, "'::bytea"));
     }
 
     // Check 'subsidy'
     state->subsidy_sum = Amount{0};
     for (const auto& item : state->subsidy) {
-        state->subsidy_sum += item.second.amount;
-        if (state->subsidy_sum < 1 || item.second.amount < 1) {
+        state->subsidy_sum += item.second;
+        if (state->subsidy_sum < 1 || item.second < 1) {
             return callback(JSONRPCError("overflow"));
         }
         auto itr = state->webcash.find(item.first);
         if (itr == state->webcash.end()) {
             return callback(JSONRPCError("missing subsidy from webcash"));
         }
-        if (itr->second.amount != item.second.amount) {
+        if (itr->second != item.second) {
             return callback(JSONRPCError("subsidy doesn't match webcash"));
         }
     }
@@ -1322,7 +1347,7 @@ void V1::miningReport(
     // Calculate proof-of-work
     CSHA256().Write((unsigned char*)state->preimage.c_str(), state->preimage.length()).Finalize(state->hash.data());
     state->bits = get_apparent_difficulty(state->hash);
-    if (state->bits < 25) { // DoS prevention
+    if (state->bits < webcash::state().min_report_bits) { // DoS prevention
         return callback(JSONRPCError("difficulty too low"));
     }
 
@@ -1347,6 +1372,7 @@ void V1::miningReport(
         return callback(JSONRPCError("error creating database transaction"));
     }
 
+    webcash::state().profileMiningReport(MiningReportStage::PARSE, state->stage_start);
     return SelectLastMiningReport(callback, state, tx);
 }
 
@@ -1381,7 +1407,7 @@ void SelectLastMiningReport(
                     // No MiningReport records yet, so fill with default
                     // values for the first report.
                     state->last_difficulty = 0;
-                    state->current_difficulty = 28;
+                    state->current_difficulty = webcash::state().initial_difficulty;
                     state->last_aggregate_work = 0.0;
                     state->has_last_report = true;
                 }
@@ -1403,6 +1429,7 @@ void SelectLastMiningReport(
                     return callback(JSONRPCError("proof of work doesn't meet current difficulty"));
                 }
 
+                webcash::state().profileMiningReport(MiningReportStage::LAST_REPORT, state->stage_start);
                 return CheckNewMiningReportPreimage(callback, state, tx);
             }
         }
@@ -1480,6 +1507,7 @@ void CheckNewMiningReportPreimage(
                 return callback(JSONRPCError("subsidy doesn't match required amount"));
             }
 
+            webcash::state().profileMiningReport(MiningReportStage::CHECK_PREIMAGE, state->stage_start);
             return CheckOutputsDoNotExist(callback, state, tx);
         }
         >> [=](const DrogonDbException &e) {
@@ -1512,6 +1540,7 @@ void CheckOutputsDoNotExist(
             }
 
             state->to_check.clear();
+            webcash::state().profileMiningReport(MiningReportStage::CHECK_OUTPUTS, state->stage_start);
             CreateOutputs(callback, state, tx);
         }
         >> [=](const DrogonDbException &e) {
@@ -1528,6 +1557,7 @@ void CreateOutputs(
 ){
     *tx << state->sql_insert_outputs
         >> [=](const Result &r) {
+            webcash::state().profileMiningReport(MiningReportStage::CREATE_OUTPUTS, state->stage_start);
             RecordMiningReport(callback, state, tx);
         }
         >> [=](const DrogonDbException &e) {
@@ -1576,7 +1606,10 @@ void RecordMiningReport(
         >> [=](const Result &r) {
             // FIXME: claim server funds?
 
+            webcash::state().profileMiningReport(MiningReportStage::RECORD, state->stage_start);
             tx->setCommitCallback([=](bool){
+                webcash::state().profileMiningReport(MiningReportStage::COMMIT, state->stage_start);
+
                 // Note that while each of the following statements are atomic,
                 // the combined operation is not.  It is possible for reads to
                 // interleave between these statements.
@@ -1592,7 +1625,7 @@ void RecordMiningReport(
 
                 if (webcash::state().logging) {
                     std::stringstream ss;
-                    ss << "Got BLOCK!!! " << absl::BytesToHexString(absl::string_view((const char*)state->hash.begin(), 32))
+                    ss << "Got BLOCK!!! " << HexStr32(state->hash.begin())
                        << " aggregate_work=" << log2(aggregate_work)
                        << " difficulty=" << next_difficulty
                        << " reports=" << stats.num_reports
@@ -1672,7 +1705,7 @@ void V1::healthCheck(
 
     std::vector<std::string> values;
     for (const auto& pk : state->args) {
-        values.push_back(absl::StrCat("'\\x", absl::BytesToHexString(absl::string_view((char*)pk.pk.data(), 32)), "'::bytea"));
+        values.push_back(absl::StrCat("'\\x", HexStr32(pk.pk.data()), "'::bytea"));
     }
     state->sql_unspent = absl::StrCat("SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\" WHERE \"hash\" IN (", absl::StrJoin(values, ","), ")");
     state->sql_spent = absl::StrCat("SELECT \"hash\" FROM \"SpentHashes\" WHERE \"hash\" IN (", absl::StrJoin(values, ","), ")");
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <atomic>
 #include <functional>
 #include <map>
@@ -77,6 +78,19 @@ struct WebcashStats {
     unsigned difficulty = 0;
 };
 
+// The stages of processing a mining report, in order, each of which ends once
+// the database has answered the query it makes.  Used to profile the server.
+enum class MiningReportStage : unsigned {
+    PARSE,          // decoding and checking the preimage
+    LAST_REPORT,    // fetching the current difficulty
+    CHECK_PREIMAGE, // checking that the preimage is new
+    CHECK_OUTPUTS,  // checking that the outputs are new
+    CREATE_OUTPUTS,
+    RECORD,         // inserting the MiningReports record
+    COMMIT,
+    NUM_STAGES,
+};
+
 class WebcashEconomy {
 public: // should be protected:
     const int64_t k_initial_mining_amount = 20000000000000LL;
@@ -94,6 +108,19 @@ public: // should be protected:
     // treated as constant
     absl::Time genesis = absl::Now();
     bool logging = true;
+    // Mining reports with fewer bits of work than this are rejected without
+    // further checks, as DoS prevention.  Only lowered by the benchmarks, so
+    // that they needn't mine real proofs-of-work.
+    std::atomic<unsigned> min_report_bits = 25;
+    // The difficulty of the first mining report.
+    std::atomic<unsigned> initial_difficulty = 28;
+    // If set, the time spent in each stage of processing successful mining
+    // reports is totalled in mining_report_nanos, and the number of reports
+    // to get through it in mining_report_count.
+    std::atomic<bool> profiling = false;
+    static const unsigned k_mining_report_stages = static_cast<unsigned>(MiningReportStage::NUM_STAGES);
+    std::array<std::atomic<int64_t>, k_mining_report_stages> mining_report_nanos{};
+    std::array<std::atomic<uint64_t>, k_mining_report_stages> mining_report_count{};
 
 public:
     WebcashEconomy() = default;
@@ -127,6 +154,17 @@ public:
     }
 
     WebcashStats getStats(absl::Time now);
+
+    // Adds the time since *start to the given stage of mining report
+    // processing, and restarts the clock for the next stage.
+    inline void profileMiningReport(MiningReportStage stage, absl::Time& start) {
+        if (profiling.load(std::memory_order_relaxed)) {
+            const absl::Time now = absl::Now();
+            mining_report_nanos[static_cast<unsigned>(stage)] += absl::ToInt64Nanoseconds(now - start);
+            ++mining_report_count[static_cast<unsigned>(stage)];
+            start = now;
+        }
+    }
 };
 
 namespace webcash {
@@ -135,7 +173,7 @@ namespace webcash {
 
 std::shared_ptr<drogon::HttpResponse> JSONRPCError(const std::string& err);
 bool check_legalese(const Json::Value& request);
-bool parse_secret_webcashes(const Json::Value& array, std::map<uint256, SecretWebcash>& webcash);
+bool parse_secret_webcashes(const Json::Value& array, std::map<uint256, Amount>& webcash);
 bool parse_public_webcashes(const Json::Value& array, std::vector<PublicWebcash>& webcash);
 
 class TermsOfService
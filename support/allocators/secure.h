@@ -14,6 +14,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 //
 // Allocator that locks its contents from being paged
@@ -42,7 +43,13 @@ struct secure_allocator : public std::allocator<T> {
 
     T* allocate(std::size_t n, const void* hint = 0)
     {
-        T* allocation = static_cast<T*>(LockedPoolManager::Instance().alloc(sizeof(T) * n));
+        T* allocation = nullptr;
+        if (LocalLockedArena* arena = LocalLockedArena::Current()) {
+            allocation = static_cast<T*>(arena->alloc(sizeof(T) * n));
+        }
+        if (!allocation) {
+            allocation = static_cast<T*>(LockedPoolManager::Instance().alloc(sizeof(T) * n));
+        }
         if (!allocation) {
             throw std::bad_alloc();
         }
@@ -54,13 +61,20 @@ struct secure_allocator : public std::allocator<T> {
         if (p != nullptr) {
             memory_cleanse(p, sizeof(T) * n);
         }
-        LockedPoolManager::Instance().free(p);
+        // Memory from an arena goes back to it, even if its scope is no
+        // longer current (e.g. on another thread).
+        if (!LocalLockedArena::Free(p, sizeof(T) * n)) {
+            LockedPoolManager::Instance().free(p);
+        }
     }
 };
 
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
+// A buffer of bytes with the same allocator, for raw secrets.
+typedef std::vector<unsigned char, secure_allocator<unsigned char> > SecureBytes;
+
 #endif // BITCOIN_SUPPORT_ALLOCATORS_SECURE_H
 
 // End of File
@@ -25,9 +25,10 @@
 #endif
 
 #include <algorithm>
+#include <assert.h>
+#include <iostream>
 #ifdef ARENA_DEBUG
 #include <iomanip>
-#include <iostream>
 #endif
 
 LockedPoolManager* LockedPoolManager::_instance = nullptr;
@@ -45,6 +46,8 @@ static inline size_t align_up(size_t x, size_t align)
 // Implementation: Arena
 
 Arena::Arena(void *base_in, size_t size_in, size_t alignment_in):
+    small_free(MAX_SMALL_SIZE / alignment_in), small_free_bytes(0),
+    used_size((size_in + alignment_in - 1) / alignment_in), used_bytes(0), used_chunks(0),
     base(static_cast<char*>(base_in)), end(static_cast<char*>(base_in) + size_in), alignment(alignment_in)
 {
     // Start with one free chunk that covers the entire arena
@@ -66,6 +69,64 @@ void* Arena::alloc(size_t size)
     if (size == 0)
         return nullptr;
 
+    char* ptr = nullptr;
+    // Reuse a chunk of exactly the right size, if one is available.
+    const size_t size_class = size / alignment - 1;
+    if (size_class < small_free.size() && !small_free[size_class].empty()) {
+        ptr = small_free[size_class].back();
+        small_free[size_class].pop_back();
+        small_free_bytes -= size;
+    }
+    if (!ptr) {
+        ptr = alloc_chunk(size);
+    }
+    // The free space may only be fragmented by chunks which are sitting
+    // unused on the free lists of other size classes.
+    if (!ptr && small_free_bytes) {
+        flush_small_chunks();
+        ptr = alloc_chunk(size);
+    }
+    if (!ptr)
+        return nullptr;
+
+    used_size[(ptr - base) / alignment] = size;
+    used_bytes += size;
+    ++used_chunks;
+    return reinterpret_cast<void*>(ptr);
+}
+
+void Arena::free(void *ptr)
+{
+    // Freeing the nullptr pointer is OK.
+    if (ptr == nullptr) {
+        return;
+    }
+
+    // Remove chunk from the used chunks
+    char* p = static_cast<char*>(ptr);
+    if (p < base || p >= end || (p - base) % alignment) {
+        throw std::runtime_error("Arena: invalid or double free");
+    }
+    size_t& size = used_size[(p - base) / alignment];
+    if (size == 0) {
+        throw std::runtime_error("Arena: invalid or double free");
+    }
+    const size_t freed = size;
+    size = 0;
+    used_bytes -= freed;
+    --used_chunks;
+
+    const size_t size_class = freed / alignment - 1;
+    if (size_class < small_free.size()) {
+        small_free[size_class].push_back(p);
+        small_free_bytes += freed;
+    } else {
+        free_chunk(p, freed);
+    }
+}
+
+char* Arena::alloc_chunk(size_t size)
+{
     // Pick a large enough free-chunk. Returns an iterator pointing to the first element that is not less than key.
     // This allocation strategy is best-fit. According to "Dynamic Storage Allocation: A Survey and Critical Review",
     // Wilson et. al. 1995, https://www.scs.stanford.edu/14wi-cs140/sched/readings/wilson.pdf, best-fit and first-fit
@@ -76,7 +137,7 @@ void* Arena::alloc(size_t size)
 
     // Create the used-chunk, taking its space from the end of the free-chunk
     const size_t size_remaining = size_ptr_it->first - size;
-    auto allocated = chunks_used.emplace(size_ptr_it->second + size_remaining, size).first;
+    char* allocated = size_ptr_it->second + size_remaining;
     chunks_free_end.erase(size_ptr_it->second + size_ptr_it->first);
     if (size_ptr_it->first == size) {
         // whole chunk is used up
@@ -89,23 +150,12 @@ void* Arena::alloc(size_t size)
     }
     size_to_free_chunk.erase(size_ptr_it);
 
-    return reinterpret_cast<void*>(allocated->first);
+    return allocated;
 }
 
-void Arena::free(void *ptr)
+void Arena::free_chunk(char* ptr, size_t size)
 {
-    // Freeing the nullptr pointer is OK.
-    if (ptr == nullptr) {
-        return;
-    }
-
-    // Remove chunk from used map
-    auto i = chunks_used.find(static_cast<char*>(ptr));
-    if (i == chunks_used.end()) {
-        throw std::runtime_error("Arena: invalid or double free");
-    }
-    std::pair<char*, size_t> freed = *i;
-    chunks_used.erase(i);
+    std::pair<char*, size_t> freed(ptr, size);
 
     // coalesce freed with previous chunk
     auto prev = chunks_free_end.find(freed.first);
@@ -130,13 +180,25 @@ void Arena::free(void *ptr)
     chunks_free_end[freed.first + freed.second] = it;
 }
 
+void Arena::flush_small_chunks()
+{
+    for (size_t i = 0; i < small_free.size(); ++i) {
+        for (char* ptr : small_free[i]) {
+            free_chunk(ptr, (i + 1) * alignment);
+        }
+        small_free[i].clear();
+    }
+    small_free_bytes = 0;
+}
+
 Arena::Stats Arena::stats() const
 {
-    Arena::Stats r{ 0, 0, 0, chunks_used.size(), chunks_free.size() };
-    for (const auto& chunk: chunks_used)
-        r.used += chunk.second;
+    Arena::Stats r{ used_bytes, 0, 0, used_chunks, chunks_free.size() };
     for (const auto& chunk: chunks_free)
         r.free += chunk.second->first;
+    r.free += small_free_bytes;
+    for (const auto& list: small_free)
+        r.chunks_free += list.size();
     r.total = r.used + r.free;
     return r;
 }
@@ -150,11 +212,15 @@ static void printchunk(void* base, size_t sz, bool used) {
 }
 void Arena::walk() const
 {
-    for (const auto& chunk: chunks_used)
-        printchunk(chunk.first, chunk.second, true);
+    for (size_t i = 0; i < used_size.size(); ++i)
+        if (used_size[i])
+            printchunk(base + i * alignment, used_size[i], true);
     std::cout << std::endl;
     for (const auto& chunk: chunks_free)
         printchunk(chunk.first, chunk.second->first, false);
+    for (size_t i = 0; i < small_free.size(); ++i)
+        for (char* ptr: small_free[i])
+            printchunk(ptr, (i + 1) * alignment, false);
     std::cout << std::endl;
 }
 #endif
@@ -413,4 +479,150 @@ void LockedPoolManager::CreateInstance()
     LockedPoolManager::_instance = &instance;
 }
 
+/*******************************************************************************/
+// Implementation: LocalLockedArena
+//
+thread_local LocalLockedArena* LocalLockedArena::current = nullptr;
+thread_local LocalLockedArena* LocalLockedArena::self = nullptr;
+std::mutex LocalLockedArena::registry_mutex;
+std::vector<LocalLockedArena*> LocalLockedArena::registry;
+std::atomic<size_t> LocalLockedArena::registered(0);
+
+LocalLockedArena::LocalLockedArena():
+    base(static_cast<char*>(LockedPoolManager::Instance().alloc(BLOCK_SIZE))), used(0), depth(0)
+{
+    for (size_t d = 0; d < MAX_DEPTH; ++d) {
+        marks[d] = BLOCK_SIZE;
+        live[d] = 0;
+    }
+    self = this;
+    if (base) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(this);
+        ++registered;
+    }
+}
+
+LocalLockedArena::~LocalLockedArena()
+{
+    self = nullptr;
+    if (base) {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            registry.erase(std::find(registry.begin(), registry.end(), this));
+            --registered;
+        }
+        memory_cleanse(base, BLOCK_SIZE);
+        LockedPoolManager::Instance().free(base);
+    }
+}
+
+LocalLockedArena& LocalLockedArena::Instance()
+{
+    // Created on first use by each thread, after the LockedPoolManager it
+    // takes its memory from, so that it is also destroyed before it.
+    static thread_local LocalLockedArena arena;
+    return arena;
+}
+
+void* LocalLockedArena::alloc(size_t size)
+{
+    size = align_up(size, LockedPool::ARENA_ALIGN);
+    if (!base || size == 0 || size > BLOCK_SIZE - used) {
+        return nullptr;
+    }
+    void* ptr = base + used;
+    used += size;
+    ++live[depth - 1];
+    return ptr;
+}
+
+size_t LocalLockedArena::scopeOf(void *ptr) const
+{
+    // Each scope's memory starts where the enclosing scope's ended, and the
+    // marks of inactive depths are past the end of the block.  While the
+    // chunk is allocated the scopes up to its own can't end, and any deeper
+    // ones start after it, so this is safe on any thread.
+    const size_t offset = static_cast<char*>(ptr) - base;
+    size_t d = 0;
+    while (d + 1 < MAX_DEPTH && marks[d + 1].load(std::memory_order_relaxed) <= offset) {
+        ++d;
+    }
+    return d;
+}
+
+void LocalLockedArena::release(void *ptr, size_t size, bool owner)
+{
+    const size_t d = scopeOf(ptr);
+    --live[d];
+    // Allocations are usually freed in reverse order, in which case the
+    // memory can be reused right away.  Only the owning thread touches the
+    // rest of the arena's state, and memory from an enclosing scope stays put
+    // until the scopes inside it have ended.
+    size = align_up(size, LockedPool::ARENA_ALIGN);
+    if (owner && d + 1 == depth && static_cast<char*>(ptr) + size == base + used) {
+        used -= size;
+    }
+}
+
+bool LocalLockedArena::Free(void *ptr, size_t size)
+{
+    // Usually the memory comes from the calling thread's own arena.
+    const bool own = self && self->base;
+    if (own && self->addressInArena(ptr)) {
+        self->release(ptr, size, true);
+        return true;
+    }
+
+    // Otherwise it might have been handed over from another thread, whose
+    // arena keeps the memory until its scope ends.  That arena was registered
+    // before the memory was handed over, so if there are no others the
+    // registry needn't be searched.
+    if (registered.load(std::memory_order_acquire) <= (own ? 1 : 0)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (LocalLockedArena* arena : registry) {
+        if (arena->addressInArena(ptr)) {
+            arena->release(ptr, size, false);
+            return true;
+        }
+    }
+    return false;
+}
+
+LocalLockedArena::Scope::Scope():
+    arena(LocalLockedArena::Instance()), prev(current), depth(arena.depth)
+{
+    if (depth < MAX_DEPTH) {
+        arena.marks[depth] = arena.used;
+        arena.live[depth] = 0;
+        ++arena.depth;
+        current = &arena;
+    } else {
+        // Too deep to track, so allocations go to the shared pool instead.
+        current = nullptr;
+    }
+}
+
+LocalLockedArena::Scope::~Scope()
+{
+    current = prev;
+    if (depth >= MAX_DEPTH) {
+        return;
+    }
+    // Anything still allocated would be left dangling, and its memory handed
+    // out again, so this is fatal even in release builds.
+    const size_t outstanding = arena.live[depth];
+    if (outstanding) {
+        std::cerr << "LocalLockedArena: " << outstanding << " allocation(s) still live at the end of their scope" << std::endl;
+        abort();
+    }
+    const size_t mark = arena.marks[depth];
+    memory_cleanse(arena.base + mark, arena.used - mark);
+    arena.used = mark;
+    arena.marks[depth] = BLOCK_SIZE;
+    --arena.depth;
+}
+
 // End of File
@@ -9,11 +9,13 @@
 #define BITCOIN_SUPPORT_LOCKEDPOOL_H
 
 #include <stdint.h>
+#include <atomic>
 #include <list>
 #include <map>
 #include <mutex>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 /**
  * OS-dependent allocation and deallocation of locked/pinned memory pages.
@@ -47,6 +49,11 @@ public:
 
 /* An arena manages a contiguous region of memory by dividing it into
  * chunks.
+ *
+ * Small chunks are kept on segregated free lists by size class when freed, so
+ * that the common case of allocating secrets of the same few sizes over and
+ * over again takes constant time.  Larger chunks, and small chunks when their
+ * free list is empty, are carved out of the remaining memory by best-fit.
  */
 class Arena
 {
@@ -91,7 +98,28 @@ public:
      * chunk starting addresses.
      */
     bool addressInArena(void *ptr) const { return ptr >= base && ptr < end; }
+
+    /** Chunks of up to this many bytes are served from size-class free lists. */
+    static const size_t MAX_SMALL_SIZE = 256;
 private:
+    /** Best-fit allocation of a chunk of size bytes, a multiple of alignment. */
+    char* alloc_chunk(size_t size);
+    /** Return a chunk to the best-fit free space, coalescing it with its
+     * neighbours.
+     */
+    void free_chunk(char* ptr, size_t size);
+    /** Return every chunk on the size-class free lists to the best-fit free
+     * space, so that larger chunks can be carved out of them.
+     */
+    void flush_small_chunks();
+
+    /** Free lists of small chunks, indexed by size in units of alignment,
+     * minus one.
+     */
+    std::vector<std::vector<char*>> small_free;
+    /** Total size of the chunks on the size-class free lists. */
+    size_t small_free_bytes;
+
     typedef std::multimap<size_t, char*> SizeToChunkSortedMap;
     /** Map to enable O(log(n)) best-fit allocation, as it's sorted by size */
     SizeToChunkSortedMap size_to_free_chunk;
@@ -102,8 +130,13 @@ private:
     /** Map from end of free chunk to its node in size_to_free_chunk */
     ChunkToSizeMap chunks_free_end;
 
-    /** Map from begin of used chunk to its size */
-    std::unordered_map<char*, size_t> chunks_used;
+    /** Size of each used chunk, indexed by its offset from base in units of
+     * alignment, or zero where no used chunk begins.
+     */
+    std::vector<size_t> used_size;
+    /** Total size and number of used chunks. */
+    size_t used_bytes;
+    size_t used_chunks;
 
     /** Base address of arena */
     char* base;
@@ -240,6 +273,103 @@ private:
     static LockedPoolManager* _instance;
 };
 
+/**
+ * Per-thread bump allocator over a block of locked memory taken from the
+ * LockedPoolManager, for short-lived secrets which are created and destroyed
+ * on the same thread.
+ *
+ * While a LocalLockedArena::Scope is active on a thread, secure_allocator takes
+ * memory from that thread's arena instead of contending on the LockedPool
+ * mutex.  Everything allocated within a scope must be freed before the scope
+ * ends, at which point all the memory it used is cleansed and made available
+ * again; the process is aborted if anything is still allocated.  Scopes may
+ * be nested, and memory from an outer scope may be freed while an inner one
+ * is active.  Memory may be freed on any thread, whether or not it has a
+ * scope active.  Allocations which don't fit, and those made in scopes nested
+ * deeper than MAX_DEPTH, fall back to the LockedPoolManager.
+ */
+class LocalLockedArena
+{
+public:
+    /** Size of each thread's block of locked memory. */
+    static const size_t BLOCK_SIZE = 16*1024;
+    /** Deepest nesting of scopes which take memory from the arena. */
+    static const size_t MAX_DEPTH = 8;
+
+    class Scope
+    {
+    public:
+        Scope();
+        ~Scope();
+
+        Scope(const Scope& other) = delete; // non construction-copyable
+        Scope& operator=(const Scope&) = delete; // non copyable
+
+    private:
+        LocalLockedArena& arena;
+        LocalLockedArena* prev;
+        size_t depth;
+    };
+
+    LocalLockedArena(const LocalLockedArena& other) = delete; // non construction-copyable
+    LocalLockedArena& operator=(const LocalLockedArena&) = delete; // non copyable
+
+    /** Return the calling thread's arena if it has an active scope, or
+     * nullptr otherwise.
+     */
+    static LocalLockedArena* Current() { return current; }
+
+    /** Allocate size bytes from the arena.
+     * Returns nullptr if the arena doesn't have room.
+     */
+    void* alloc(size_t size);
+
+    /** Free a chunk of memory previously allocated from any thread's arena.
+     * The memory is only reused once the enclosing scope ends, unless it was
+     * the most recent allocation of the innermost scope on the calling
+     * thread's arena.
+     * Returns false if ptr does not point into an arena.
+     */
+    static bool Free(void *ptr, size_t size);
+
+private:
+    LocalLockedArena();
+    ~LocalLockedArena();
+
+    static LocalLockedArena& Instance();
+    static thread_local LocalLockedArena* current;
+    /** The calling thread's arena, once it has been created. */
+    static thread_local LocalLockedArena* self;
+    /** Every thread's arena, for memory freed on other threads. */
+    static std::mutex registry_mutex;
+    static std::vector<LocalLockedArena*> registry;
+    /** Size of the registry, so that frees of memory which can't be from
+     * another thread's arena don't need to take registry_mutex.
+     */
+    static std::atomic<size_t> registered;
+
+    bool addressInArena(void *ptr) const { return base && ptr >= base && ptr < base + BLOCK_SIZE; }
+    /** Depth of the scope a chunk of the arena was allocated in. */
+    size_t scopeOf(void *ptr) const;
+    /** Return a chunk to the arena, rewinding it if the chunk was the most
+     * recent allocation of the innermost scope and the caller owns the arena.
+     */
+    void release(void *ptr, size_t size, bool owner);
+
+    char* base;
+    size_t used;
+    /** Number of scopes active on the owning thread. */
+    size_t depth;
+    /** Offset at which each active scope's memory starts, or BLOCK_SIZE for
+     * depths with no active scope.
+     */
+    std::atomic<size_t> marks[MAX_DEPTH];
+    /** Number of allocations from each active scope which have not yet been
+     * freed.
+     */
+    std::atomic<size_t> live[MAX_DEPTH];
+};
+
 #endif // BITCOIN_SUPPORT_LOCKEDPOOL_H
 
 // End of File
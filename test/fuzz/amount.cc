@@ -0,0 +1,158 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Differential fuzzer for the Amount parser and formatter, which checks them
+// against the straightforward implementations they replaced.  Requires clang
+// for -fsanitize=fuzzer.  Run with a corpus directory, e.g.
+//
+//     CC=clang bazel build -c opt //:fuzz_amount
+//     bazel-bin/fuzz_amount corpus/
+
+#include "webcash.h"
+
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "absl/numeric/int128.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/string_view.h"
+
+namespace reference {
+
+bool parse(Amount& amt, const absl::string_view& str) {
+    if (str.empty()) {
+        return false;
+    }
+    if (str.size() != strnlen(str.data(), str.size())) {
+        return false;
+    }
+
+    auto pos = str.begin();
+    auto end = str.end();
+    absl::int128 i = 0;
+
+    if (*pos == '"') {
+        do {
+            --end;
+        } while (*end != '"');
+        if (pos == end) {
+            return false;
+        }
+        ++pos;
+    }
+
+    bool negative = (*pos == '-');
+    if (negative) {
+        ++pos;
+        if (pos == end) {
+            return false;
+        }
+    }
+
+    if (!absl::ascii_isdigit(*pos)) {
+        return false;
+    }
+    if (pos[0] == '0' && (pos + 1) != end && pos[1] != '.') {
+        return false;
+    }
+
+    for (; pos != end && absl::ascii_isdigit(*pos); ++pos) {
+        i *= 10;
+        i += (*pos - '0');
+        if (i > std::numeric_limits<int64_t>::max()) {
+            return false;
+        }
+    }
+
+    int j = 0;
+    if (pos != end) {
+        if (*pos != '.') {
+            return false;
+        }
+        ++pos;
+        if (pos == end) {
+            return false;
+        }
+        for (; j < 8 && pos != end; ++j, ++pos) {
+            if (!absl::ascii_isdigit(*pos)) {
+                return false;
+            }
+            i *= 10;
+            i += (*pos - '0');
+        }
+        if (pos != end) {
+            return false;
+        }
+    }
+    for (; j < 8; ++j) {
+        i *= 10;
+    }
+    if (i > std::numeric_limits<int64_t>::max()) {
+        return false;
+    }
+
+    amt.i64 = static_cast<int64_t>(i);
+    if (negative) {
+        amt.i64 = -amt.i64;
+    }
+    return true;
+}
+
+std::string to_string(const Amount& amt) {
+    using std::to_string;
+    std::lldiv_t div = std::lldiv(std::abs(amt.i64), 100000000LL);
+    std::string res = (amt.i64 < 0) ? "-" : "";
+    res += to_string(div.quot);
+    if (div.rem) {
+        std::string frac = to_string(div.rem);
+        res.push_back('.');
+        res.insert(res.end(), 8 - frac.length(), '0');
+        res += frac;
+        while (res.back() == '0') {
+            res.pop_back();
+        }
+    }
+    return res;
+}
+
+} // namespace reference
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    using std::to_string;
+    const absl::string_view str(reinterpret_cast<const char*>(data), size);
+
+    // Both parsers must accept exactly the same inputs, with the same result.
+    Amount expected(-1), actual(-1);
+    const bool ok = reference::parse(expected, str);
+    if (actual.parse(str) != ok || actual != expected) {
+        abort();
+    }
+
+    // Also treat the first 8 bytes as an amount to format.  The reference
+    // formatter cannot handle the most negative amount.
+    if (size >= 8) {
+        int64_t i64;
+        memcpy(&i64, data, 8);
+        const Amount amt(i64);
+        if (i64 != std::numeric_limits<int64_t>::min() && to_string(amt) != reference::to_string(amt)) {
+            abort();
+        }
+        // Every formatted amount must parse back to itself.
+        Amount round_trip;
+        if (i64 != std::numeric_limits<int64_t>::min() && (!round_trip.parse(to_string(amt)) || round_trip != amt)) {
+            abort();
+        }
+    }
+    return 0;
+}
+
+// End of File
@@ -11,6 +11,7 @@
 #include "async.h"
 #include "random.h"
 #include "server.h"
+#include "util/hex.h"
 
 // This code is copied from the server benchmarking setup and teardown code,
 // with minimal changes.  We should merge the two somehow.
@@ -63,8 +64,10 @@ static void SetupServer() {
         // Start the main event loop.
         drogon::app().run();
     });
-    // While that is starting up, detect which sha256 engine we should use.
+    // While that is starting up, detect which sha256 and hex engines we
+    // should use.
     SHA256AutoDetect();
+    HexAutoDetect();
     // Wait for the event loop to begin processing.
     f1.get();
     // Clear the database
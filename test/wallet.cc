@@ -6,8 +6,40 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <string.h>
+
+#include <httplib.h>
+
+#include "crypto/chacha20.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+#include "random.h"
+#include "uint256.h"
+#include "util/hex.h"
+#include "util/pow.h"
 #include "wallet.h"
 
+#include "absl/flags/flag.h"
+#include "absl/strings/str_cat.h"
+
+#include "boost/filesystem.hpp"
+
+#include "univalue.h"
+
+// Nothing listens on this port, so any request the wallet makes fails with a
+// network error and is left to be retried later.
+ABSL_FLAG(std::string, server, "http://127.0.0.1:1", "server endpoint");
+
 TEST(amount, parse) {
     {
         Amount amt;
@@ -54,6 +86,22 @@ TEST(amount, parse) {
         EXPECT_FALSE(amt.parse("\"\"30.0\"\""));
         EXPECT_FALSE(amt.parse("\"\"30\".0\""));
     }
+    {
+        Amount amt;
+        EXPECT_TRUE(amt.parse("92233720368.54775807"));
+        EXPECT_EQ(amt.i64, std::numeric_limits<int64_t>::max());
+        EXPECT_TRUE(amt.parse("-92233720368.54775807"));
+        EXPECT_EQ(amt.i64, -std::numeric_limits<int64_t>::max());
+        EXPECT_FALSE(amt.parse("92233720368.54775808"));
+        EXPECT_FALSE(amt.parse("100000000000"));
+        EXPECT_FALSE(amt.parse("01"));
+        EXPECT_FALSE(amt.parse("1."));
+        EXPECT_FALSE(amt.parse(".1"));
+        EXPECT_FALSE(amt.parse("1.2.3"));
+        EXPECT_FALSE(amt.parse("-"));
+        EXPECT_FALSE(amt.parse("+1"));
+        EXPECT_EQ(amt.i64, -std::numeric_limits<int64_t>::max());
+    }
 }
 
 TEST(amount, to_string) {
@@ -69,6 +117,1030 @@ TEST(amount, to_string) {
     EXPECT_EQ(to_string(Amount(300000000)), "3");
     EXPECT_EQ(to_string(Amount(3000000000)), "30");
     EXPECT_EQ(to_string(Amount(3000000300)), "30.000003");
+    EXPECT_EQ(to_string(Amount(-3000000300)), "-30.000003");
+    EXPECT_EQ(to_string(Amount(0)), "0");
+    EXPECT_EQ(to_string(Amount(std::numeric_limits<int64_t>::max())), "92233720368.54775807");
+    EXPECT_EQ(to_string(Amount(std::numeric_limits<int64_t>::min())), "-92233720368.54775808");
+}
+
+TEST(amount, to_chars) {
+    char buf[k_max_amount_chars];
+    char* end = to_chars(buf, buf + sizeof(buf), Amount(std::numeric_limits<int64_t>::min()));
+    ASSERT_NE(end, nullptr);
+    EXPECT_EQ(std::string(buf, end), "-92233720368.54775808");
+    EXPECT_EQ(to_chars(buf, buf + 4, Amount(3000000300)), nullptr);
+    end = to_chars(buf, buf + 9, Amount(3000000300));
+    ASSERT_NE(end, nullptr);
+    EXPECT_EQ(std::string(buf, end), "30.000003");
+}
+
+TEST(webcash, parse) {
+    using std::to_string;
+    {
+        SecretWebcash sk;
+        EXPECT_TRUE(sk.parse("e1.5:secret:abc:def"));
+        EXPECT_EQ(sk.amount, Amount(150000000));
+        EXPECT_EQ(sk.sk, "abc:def");
+        EXPECT_EQ(to_string(sk), "e1.5:secret:abc:def");
+        EXPECT_TRUE(sk.parse("2:secret:"));
+        EXPECT_EQ(sk.amount, Amount(200000000));
+        EXPECT_EQ(sk.sk, "");
+        EXPECT_FALSE(sk.parse("e1:secret"));
+        EXPECT_FALSE(sk.parse("e1:public:abc"));
+        EXPECT_FALSE(sk.parse("ex:secret:abc"));
+    }
+    {
+        const std::string str = "e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
+        PublicWebcash pk;
+        EXPECT_TRUE(pk.parse(str));
+        EXPECT_EQ(pk.amount, Amount(19000000000000));
+        EXPECT_EQ(pk.pk.begin()[0], 0x9a);
+        EXPECT_EQ(pk.pk.begin()[31], 0xcf);
+        EXPECT_EQ(to_string(pk), str);
+        char buf[k_max_public_webcash_chars];
+        char* end = to_chars(buf, buf + sizeof(buf), pk);
+        ASSERT_NE(end, nullptr);
+        EXPECT_EQ(std::string(buf, end), str);
+        EXPECT_EQ(to_chars(buf, buf + str.size() - 1, pk), nullptr);
+
+        PublicWebcash upper;
+        EXPECT_TRUE(upper.parse("\xe2\x82\xa9" "190000:public:9A8A1AC24DD10F243C9AC05EB7093D130A032D5A31AE648014A33F8E02D47FCF"));
+        EXPECT_EQ(upper, pk);
+        EXPECT_FALSE(pk.parse("e1:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fc"));
+        EXPECT_FALSE(pk.parse("e1:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcg"));
+        EXPECT_FALSE(pk.parse("e1:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf:"));
+        EXPECT_EQ(pk.amount, Amount(19000000000000));
+    }
+}
+
+TEST(lockedpool, local_arena) {
+    EXPECT_EQ(LocalLockedArena::Current(), nullptr);
+    {
+        LocalLockedArena::Scope scope;
+        LocalLockedArena* arena = LocalLockedArena::Current();
+        ASSERT_NE(arena, nullptr);
+        const size_t used = LockedPoolManager::Instance().stats().used;
+        {
+            // Small secrets come from the arena...
+            SecureString a(100, 'a');
+            SecureString b(200, 'b');
+            EXPECT_EQ(LockedPoolManager::Instance().stats().used, used);
+            // ...but large ones still go to the shared pool.
+            SecureString c(LocalLockedArena::BLOCK_SIZE, 'c');
+            EXPECT_GT(LockedPoolManager::Instance().stats().used, used);
+            {
+                LocalLockedArena::Scope inner;
+                EXPECT_EQ(LocalLockedArena::Current(), arena);
+                SecureString d(100, 'd');
+            }
+            EXPECT_EQ(LocalLockedArena::Current(), arena);
+        }
+        EXPECT_EQ(LockedPoolManager::Instance().stats().used, used);
+    }
+    EXPECT_EQ(LocalLockedArena::Current(), nullptr);
+}
+
+TEST(lockedpool, local_arena_nested) {
+    LocalLockedArena::Scope scope;
+    const size_t used = LockedPoolManager::Instance().stats().used;
+    // Memory from an outer scope can be freed while an inner one is active,
+    // including the most recent allocation of the outer scope, without the
+    // inner scope losing track of its own memory.
+    SecureString* a = new SecureString(40, 'a');
+    {
+        LocalLockedArena::Scope inner;
+        SecureString b(40, 'b');
+        delete a;
+        SecureString c(40, 'c');
+        EXPECT_EQ(b, SecureString(40, 'b'));
+    }
+    a = new SecureString(40, 'a');
+    {
+        LocalLockedArena::Scope inner;
+        delete a;
+        SecureString b(40, 'b');
+        EXPECT_EQ(b, SecureString(40, 'b'));
+    }
+    // Scopes nested too deeply to track take memory from the shared pool.
+    {
+        std::vector<std::unique_ptr<LocalLockedArena::Scope>> scopes;
+        for (size_t d = 1; d < LocalLockedArena::MAX_DEPTH; ++d) {
+            scopes.push_back(std::make_unique<LocalLockedArena::Scope>());
+        }
+        EXPECT_NE(LocalLockedArena::Current(), nullptr);
+        {
+            LocalLockedArena::Scope deepest;
+            EXPECT_EQ(LocalLockedArena::Current(), nullptr);
+            SecureString d(40, 'd');
+            EXPECT_GT(LockedPoolManager::Instance().stats().used, used);
+        }
+        EXPECT_NE(LocalLockedArena::Current(), nullptr);
+        while (!scopes.empty()) {
+            scopes.pop_back();
+        }
+    }
+    EXPECT_EQ(LockedPoolManager::Instance().stats().used, used);
+}
+
+TEST(lockedpool, local_arena_other_thread) {
+    LocalLockedArena::Scope scope;
+    const size_t used = LockedPoolManager::Instance().stats().used;
+    // Memory from the arena can be freed on another thread, with or without
+    // a scope of its own, while the scope it came from is still active.
+    SecureString* a = new SecureString(100, 'a');
+    SecureString* b = new SecureString(100, 'b');
+    std::thread([&]() { delete a; }).join();
+    std::thread([&]() {
+        LocalLockedArena::Scope other;
+        SecureString c(100, 'c');
+        delete b;
+    }).join();
+    EXPECT_EQ(LockedPoolManager::Instance().stats().used, used);
+}
+
+TEST(lockedpool, local_arena_escape) {
+    // Memory which is freed after its scope has ended would already have
+    // been handed out again, so the end of the scope is fatal.
+    EXPECT_DEATH({
+        SecureString* escaped = nullptr;
+        {
+            LocalLockedArena::Scope scope;
+            escaped = new SecureString(100, 'a');
+        }
+        delete escaped;
+    }, "still live");
+}
+
+TEST(random, secret_rand_bytes) {
+    unsigned char a[32] = {};
+    unsigned char b[32] = {};
+    unsigned char zero[32] = {};
+    GetSecretRandBytes(a, sizeof(a));
+    GetSecretRandBytes(b, sizeof(b));
+    EXPECT_NE(memcmp(a, zero, sizeof(a)), 0);
+    EXPECT_NE(memcmp(a, b, sizeof(a)), 0);
+    // Requests larger than a block, and from other threads, are independent
+    // streams too.
+    std::vector<unsigned char> c(1000);
+    GetSecretRandBytes(c.data(), c.size());
+    EXPECT_NE(memcmp(c.data() + c.size() - sizeof(zero), zero, sizeof(zero)), 0);
+    std::thread([&]() { GetSecretRandBytes(b, sizeof(b)); }).join();
+    EXPECT_NE(memcmp(a, b, sizeof(a)), 0);
+    // Small requests are served from a buffer of keystream, and must not
+    // repeat across refills of it.
+    std::vector<unsigned char> d(31 * 100);
+    for (size_t i = 0; i < d.size(); i += 31) {
+        GetSecretRandBytes(d.data() + i, 31);
+    }
+    for (size_t i = 31; i < d.size(); i += 31) {
+        EXPECT_NE(memcmp(d.data() + i - 31, d.data() + i, 31), 0);
+        EXPECT_NE(memcmp(d.data() + i, zero, 31), 0);
+    }
+}
+
+// The self tests run by the autodetect functions are compiled out of
+// optimized builds, so the vector implementations are checked here against
+// the standard ones, at the lengths and counts which take the edge cases:
+// empty and padding-boundary messages, and counts which leave some over after
+// the last whole group of lanes.
+
+namespace {
+
+std::vector<unsigned char> TestData(size_t len, unsigned char seed) {
+    std::vector<unsigned char> data(len);
+    for (size_t i = 0; i < len; ++i) {
+        data[i] = (unsigned char)(seed + 31 * i + (i >> 8));
+    }
+    return data;
+}
+
+const std::vector<sha256_implementation::UseImplementation> kSHA256Implementations = {
+    sha256_implementation::STANDARD,
+    sha256_implementation::USE_SSE4,
+    sha256_implementation::USE_AVX2,
+    sha256_implementation::USE_SSE4_AND_AVX2,
+    sha256_implementation::USE_SSE4_AND_SHANI,
+    sha256_implementation::USE_ALL,
+};
+
+} // namespace
+
+TEST(sha256, many_matches_standard) {
+    const size_t lens[] = {0, 55, 56, 64, 119};
+    const size_t counts[] = {1, 2, 3, 5, 9, 13, 17};
+    for (const auto use : kSHA256Implementations) {
+        SCOPED_TRACE(SHA256AutoDetect(use));
+        for (const size_t count : counts) {
+            // Every message one of the lengths, and then the lengths mixed
+            // so that the lanes finish at different times.
+            for (size_t k = 0; k <= 5; ++k) {
+                std::vector<std::vector<unsigned char>> data;
+                std::vector<absl::string_view> msgs;
+                for (size_t i = 0; i < count; ++i) {
+                    const size_t len = lens[k < 5 ? k : i % 5];
+                    data.push_back(TestData(len, (unsigned char)i));
+                }
+                for (const auto& d : data) {
+                    msgs.emplace_back((const char*)d.data(), d.size());
+                }
+                std::vector<unsigned char> out(32 * count);
+                SHA256Many(out.data(), msgs);
+                SHA256AutoDetect(sha256_implementation::STANDARD);
+                for (size_t i = 0; i < count; ++i) {
+                    unsigned char expected[32];
+                    CSHA256().Write(data[i].data(), data[i].size()).Finalize(expected);
+                    EXPECT_EQ(memcmp(out.data() + 32 * i, expected, 32), 0) << "count " << count << " message " << i << " of " << data[i].size() << " bytes";
+                }
+                SHA256AutoDetect(use);
+            }
+        }
+    }
+    SHA256AutoDetect();
+}
+
+TEST(sha256, write_and_finalize_many_matches_standard) {
+    const size_t prefix_lens[] = {0, 64, 128};
+    const size_t tail_lens[] = {0, 1, 32, 55};
+    const size_t counts[] = {1, 3, 4, 5, 8, 9, 17};
+    for (const auto use : kSHA256Implementations) {
+        SCOPED_TRACE(SHA256AutoDetect(use));
+        for (const size_t prefix_len : prefix_lens) {
+            const std::vector<unsigned char> prefix = TestData(prefix_len, 0x5a);
+            for (const size_t tail_len : tail_lens) {
+                for (const size_t count : counts) {
+                    const std::vector<unsigned char> tails = TestData(tail_len * count, 0xa5);
+                    std::vector<unsigned char> out(32 * count);
+                    CSHA256 hasher;
+                    hasher.Write(prefix.data(), prefix.size());
+                    hasher.WriteAndFinalizeMany(tails.data(), tail_len, count, out.data());
+                    SHA256AutoDetect(sha256_implementation::STANDARD);
+                    for (size_t i = 0; i < count; ++i) {
+                        unsigned char expected[32];
+                        CSHA256().Write(prefix.data(), prefix.size()).Write(tails.data() + tail_len * i, tail_len).Finalize(expected);
+                        EXPECT_EQ(memcmp(out.data() + 32 * i, expected, 32), 0) << "prefix " << prefix_len << " tail " << tail_len << " count " << count << " hash " << i;
+                    }
+                    SHA256AutoDetect(use);
+                }
+            }
+        }
+    }
+    SHA256AutoDetect();
+}
+
+TEST(sha512, matches_standard) {
+    const size_t lens[] = {0, 1, 111, 112, 128, 239, 256, 1000};
+    std::vector<std::vector<unsigned char>> expected;
+    SHA512AutoDetect(false);
+    for (const size_t len : lens) {
+        const std::vector<unsigned char> data = TestData(len, 0x3c);
+        expected.emplace_back(CSHA512::OUTPUT_SIZE);
+        CSHA512().Write(data.data(), data.size()).Finalize(expected.back().data());
+    }
+    SCOPED_TRACE(SHA512AutoDetect());
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+        const std::vector<unsigned char> data = TestData(lens[i], 0x3c);
+        unsigned char out[CSHA512::OUTPUT_SIZE];
+        CSHA512().Write(data.data(), data.size()).Finalize(out);
+        EXPECT_EQ(memcmp(out, expected[i].data(), sizeof(out)), 0) << lens[i] << " bytes";
+    }
+}
+
+TEST(chacha20, keystream_matches_standard) {
+    static const unsigned char key[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    };
+    const size_t lens[] = {0, 1, 63, 64, 65, 64 * 4 - 1, 64 * 4, 64 * 5 + 7, 64 * 8, 64 * 9 + 1, 64 * 16, 64 * 17 + 33, 64 * 37};
+    // Starting near the end of the low counter word, so that the counter
+    // carries into the high word partway through the longer keystreams.
+    const uint64_t seeks[] = {0, 0xfffffffd, 0xfffffffffffffff0};
+    for (const size_t max_blocks : {size_t{4}, size_t{8}, SIZE_MAX}) {
+        SCOPED_TRACE(ChaCha20AutoDetect(max_blocks));
+        for (const uint64_t seek : seeks) {
+            for (const size_t len : lens) {
+                ChaCha20 rng(key, 32);
+                rng.SetIV(0x0706050403020100);
+                rng.Seek(seek);
+                std::vector<unsigned char> out(len + 64);
+                rng.Keystream(out.data(), len);
+                // The stream must continue from the right block afterwards,
+                // which skips the rest of a partly used block.
+                rng.Keystream(out.data() + len, 64);
+                const size_t used = (len + 63) / 64 * 64;
+
+                ChaCha20AutoDetect(0);
+                ChaCha20 ref(key, 32);
+                ref.SetIV(0x0706050403020100);
+                ref.Seek(seek);
+                std::vector<unsigned char> expected(used + 64);
+                for (size_t i = 0; i < expected.size(); i += 64) {
+                    ref.Keystream(expected.data() + i, 64);
+                }
+                ChaCha20AutoDetect(max_blocks);
+
+                EXPECT_EQ(memcmp(out.data(), expected.data(), len), 0) << "seek " << seek << " length " << len;
+                EXPECT_EQ(memcmp(out.data() + len, expected.data() + used, 64), 0) << "seek " << seek << " length " << len;
+            }
+        }
+    }
+    ChaCha20AutoDetect();
+}
+
+TEST(pow, find_matches_standard) {
+    // Hashes with a spread of leading zero bits, so that every difficulty
+    // from 0 to 48 is first met at a different place.
+    std::vector<unsigned char> hashes(64 * 32, 0xff);
+    for (size_t i = 0; i < 64; ++i) {
+        const int zeros = (i * 37 + 11) % 50;
+        unsigned char* hash = hashes.data() + 32 * i;
+        memset(hash, 0, zeros / 8);
+        hash[zeros / 8] = 0xff >> (zeros % 8);
+        // Vary the low bits too, which the masks must ignore.
+        hash[31] = (unsigned char)i;
+    }
+    const size_t counts[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 64};
+    for (const size_t max_way : {size_t{8}, SIZE_MAX}) {
+        SCOPED_TRACE(ProofOfWorkAutoDetect(max_way));
+        for (size_t offset = 0; offset < 3; ++offset) {
+            for (const size_t count : counts) {
+                if (offset + count > 64) continue;
+                const unsigned char* first = hashes.data() + 32 * offset;
+                for (int difficulty = 0; difficulty <= 48; ++difficulty) {
+                    size_t expected = 0;
+                    while (expected < count && get_apparent_difficulty(first + 32 * expected) < difficulty) {
+                        ++expected;
+                    }
+                    EXPECT_EQ(FindProofOfWork(first, count, difficulty), expected) << "offset " << offset << " count " << count << " difficulty " << difficulty;
+                    ProofOfWorkAutoDetect(0);
+                    EXPECT_EQ(FindProofOfWork(first, count, difficulty), expected) << "offset " << offset << " count " << count << " difficulty " << difficulty;
+                    ProofOfWorkAutoDetect(max_way);
+                }
+            }
+        }
+    }
+    ProofOfWorkAutoDetect();
+}
+
+TEST(uint256, hex) {
+    HexAutoDetect();
+    const std::string str = "9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
+    uint256 hash;
+    ASSERT_TRUE(HexDecode32(hash.begin(), str.data()));
+    EXPECT_EQ(hash.begin()[0], 0x9a);
+    EXPECT_EQ(hash.begin()[31], 0xcf);
+    EXPECT_EQ(HexStr32(hash.begin()), str);
+    EXPECT_EQ(hash.GetHex(), str);
+    uint256 other;
+    other.SetHex("0x9A8A1AC24DD10F243C9AC05EB7093D130A032D5A31AE648014A33F8E02D47FCF");
+    EXPECT_EQ(other, hash);
+    EXPECT_TRUE(is_uint256(str));
+    EXPECT_FALSE(is_uint256(str.substr(1)));
+    for (size_t i = 0; i < str.size(); ++i) {
+        std::string bad = str;
+        bad[i] = 'g';
+        EXPECT_FALSE(is_uint256(bad));
+        EXPECT_FALSE(HexDecode32(other.begin(), bad.data()));
+        EXPECT_EQ(other, hash);
+    }
+}
+
+// A temporary directory holding a wallet's files, which is removed when it
+// goes out of scope.
+struct TempWalletPath {
+    boost::filesystem::path dir;
+    boost::filesystem::path path;
+
+    TempWalletPath()
+        : dir(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("webcash-test-%%%%-%%%%-%%%%"))
+        , path(dir / "wallet")
+    {
+        boost::filesystem::create_directories(dir);
+    }
+    ~TempWalletPath() {
+        boost::filesystem::remove_all(dir);
+    }
+};
+
+// A wallet with its internals exposed to the tests.
+class TestWallet : public Wallet {
+public:
+    explicit TestWallet(const boost::filesystem::path& path) : Wallet(path) {}
+
+    using Wallet::GetCachedStatement;
+    using Wallet::RequestSweep;
+
+    RecoveryLog& recovery_log() { return m_recovery_log; }
+    const boost::filesystem::path& logfile() const { return m_logfile; }
+
+    // Runs a query returning a single integer.
+    int64_t QueryInt(const std::string& sql) {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        int64_t ret = -1;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            ret = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_reset(stmt);
+        return ret;
+    }
+
+    std::string ReadLogFile() const {
+        std::ifstream in(m_logfile.string());
+        std::stringstream ss;
+        ss << in.rdbuf();
+        return ss.str();
+    }
+
+    // The secret at the given depth of one of the master secret's chains.
+    SecretWebcash DeriveSecret(bool mine, bool sweep, int64_t depth, int64_t amount) const {
+        unsigned char secret[32];
+        DeriveSecrets(0, mine, sweep, depth, 1, secret);
+        return SecretWebcash(HexStr32(secret), Amount(amount));
+    }
+
+    // Chooses and records the outputs to merge, as a sweep would before
+    // asking the server to merge them.
+    bool BeginConsolidation(size_t max_unspent) {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        int consolidation_id;
+        std::vector<WalletOutput> inputs;
+        std::vector<std::pair<WalletSecret, Amount>> outputs;
+        return StartConsolidation(max_unspent, consolidation_id, inputs, outputs) && consolidation_id;
+    }
+};
+
+static SecretWebcash NewSecret(int64_t amount) {
+    unsigned char bytes[32];
+    GetStrongRandBytes(bytes, sizeof(bytes));
+    return SecretWebcash(HexStr32(bytes), Amount(amount));
+}
+
+// A stand-in for the webcash server, with just the replace and health_check
+// APIs the wallet uses, run against an in-memory ledger.  The wallet talks to
+// it for as long as it exists.
+class StubServer {
+protected:
+    struct Entry {
+        Amount amount;
+        bool spent;
+    };
+
+    std::mutex m_mut;
+    std::map<uint256, Entry> m_ledger;
+    size_t m_replacements;
+
+    httplib::Server m_server;
+    std::thread m_thread;
+    std::string m_old_server;
+
+    void Replace(const httplib::Request& req, httplib::Response& res) {
+        UniValue body;
+        body.read(req.body);
+        std::vector<PublicWebcash> ins, outs;
+        Amount total_in = 0, total_out = 0;
+        for (const UniValue& v : body["webcashes"].getValues()) {
+            SecretWebcash sk;
+            if (!sk.parse(v.get_str())) {
+                res.status = 400;
+                return;
+            }
+            ins.emplace_back(sk);
+            total_in += sk.amount;
+        }
+        for (const UniValue& v : body["new_webcashes"].getValues()) {
+            SecretWebcash sk;
+            if (!sk.parse(v.get_str())) {
+                res.status = 400;
+                return;
+            }
+            outs.emplace_back(sk);
+            total_out += sk.amount;
+        }
+
+        const std::lock_guard<std::mutex> lock(m_mut);
+        bool ok = !ins.empty() && total_in == total_out;
+        for (const PublicWebcash& pk : ins) {
+            auto itr = m_ledger.find(pk.pk);
+            ok = ok && itr != m_ledger.end() && !itr->second.spent && itr->second.amount == pk.amount;
+        }
+        for (const PublicWebcash& pk : outs) {
+            ok = ok && !m_ledger.count(pk.pk);
+        }
+        if (!ok) {
+            res.status = 500;
+            res.set_content("{\"error\":\"invalid replacement\"}", "application/json");
+            return;
+        }
+        for (const PublicWebcash& pk : ins) {
+            m_ledger[pk.pk].spent = true;
+        }
+        for (const PublicWebcash& pk : outs) {
+            m_ledger[pk.pk] = Entry{pk.amount, false};
+        }
+        ++m_replacements;
+        res.status = 200;
+        res.set_content("{\"status\":\"success\"}", "application/json");
+    }
+
+    void HealthCheck(const httplib::Request& req, httplib::Response& res) {
+        using std::to_string;
+        UniValue query;
+        query.read(req.body);
+        UniValue results(UniValue::VOBJ);
+        const std::lock_guard<std::mutex> lock(m_mut);
+        for (const UniValue& v : query.getValues()) {
+            PublicWebcash pk;
+            if (!pk.parse(v.get_str())) {
+                res.status = 400;
+                return;
+            }
+            UniValue result(UniValue::VOBJ);
+            auto itr = m_ledger.find(pk.pk);
+            if (itr == m_ledger.end()) {
+                result.push_back(std::make_pair("spent", UniValue()));
+            } else {
+                result.push_back(std::make_pair("spent", itr->second.spent));
+                if (!itr->second.spent) {
+                    result.push_back(std::make_pair("amount", to_string(itr->second.amount)));
+                }
+            }
+            results.push_back(std::make_pair(v.get_str(), result));
+        }
+        UniValue o(UniValue::VOBJ);
+        o.push_back(std::make_pair("results", results));
+        res.status = 200;
+        res.set_content(o.write(), "application/json");
+    }
+
+public:
+    StubServer() : m_replacements(0) {
+        m_server.Post("/api/v1/replace", [this](const httplib::Request& req, httplib::Response& res) { Replace(req, res); });
+        m_server.Post("/api/v1/health_check", [this](const httplib::Request& req, httplib::Response& res) { HealthCheck(req, res); });
+        const int port = m_server.bind_to_any_port("127.0.0.1");
+        m_thread = std::thread([this]() { m_server.listen_after_bind(); });
+        while (!m_server.is_running()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        m_old_server = absl::GetFlag(FLAGS_server);
+        absl::SetFlag(&FLAGS_server, absl::StrCat("http://127.0.0.1:", port));
+    }
+
+    ~StubServer() {
+        absl::SetFlag(&FLAGS_server, m_old_server);
+        m_server.stop();
+        m_thread.join();
+    }
+
+    // Adds an output to the ledger, as if it had been paid to the wallet.
+    void Add(const SecretWebcash& sk, bool spent = false) {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        m_ledger[PublicWebcash(sk).pk] = Entry{sk.amount, spent};
+    }
+
+    bool IsUnspent(const SecretWebcash& sk) {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        auto itr = m_ledger.find(PublicWebcash(sk).pk);
+        return itr != m_ledger.end() && !itr->second.spent;
+    }
+
+    size_t replacements() {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        return m_replacements;
+    }
+};
+
+TEST(wallet, statement_cache) {
+    TempWalletPath tmp;
+    TestWallet wallet(tmp.path);
+    // The same SQL text always gives back the same prepared statement.
+    const std::string sql = "SELECT EXISTS(SELECT 1 FROM 'terms' WHERE body=?1)";
+    sqlite3_stmt* stmt = wallet.GetCachedStatement(sql);
+    EXPECT_EQ(wallet.GetCachedStatement(sql), stmt);
+    EXPECT_NE(wallet.GetCachedStatement("SELECT count(*) FROM 'terms';"), stmt);
+
+    // Parameters are bound by position, and the statements used to look up
+    // and record terms are reused from one call to the next.
+    EXPECT_FALSE(wallet.HaveAcceptedTerms());
+    wallet.AcceptTerms("first");
+    wallet.AcceptTerms(std::string("second"));
+    wallet.AcceptTerms("first");
+    EXPECT_TRUE(wallet.HaveAcceptedTerms());
+    EXPECT_TRUE(wallet.AreTermsAccepted("first"));
+    EXPECT_TRUE(wallet.AreTermsAccepted("second"));
+    EXPECT_FALSE(wallet.AreTermsAccepted("third"));
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'terms';"), 2);
+    EXPECT_EQ(wallet.GetCachedStatement(sql), stmt);
+
+    // Cached statements are left reset, with no bindings which could refer
+    // to memory the caller has since freed.
+    EXPECT_FALSE(sqlite3_stmt_busy(stmt));
+    char* expanded = sqlite3_expanded_sql(stmt);
+    EXPECT_EQ(std::string(expanded), "SELECT EXISTS(SELECT 1 FROM 'terms' WHERE body=NULL)");
+    sqlite3_free(expanded);
+}
+
+TEST(wallet, insert) {
+    using std::to_string;
+    TempWalletPath tmp;
+    StubServer server;
+    TestWallet wallet(tmp.path);
+
+    // Inserted secrets are saved to the recovery file and the database before
+    // InsertMany() returns, and are replaced in the background.
+    std::vector<SecretWebcash> sks;
+    for (int i = 1; i <= 5; ++i) {
+        sks.push_back(NewSecret(i * 100));
+        server.Add(sks.back());
+    }
+    EXPECT_TRUE(wallet.InsertMany(sks, true));
+    EXPECT_EQ(wallet.GetBalance(), Amount(1500));
+    const std::string log = wallet.ReadLogFile();
+    for (const SecretWebcash& sk : sks) {
+        EXPECT_NE(log.find(to_string(sk).c_str()), std::string::npos);
+    }
+    EXPECT_TRUE(wallet.InsertMany({}, true));
+
+    // Insertions queued from other threads all run before Flush() returns,
+    // as does the sweep they request.
+    std::atomic<int> inserted = 0;
+    for (int i = 1; i <= 5; ++i) {
+        sks.push_back(NewSecret(i));
+        server.Add(sks.back());
+        wallet.InsertAsync(sks.back(), true, [&](bool ok) { inserted += ok; });
+    }
+    wallet.Flush();
+    EXPECT_EQ(inserted, 5);
+    EXPECT_EQ(wallet.GetBalance(), Amount(1515));
+    EXPECT_EQ(wallet.CountUnspent(), 10);
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 0);
+
+    // Every inserted output was replaced with change from the wallet's own
+    // HD chain, in as few requests as possible.
+    for (const SecretWebcash& sk : sks) {
+        EXPECT_FALSE(server.IsUnspent(sk));
+    }
+    EXPECT_LE(server.replacements(), 6);
+    for (const WalletOutput& output : wallet.ListUnspent(100)) {
+        ASSERT_TRUE(output.secret);
+        EXPECT_TRUE(server.IsUnspent(SecretWebcash(output.secret->secret, output.amount)));
+    }
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'output' WHERE spent=TRUE;"), 10);
+
+    // Inserting a secret again doesn't add it twice, or resurrect it.
+    EXPECT_TRUE(wallet.Insert(sks.front(), true));
+    wallet.Flush();
+    EXPECT_EQ(wallet.GetBalance(), Amount(1515));
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'output';"), 20);
+}
+
+// Exposes the recovery log's batch counter.
+class TestRecoveryLog : public RecoveryLog {
+public:
+    using RecoveryLog::RecoveryLog;
+
+    uint64_t batches() {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        return m_next_batch - 1;
+    }
+};
+
+TEST(wallet, recovery_log_group_commit) {
+    TempWalletPath tmp;
+    const boost::filesystem::path path = tmp.dir / "recovery.bak";
+    TestRecoveryLog log(absl::Milliseconds(200));
+    EXPECT_FALSE(log.Append({"closed"}));
+    ASSERT_TRUE(log.Open(path));
+
+    // Lines appended within the durability window of each other are written
+    // and synced together.
+    static const int k_threads = 8;
+    std::vector<std::thread> threads;
+    std::atomic<int> ok = 0;
+    for (int i = 0; i < k_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            ok += log.Append({absl::StrCat("line ", i, " a"), absl::StrCat("line ", i, " b")});
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(ok, k_threads);
+    EXPECT_LT(log.batches(), k_threads);
+    log.Close();
+
+    std::ifstream in(path.string());
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line)) {
+        lines.push_back(line);
+    }
+    ASSERT_EQ(lines.size(), 2 * k_threads);
+    for (int i = 0; i < k_threads; ++i) {
+        // Each caller's lines are kept together, in order.
+        auto a = std::find(lines.begin(), lines.end(), absl::StrCat("line ", i, " a"));
+        ASSERT_NE(a, lines.end());
+        ASSERT_NE(a + 1, lines.end());
+        EXPECT_EQ(*(a + 1), absl::StrCat("line ", i, " b"));
+    }
+}
+
+TEST(wallet, sweep_resumes_after_restart) {
+    TempWalletPath tmp;
+    std::vector<SecretWebcash> sks = {NewSecret(300), NewSecret(400)};
+    int64_t change_id;
+    {
+        // With the server unreachable, inserted outputs stay queued.
+        TestWallet wallet(tmp.path);
+        EXPECT_TRUE(wallet.InsertMany(sks, true));
+        wallet.Flush();
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 2);
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'output' WHERE spent=TRUE;"), 0);
+        change_id = wallet.QueryInt("SELECT MIN(change_secret_id) FROM 'sweepqueue';");
+    }
+    StubServer server;
+    for (const SecretWebcash& sk : sks) {
+        server.Add(sk);
+    }
+    {
+        // The queue is picked up again when the wallet is next opened, with
+        // the change secrets chosen the first time around.
+        TestWallet wallet(tmp.path);
+        wallet.Flush();
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 0);
+        EXPECT_EQ(wallet.GetBalance(), Amount(700));
+        EXPECT_EQ(wallet.CountUnspent(), 2);
+        EXPECT_EQ(wallet.QueryInt(absl::StrCat("SELECT count(*) FROM 'output' WHERE spent=FALSE AND secret_id=", change_id, ";")), 1);
+        EXPECT_EQ(server.replacements(), 1);
+    }
+    for (const SecretWebcash& sk : sks) {
+        EXPECT_FALSE(server.IsUnspent(sk));
+    }
+}
+
+TEST(wallet, balance_and_select_coins) {
+    TempWalletPath tmp;
+    std::vector<SecretWebcash> sks;
+    for (int i = 1; i <= 10; ++i) {
+        sks.push_back(NewSecret(i));
+    }
+    const std::string sum = "SELECT IFNULL(SUM(amount),0) FROM 'output' WHERE spent=FALSE;";
+    {
+        TestWallet wallet(tmp.path);
+        EXPECT_EQ(wallet.GetBalance(), Amount(0));
+        EXPECT_EQ(wallet.CountUnspent(), 0);
+        EXPECT_TRUE(wallet.InsertMany(sks, true));
+        wallet.Flush();
+        EXPECT_EQ(wallet.GetBalance(), Amount(55));
+        EXPECT_EQ(wallet.CountUnspent(), 10);
+        // Outputs waiting to be swept are never selected.
+        EXPECT_TRUE(wallet.SelectCoins(Amount(1)).empty());
+    }
+    StubServer server;
+    for (const SecretWebcash& sk : sks) {
+        server.Add(sk);
+    }
+    TestWallet wallet(tmp.path);
+    wallet.Flush();
+    // The balance is kept up to date as outputs are spent and created.
+    EXPECT_EQ(wallet.GetBalance(), Amount(55));
+    EXPECT_EQ(wallet.GetBalance(), Amount(wallet.QueryInt(sum)));
+    EXPECT_EQ(wallet.CountUnspent(), 10);
+
+    const auto total = [](const std::vector<WalletOutput>& outputs) {
+        Amount amount = 0;
+        for (const WalletOutput& output : outputs) {
+            amount += output.amount;
+        }
+        return amount;
+    };
+    // The smallest output which covers the target on its own is preferred.
+    std::vector<WalletOutput> coins = wallet.SelectCoins(Amount(7));
+    ASSERT_EQ(coins.size(), 1);
+    EXPECT_EQ(coins[0].amount, Amount(7));
+    // Otherwise the largest are taken until the target is reached.
+    coins = wallet.SelectCoins(Amount(25));
+    EXPECT_EQ(coins.size(), 3);
+    EXPECT_EQ(total(coins), Amount(27));
+    coins = wallet.SelectCoins(Amount(55));
+    EXPECT_EQ(coins.size(), 10);
+    // Too much, or with too few inputs, is impossible.
+    EXPECT_TRUE(wallet.SelectCoins(Amount(56)).empty());
+    EXPECT_TRUE(wallet.SelectCoins(Amount(25), 2).empty());
+    EXPECT_TRUE(wallet.SelectCoins(Amount(0)).empty());
+
+    // ListUnspent() pages through outputs in the order they were added.
+    std::vector<WalletOutput> page = wallet.ListUnspent(4);
+    ASSERT_EQ(page.size(), 4);
+    std::vector<WalletOutput> next = wallet.ListUnspent(100, page.back().id);
+    EXPECT_EQ(next.size(), 6);
+    EXPECT_GT(next.front().id, page.back().id);
+}
+
+TEST(wallet, consolidation_resumes_after_restart) {
+    TempWalletPath tmp;
+    StubServer server;
+    int64_t change_id;
+    {
+        TestWallet wallet(tmp.path);
+        for (int i = 1; i <= 6; ++i) {
+            SecretWebcash sk = NewSecret(i * 10);
+            server.Add(sk);
+            EXPECT_TRUE(wallet.Insert(sk, true));
+        }
+        wallet.Flush();
+        EXPECT_EQ(wallet.CountUnspent(), 6);
+
+        // Record a consolidation as if we had crashed just before asking the
+        // server for it.  Its inputs are set aside in the meantime.
+        ASSERT_TRUE(wallet.BeginConsolidation(2));
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'consolidationinput';"), 5);
+        EXPECT_EQ(wallet.SelectCoins(Amount(60)).size(), 1);
+        EXPECT_TRUE(wallet.SelectCoins(Amount(61)).empty());
+        change_id = wallet.QueryInt("SELECT change_secret_id FROM 'consolidation';");
+    }
+    const size_t replacements = server.replacements();
+    {
+        // The next sweep with consolidation enabled finishes the recorded one
+        // first, which is already enough to get under the limit.
+        TestWallet wallet(tmp.path);
+        wallet.SetConsolidation(2);
+        wallet.Flush();
+        EXPECT_EQ(server.replacements(), replacements + 1);
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'consolidation';"), 0);
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'consolidationinput';"), 0);
+        EXPECT_EQ(wallet.CountUnspent(), 2);
+        EXPECT_EQ(wallet.GetBalance(), Amount(210));
+        EXPECT_EQ(wallet.QueryInt(absl::StrCat("SELECT amount FROM 'output' WHERE spent=FALSE AND secret_id=", change_id, ";")), 150);
+    }
+}
+
+TEST(wallet, recover_gap_limit) {
+    TempWalletPath tmp;
+    StubServer server;
+    TestWallet wallet(tmp.path);
+
+    // Keys used elsewhere, on the payment chain: two within the first batch
+    // (one of them since spent), and one far beyond it.
+    server.Add(wallet.DeriveSecret(false, false, 0, 100));
+    server.Add(wallet.DeriveSecret(false, false, 10, 200), /* spent = */ true);
+    server.Add(wallet.DeriveSecret(false, false, 300, 400));
+    const std::string maxdepth = "SELECT maxdepth FROM 'hdchain' WHERE mine=FALSE AND sweep=FALSE;";
+    const std::string keys = "SELECT count(*) FROM 'hdkey' JOIN 'hdchain' ON hdchain.id=hdkey.hdchain_id WHERE hdchain.mine=FALSE AND hdchain.sweep=FALSE;";
+
+    // A gap of more than 20 unused keys ends the scan.
+    EXPECT_TRUE(wallet.Recover(20));
+    EXPECT_EQ(wallet.GetBalance(), Amount(100));
+    EXPECT_EQ(wallet.CountUnspent(), 1);
+    EXPECT_EQ(wallet.QueryInt(maxdepth), 11);
+    EXPECT_EQ(wallet.QueryInt(keys), 2);
+
+    // A larger gap limit finds the rest, and recovering again is harmless.
+    EXPECT_TRUE(wallet.Recover(300));
+    EXPECT_EQ(wallet.GetBalance(), Amount(500));
+    EXPECT_EQ(wallet.CountUnspent(), 2);
+    EXPECT_EQ(wallet.QueryInt(maxdepth), 301);
+    EXPECT_EQ(wallet.QueryInt(keys), 3);
+}
+
+TEST(wallet, restore_from_recovery_file) {
+    TempWalletPath tmp;
+    SecretWebcash sk;
+    {
+        TestWallet wallet(tmp.path);
+        sk = wallet.DeriveSecret(true, false, 3, 100);
+        EXPECT_FALSE(wallet.IsRecoveryPending());
+    }
+    boost::filesystem::path dbfile(tmp.path);
+    dbfile.replace_extension(".db");
+    boost::filesystem::remove(dbfile);
+
+    // Nothing is listening on the server port, so the master secret is
+    // restored without asking the server anything, and the recovery waits.
+    {
+        TestWallet wallet(tmp.path);
+        EXPECT_TRUE(wallet.IsRecoveryPending());
+        EXPECT_EQ(wallet.DeriveSecret(true, false, 3, 100), sk);
+        EXPECT_FALSE(wallet.Recover());
+        EXPECT_TRUE(wallet.IsRecoveryPending());
+    }
+
+    // It stays pending until a recovery succeeds.
+    StubServer server;
+    server.Add(sk);
+    {
+        TestWallet wallet(tmp.path);
+        EXPECT_TRUE(wallet.IsRecoveryPending());
+        EXPECT_TRUE(wallet.Recover());
+        EXPECT_FALSE(wallet.IsRecoveryPending());
+        EXPECT_EQ(wallet.GetBalance(), Amount(100));
+    }
+    {
+        TestWallet wallet(tmp.path);
+        EXPECT_FALSE(wallet.IsRecoveryPending());
+    }
+}
+
+TEST(wallet, insert_waits_for_recovery) {
+    TempWalletPath tmp;
+    {
+        TestWallet wallet(tmp.path);
+    }
+    boost::filesystem::path dbfile(tmp.path);
+    dbfile.replace_extension(".db");
+    boost::filesystem::remove(dbfile);
+
+    // While the recovery is pending, no keys are handed out, since they might
+    // repeat ones the server has already seen.
+    StubServer server;
+    {
+        TestWallet wallet(tmp.path);
+        ASSERT_TRUE(wallet.IsRecoveryPending());
+        EXPECT_FALSE(wallet.Insert(NewSecret(100), true));
+        EXPECT_FALSE(wallet.InsertMany({NewSecret(100), NewSecret(200)}, true));
+        wallet.Flush();
+        EXPECT_EQ(wallet.QueryInt("SELECT COUNT(*) FROM 'hdkey';"), 0);
+        EXPECT_EQ(wallet.QueryInt("SELECT COUNT(*) FROM 'output';"), 0);
+
+        EXPECT_TRUE(wallet.Recover());
+        const SecretWebcash sk = NewSecret(100);
+        server.Add(sk);
+        EXPECT_TRUE(wallet.Insert(sk, true));
+        wallet.Flush();
+        EXPECT_EQ(wallet.GetBalance(), Amount(100));
+    }
+}
+
+TEST(wallet, merge_duplicate_outputs) {
+    TempWalletPath tmp;
+    const SecretWebcash sk = NewSecret(100);
+    {
+        TestWallet wallet(tmp.path);
+        EXPECT_TRUE(wallet.Insert(sk, true));
+        wallet.Flush();
+    }
+
+    // Older wallets could record the same output twice.  Make a spent copy
+    // of it, with no secret, and move its sweep to the copy.
+    {
+        boost::filesystem::path dbfile(tmp.path);
+        dbfile.replace_extension(".db");
+        sqlite3* db;
+        ASSERT_EQ(sqlite3_open(dbfile.c_str(), &db), SQLITE_OK);
+        EXPECT_EQ(sqlite3_exec(db,
+            "DROP INDEX 'output_hash';"
+            "INSERT INTO 'output' ('timestamp','hash','secret_id','amount','spent') "
+                "SELECT timestamp,hash,NULL,amount,TRUE FROM 'output';"
+            "UPDATE 'sweepqueue' SET output_id=(SELECT MAX(id) FROM 'output');",
+            nullptr, nullptr, nullptr), SQLITE_OK);
+        sqlite3_close(db);
+    }
+
+    // Opening the wallet merges them into the original record, keeping the
+    // secret and the spent flag.
+    TestWallet wallet(tmp.path);
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'output';"), 1);
+    EXPECT_EQ(wallet.QueryInt("SELECT spent FROM 'output';"), 1);
+    EXPECT_EQ(wallet.QueryInt("SELECT secret_id IS NOT NULL FROM 'output';"), 1);
+    EXPECT_EQ(wallet.QueryInt("SELECT output_id FROM 'sweepqueue';"), wallet.QueryInt("SELECT id FROM 'output';"));
+    EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM sqlite_master WHERE type='index' AND name='output_hash';"), 1);
+    EXPECT_EQ(wallet.GetBalance(), Amount(0));
+    EXPECT_EQ(wallet.CountUnspent(), 0);
+}
+
+TEST(wallet, unlogged_insert_queued_later) {
+    using std::to_string;
+    TempWalletPath tmp;
+    {
+        TestWallet wallet(tmp.path);
+        // Secrets which can't be written to the recovery file are still kept,
+        // but not queued for replacement.
+        wallet.recovery_log().Close();
+        const SecretWebcash sk = NewSecret(100);
+        EXPECT_FALSE(wallet.Insert(sk, true));
+        wallet.Flush();
+        EXPECT_EQ(wallet.GetBalance(), Amount(100));
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 0);
+        EXPECT_EQ(wallet.ReadLogFile().find(to_string(sk).c_str()), std::string::npos);
+
+        // Once the file is writable again, the next sweep saves them and
+        // queues them up.
+        ASSERT_TRUE(wallet.recovery_log().Open(wallet.logfile()));
+        wallet.RequestSweep();
+        wallet.Flush();
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 1);
+        EXPECT_NE(wallet.ReadLogFile().find(to_string(sk).c_str()), std::string::npos);
+
+        // The same happens when the wallet is next opened, if it was closed
+        // first.
+        wallet.recovery_log().Close();
+        EXPECT_FALSE(wallet.Insert(NewSecret(200), true));
+    }
+    {
+        TestWallet wallet(tmp.path);
+        wallet.Flush();
+        EXPECT_EQ(wallet.GetBalance(), Amount(300));
+        EXPECT_EQ(wallet.QueryInt("SELECT count(*) FROM 'sweepqueue';"), 2);
+    }
 }
 
 // End of File
@@ -24,6 +24,9 @@ base_blob<BITS>::base_blob(const std::vector<unsigned char>& vch)
 template <unsigned int BITS>
 std::string base_blob<BITS>::GetHex() const
 {
+    if constexpr (WIDTH == 32) {
+        return HexStr32(m_data);
+    }
     return absl::BytesToHexString(absl::string_view((char*)m_data, WIDTH));
 }
 
@@ -55,6 +58,13 @@ void base_blob<BITS>::SetHex(const char* psz)
     size_t digits = 0;
     while (absl::ascii_isxdigit(psz[digits]))
         digits++;
+
+    // Fast path for the usual case of exactly as many digits as fit.
+    if constexpr (WIDTH == 32) {
+        if (digits == 64 && HexDecode32(m_data, psz)) {
+            return;
+        }
+    }
     unsigned char* p1 = (unsigned char*)m_data;
     unsigned char* pend = p1 + WIDTH;
     while (digits > 0 && p1 < pend) {
@@ -10,6 +10,10 @@
 #define BITCOIN_UINT256_H
 
 #include "absl/strings/ascii.h"
+#include "absl/strings/string_view.h"
+
+#include "crypto/common.h"
+#include "util/hex.h"
 
 #include <assert.h>
 #include <cstring>
@@ -156,38 +160,28 @@ inline uint256 uint256S(const std::string& str)
     return rv;
 }
 
-inline bool is_uint256(const std::string& str)
+inline bool is_uint256(const absl::string_view& str)
 {
-    if (str.length() != 64) {
-        return false;
-    }
-    for (size_t i = 0; i < str.length(); ++i) {
-        if (!absl::ascii_isxdigit(str[i])) {
-            return false;
+    unsigned char bytes[32];
+    return str.size() == 64 && HexDecode32(bytes, str.data());
+}
+
+/** The number of leading zero bits of the 32-byte hash, read as a big-endian
+ *  number, which is the difficulty of the work it represents. */
+inline int get_apparent_difficulty(const unsigned char* hash)
+{
+    for (int i = 0; i < 4; ++i) {
+        const uint64_t word = ReadBE64(hash + 8 * i);
+        if (word) {
+            return 64 * i + __builtin_clzll(word);
         }
     }
-    return true;
+    return 256;
 }
 
 inline int get_apparent_difficulty(const uint256& hash)
 {
-    int bits = 0;
-    for (int i = 0; i < 32; ++i) {
-        const unsigned char c = hash.begin()[i];
-        if (c == 0x00) {
-            bits += 8;
-            continue;
-        }
-        if (c == 0x01) return bits + 7;
-        if (c <= 0x03) return bits + 6;
-        if (c <= 0x07) return bits + 5;
-        if (c <= 0x0f) return bits + 4;
-        if (c <= 0x1f) return bits + 3;
-        if (c <= 0x3f) return bits + 2;
-        if (c <= 0x7f) return bits + 1;
-        break;
-    }
-    return bits;
+    return get_apparent_difficulty(hash.begin());
 }
 
 #endif // BITCOIN_UINT256_H
@@ -0,0 +1,193 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "util/hex.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compat/cpuid.h"
+
+#if defined(__x86_64__) || defined(__amd64__)
+namespace hex_sse41
+{
+void Encode32(char* out, const unsigned char* in);
+bool Decode32(unsigned char* out, const char* in);
+}
+
+namespace hex_avx2
+{
+void Encode32(char* out, const unsigned char* in);
+bool Decode32(unsigned char* out, const char* in);
+}
+#endif
+
+#if defined(__aarch64__)
+namespace hex_neon
+{
+void Encode32(char* out, const unsigned char* in);
+bool Decode32(unsigned char* out, const char* in);
+}
+#endif
+
+// Internal implementation code.
+namespace
+{
+/// Internal hex implementation.
+namespace hex
+{
+const char k_digits[] = "0123456789abcdef";
+
+// Maps each character to its value as a hex digit, or -1.
+constexpr signed char Value(char c)
+{
+    return ('0' <= c && c <= '9') ? c - '0'
+         : ('a' <= c && c <= 'f') ? c - 'a' + 10
+         : ('A' <= c && c <= 'F') ? c - 'A' + 10
+         : -1;
+}
+
+struct ValueTable {
+    signed char v[256];
+    constexpr ValueTable() : v() {
+        for (int i = 0; i < 256; ++i) {
+            v[i] = Value(static_cast<char>(i));
+        }
+    }
+};
+constexpr ValueTable k_values;
+
+void Encode32(char* out, const unsigned char* in)
+{
+    for (int i = 0; i < 32; ++i) {
+        out[2*i] = k_digits[in[i] >> 4];
+        out[2*i + 1] = k_digits[in[i] & 0xf];
+    }
+}
+
+bool Decode32(unsigned char* out, const char* in)
+{
+    unsigned char tmp[32];
+    // Accumulate the values of all the digits, so that there is only one
+    // branch for the validity check.
+    signed char bad = 0;
+    for (int i = 0; i < 32; ++i) {
+        signed char hi = k_values.v[static_cast<unsigned char>(in[2*i])];
+        signed char lo = k_values.v[static_cast<unsigned char>(in[2*i + 1])];
+        bad |= hi | lo;
+        tmp[i] = static_cast<unsigned char>((hi << 4) | lo);
+    }
+    if (bad < 0) {
+        return false;
+    }
+    memcpy(out, tmp, 32);
+    return true;
+}
+} // namespace hex
+
+typedef void (*Encode32Fn)(char*, const unsigned char*);
+typedef bool (*Decode32Fn)(unsigned char*, const char*);
+
+Encode32Fn Encode32 = hex::Encode32;
+Decode32Fn Decode32 = hex::Decode32;
+
+#ifndef NDEBUG
+bool SelfTest()
+{
+    static const unsigned char bytes[32] = {
+        0x00, 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32,
+        0x10, 0x0f, 0xf0, 0x5a, 0xa5, 0x3c, 0xc3, 0x96, 0x69, 0x7e, 0xe7, 0x81, 0x18, 0x42, 0x24, 0xff,
+    };
+    static const char lower[] = "000123456789abcdeffedcba98765432100ff05aa53cc396697ee781184224ff";
+    static const char upper[] = "000123456789ABCDEFFEDCBA98765432100FF05AA53CC396697EE781184224FF";
+
+    char str[64];
+    Encode32(str, bytes);
+    if (memcmp(str, lower, 64) != 0) {
+        return false;
+    }
+    unsigned char out[32];
+    if (!Decode32(out, lower) || memcmp(out, bytes, 32) != 0) {
+        return false;
+    }
+    if (!Decode32(out, upper) || memcmp(out, bytes, 32) != 0) {
+        return false;
+    }
+    // Every position must be checked, and characters adjacent to the digit
+    // ranges must be rejected.
+    for (int i = 0; i < 64; ++i) {
+        for (char c : {'/', ':', '@', 'G', '`', 'g', ' ', '\0', '\x80', '\xff'}) {
+            memcpy(str, lower, 64);
+            str[i] = c;
+            memset(out, 0, 32);
+            if (Decode32(out, str) || out[0] != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+#endif // NDEBUG
+} // namespace
+
+void HexEncode32(char* out, const unsigned char* in)
+{
+    Encode32(out, in);
+}
+
+bool HexDecode32(unsigned char* out, const char* in)
+{
+    return Decode32(out, in);
+}
+
+std::string HexAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(HAVE_GETCPUID) && (defined(__x86_64__) || defined(__amd64__))
+    bool have_sse4 = false;
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool enabled_avx = false;
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    have_sse4 = (ecx >> 19) & 1;
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        uint32_t a, d;
+        __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        enabled_avx = (a & 6) == 6;
+    }
+    if (have_sse4) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+    }
+
+    if (have_sse4) {
+        Encode32 = hex_sse41::Encode32;
+        Decode32 = hex_sse41::Decode32;
+        ret = "sse41";
+    }
+    if (have_avx2 && have_avx && enabled_avx) {
+        Encode32 = hex_avx2::Encode32;
+        Decode32 = hex_avx2::Decode32;
+        ret = "avx2";
+    }
+#elif defined(__aarch64__)
+    // Advanced SIMD is a mandatory part of ARMv8-A.
+    Encode32 = hex_neon::Encode32;
+    Decode32 = hex_neon::Decode32;
+    ret = "neon";
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+// End of File
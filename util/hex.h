@@ -0,0 +1,38 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTIL_HEX_H
+#define UTIL_HEX_H
+
+#include <string>
+
+#include <stddef.h>
+
+/** Writes the 64 lowercase hex digits of the 32 bytes at in to out.  No NUL
+ *  terminator is written. */
+void HexEncode32(char* out, const unsigned char* in);
+
+/** Decodes the 64 hex digits of either case at in to 32 bytes at out.
+ *  Returns false, leaving out unmodified, if any of the characters is not a
+ *  hex digit. */
+bool HexDecode32(unsigned char* out, const char* in);
+
+/** Returns the 64 lowercase hex digits of the 32 bytes at in. */
+inline std::string HexStr32(const unsigned char* in)
+{
+    std::string ret(64, '\0');
+    HexEncode32(&ret[0], in);
+    return ret;
+}
+
+/** Autodetect the best available hex implementation.  Returns the name of the
+ *  implementation.  Until this is called the portable implementation is used,
+ *  so it should be called at startup, before any other threads are running. */
+std::string HexAutoDetect();
+
+#endif // UTIL_HEX_H
+
+// End of File
@@ -0,0 +1,71 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// The functions are compiled for AVX2 individually, so that nothing else in
+// the library can end up using instructions the CPU might not have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+namespace {
+
+// Same approach as the SSE4.1 version, but with the whole value in one
+// register.  Shuffles and unpacks work within each 128-bit lane, so the
+// lanes have to be put back in order at the end.
+AVX2 inline __m256i Values32(__m256i in, __m256i& valid)
+{
+    __m256i num = _mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+    __m256i is_num = _mm256_cmpeq_epi8(_mm256_min_epu8(num, _mm256_set1_epi8(9)), num);
+    __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(in, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+    valid = _mm256_and_si256(valid, _mm256_or_si256(is_num, is_alpha));
+    return _mm256_or_si256(_mm256_and_si256(is_num, num), _mm256_and_si256(is_alpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10))));
+}
+
+}
+
+namespace hex_avx2 {
+
+AVX2 void Encode32(char* out, const unsigned char* in)
+{
+    const __m256i digits = _mm256_setr_epi8(
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i v = _mm256_loadu_si256((const __m256i*)in);
+    __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, mask));
+    // Lane 0 of each holds bytes 0-7 and 8-15, lane 1 bytes 16-23 and 24-31.
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i*)(out + 32), _mm256_permute2x128_si256(a, b, 0x31));
+}
+
+AVX2 bool Decode32(unsigned char* out, const char* in)
+{
+    __m256i valid = _mm256_set1_epi8(-1);
+    __m256i v0 = Values32(_mm256_loadu_si256((const __m256i*)in), valid);
+    __m256i v1 = Values32(_mm256_loadu_si256((const __m256i*)(in + 32)), valid);
+    if (_mm256_movemask_epi8(valid) != -1) {
+        return false;
+    }
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    __m256i packed = _mm256_packus_epi16(_mm256_maddubs_epi16(v0, weights), _mm256_maddubs_epi16(v1, weights));
+    // Packing interleaves the 64-bit halves of each lane.
+    _mm256_storeu_si256((__m256i*)out, _mm256_permute4x64_epi64(packed, 0xd8));
+    return true;
+}
+
+}
+
+#endif
+
+// End of File
@@ -0,0 +1,70 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#if defined(__aarch64__)
+
+#include <stdint.h>
+#include <arm_neon.h>
+
+namespace {
+
+// Converts 16 characters to their values as hex digits, and accumulates into
+// valid a mask of which characters were digits.
+inline uint8x16_t Values16(uint8x16_t in, uint8x16_t& valid)
+{
+    uint8x16_t num = vsubq_u8(in, vdupq_n_u8('0'));
+    uint8x16_t is_num = vcleq_u8(num, vdupq_n_u8(9));
+    // Setting bit 5 maps upper case letters to lower case, and leaves digits
+    // outside the range of letters.
+    uint8x16_t alpha = vsubq_u8(vorrq_u8(in, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_alpha = vcleq_u8(alpha, vdupq_n_u8(5));
+    valid = vandq_u8(valid, vorrq_u8(is_num, is_alpha));
+    return vorrq_u8(vandq_u8(is_num, num), vandq_u8(is_alpha, vaddq_u8(alpha, vdupq_n_u8(10))));
+}
+
+}
+
+namespace hex_neon {
+
+void Encode32(char* out, const unsigned char* in)
+{
+    static const uint8_t k_digits[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+    const uint8x16_t digits = vld1q_u8(k_digits);
+    for (int i = 0; i < 2; ++i) {
+        uint8x16_t v = vld1q_u8(in + 16*i);
+        uint8x16x2_t chars;
+        chars.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+        chars.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+        // Stores the two vectors interleaved, high nibble first.
+        vst2q_u8((uint8_t*)out + 32*i, chars);
+    }
+}
+
+bool Decode32(unsigned char* out, const char* in)
+{
+    uint8x16_t valid = vdupq_n_u8(0xff);
+    uint8x16_t bytes[2];
+    for (int i = 0; i < 2; ++i) {
+        // Loads the even (high nibble) and odd (low nibble) characters into
+        // separate vectors.
+        uint8x16x2_t chars = vld2q_u8((const uint8_t*)in + 32*i);
+        uint8x16_t hi = Values16(chars.val[0], valid);
+        uint8x16_t lo = Values16(chars.val[1], valid);
+        bytes[i] = vorrq_u8(vshlq_n_u8(hi, 4), lo);
+    }
+    if (vminvq_u8(valid) != 0xff) {
+        return false;
+    }
+    vst1q_u8(out, bytes[0]);
+    vst1q_u8(out + 16, bytes[1]);
+    return true;
+}
+
+}
+
+#endif
+
+// End of File
@@ -0,0 +1,82 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// The functions are compiled for SSE4.1 individually, so that nothing else
+// in the library can end up using instructions the CPU might not have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#define SSE41 __attribute__((target("sse4.1")))
+
+namespace {
+
+// Each byte is split into its two nibbles, which are used to look up the
+// digit characters with a byte shuffle, then interleaved high nibble first.
+SSE41 inline void Encode16(char* out, __m128i in)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, mask));
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+// Converts 16 characters to their values as hex digits, and accumulates into
+// valid a mask of which characters were digits.
+SSE41 inline __m128i Values16(__m128i in, __m128i& valid)
+{
+    // Unsigned x <= n is tested as min(x, n) == x.
+    __m128i num = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+    __m128i is_num = _mm_cmpeq_epi8(_mm_min_epu8(num, _mm_set1_epi8(9)), num);
+    // Setting bit 5 maps upper case letters to lower case, and leaves digits
+    // outside the range of letters.
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(in, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    valid = _mm_and_si128(valid, _mm_or_si128(is_num, is_alpha));
+    return _mm_or_si128(_mm_and_si128(is_num, num), _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+
+// Combines pairs of digit values into bytes: hi * 16 + lo.
+SSE41 inline __m128i Pack16(__m128i a, __m128i b)
+{
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    return _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+}
+
+}
+
+namespace hex_sse41 {
+
+SSE41 void Encode32(char* out, const unsigned char* in)
+{
+    Encode16(out, _mm_loadu_si128((const __m128i*)in));
+    Encode16(out + 32, _mm_loadu_si128((const __m128i*)(in + 16)));
+}
+
+SSE41 bool Decode32(unsigned char* out, const char* in)
+{
+    __m128i valid = _mm_set1_epi8(-1);
+    __m128i v0 = Values16(_mm_loadu_si128((const __m128i*)in), valid);
+    __m128i v1 = Values16(_mm_loadu_si128((const __m128i*)(in + 16)), valid);
+    __m128i v2 = Values16(_mm_loadu_si128((const __m128i*)(in + 32)), valid);
+    __m128i v3 = Values16(_mm_loadu_si128((const __m128i*)(in + 48)), valid);
+    if (_mm_movemask_epi8(valid) != 0xffff) {
+        return false;
+    }
+    _mm_storeu_si128((__m128i*)out, Pack16(v0, v1));
+    _mm_storeu_si128((__m128i*)(out + 16), Pack16(v2, v3));
+    return true;
+}
+
+}
+
+#endif
+
+// End of File
@@ -0,0 +1,153 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "util/pow.h"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compat/cpuid.h"
+#include "crypto/common.h"
+#include "uint256.h"
+
+#if defined(__x86_64__) || defined(__amd64__)
+namespace pow_avx2
+{
+uint32_t Candidates_8way(const unsigned char* hashes, uint64_t mask);
+}
+
+namespace pow_avx512
+{
+uint32_t Candidates_16way(const unsigned char* hashes, uint64_t mask);
+}
+#endif
+
+// Internal implementation code.
+namespace
+{
+/** The bits of the first eight bytes of a hash, as read by ReadLE64, which
+ *  must all be zero for it to meet difficulty.  Beyond 64 bits this is only a
+ *  necessary condition, so candidates must still be checked in full. */
+uint64_t ZeroMask(int difficulty)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        const int bits = std::min(std::max(difficulty - 8 * i, 0), 8);
+        bytes[i] = (0xff00 >> bits) & 0xff;
+    }
+    return ReadLE64(bytes);
+}
+
+/** Returns a bit set for each of a group of hashes which might meet the
+ *  difficulty given by mask. */
+typedef uint32_t (*CandidatesFn)(const unsigned char*, uint64_t);
+
+CandidatesFn Candidates = nullptr;
+size_t candidates_way = 0;
+
+#ifndef NDEBUG
+bool SelfTest()
+{
+    // Everything fails except for hash 5, which falls one bit short of 30,
+    // hash 20, which has exactly 30 zero bits, and hash 29, which has 72.
+    // There are enough that the groups of every implementation are used, with
+    // some left over.
+    unsigned char hashes[37 * 32];
+    memset(hashes, 0xff, sizeof(hashes));
+    memset(hashes + 5 * 32, 0, 3);
+    hashes[5 * 32 + 3] = 0x07;
+    memset(hashes + 20 * 32, 0, 3);
+    hashes[20 * 32 + 3] = 0x03;
+    memset(hashes + 29 * 32, 0, 9);
+    if (FindProofOfWork(hashes, 37, 0) != 0) return false;
+    if (FindProofOfWork(hashes, 37, 29) != 5) return false;
+    if (FindProofOfWork(hashes, 37, 30) != 20) return false;
+    if (FindProofOfWork(hashes + 6 * 32, 31, 29) != 14) return false;
+    if (FindProofOfWork(hashes, 37, 31) != 29) return false;
+    if (FindProofOfWork(hashes, 37, 72) != 29) return false;
+    if (FindProofOfWork(hashes, 37, 73) != 37) return false;
+    if (FindProofOfWork(hashes, 29, 31) != 29) return false;
+    return true;
+}
+#endif // NDEBUG
+} // namespace
+
+size_t FindProofOfWork(const unsigned char* hashes, size_t count, int difficulty)
+{
+    const uint64_t mask = ZeroMask(difficulty);
+    size_t i = 0;
+    const CandidatesFn candidates = Candidates;
+    const size_t way = candidates_way;
+    if (candidates) {
+        for (; i + way <= count; i += way) {
+            for (uint32_t found = candidates(hashes + 32 * i, mask); found; found &= found - 1) {
+                const size_t k = i + __builtin_ctz(found);
+                if (get_apparent_difficulty(hashes + 32 * k) >= difficulty) {
+                    return k;
+                }
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        if (!(ReadLE64(hashes + 32 * i) & mask) && get_apparent_difficulty(hashes + 32 * i) >= difficulty) {
+            return i;
+        }
+    }
+    return count;
+}
+
+std::string ProofOfWorkAutoDetect(size_t max_way)
+{
+    std::string ret = "standard";
+    Candidates = nullptr;
+    candidates_way = 0;
+#if defined(HAVE_GETCPUID) && (defined(__x86_64__) || defined(__amd64__))
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool have_avx512 = false;
+    bool enabled_avx = false;
+    bool enabled_avx512 = false;
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(0, 0, eax, ebx, ecx, edx);
+    const uint32_t max_leaf = eax;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        uint32_t a, d;
+        __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        enabled_avx = (a & 6) == 6;
+        // The opmask and upper ZMM state must be enabled as well.
+        enabled_avx512 = (a & 0xe6) == 0xe6;
+    }
+    if (max_leaf >= 7) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_avx512 = (ebx >> 16) & 1;
+    }
+
+    if (have_avx2 && have_avx && enabled_avx && max_way >= 8) {
+        Candidates = pow_avx2::Candidates_8way;
+        candidates_way = 8;
+        ret = "avx2(8way)";
+    }
+    if (have_avx512 && have_avx && enabled_avx512 && max_way >= 16) {
+        Candidates = pow_avx512::Candidates_16way;
+        candidates_way = 16;
+        ret = "avx512(16way)";
+    }
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+// End of File
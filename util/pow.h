@@ -0,0 +1,28 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTIL_POW_H
+#define UTIL_POW_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Returns the index of the first of count 32-byte hashes, stored one after
+ *  another at hashes, whose apparent difficulty is at least difficulty, or
+ *  count if there is none. */
+size_t FindProofOfWork(const unsigned char* hashes, size_t count, int difficulty);
+
+/** Autodetect the best available implementation of FindProofOfWork checking
+ *  at most max_way hashes at a time.  Returns the name of the implementation.
+ *  Until this is called the portable implementation is used, so it should be
+ *  called at startup, before any other threads are running. */
+std::string ProofOfWorkAutoDetect(size_t max_way = SIZE_MAX);
+
+#endif // UTIL_POW_H
+
+// End of File
@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// The first eight bytes of eight hashes at a time, one per 64-bit lane of two
+// vectors.  The function is compiled for AVX2 individually, so that nothing
+// else in the library can end up using instructions the CPU might not have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+namespace pow_avx2 {
+
+/** The first eight bytes of four hashes, one per 64-bit lane. */
+AVX2 __m256i inline Load4(const unsigned char* hashes)
+{
+    __m256i ab = _mm256_unpacklo_epi64(_mm256_loadu_si256((const __m256i*)hashes), _mm256_loadu_si256((const __m256i*)(hashes + 32)));
+    __m256i cd = _mm256_unpacklo_epi64(_mm256_loadu_si256((const __m256i*)(hashes + 64)), _mm256_loadu_si256((const __m256i*)(hashes + 96)));
+    return _mm256_permute2x128_si256(ab, cd, 0x20);
+}
+
+AVX2 uint32_t Candidates_8way(const unsigned char* hashes, uint64_t mask)
+{
+    const __m256i m = _mm256_set1_epi64x(mask);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_cmpeq_epi64(_mm256_and_si256(Load4(hashes), m), zero);
+    __m256i hi = _mm256_cmpeq_epi64(_mm256_and_si256(Load4(hashes + 128), m), zero);
+    return _mm256_movemask_pd(_mm256_castsi256_pd(lo)) | _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+}
+
+} // namespace pow_avx2
+
+#endif
+
+// End of File
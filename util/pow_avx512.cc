@@ -0,0 +1,40 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// The first eight bytes of sixteen hashes at a time, one per 64-bit lane of
+// two vectors.  The function is compiled for AVX-512 individually, so that
+// nothing else in the library can end up using instructions the CPU might not
+// have.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+// GCC's AVX-512 gathers initialize their don't-care source operand from
+// itself, which -Wuninitialized reports once they are inlined.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+
+#define AVX512 __attribute__((target("avx512f")))
+
+namespace pow_avx512 {
+
+AVX512 uint32_t Candidates_16way(const unsigned char* hashes, uint64_t mask)
+{
+    const __m512i offsets = _mm512_setr_epi64(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m512i m = _mm512_set1_epi64(mask);
+    __m512i lo = _mm512_i64gather_epi64(offsets, hashes, 1);
+    __m512i hi = _mm512_i64gather_epi64(offsets, hashes + 256, 1);
+    return _mm512_testn_epi64_mask(lo, m) | _mm512_testn_epi64_mask(hi, m) << 8;
+}
+
+} // namespace pow_avx512
+
+#endif
+
+// End of File
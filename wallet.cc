@@ -8,22 +8,31 @@
 
 #include "webcash.h"
 
+#include <algorithm>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <utility>
-#include <variant>
 #include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "absl/flags/declare.h"
 #include "absl/flags/flag.h"
 
 ABSL_DECLARE_FLAG(std::string, server);
 
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
@@ -40,6 +49,7 @@ ABSL_DECLARE_FLAG(std::string, server);
 #include <univalue.h>
 
 #include "random.h"
+#include "util/hex.h"
 
 // We group outputs based on their use.  There are currently four categories of
 // webcash recognized by the wallet:
@@ -74,90 +84,216 @@ enum HashType : int {
     MINING = 3,
 };
 
-class BindParameterVisitor
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlNull& v) { return sqlite3_bind_null(stmt, index); }
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlBool& v) { return sqlite3_bind_int(stmt, index, !!v.b); }
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlInteger& v) { return sqlite3_bind_int64(stmt, index, v.i); }
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlFloat& v) { return sqlite3_bind_double(stmt, index, v.d); }
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlText& v) { return sqlite3_bind_text64(stmt, index, v.data, v.size, SQLITE_STATIC, SQLITE_UTF8); }
+static inline int BindSqlValue(sqlite3_stmt* stmt, int index, const SqlBlob& v) { return sqlite3_bind_blob64(stmt, index, v.data, v.size, SQLITE_STATIC); }
+
+std::string to_string(const SqlNull& v)
+{
+    return "NULL";
+}
+
+std::string to_string(const SqlBool& v)
+{
+    return v.b ? "TRUE" : "FALSE";
+}
+
+std::string to_string(const SqlInteger& v)
+{
+    return std::to_string(v.i);
+}
+
+std::string to_string(const SqlFloat& v)
+{
+    return std::to_string(v.d);
+}
+
+std::string to_string(const SqlText& v)
+{
+    std::stringstream ss;
+    ss << std::quoted(std::string(v.data, v.size), '\'', '\'');
+    return ss.str();
+}
+
+std::string to_string(const SqlBlob& v)
+{
+    return absl::StrCat("x'", absl::BytesToHexString(absl::string_view((const char*)v.data, v.size)), "'");
+}
+
+// Resets a cached prepared statement and clears its bindings when it goes out
+// of scope, so that the statement is ready for its next use and doesn't hold
+// open a read transaction on the database in the meantime.
+class StatementReset
 {
 protected:
     sqlite3_stmt* m_stmt;
-    int m_index;
 
 public:
-    BindParameterVisitor(sqlite3_stmt* stmt, int index) : m_stmt(stmt), m_index(index) {}
-
-    int operator()(const SqlNull& v) const { return sqlite3_bind_null(m_stmt, m_index); }
-    int operator()(const SqlBool& v) const { return sqlite3_bind_int(m_stmt, m_index, !!v.b); }
-    int operator()(const SqlInteger& v) const { return sqlite3_bind_int64(m_stmt, m_index, v.i); }
-    int operator()(const SqlFloat& v) const { return sqlite3_bind_double(m_stmt, m_index, v.d); }
-    int operator()(const SqlText& v) const { return sqlite3_bind_text(m_stmt, m_index, v.s.c_str(), v.s.size(), SQLITE_STATIC); }
-    int operator()(const SqlBlob& v) const { return sqlite3_bind_blob(m_stmt, m_index, v.vch.data(), v.vch.size(), SQLITE_STATIC); }
+    explicit StatementReset(sqlite3_stmt* stmt) : m_stmt(stmt) {}
+    ~StatementReset() {
+        sqlite3_reset(m_stmt);
+        sqlite3_clear_bindings(m_stmt);
+    }
+
+    // Non-copyable:
+    StatementReset(const StatementReset&) = delete;
+    StatementReset& operator=(const StatementReset&) = delete;
 };
 
-std::string to_string(const SqlValue& v)
+sqlite3_stmt* Wallet::GetCachedStatement(const std::string& sql)
 {
-    using std::to_string;
-    if (std::holds_alternative<SqlNull>(v)) {
-        return "NULL";
+    auto itr = m_stmt_cache.find(sql);
+    if (itr != m_stmt_cache.end()) {
+        if (itr->second.size() != 1) {
+            std::string msg(absl::StrCat("Cached SQL [\"", sql, "\"] contains ", itr->second.size(), " statements; expected exactly one."));
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+        return itr->second.front();
     }
-    if (std::holds_alternative<SqlBool>(v)) {
-        return std::get<SqlBool>(v).b ? "TRUE" : "FALSE";
+    sqlite3_stmt* stmt;
+    int res = sqlite3_prepare_v3(m_db, sql.c_str(), sql.size(), SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+    if (res != SQLITE_OK) {
+        std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
     }
-    if (std::holds_alternative<SqlInteger>(v)) {
-        return to_string(std::get<SqlInteger>(v).i);
+    m_stmt_cache[sql].push_back(stmt);
+    return stmt;
+}
+
+// Binds a single parameter, unless the statement doesn't use that many.
+template<typename Param>
+static bool BindParameter(sqlite3_stmt* stmt, int count, int index, const Param& param)
+{
+    using std::to_string;
+    if (count < index) {
+        return true;
     }
-    if (std::holds_alternative<SqlFloat>(v)) {
-        return to_string(std::get<SqlFloat>(v).d);
+    int res = BindSqlValue(stmt, index, param);
+    if (res != SQLITE_OK) {
+        std::cerr << "Unable to bind ?" << index << " in SQL statement [\"" << sqlite3_sql(stmt) << "\"] to " << to_string(param) << ": " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
+        return false;
     }
-    if (std::holds_alternative<SqlText>(v)) {
-        std::stringstream ss;
-        ss << std::quoted(std::get<SqlText>(v).s, '\'', '\'');
-        return ss.str();
+    return true;
+}
+
+// Binds params to the statement's ?1, ?2, ... parameters in order.  Trailing
+// parameters which the statement doesn't use are skipped, since each of the
+// statements of a multi-statement SQL string is bound to the same params.
+template<typename... Params>
+static bool BindParameters(sqlite3_stmt* stmt, const Params&... params)
+{
+    [[maybe_unused]] const int count = sqlite3_bind_parameter_count(stmt);
+    [[maybe_unused]] int index = 0;
+    return (BindParameter(stmt, count, ++index, params) && ...);
+}
+
+// Binds the parameters used by a statement, then runs the statement to
+// completion.  The statement is reset afterwards whether or not it succeeds.
+template<typename... Params>
+static bool RunStatement(sqlite3_stmt* stmt, const Params&... params)
+{
+    using std::to_string;
+    const StatementReset reset(stmt);
+    if (!BindParameters(stmt, params...)) {
+        return false;
     }
-    if (std::holds_alternative<SqlBlob>(v)) {
-        const std::vector<unsigned char>& vch = std::get<SqlBlob>(v).vch;
-        return absl::StrCat("x'", absl::BytesToHexString(std::string_view((const char*)vch.data(), vch.size())), "'");
+    // Execute statement
+    int res = sqlite3_step(stmt);
+    if (res != SQLITE_DONE) {
+        std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;;
+        return false;
     }
-    return "unknown";
+    return true;
 }
 
-bool Wallet::ExecuteSql(const std::string& sql, const SqlParams& params)
+template<typename... Params>
+bool Wallet::ExecuteSql(const std::string& sql, const Params&... params)
 {
-    const char* head = sql.c_str();
-    const char* tail = sql.c_str() + sql.size();
-    while (head != tail) {
-        // Parse next SQL statment
-        sqlite3_stmt* stmt;
-        size_t size = tail - head;
-        int res = sqlite3_prepare_v2(m_db, head, size, &stmt, &tail);
-        size = tail - head; // tail is set to the end of the current statement
-        if (res != SQLITE_OK) {
-            std::cerr << "Unable to prepare SQL statement [\"" << head << "\"]: " << sqlite3_errstr(res) << " (" << std::to_string(res) << ")" << std::endl;
-            return false;
+    bool ok = true;
+    auto itr = m_stmt_cache.find(sql);
+    if (itr != m_stmt_cache.end()) {
+        for (sqlite3_stmt* stmt : itr->second) {
+            if (!(ok = RunStatement(stmt, params...))) {
+                break;
+            }
         }
-        // Bind parameters
-        for (const auto& bind : params) {
-            const std::string key(":" + bind.first);
-            int index = sqlite3_bind_parameter_index(stmt, key.c_str());
-            if (index) {
-                res = std::visit(BindParameterVisitor(stmt, index), bind.second);
-                if (res != SQLITE_OK) {
-                    std::cerr << "Unable to bind ':" << bind.first << "' in SQL statement [\"" << sqlite3_sql(stmt) << "\"] to " << to_string(bind.second) << ": " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
-                    sqlite3_finalize(stmt);
-                    return false;
-                }
+    } else {
+        // Each statement is prepared only after the ones before it have been
+        // run, since earlier statements might make schema changes that later
+        // statements depend upon.
+        std::vector<sqlite3_stmt*> stmts;
+        const char* head = sql.c_str();
+        const char* tail = sql.c_str() + sql.size();
+        while (head != tail) {
+            // Parse next SQL statment
+            sqlite3_stmt* stmt;
+            size_t size = tail - head;
+            int res = sqlite3_prepare_v3(m_db, head, size, SQLITE_PREPARE_PERSISTENT, &stmt, &tail);
+            if (res != SQLITE_OK) {
+                std::cerr << "Unable to prepare SQL statement [\"" << head << "\"]: " << sqlite3_errstr(res) << " (" << std::to_string(res) << ")" << std::endl;
+                ok = false;
+                break;
+            }
+            // Trailing whitespace or comments do not compile to a statement.
+            if (!stmt) {
+                break;
             }
+            stmts.push_back(stmt);
+            if (!(ok = RunStatement(stmt, params...))) {
+                break;
+            }
+            // Set [head, tail) to point past the last statement executed before
+            // continuing the loop:
+            head = tail;
+            tail = sql.c_str() + sql.size();
         }
-        // Execute statement
-        res = sqlite3_step(stmt);
-        if (res != SQLITE_DONE) {
-            std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;;
-            sqlite3_finalize(stmt);
-            return false;
+        if (ok) {
+            m_stmt_cache.emplace(sql, std::move(stmts));
+        } else {
+            for (sqlite3_stmt* stmt : stmts) {
+                sqlite3_finalize(stmt);
+            }
+        }
+    }
+    return ok;
+}
+
+Wallet::Savepoint::Savepoint(Wallet& wallet, const std::string& name)
+    : m_wallet(wallet)
+    , m_name(name)
+    , m_active(false)
+{
+    if (!m_wallet.ExecuteSql(absl::StrCat("SAVEPOINT ", m_name, ";"))) {
+        throw std::runtime_error(absl::StrCat("Unable to begin database transaction '", m_name, "'.  See error log for details."));
+    }
+    m_active = true;
+}
+
+Wallet::Savepoint::~Savepoint()
+{
+    if (m_active) {
+        // Undo any changes made since the savepoint was opened, then remove
+        // the savepoint from the transaction stack.
+        if (!m_wallet.ExecuteSql(absl::StrCat("ROLLBACK TO ", m_name, "; RELEASE ", m_name, ";"))) {
+            std::cerr << "WARNING: Unable to roll back database transaction '" << m_name << "'.  See error log for details." << std::endl;
         }
-        sqlite3_finalize(stmt);
-        // Set [head, tail) to point past the last statement executed before
-        // continuing the loop:
-        head = tail;
-        tail = sql.c_str() + sql.size();
     }
+}
+
+bool Wallet::Savepoint::Commit()
+{
+    if (!m_active) {
+        return false;
+    }
+    if (!m_wallet.ExecuteSql(absl::StrCat("RELEASE ", m_name, ";"))) {
+        return false;
+    }
+    m_active = false;
     return true;
 }
 
@@ -205,10 +341,119 @@ void Wallet::UpgradeDatabase()
             "'secret_id' INTEGER UNIQUE NOT NULL,"
             "FOREIGN KEY('hdchain_id') REFERENCES 'hdchain'('id'),"
             "FOREIGN KEY('secret_id') REFERENCES 'secret'('id'),"
-            "UNIQUE('hdchain_id','depth'));";
-    if (!ExecuteSql(sql, {})) {
+            "UNIQUE('hdchain_id','depth'));"
+        "CREATE TABLE IF NOT EXISTS 'sweepqueue' ("
+            "'id' INTEGER PRIMARY KEY NOT NULL,"
+            "'timestamp' INTEGER NOT NULL,"
+            "'output_id' INTEGER UNIQUE NOT NULL,"
+            "'change_secret_id' INTEGER UNIQUE NOT NULL,"
+            "FOREIGN KEY('output_id') REFERENCES 'output'('id'),"
+            "FOREIGN KEY('change_secret_id') REFERENCES 'secret'('id'));"
+        "CREATE TABLE IF NOT EXISTS 'consolidation' ("
+            "'id' INTEGER PRIMARY KEY NOT NULL,"
+            "'timestamp' INTEGER NOT NULL,"
+            "'change_secret_id' INTEGER UNIQUE NOT NULL,"
+            "FOREIGN KEY('change_secret_id') REFERENCES 'secret'('id'));"
+        "CREATE TABLE IF NOT EXISTS 'consolidationinput' ("
+            "'id' INTEGER PRIMARY KEY NOT NULL,"
+            "'consolidation_id' INTEGER NOT NULL,"
+            "'output_id' INTEGER UNIQUE NOT NULL,"
+            "FOREIGN KEY('consolidation_id') REFERENCES 'consolidation'('id'),"
+            "FOREIGN KEY('output_id') REFERENCES 'output'('id'));"
+        "CREATE TABLE IF NOT EXISTS 'pendingrecovery' ("
+            "'id' INTEGER PRIMARY KEY NOT NULL,"
+            "'timestamp' INTEGER NOT NULL,"
+            "'hdroot_id' INTEGER UNIQUE NOT NULL,"
+            "FOREIGN KEY('hdroot_id') REFERENCES 'hdroot'('id'));"
+        "CREATE INDEX IF NOT EXISTS 'consolidationinput_consolidation_id' ON 'consolidationinput'('consolidation_id');";
+    Savepoint tx(*this, "upgrade");
+    if (!ExecuteSql(sql)) {
         throw std::runtime_error("Unable to create database tables.  See error log for details.");
     }
+
+    // Earlier versions of the wallet could record the same output more than
+    // once, if its secret was inserted again.  Merge any duplicates before
+    // requiring output hashes to be unique.
+    bool have_hash_index = false;
+    {
+        const std::string sql = "SELECT EXISTS(SELECT 1 FROM sqlite_master WHERE type='index' AND name='output_hash');";
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
+        if (res != SQLITE_ROW) {
+            std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+        have_hash_index = !!sqlite3_column_int(stmt, 0);
+    }
+    if (!have_hash_index) {
+        const std::string sql =
+            "CREATE INDEX IF NOT EXISTS 'output_hash_dup' ON 'output'('hash');"
+            "UPDATE 'output' SET spent=(SELECT MAX(dup.spent) FROM 'output' AS dup WHERE dup.hash=output.hash),"
+                                "secret_id=(SELECT MAX(dup.secret_id) FROM 'output' AS dup WHERE dup.hash=output.hash);"
+            "UPDATE OR IGNORE 'sweepqueue' SET output_id=(SELECT MIN(dup.id) FROM 'output' AS dup JOIN 'output' AS orig ON dup.hash=orig.hash WHERE orig.id=sweepqueue.output_id);"
+            "DELETE FROM 'sweepqueue' WHERE output_id NOT IN (SELECT MIN(id) FROM 'output' GROUP BY hash);"
+            "DELETE FROM 'output' WHERE id NOT IN (SELECT MIN(id) FROM 'output' GROUP BY hash);"
+            "DROP INDEX 'output_hash_dup';";
+        if (!ExecuteSql(sql)) {
+            throw std::runtime_error("Unable to merge duplicate outputs in database.  See error log for details.");
+        }
+    }
+
+    // Queries on unspent outputs only ever touch the (partial) indexes over
+    // them, and the wallet balance is kept up to date by triggers so that it
+    // can be read without a scan.
+    const std::string index_sql =
+        "CREATE UNIQUE INDEX IF NOT EXISTS 'output_hash' ON 'output'('hash');"
+        "CREATE INDEX IF NOT EXISTS 'output_secret_id' ON 'output'('secret_id');"
+        "CREATE INDEX IF NOT EXISTS 'output_unspent_id' ON 'output'('id') WHERE spent=FALSE;"
+        "CREATE INDEX IF NOT EXISTS 'output_unspent_amount' ON 'output'('amount','id') WHERE spent=FALSE;"
+        "CREATE TABLE IF NOT EXISTS 'balance' ("
+            "'id' INTEGER PRIMARY KEY NOT NULL CHECK(id=1),"
+            "'amount' INTEGER NOT NULL,"
+            "'count' INTEGER NOT NULL);"
+        "INSERT OR IGNORE INTO 'balance' ('id','amount','count')"
+        "VALUES(1,"
+               "(SELECT IFNULL(SUM(amount),0) FROM 'output' WHERE spent=FALSE),"
+               "(SELECT COUNT(1) FROM 'output' WHERE spent=FALSE));"
+        "CREATE TRIGGER IF NOT EXISTS 'output_balance_insert' AFTER INSERT ON 'output' "
+        "WHEN NEW.spent=FALSE BEGIN "
+            "UPDATE 'balance' SET amount=amount+NEW.amount,count=count+1;"
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS 'output_balance_delete' AFTER DELETE ON 'output' "
+        "WHEN OLD.spent=FALSE BEGIN "
+            "UPDATE 'balance' SET amount=amount-OLD.amount,count=count-1;"
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS 'output_balance_update' AFTER UPDATE OF amount,spent ON 'output' BEGIN "
+            "UPDATE 'balance' SET amount=amount-(CASE WHEN OLD.spent=FALSE THEN OLD.amount ELSE 0 END)"
+                                            "+(CASE WHEN NEW.spent=FALSE THEN NEW.amount ELSE 0 END),"
+                                 "count=count-(OLD.spent=FALSE)+(NEW.spent=FALSE);"
+        "END;";
+    if (!ExecuteSql(index_sql) || !tx.Commit()) {
+        throw std::runtime_error("Unable to create database indexes.  See error log for details.");
+    }
+}
+
+// Finds the first master secret recorded in the wallet recovery file, if any.
+static bool ReadHDRootFromRecoveryLog(const boost::filesystem::path& path, int64_t& timestamp, uint256& hdroot)
+{
+    boost::filesystem::ifstream bak(path);
+    std::string line;
+    while (std::getline(bak, line)) {
+        std::vector<std::string> parts = absl::StrSplit(line, ' ');
+        if (parts.size() != 4 || parts[1] != "hdroot" || parts[3] != "version=1") {
+            continue;
+        }
+        if (!is_uint256(parts[2]) || !absl::SimpleAtoi(parts[0], &timestamp)) {
+            continue;
+        }
+        HexDecode32(hdroot.begin(), parts[2].data());
+        memory_cleanse(line.data(), line.size());
+        memory_cleanse(parts[2].data(), parts[2].size());
+        return true;
+    }
+    return false;
 }
 
 void Wallet::GetOrCreateHDRoot()
@@ -218,59 +463,63 @@ void Wallet::GetOrCreateHDRoot()
     int count = -1;
     {
         const std::string sql = "SELECT COUNT(1) FROM 'hdroot';";
-        sqlite3_stmt* stmt;
-        int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_step(stmt);
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
         if (res != SQLITE_ROW) {
             std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
             std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         count = sqlite3_column_int(stmt, 0);
-        sqlite3_finalize(stmt);
     }
 
     if (count == 0) {
-        std::cout << "Generating master secret for wallet." << std::endl;
-        const int64_t timestamp = absl::ToUnixSeconds(absl::Now());
-        GetStrongRandBytes(m_hdroot.begin(), 32);
+        int64_t timestamp = 0;
+        // Set if the database was lost or deleted, but the recovery file
+        // survived.  Which keys of the master secret were used isn't known
+        // until the server is asked, so a recovery is recorded as pending.
+        // Opening the wallet doesn't wait on the network for that; it is up
+        // to the caller to Recover() before handing out new keys.
+        bool restored = false;
+        if (ReadHDRootFromRecoveryLog(m_logfile, timestamp, m_hdroot)) {
+            std::cout << "Restoring master secret from wallet recovery file.  Its outputs must be recovered from the server before the wallet is used." << std::endl;
+            restored = true;
+        } else {
+            std::cout << "Generating master secret for wallet." << std::endl;
+            timestamp = absl::ToUnixSeconds(absl::Now());
+            GetStrongRandBytes(m_hdroot.begin(), 32);
 
-        {
-            std::string line = absl::StrCat(to_string(timestamp), " hdroot ", absl::BytesToHexString(absl::string_view((const char*)m_hdroot.begin(), 32)), " version=1");
-            boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
-            if (!bak) {
+            std::string line = absl::StrCat(to_string(timestamp), " hdroot ", HexStr32(m_hdroot.begin()), " version=1");
+            if (!m_recovery_log.Append({line})) {
                 std::string msg("Unable to open/create wallet recovery file to save wallet master key.");
                 std::cerr << msg << std::endl;
                 throw std::runtime_error(msg);
-            } else {
-                bak << line << std::endl;
-                bak.flush();
             }
         }
 
+        Savepoint tx(*this, "create_hdroot");
         const std::string sql =
-            "BEGIN TRANSACTION;"
-            ""
             "INSERT OR IGNORE INTO hdroot ('timestamp','version','secret')"
-            "VALUES(:timestamp,1,:secret);"
+            "VALUES(?2,1,?1);"
             ""
             "INSERT OR IGNORE INTO hdchain ('hdroot_id','chaincode','mine','sweep','mindepth','maxdepth')"
-            "VALUES((SELECT id FROM 'hdroot' WHERE secret=:secret),0,FALSE,FALSE,0,0),"
-                  "((SELECT id FROM 'hdroot' WHERE secret=:secret),0,FALSE,TRUE,0,0),"
-                  "((SELECT id FROM 'hdroot' WHERE secret=:secret),0,TRUE,FALSE,0,0),"
-                  "((SELECT id FROM 'hdroot' WHERE secret=:secret),0,TRUE,TRUE,0,0);"
-            ""
-            "COMMIT;";
-        SqlParams params;
-        params["timestamp"] = SqlInteger(timestamp);
-        params["secret"] = SqlBlob(m_hdroot.begin(), m_hdroot.end());
-        if (!ExecuteSql(sql, params)) {
+            "VALUES((SELECT id FROM 'hdroot' WHERE secret=?1),0,FALSE,FALSE,0,0),"
+                  "((SELECT id FROM 'hdroot' WHERE secret=?1),0,FALSE,TRUE,0,0),"
+                  "((SELECT id FROM 'hdroot' WHERE secret=?1),0,TRUE,FALSE,0,0),"
+                  "((SELECT id FROM 'hdroot' WHERE secret=?1),0,TRUE,TRUE,0,0);";
+        if (!ExecuteSql(sql, SqlBlob(m_hdroot.begin(), m_hdroot.end()), SqlInteger(timestamp))) {
+            throw std::runtime_error("Unable to insert master secret into database.  See error log for details.");
+        }
+        if (restored) {
+            const std::string pending_sql =
+                "INSERT OR IGNORE INTO pendingrecovery ('timestamp','hdroot_id')"
+                "VALUES(?2,(SELECT id FROM 'hdroot' WHERE secret=?1));";
+            if (!ExecuteSql(pending_sql, SqlBlob(m_hdroot.begin(), m_hdroot.end()), SqlInteger(absl::ToUnixSeconds(absl::Now())))) {
+                throw std::runtime_error("Unable to insert master secret into database.  See error log for details.");
+            }
+        }
+        if (!tx.Commit()) {
             throw std::runtime_error("Unable to insert master secret into database.  See error log for details.");
         }
     }
@@ -280,18 +529,12 @@ void Wallet::GetOrCreateHDRoot()
             std::cout << "Loading master secret from wallet." << std::endl;
         }
         const std::string sql = "SELECT id,version,secret FROM 'hdroot' LIMIT 1;";
-        sqlite3_stmt* stmt;
-        int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_step(stmt);
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
         if (res != SQLITE_ROW) {
             std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
             std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         int hdroot_id = sqlite3_column_int(stmt, 0);
@@ -299,21 +542,18 @@ void Wallet::GetOrCreateHDRoot()
         if (version != 1) {
             std::string msg(absl::StrCat("Wallet contains HD root with unrecognized version(", to_string(version), "  Not sure what to do."));
             std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         size_t len = sqlite3_column_bytes(stmt, 2);
         if (len < 16 || 32 < len) {
             std::string msg(absl::StrCat("Expected between 16-32 bytes for HD root secret value.  Got ", to_string(len), " bytes.  Not sure what to do."));
             std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         const unsigned char* data = (const unsigned char*)sqlite3_column_blob(stmt, 2);
         if (!data) {
             std::string msg("Expected data pointer for HD root secret value.  Got NULL instead.  Not sure what to do.");
             std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         m_hdroot_id = hdroot_id;
@@ -321,7 +561,6 @@ void Wallet::GetOrCreateHDRoot()
         if (len < m_hdroot.size()) {
             std::fill(m_hdroot.begin() + len, m_hdroot.end(), 0);
         }
-        sqlite3_finalize(stmt);
     }
 
     else {
@@ -331,8 +570,83 @@ void Wallet::GetOrCreateHDRoot()
     }
 }
 
-Wallet::Wallet(const boost::filesystem::path& path)
+void Wallet::ConfigureDatabase(WalletStorage storage)
+{
+    using std::to_string;
+
+    if (storage != WalletStorage::WRITE_AHEAD_LOG) {
+        return;
+    }
+
+    // The journal mode is a persistent property of the database file.  The
+    // pragma returns the mode actually in effect afterwards, which won't be
+    // WAL if the underlying filesystem doesn't support it.
+    {
+        const std::string sql = "PRAGMA journal_mode=WAL;";
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
+        if (res != SQLITE_ROW) {
+            std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")"));
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+        const std::string mode((const char*)sqlite3_column_text(stmt, 0));
+        if (mode != "wal") {
+            // Stick with full synchronous writes for a rollback journal.
+            std::cerr << "WARNING: Unable to enable write-ahead logging for wallet database; using journal_mode=" << mode << " instead." << std::endl;
+            return;
+        }
+    }
+
+    // In WAL mode, synchronous=NORMAL only syncs the log at checkpoints
+    // rather than on every commit.  The database remains consistent, and
+    // secrets are protected by the recovery file rather than the database.
+    if (!ExecuteSql("PRAGMA synchronous=NORMAL;")) {
+        throw std::runtime_error("Unable to configure wallet database synchronization.  See error log for details.");
+    }
+
+    // Read the database through a memory map rather than read() calls.
+    {
+        const std::string sql = "PRAGMA mmap_size=268435456;"; // 256 MiB
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
+        if (res != SQLITE_ROW && res != SQLITE_DONE) {
+            std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")"));
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+    }
+}
+
+// Returns a hasher which has absorbed the tag prefix used for HD derivation.
+static CSHA256 GetHDKeyHasher()
+{
+    const std::string tag_str = "webcashwalletv1";
+    uint256 tag;
+    CSHA256()
+        .Write((const unsigned char*)tag_str.c_str(), tag_str.size())
+        .Finalize(tag.begin());
+    CSHA256 hasher;
+    hasher.Write(tag.begin(), 32);
+    hasher.Write(tag.begin(), 32);
+    return hasher;
+}
+
+Wallet::Wallet(const boost::filesystem::path& path, WalletStorage storage, absl::Duration recovery_window)
     : m_logfile(path)
+    , m_recovery_log(recovery_window)
+    , m_hdkey_hasher(GetHDKeyHasher())
+    , m_sweep_queued(false)
+    , m_sweep_running(false)
+    , m_next_sweep(absl::InfiniteFuture())
+    , m_unqueued_outputs(true)
+    , m_consolidate_max_unspent(0)
+    , m_consolidate_interval(absl::Minutes(1))
+    , m_next_consolidation(absl::InfinitePast())
+    , m_queue_running(0)
+    , m_shutdown(false)
 {
     // The caller can either give the path to one of the wallet files (the
     // recovery log or the sqlite3 database file), or to the shared basename of
@@ -355,40 +669,65 @@ Wallet::Wallet(const boost::filesystem::path& path)
         throw std::runtime_error(msg);
     }
 
-    int error = sqlite3_open_v2(dbfile.c_str(), &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_EXRESCODE, nullptr);
+    // The recovery file is kept open for as long as the wallet is.  It needs
+    // to be available before the master secret is generated, and creating it
+    // up front also allows the user to see the file even before any wallet
+    // operations have been performed.
+    if (!m_recovery_log.Open(m_logfile)) {
+        m_db_lock.unlock();
+        std::string msg(absl::StrCat("Unable to open/create wallet recovery file"));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+
+    // All access to the database connection is serialized by m_mut, so there
+    // is no need for sqlite3 to do its own locking as well.
+    int error = sqlite3_open_v2(dbfile.c_str(), &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_EXRESCODE, nullptr);
     if (error != SQLITE_OK) {
         m_db_lock.unlock();
         std::string msg(absl::StrCat("Unable to open/create wallet database file: ", sqlite3_errstr(error), " (", std::to_string(error), ")"));
         std::cerr << msg << std::endl;
         throw std::runtime_error(msg);
     }
+    ConfigureDatabase(storage);
     UpgradeDatabase();
     GetOrCreateHDRoot();
 
-    // Touch the wallet file, which will create it if it doesn't already exist.
-    // The file locking primitives assume that the file exists, so we need to
-    // create here first.  It also allows the user to see the file even before
-    // any wallet operations have been performed.
-    {
-        // This operation isn't protected by a filesystem lock, but that
-        // shouldn't be an issue because it doesn't do anything else the file
-        // didn't exist in the first place.
-        boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
-        if (!bak) {
-            sqlite3_close_v2(m_db); m_db = nullptr;
-            m_db_lock.unlock();
-            std::string msg(absl::StrCat("Unable to open/create wallet recovery file"));
-            std::cerr << msg << std::endl;
-            throw std::runtime_error(msg);
-        }
-        bak.flush();
-    }
+    // Start the writer and sweeper threads last, once the wallet is fully set
+    // up.
+    m_writer = std::thread(&Wallet::WriterThread, this);
+    m_sweeper = std::thread(&Wallet::SweeperThread, this);
+
+    // Finish any replacements left pending when the wallet was last closed.
+    RequestSweep();
 }
 
 Wallet::~Wallet()
 {
+    // Let the writer thread finish any queued commands, then shut it down.
+    // The sweeper thread waits for the writer, so that sweeps requested by
+    // the last insertions still run.
+    {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        m_shutdown = true;
+    }
+    m_queue_cv.notify_all();
+    if (m_writer.joinable()) {
+        m_writer.join();
+    }
+    if (m_sweeper.joinable()) {
+        m_sweeper.join();
+    }
     // Wait for other threads using the wallet to finish up.
     const std::lock_guard<std::mutex> lock(m_mut);
+    // Prepared statements must be finalized before the database is closed, or
+    // else sqlite3 will keep the connection open as a "zombie."
+    for (auto& item : m_stmt_cache) {
+        for (sqlite3_stmt* stmt : item.second) {
+            sqlite3_finalize(stmt);
+        }
+    }
+    m_stmt_cache.clear();
     // No errors are expected when closing the database file, but if there is
     // then that might be an indication of a serious bug or data loss the user
     // should know about.
@@ -439,213 +778,312 @@ static HashType get_hash_type(bool mine, bool sweep)
     return HashType::UNUSED;
 }
 
-WalletSecret Wallet::ReserveSecret(absl::Time _timestamp, bool mine, bool sweep)
+RecoveryLog::RecoveryLog(absl::Duration window)
+    : m_fd(-1)
+    , m_window(window)
+    , m_next_batch(1)
+    , m_synced_batch(0)
+    , m_failed_batch(0)
+    , m_writing(false)
 {
-    const int64_t chaincode = 0;
-
-    // Timestamps in the database are recorded as seconds since the UNIX epoch.
-    const int64_t timestamp = absl::ToUnixSeconds(_timestamp);
+}
 
-    int hdchain_id = -1;
-    int64_t depth = -1;
-    {
-        const std::string sql =
-            "SELECT id,maxdepth "
-              "FROM 'hdchain' "
-             "WHERE hdroot_id=:hdroot_id "
-               "AND chaincode=:chaincode "
-               "AND mine=:mine "
-               "AND sweep=:sweep "
-            "LIMIT 1;";
-        sqlite3_stmt* stmt;
-        int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":hdroot_id"), m_hdroot_id);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':hdroot_id' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", m_hdroot_id, ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":chaincode"), chaincode);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':hdroot_id' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", to_string(chaincode), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":mine"), !!mine);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':mine' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", (mine ? "TRUE" : "FALSE"), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":sweep"), !!sweep);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':sweep' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", (mine ? "TRUE" : "FALSE"), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_step(stmt);
-        if (res != SQLITE_ROW) {
-            std::string msg = absl::StrCat("Running SQL statement [\"", sqlite3_expanded_sql(stmt), "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")");
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        hdchain_id = sqlite3_column_int(stmt, 0);
-        if (hdchain_id < 0) {
-            std::string msg(absl::StrCat("Current HD chain id is negative.  Not sure what to do."));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        depth = sqlite3_column_int64(stmt, 1);
-        if (depth < 0) {
-            std::string msg(absl::StrCat("Current HD chain depth is negative.  Not sure what to do."));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        sqlite3_finalize(stmt);
-    }
+RecoveryLog::~RecoveryLog()
+{
+    Close();
+}
 
-    const std::string tag_str = "webcashwalletv1";
-    uint256 tag;
-    CSHA256()
-        .Write((const unsigned char*)tag_str.c_str(), tag_str.size())
-        .Finalize(tag.begin());
-    std::array<unsigned char, 8> chaincode_bytes = {
-        static_cast<unsigned char>((chaincode >> 54) & 0xff),
-        static_cast<unsigned char>((chaincode >> 46) & 0xff),
-        static_cast<unsigned char>((chaincode >> 38) & 0xff),
-        static_cast<unsigned char>((chaincode >> 30) & 0xff),
-        static_cast<unsigned char>((chaincode >> 22) & 0xff),
-        static_cast<unsigned char>((chaincode >> 14) & 0xff),
-        static_cast<unsigned char>((chaincode >> 6) & 0xff),
-        static_cast<unsigned char>((chaincode << 2) & 0xfc),
-    };
-    if (!mine && sweep) {
-        chaincode_bytes.back() |= 0;
-    } else
-    if (!mine && !sweep) {
-        chaincode_bytes.back() |= 1;
-    } else
-    if (mine && !sweep) {
-        chaincode_bytes.back() |= 2;
-    } else
-    if (mine && sweep) {
-        chaincode_bytes.back() |= 3;
+bool RecoveryLog::Open(const boost::filesystem::path& path)
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    if (m_fd >= 0) {
+        return true;
     }
-    std::array<unsigned char, 8> depth_bytes = {
-        static_cast<unsigned char>((depth >> 56) & 0xff),
-        static_cast<unsigned char>((depth >> 48) & 0xff),
-        static_cast<unsigned char>((depth >> 40) & 0xff),
-        static_cast<unsigned char>((depth >> 32) & 0xff),
-        static_cast<unsigned char>((depth >> 24) & 0xff),
-        static_cast<unsigned char>((depth >> 16) & 0xff),
-        static_cast<unsigned char>((depth >> 8) & 0xff),
-        static_cast<unsigned char>(depth & 0xff),
-    };
-    uint256 secret;
-    CSHA256()
-        .Write(tag.begin(), 32)
-        .Write(tag.begin(), 32)
-        .Write(m_hdroot.begin(), 32)
-        .Write(chaincode_bytes.data(), chaincode_bytes.size())
-        .Write(depth_bytes.data(), depth_bytes.size())
-        .Finalize(secret.begin());
-    SecureString sk(absl::BytesToHexString(absl::string_view((const char*)secret.begin(), secret.size())));
-    memory_cleanse(secret.begin(), secret.size());
-
-    int secret_id = -1;
-    {
-        const std::string sql =
-            "BEGIN TRANSACTION;"
-            ""
-            "INSERT OR IGNORE INTO secret ('timestamp','secret','mine','sweep')"
-            "VALUES(:timestamp,:secret,:mine,:sweep);"
-            "UPDATE secret SET mine = mine & :mine WHERE secret = :secret;"
-            "UPDATE secret SET sweep = sweep | :sweep WHERE secret = :secret;"
-            ""
-            "INSERT OR IGNORE INTO hdkey ('hdchain_id','depth','secret_id')"
-            "VALUES(:hdchain_id,:depth,(SELECT id FROM 'secret' WHERE secret = :secret));"
-            ""
-            "UPDATE 'hdchain' SET maxdepth = maxdepth + 1 "
-            "WHERE id = :hdchain_id;"
-            ""
-            "COMMIT;";
-        SqlParams params;
-        params["timestamp"] = SqlInteger(timestamp);
-        params["secret"] = SqlText(sk);
-        params["mine"] = SqlBool(mine);
-        params["sweep"] = SqlBool(sweep);
-        params["hdchain_id"] = SqlInteger(hdchain_id);
-        params["depth"] = SqlInteger(depth);
-        if (!ExecuteSql(sql, params)) {
-            throw std::runtime_error("Unable to insert secret into database.  See error log for details.");
-        }
+    do {
+        m_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    } while (m_fd < 0 && errno == EINTR);
+    if (m_fd < 0) {
+        std::cerr << "Unable to open wallet recovery file " << path << ": " << strerror(errno) << std::endl;
+        return false;
     }
-
-    WalletSecret wsecret;
-    wsecret.id = secret_id;
-    wsecret.timestamp = _timestamp;
-    wsecret.secret = sk;
-    wsecret.mine = mine;
-    wsecret.sweep = sweep;
-
-    return wsecret;
+    return true;
 }
 
-int Wallet::AddSecretToWallet(absl::Time _timestamp, const SecretWebcash &sk, bool mine, bool sweep)
+void RecoveryLog::Close()
 {
-    using std::to_string;
-    int result = true;
+    std::unique_lock<std::mutex> lock(m_mut);
+    m_cv.wait(lock, [this]() { return !m_writing; });
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
 
-    // Timestamps in the database are recorded as seconds since the UNIX epoch.
-    const int64_t timestamp = absl::ToUnixSeconds(_timestamp);
+// Writes the whole buffer and syncs the file's contents to disk.
+static bool WriteAndSync(int fd, const std::string& buffer)
+{
+    const char* data = buffer.data();
+    size_t len = buffer.size();
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing to wallet recovery file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+#if defined(__APPLE__)
+    // fsync() on macOS doesn't ask the drive to flush its cache.
+    if (fcntl(fd, F_FULLFSYNC) == 0) {
+        return true;
+    }
+#elif defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    if (fdatasync(fd) == 0) {
+        return true;
+    }
+#endif
+    if (fsync(fd) != 0) {
+        std::cerr << "Error syncing wallet recovery file to disk: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool RecoveryLog::Append(const std::vector<std::string>& lines)
+{
+    std::unique_lock<std::mutex> lock(m_mut);
+    if (m_fd < 0) {
+        return false;
+    }
+    for (const std::string& line : lines) {
+        m_buffer.append(line);
+        m_buffer.push_back('\n');
+    }
+    const uint64_t batch = m_next_batch;
+
+    while (m_synced_batch < batch) {
+        if (m_writing) {
+            // Someone else is writing an earlier batch.  Our lines go out
+            // with the next one, which might be written by us.
+            m_cv.wait(lock);
+            continue;
+        }
+
+        // Give other callers a chance to add their lines to this batch.
+        m_writing = true;
+        if (m_window > absl::ZeroDuration()) {
+            lock.unlock();
+            absl::SleepFor(m_window);
+            lock.lock();
+        }
+        std::string buffer;
+        buffer.swap(m_buffer);
+        const uint64_t writing = m_next_batch++;
+        lock.unlock();
+
+        bool ok = WriteAndSync(m_fd, buffer);
+        memory_cleanse(buffer.data(), buffer.size());
+
+        lock.lock();
+        m_synced_batch = writing;
+        if (!ok) {
+            m_failed_batch = writing;
+        }
+        m_writing = false;
+        m_cv.notify_all();
+    }
+
+    // If a later batch failed we can't tell whether ours did too, so assume
+    // the worst.
+    return m_failed_batch < batch;
+}
+
+void Wallet::GetHDChain(int64_t chaincode, bool mine, bool sweep, int& hdchain_id, int64_t& depth)
+{
+    using std::to_string;
+
+    hdchain_id = -1;
+    depth = -1;
+
+    const std::string sql =
+        "SELECT id,maxdepth "
+          "FROM 'hdchain' "
+         "WHERE hdroot_id=?1 "
+           "AND chaincode=?2 "
+           "AND mine=?3 "
+           "AND sweep=?4 "
+        "LIMIT 1;";
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    if (!BindParameters(stmt, SqlInteger(m_hdroot_id), SqlInteger(chaincode), SqlBool(mine), SqlBool(sweep))) {
+        throw std::runtime_error("Unable to bind SQL parameters.  See error log for details.");
+    }
+    int res = sqlite3_step(stmt);
+    if (res != SQLITE_ROW) {
+        std::string msg = absl::StrCat("Running SQL statement [\"", sqlite3_expanded_sql(stmt), "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")");
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    hdchain_id = sqlite3_column_int(stmt, 0);
+    if (hdchain_id < 0) {
+        std::string msg(absl::StrCat("Current HD chain id is negative.  Not sure what to do."));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    depth = sqlite3_column_int64(stmt, 1);
+    if (depth < 0) {
+        std::string msg(absl::StrCat("Current HD chain depth is negative.  Not sure what to do."));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+}
+
+void Wallet::DeriveSecrets(int64_t chaincode, bool mine, bool sweep, int64_t depth, size_t count, unsigned char* out) const
+{
+    std::array<unsigned char, 8> chaincode_bytes = {
+        static_cast<unsigned char>((chaincode >> 54) & 0xff),
+        static_cast<unsigned char>((chaincode >> 46) & 0xff),
+        static_cast<unsigned char>((chaincode >> 38) & 0xff),
+        static_cast<unsigned char>((chaincode >> 30) & 0xff),
+        static_cast<unsigned char>((chaincode >> 22) & 0xff),
+        static_cast<unsigned char>((chaincode >> 14) & 0xff),
+        static_cast<unsigned char>((chaincode >> 6) & 0xff),
+        static_cast<unsigned char>((chaincode << 2) & 0xfc),
+    };
+    if (!mine && sweep) {
+        chaincode_bytes.back() |= 0;
+    } else
+    if (!mine && !sweep) {
+        chaincode_bytes.back() |= 1;
+    } else
+    if (mine && !sweep) {
+        chaincode_bytes.back() |= 2;
+    } else
+    if (mine && sweep) {
+        chaincode_bytes.back() |= 3;
+    }
+
+    // Each secret is SHA256(tag || tag || hdroot || chaincode || depth).  The
+    // leading tags are already absorbed by m_hdkey_hasher, and what's left
+    // fits in a single block, so all the secrets can be derived together with
+    // the multi-way SHA256 kernels.
+    static const size_t k_tail_len = 32 + 8 + 8;
+    SecureBytes tails(count * k_tail_len);
+    for (size_t i = 0; i < count; ++i) {
+        const int64_t key_depth = depth + i;
+        unsigned char* tail = tails.data() + i * k_tail_len;
+        std::copy(m_hdroot.begin(), m_hdroot.end(), tail);
+        std::copy(chaincode_bytes.begin(), chaincode_bytes.end(), tail + 32);
+        for (int j = 0; j < 8; ++j) {
+            tail[40 + j] = static_cast<unsigned char>((key_depth >> (56 - 8*j)) & 0xff);
+        }
+    }
+    CSHA256(m_hdkey_hasher).WriteAndFinalizeMany(tails.data(), k_tail_len, count, out);
+}
+
+int Wallet::AddHDKeyToWallet(absl::Time timestamp, int hdchain_id, int64_t depth, const absl::string_view& secret, bool mine, bool sweep)
+{
+    int secret_id = AddSecretToWallet(timestamp, secret, mine, sweep);
+    if (!secret_id) {
+        return 0;
+    }
+
+    const std::string sql =
+        "INSERT OR IGNORE INTO hdkey ('hdchain_id','depth','secret_id')"
+        "VALUES(?1,?2,?3);";
+    if (!ExecuteSql(sql, SqlInteger(hdchain_id), SqlInteger(depth), SqlInteger(secret_id))) {
+        return 0;
+    }
+    return secret_id;
+}
+
+std::vector<WalletSecret> Wallet::ReserveSecrets(absl::Time _timestamp, bool mine, bool sweep, size_t count)
+{
+    // Until the chains have been scanned, the next keys might be ones the
+    // server has already seen.
+    if (RecoveryPending()) {
+        std::cerr << "Wallet recovery is pending; no new keys can be derived until Recover() succeeds." << std::endl;
+        throw std::runtime_error("Wallet recovery is pending.");
+    }
+
+    const int64_t chaincode = 0;
+
+    int hdchain_id;
+    int64_t depth;
+    GetHDChain(chaincode, mine, sweep, hdchain_id, depth);
+
+    SecureBytes secrets(count * CSHA256::OUTPUT_SIZE);
+    DeriveSecrets(chaincode, mine, sweep, depth, count, secrets.data());
+
+    std::vector<WalletSecret> ret;
+    ret.reserve(count);
+    Savepoint tx(*this, "reserve_secrets");
+    for (size_t i = 0; i < count; ++i) {
+        SecureString sk(2 * CSHA256::OUTPUT_SIZE, '\0');
+        HexEncode32(&sk[0], secrets.data() + i * CSHA256::OUTPUT_SIZE);
+
+        int secret_id = AddHDKeyToWallet(_timestamp, hdchain_id, depth + i, sk, mine, sweep);
+        if (!secret_id) {
+            throw std::runtime_error("Unable to insert HD key into database.  See error log for details.");
+        }
+
+        WalletSecret wsecret;
+        wsecret.id = secret_id;
+        wsecret.timestamp = _timestamp;
+        wsecret.secret = sk;
+        wsecret.mine = mine;
+        wsecret.sweep = sweep;
+        ret.push_back(std::move(wsecret));
+    }
 
-    // First write the key to the wallet recovery file.
     {
-        std::string line = absl::StrCat(to_string(timestamp), " ", to_string(get_hash_type(mine, sweep)), " ", to_string(sk));
-        boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
-        if (!bak) {
-            std::cerr << "WARNING: Unable to open/create wallet recovery file to save key prior to insertion: \"" << line << "\".  BACKUP THIS KEY NOW TO AVOID DATA LOSS!" << std::endl;
-            // We do not return 0 here even though there was an error writing to
-            // the recovery log, because we can still attempt to save the key to
-            // the wallet.
-            result = false;
-        } else {
-            bak << line << std::endl;
-            bak.flush();
+        const std::string sql =
+            "UPDATE 'hdchain' SET maxdepth = maxdepth + ?1 "
+            "WHERE id = ?2;";
+        if (!ExecuteSql(sql, SqlInteger(count), SqlInteger(hdchain_id)) || !tx.Commit()) {
+            throw std::runtime_error("Unable to update HD chain depth in database.  See error log for details.");
         }
     }
 
-    // Then attempt to write the key to the wallet database
+    return ret;
+}
+
+WalletSecret Wallet::ReserveSecret(absl::Time timestamp, bool mine, bool sweep)
+{
+    return std::move(ReserveSecrets(timestamp, mine, sweep, 1).front());
+}
+
+int Wallet::AddSecretToWallet(absl::Time _timestamp, const absl::string_view& secret, bool mine, bool sweep)
+{
+    using std::to_string;
+
+    // Timestamps in the database are recorded as seconds since the UNIX epoch.
+    const int64_t timestamp = absl::ToUnixSeconds(_timestamp);
+
+    // If the secret is already known to the wallet, it remains "ours" only if
+    // both records agree that it is, and is swept if either record says so.
     const std::string sql =
-        "BEGIN TRANSACTION;"
-        ""
-        "INSERT OR IGNORE INTO secret ('timestamp','secret','mine','sweep')"
-        "VALUES(:timestamp,:secret,:mine,:sweep);"
-        ""
-        "UPDATE secret SET mine = mine & :mine WHERE secret = :secret;"
-        "UPDATE secret SET sweep = sweep | :sweep WHERE secret = :secret;"
-        ""
-        "COMMIT;";
-    SqlParams params;
-    params["timestamp"] = SqlInteger(timestamp);
-    params["secret"] = SqlText(sk.sk);
-    params["mine"] = SqlBool(mine);
-    params["sweep"] = SqlBool(sweep);
-    result = ExecuteSql(sql, params) && result;
-
-    return result ? sqlite3_last_insert_rowid(m_db) : 0;
+        "INSERT INTO secret ('timestamp','secret','mine','sweep')"
+        "VALUES(?1,?2,?3,?4) "
+        "ON CONFLICT(secret) DO UPDATE "
+           "SET mine = mine & excluded.mine,"
+              "sweep = sweep | excluded.sweep "
+        "RETURNING id;";
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    if (!BindParameters(stmt, SqlInteger(timestamp), SqlText(secret), SqlBool(mine), SqlBool(sweep))) {
+        return 0;
+    }
+    int res = sqlite3_step(stmt);
+    if (res != SQLITE_ROW) {
+        std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
+        return 0;
+    }
+    return sqlite3_column_int(stmt, 0);
 }
 
 int Wallet::AddOutputToWallet(absl::Time _timestamp, const PublicWebcash& pk, int secret_id, bool spent)
@@ -655,28 +1093,95 @@ int Wallet::AddOutputToWallet(absl::Time _timestamp, const PublicWebcash& pk, in
     // Timestamps in the database are recorded as seconds since the UNIX epoch.
     const int64_t timestamp = absl::ToUnixSeconds(_timestamp);
 
-    // Attempt to write the output record to the database.
+    // Attempt to write the output record to the database.  If the output is
+    // already known, the existing record is kept (filling in its secret if it
+    // was missing) and its id returned.
     const std::string sql =
         "INSERT INTO output ('timestamp','hash','secret_id','amount','spent')"
-        "VALUES(:timestamp,:hash,:secret_id,:amount,:spent);";
-    SqlParams params;
-    params["timestamp"] = SqlInteger(timestamp);
-    params["hash"] = SqlBlob(pk.pk.begin(), pk.pk.end());
-    if (secret_id) {
-        params["secret_id"] = SqlInteger(secret_id);
-    } else {
-        params["secret_id"] = SqlNull();
+        "VALUES(?1,?2,NULLIF(?3,0),?4,?5) "
+        "ON CONFLICT(hash) DO UPDATE "
+           "SET secret_id = IFNULL(secret_id, excluded.secret_id) "
+        "RETURNING id;";
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    if (!BindParameters(stmt, SqlInteger(timestamp), SqlBlob(pk.pk.begin(), pk.pk.end()), SqlInteger(secret_id), SqlInteger(pk.amount.i64), SqlBool(spent))) {
+        return 0;
     }
-    params["amount"] = SqlInteger(pk.amount.i64);
-    params["spent"] = SqlBool(spent);
-    if (!ExecuteSql(sql, params)) {
+    int res = sqlite3_step(stmt);
+    if (res != SQLITE_ROW) {
+        std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
         return 0;
     }
+    return sqlite3_column_int(stmt, 0);
+}
+
+// The columns read by ReadWalletOutput(), for an output joined with its
+// secret.
+static const std::string k_output_columns =
+    "output.id,output.timestamp,output.hash,output.amount,output.spent,"
+    "secret.id,secret.timestamp,secret.secret,secret.mine,secret.sweep";
+
+// Reads a secret from five columns of a query result, starting at column col:
+// id, timestamp, secret, mine, and sweep.
+static void ReadWalletSecret(sqlite3_stmt* stmt, int col, WalletSecret& out)
+{
+    out.id = sqlite3_column_int(stmt, col + 0);
+    out.timestamp = absl::FromUnixSeconds(sqlite3_column_int64(stmt, col + 1));
+    out.secret = std::string((const char*)sqlite3_column_text(stmt, col + 2), sqlite3_column_bytes(stmt, col + 2));
+    out.mine = !!sqlite3_column_int(stmt, col + 3);
+    out.sweep = !!sqlite3_column_int(stmt, col + 4);
+}
+
+// Reads an output and its secret (if any) from the k_output_columns of a
+// query result, starting at column col.
+static bool ReadWalletOutput(sqlite3_stmt* stmt, int col, WalletOutput& out)
+{
+    out.id = sqlite3_column_int(stmt, col + 0);
+    out.timestamp = absl::FromUnixSeconds(sqlite3_column_int64(stmt, col + 1));
+    if (sqlite3_column_bytes(stmt, col + 2) != 32) {
+        std::cerr << "Unexpected hash length for output #" << out.id << " in wallet database." << std::endl;
+        return false;
+    }
+    const unsigned char* hash = (const unsigned char*)sqlite3_column_blob(stmt, col + 2);
+    std::copy(hash, hash + 32, out.hash.begin());
+    out.amount = sqlite3_column_int64(stmt, col + 3);
+    out.spent = !!sqlite3_column_int(stmt, col + 4);
+    out.secret.reset();
+    if (sqlite3_column_type(stmt, col + 5) != SQLITE_NULL) {
+        WalletSecret secret;
+        ReadWalletSecret(stmt, col + 5, secret);
+        out.secret = std::make_unique<WalletSecret>(std::move(secret));
+    }
+    return true;
+}
 
-    return sqlite3_last_insert_rowid(m_db);
+// Runs a query returning k_output_columns, appending each row to outputs.
+// Stops early once a callback returns false.
+template<typename... Params>
+static void QueryOutputs(sqlite3_stmt* stmt, std::vector<WalletOutput>& outputs, std::function<bool(const WalletOutput&)> more, const Params&... params)
+{
+    if (!BindParameters(stmt, params...)) {
+        throw std::runtime_error("Unable to bind SQL parameters.  See error log for details.");
+    }
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        WalletOutput output;
+        if (!ReadWalletOutput(stmt, 0, output)) {
+            continue;
+        }
+        outputs.push_back(std::move(output));
+        if (more && !more(outputs.back())) {
+            return;
+        }
+    }
+    if (res != SQLITE_DONE) {
+        std::string msg(absl::StrCat("Running SQL statement [\"", sqlite3_expanded_sql(stmt), "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
 }
 
-std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time timestamp, std::vector<WalletOutput>& inputs, const std::vector<std::pair<WalletSecret, Amount>>& outputs)
+Wallet::ReplaceResult Wallet::SubmitReplacement(const std::vector<WalletOutput>& inputs, const std::vector<std::pair<WalletSecret, Amount>>& outputs)
 {
     using std::to_string;
 
@@ -684,19 +1189,19 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     UniValue in(UniValue::VARR);
     if (inputs.empty()) {
         std::cerr << "No inputs provided for replacement." << std::endl;
-        return {};
+        return ReplaceResult::REJECTED;
     }
     for (const WalletOutput& webcash : inputs) {
         if (!webcash.secret) {
             std::cerr << "Unable to replace output without corresponding secret: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
-            return {};
+            return ReplaceResult::REJECTED;
         }
         if (webcash.amount.i64 < 1) {
             std::cerr << "Invalid amount for replacement intput: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
         }
         if (webcash.spent) {
             std::cerr << "Replacement intput already spent: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
-            return {};
+            return ReplaceResult::REJECTED;
         }
         in.push_back(std::string(to_string(SecretWebcash(webcash.secret->secret, webcash.amount)).c_str()));
         total_in += webcash.amount;
@@ -706,12 +1211,12 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     UniValue out(UniValue::VARR);
     if (outputs.empty()) {
         std::cerr << "No outputs provided for replacement." << std::endl;
-        return {};
+        return ReplaceResult::REJECTED;
     }
     for (const std::pair<WalletSecret, Amount>& webcash : outputs) {
         if (webcash.second.i64 < 1) {
             std::cerr << "Invalid amount for replacement output: " << to_string(PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second))) << std::endl;
-            return {};
+            return ReplaceResult::REJECTED;
         }
         out.push_back(std::string(to_string(SecretWebcash(webcash.first.secret, webcash.second)).c_str()));
         total_out += webcash.second;
@@ -719,7 +1224,7 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
 
     if (total_in != total_out) {
         std::cerr << "Invalid replacement: sum(inputs) != sum(outputs) [" << to_string(total_in) << " != " << to_string(total_out) << "]" << std::endl;
-        return {};
+        return ReplaceResult::REJECTED;
     }
 
     // Acceptance of terms of service is hard-coded here because it is checked
@@ -742,182 +1247,1122 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
         replace.write(),
         "application/json");
 
-    // Handle network errors by aborting further processing
+    // Network errors leave us not knowing whether the replacement went
+    // through, so the caller will have to try again later.
     if (!r) {
         std::cerr << "Error: returned invalid response to Replace request: " << r.error() << std::endl;
-        std::cerr << "Possible transient error, or server timeout?  Cannot proceed." << std::endl;
-        return {};
+        std::cerr << "Possible transient error, or server timeout?  Will try again later." << std::endl;
+        return ReplaceResult::NETWORK_ERROR;
     }
 
-    // Parse response.
-    UniValue o;
-    o.read(r->body);
-
     // Report server rejection to the user.
     if (r->status != 200) {
         std::cerr << "Error: returned invalid response to Replace request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
-        return {};
+        return ReplaceResult::REJECTED;
     }
 
-    // Mark each input as spent in the database.
-    {
-        for (WalletOutput& webcash : inputs) {
-            // Update the object.
-            webcash.spent = true;
-            // Update the database.
-            const std::string sql =
-                "UPDATE 'output' SET spent=TRUE WHERE id=:output_id;";
-            SqlParams params;
-            params["output_id"] = SqlInteger(webcash.id);
-            if (!ExecuteSql(sql, params)) {
-                std::cerr << "Unable to mark output as spent.  See error log for details." << std::endl;
+    return ReplaceResult::ACCEPTED;
+}
+
+// What the server knows about an output, as reported by its health check API.
+enum class OutputState {
+    UNKNOWN, // never created
+    UNSPENT,
+    SPENT,
+};
+
+// Looks up the state of each output on the server, and optionally the amount
+// of each unspent output (zero otherwise).  Returns false if the server
+// couldn't be reached or gave an unexpected response.
+static bool CheckOutputs(httplib::Client& cli, const std::vector<PublicWebcash>& pks, std::vector<OutputState>& states, std::vector<Amount>* amounts = nullptr)
+{
+    using std::to_string;
+
+    std::vector<std::string> keys;
+    keys.reserve(pks.size());
+    UniValue query(UniValue::VARR);
+    for (const PublicWebcash& pk : pks) {
+        keys.push_back(to_string(pk));
+        query.push_back(keys.back());
+    }
+
+    auto r = cli.Post(
+        "/api/v1/health_check",
+        query.write(),
+        "application/json");
+    if (!r) {
+        std::cerr << "Error: returned invalid response to HealthCheck request: " << r.error() << std::endl;
+        return false;
+    }
+    if (r->status != 200) {
+        std::cerr << "Error: returned invalid response to HealthCheck request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
+        return false;
+    }
+
+    UniValue o;
+    o.read(r->body);
+    const UniValue& results = o["results"];
+    if (!results.isObject()) {
+        std::cerr << "Error: HealthCheck response is missing results: text='" << r->body << "'" << std::endl;
+        return false;
+    }
+
+    states.clear();
+    states.reserve(keys.size());
+    if (amounts) {
+        amounts->clear();
+        amounts->reserve(keys.size());
+    }
+    for (const std::string& key : keys) {
+        const UniValue& result = results[key];
+        const UniValue& spent = result["spent"];
+        if (spent.isBool()) {
+            states.push_back(spent.get_bool() ? OutputState::SPENT : OutputState::UNSPENT);
+        } else {
+            states.push_back(OutputState::UNKNOWN);
+        }
+        if (amounts) {
+            Amount amount;
+            const UniValue& value = result["amount"];
+            if (states.back() == OutputState::UNSPENT && !(value.isStr() && amount.parse(value.get_str()))) {
+                std::cerr << "Error: HealthCheck response has invalid amount for " << key << ": text='" << r->body << "'" << std::endl;
+                return false;
+            }
+            amounts->push_back(amount);
+        }
+    }
+    return true;
+}
+
+static bool CheckOutputs(const std::vector<PublicWebcash>& pks, std::vector<OutputState>& states)
+{
+    const std::string server = absl::GetFlag(FLAGS_server);
+    httplib::Client cli(server);
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    return CheckOutputs(cli, pks, states);
+}
+
+// The number of keys looked up with each health_check request on recovery.
+static const size_t k_recover_batch_size = 250;
+
+bool Wallet::ScanHDChain(int64_t chaincode, bool mine, bool sweep, size_t gap_limit, HDChainScan& scan) const
+{
+    scan.mine = mine;
+    scan.sweep = sweep;
+    scan.depth = 0;
+    scan.keys.clear();
+
+    // A single keep-alive connection is used for the whole chain.
+    const std::string server = absl::GetFlag(FLAGS_server);
+    httplib::Client cli(server);
+    cli.set_keep_alive(true);
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+
+    SecureBytes secrets(k_recover_batch_size * CSHA256::OUTPUT_SIZE);
+    std::vector<unsigned char> hashes(k_recover_batch_size * CSHA256::OUTPUT_SIZE);
+    std::vector<SecureString> sks;
+    std::vector<PublicWebcash> pks;
+    std::vector<OutputState> states;
+    std::vector<Amount> amounts;
+    bool ok = true;
+    for (int64_t depth = 0; static_cast<size_t>(depth - scan.depth) < gap_limit; depth += k_recover_batch_size) {
+        DeriveSecrets(chaincode, mine, sweep, depth, k_recover_batch_size, secrets.data());
+        sks.clear();
+        pks.clear();
+        for (size_t i = 0; i < k_recover_batch_size; ++i) {
+            sks.emplace_back(2 * CSHA256::OUTPUT_SIZE, '\0');
+            HexEncode32(&sks.back()[0], secrets.data() + i * CSHA256::OUTPUT_SIZE);
+        }
+        std::vector<absl::string_view> views(sks.begin(), sks.end());
+        SHA256Many(hashes.data(), views);
+        for (size_t i = 0; i < k_recover_batch_size; ++i) {
+            // The server looks outputs up by hash alone, so the amount
+            // doesn't matter.
+            pks.emplace_back(uint256(), Amount(0));
+            std::copy(hashes.begin() + i * CSHA256::OUTPUT_SIZE, hashes.begin() + (i + 1) * CSHA256::OUTPUT_SIZE, pks.back().pk.begin());
+        }
+        if (!CheckOutputs(cli, pks, states, &amounts)) {
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < k_recover_batch_size; ++i) {
+            if (states[i] == OutputState::UNKNOWN) {
                 continue;
             }
+            RecoveredKey key;
+            key.depth = depth + i;
+            key.secret = sks[i];
+            key.spent = (states[i] == OutputState::SPENT);
+            key.amount = amounts[i];
+            scan.keys.push_back(std::move(key));
+            scan.depth = depth + i + 1;
         }
     }
+    return ok;
+}
 
-    // Create record for each output.
-    std::vector<std::pair<WalletSecret, int>> ret;
-    for (const std::pair<WalletSecret, Amount>& webcash : outputs) {
-        // Create database record.
-        int id = AddOutputToWallet(timestamp, PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second)), webcash.first.id, false);
-        if (!id) {
-            std::cerr << "Error creating database record for replacement output: " << to_string(PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second))) << std::endl;
+bool Wallet::ScanHDChains(size_t gap_limit, std::vector<HDChainScan>& scans) const
+{
+    static const std::array<std::pair<bool, bool>, 4> chains = {{
+        {false, false}, {false, true}, {true, false}, {true, true},
+    }};
+    scans.resize(chains.size());
+    std::vector<std::future<bool>> results;
+    for (size_t i = 0; i < chains.size(); ++i) {
+        results.push_back(std::async(std::launch::async, &Wallet::ScanHDChain, this, 0, chains[i].first, chains[i].second, gap_limit, std::ref(scans[i])));
+    }
+    bool ok = true;
+    for (auto& result : results) {
+        ok = result.get() && ok;
+    }
+    return ok;
+}
+
+bool Wallet::RecordRecovery(const std::vector<HDChainScan>& scans)
+{
+    const absl::Time timestamp = absl::Now();
+    for (const HDChainScan& scan : scans) {
+        int hdchain_id;
+        int64_t depth;
+        GetHDChain(0, scan.mine, scan.sweep, hdchain_id, depth);
+        for (const RecoveredKey& key : scan.keys) {
+            int secret_id = AddHDKeyToWallet(timestamp, hdchain_id, key.depth, key.secret, scan.mine, scan.sweep);
+            if (!secret_id) {
+                return false;
+            }
+            PublicWebcash pk(SecretWebcash(std::string(key.secret), key.amount));
+            if (!key.spent && !AddOutputToWallet(timestamp, pk, secret_id, false)) {
+                return false;
+            }
+            // The output might already be known to the wallet, in which case
+            // the server has the final say on whether it is spent.
+            const std::string sql = "UPDATE 'output' SET spent=?1 WHERE hash=?2;";
+            if (!ExecuteSql(sql, SqlBool(key.spent), SqlBlob(pk.pk.begin(), pk.pk.end()))) {
+                return false;
+            }
+        }
+        // Never hand out a key the server has already seen.
+        const std::string sql = "UPDATE 'hdchain' SET maxdepth=MAX(maxdepth,?1) WHERE id=?2;";
+        if (!ExecuteSql(sql, SqlInteger(scan.depth), SqlInteger(hdchain_id))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Wallet::Recover(size_t gap_limit)
+{
+    std::cout << "Scanning server for wallet outputs." << std::endl;
+    std::vector<HDChainScan> scans;
+    if (!ScanHDChains(gap_limit, scans)) {
+        std::cerr << "Error: Unable to scan server for wallet outputs." << std::endl;
+        return false;
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        Savepoint tx(*this, "recover");
+        const std::string sql = "DELETE FROM 'pendingrecovery' WHERE hdroot_id=?1;";
+        if (!RecordRecovery(scans) || !ExecuteSql(sql, SqlInteger(m_hdroot_id)) || !tx.Commit()) {
+            std::cerr << "Error: Unable to save recovered wallet outputs.  See error log for details." << std::endl;
+            return false;
+        }
+    }
+
+    size_t used = 0;
+    size_t unspent = 0;
+    Amount amount;
+    for (const HDChainScan& scan : scans) {
+        used += scan.keys.size();
+        for (const RecoveredKey& key : scan.keys) {
+            if (!key.spent) {
+                ++unspent;
+                amount = amount + key.amount;
+            }
+        }
+    }
+    std::cout << "Recovered " << used << " used keys, with " << unspent << " unspent outputs worth " << to_string(amount) << " webcash." << std::endl;
+    return true;
+}
+
+bool Wallet::QueueUnsweptOutputs()
+{
+    using std::to_string;
+
+    {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        if (!m_unqueued_outputs) {
+            return true;
+        }
+        m_unqueued_outputs = false;
+    }
+
+    // Inserted secrets are the only ones to be swept which aren't HD keys, so
+    // any unspent output of theirs which isn't already on its way out has yet
+    // to be queued.
+    const std::string sql = absl::StrCat(
+        "SELECT ", k_output_columns, " "
+          "FROM 'output' "
+          "JOIN 'secret' ON secret.id=output.secret_id "
+         "WHERE output.spent=FALSE "
+           "AND secret.sweep=TRUE "
+           "AND NOT EXISTS(SELECT 1 FROM 'hdkey' WHERE secret_id=secret.id) "
+           "AND NOT EXISTS(SELECT 1 FROM 'sweepqueue' WHERE output_id=output.id) "
+           "AND NOT EXISTS(SELECT 1 FROM 'consolidationinput' WHERE output_id=output.id) "
+         "ORDER BY output.id "
+         "LIMIT ?1;");
+    bool ok = true;
+    while (ok) {
+        std::vector<WalletOutput> unqueued;
+        {
+            const std::lock_guard<std::mutex> lock(m_mut);
+            sqlite3_stmt* stmt = GetCachedStatement(sql);
+            const StatementReset reset(stmt);
+            try {
+                QueryOutputs(stmt, unqueued, nullptr, SqlInteger(k_max_replace_size));
+            } catch (const std::runtime_error& e) {
+                ok = false;
+                break;
+            }
+        }
+        if (unqueued.empty()) {
+            break;
+        }
+
+        // The secrets have to be recoverable before they are replaced.
+        std::vector<std::string> lines;
+        lines.reserve(unqueued.size());
+        for (const WalletOutput& output : unqueued) {
+            const SecretWebcash sk(output.secret->secret, output.amount);
+            lines.push_back(absl::StrCat(to_string(absl::ToUnixSeconds(output.timestamp)), " ", to_string(get_hash_type(output.secret->mine, true)), " ", to_string(sk)));
+        }
+        if (!m_recovery_log.Append(lines)) {
+            std::cerr << "WARNING: Still unable to write inserted keys to wallet recovery file.  Will try again later." << std::endl;
+            ok = false;
+            break;
+        }
+
+        const absl::Time now = absl::Now();
+        const std::lock_guard<std::mutex> lock(m_mut);
+        Savepoint tx(*this, "queue_unswept");
+        // Same chain as the change for inserted secrets; see the FIXME in
+        // InsertMany().
+        std::vector<WalletSecret> change;
+        try {
+            change = ReserveSecrets(now, /* mine = */ true, /* sweep = */ true, unqueued.size());
+        } catch (const std::runtime_error& e) {
+            ok = false;
+        }
+        for (size_t i = 0; ok && i < unqueued.size(); ++i) {
+            const std::string sql =
+                "INSERT OR IGNORE INTO sweepqueue ('timestamp','output_id','change_secret_id')"
+                "VALUES(?1,?2,?3);";
+            ok = ExecuteSql(sql, SqlInteger(absl::ToUnixSeconds(now)), SqlInteger(unqueued[i].id), SqlInteger(change[i].id));
+        }
+        if (!ok || !tx.Commit()) {
+            std::cerr << "Error queueing inserted outputs for replacement; will try again later.  See error log for details." << std::endl;
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        m_unqueued_outputs = true;
+    }
+    return ok;
+}
+
+bool Wallet::LoadSweepBatch(std::vector<int>& pending_ids, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs)
+{
+    using std::to_string;
+
+    pending_ids.clear();
+    inputs.clear();
+    outputs.clear();
+
+    const std::string sql = absl::StrCat(
+        "SELECT sweepqueue.id,", k_output_columns, ","
+               "change.id,change.timestamp,change.secret,change.mine,change.sweep "
+          "FROM 'sweepqueue' "
+          "JOIN 'output' ON output.id=sweepqueue.output_id "
+          "JOIN 'secret' ON secret.id=output.secret_id "
+          "JOIN 'secret' AS change ON change.id=sweepqueue.change_secret_id "
+         "ORDER BY sweepqueue.id "
+         "LIMIT ?1;");
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    if (!BindParameters(stmt, SqlInteger(k_max_replace_size))) {
+        return false;
+    }
+
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        WalletOutput input;
+        if (!ReadWalletOutput(stmt, 1, input)) {
             continue;
         }
 
-        // Save the database id for caller.
-        ret.push_back(std::make_pair(webcash.first, id));
+        WalletSecret change;
+        ReadWalletSecret(stmt, 11, change);
+
+        pending_ids.push_back(sqlite3_column_int(stmt, 0));
+        outputs.emplace_back(std::move(change), input.amount);
+        inputs.push_back(std::move(input));
     }
+    if (res != SQLITE_DONE) {
+        std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    return ret;
+// How long to wait before trying again when pending replacements can't be
+// completed, e.g. because the server is unreachable.
+static const absl::Duration k_sweep_retry_interval = absl::Seconds(30);
+
+bool Wallet::SweepPending()
+{
+    using std::to_string;
+
+    enum class Outcome { PENDING, REPLACED, LOST };
+
+    while (true) {
+        std::vector<int> pending_ids;
+        std::vector<WalletOutput> inputs;
+        std::vector<std::pair<WalletSecret, Amount>> outputs;
+        {
+            const std::lock_guard<std::mutex> lock(m_mut);
+            if (!LoadSweepBatch(pending_ids, inputs, outputs)) {
+                break;
+            }
+        }
+        if (pending_ids.empty()) {
+            return true;
+        }
+
+        // Talk to the server without holding the wallet lock.
+        const ReplaceResult result = SubmitReplacement(inputs, outputs);
+        std::vector<Outcome> outcomes(pending_ids.size(), result == ReplaceResult::ACCEPTED ? Outcome::REPLACED : Outcome::PENDING);
+
+        // A rejected replacement might have already gone through on an
+        // earlier attempt (e.g. if we crashed before recording it), or some of
+        // the inputs might have been spent by someone else who knows the
+        // secret.  Ask the server which it is.
+        if (result == ReplaceResult::REJECTED) {
+            std::vector<PublicWebcash> pks;
+            pks.reserve(inputs.size() + outputs.size());
+            for (const WalletOutput& input : inputs) {
+                pks.emplace_back(input.hash, input.amount);
+            }
+            for (const std::pair<WalletSecret, Amount>& output : outputs) {
+                pks.emplace_back(SecretWebcash(output.first.secret, output.second));
+            }
+            std::vector<OutputState> states;
+            if (CheckOutputs(pks, states)) {
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    if (states[inputs.size() + i] != OutputState::UNKNOWN) {
+                        outcomes[i] = Outcome::REPLACED;
+                    } else if (states[i] != OutputState::UNSPENT) {
+                        outcomes[i] = Outcome::LOST;
+                    }
+                }
+            }
+        }
+
+        // Record the outcome in a single transaction.
+        size_t settled = 0;
+        {
+            const std::lock_guard<std::mutex> lock(m_mut);
+            const absl::Time now = absl::Now();
+            Savepoint tx(*this, "sweep");
+            bool ok = true;
+            for (size_t i = 0; ok && i < pending_ids.size(); ++i) {
+                if (outcomes[i] == Outcome::PENDING) {
+                    continue;
+                }
+                const PublicWebcash pk(inputs[i].hash, inputs[i].amount);
+                if (outcomes[i] == Outcome::LOST) {
+                    std::cerr << "WARNING: Unable to replace " << to_string(pk) << " because it was already spent or never existed.  Removing it from the wallet." << std::endl;
+                }
+                {
+                    const std::string sql =
+                        "UPDATE 'output' SET spent=TRUE WHERE id=?1;"
+                        "DELETE FROM 'sweepqueue' WHERE id=?2;";
+                    ok = ExecuteSql(sql, SqlInteger(inputs[i].id), SqlInteger(pending_ids[i]));
+                }
+                if (ok && outcomes[i] == Outcome::REPLACED) {
+                    const PublicWebcash change(SecretWebcash(outputs[i].first.secret, outputs[i].second));
+                    ok = !!AddOutputToWallet(now, change, outputs[i].first.id, false);
+                }
+                ++settled;
+            }
+            if (!ok || !tx.Commit()) {
+                std::cerr << "Error recording replacement in wallet database; will try again later.  See error log for details." << std::endl;
+                break;
+            }
+        }
+
+        // Nothing could be resolved this time around, so back off rather than
+        // hammering the server with the same request.
+        if (!settled) {
+            break;
+        }
+    }
+
+    return false;
 }
 
-bool Wallet::Insert(const SecretWebcash& sk, bool mine)
+bool Wallet::LoadConsolidation(int& consolidation_id, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs)
 {
     using std::to_string;
-    const std::lock_guard<std::mutex> lock(m_mut);
 
-    // The database records the timestamp of an insertion
-    const absl::Time now = absl::Now();
+    consolidation_id = 0;
+    inputs.clear();
+    outputs.clear();
 
-    // Insert secret into the wallet db.
-    int secret_id = AddSecretToWallet(now, sk, mine, true);
-    if (!secret_id) {
-        std::cerr << "Error adding secret to wallet; unable to proceed with insertion." << std::endl;
+    WalletSecret change;
+    {
+        const std::string sql =
+            "SELECT consolidation.id,"
+                   "change.id,change.timestamp,change.secret,change.mine,change.sweep "
+              "FROM 'consolidation' "
+              "JOIN 'secret' AS change ON change.id=consolidation.change_secret_id "
+             "ORDER BY consolidation.id "
+             "LIMIT 1;";
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
+        if (res == SQLITE_DONE) {
+            return true;
+        }
+        if (res != SQLITE_ROW) {
+            std::cerr << "Running SQL statement [\"" << sql << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
+            return false;
+        }
+        consolidation_id = sqlite3_column_int(stmt, 0);
+        ReadWalletSecret(stmt, 1, change);
+    }
+
+    const std::string sql = absl::StrCat(
+        "SELECT ", k_output_columns, " "
+          "FROM 'consolidationinput' "
+          "JOIN 'output' ON output.id=consolidationinput.output_id "
+          "JOIN 'secret' ON secret.id=output.secret_id "
+         "WHERE consolidationinput.consolidation_id=?1 "
+         "ORDER BY output.id;");
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    try {
+        QueryOutputs(stmt, inputs, nullptr, SqlInteger(consolidation_id));
+    } catch (const std::runtime_error& e) {
         return false;
     }
 
-    WalletSecret wsecret;
-    wsecret.id = secret_id;
-    wsecret.timestamp = now;
-    wsecret.secret = sk.sk;
-    wsecret.mine = mine;
-    wsecret.sweep = true;
+    Amount total = 0;
+    for (const WalletOutput& input : inputs) {
+        total += input.amount;
+    }
+    outputs.emplace_back(std::move(change), total);
+    return true;
+}
+
+bool Wallet::StartConsolidation(size_t max_unspent, int& consolidation_id, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs)
+{
+    using std::to_string;
+
+    consolidation_id = 0;
+    inputs.clear();
+    outputs.clear();
+
+    size_t unspent = 0;
+    {
+        const std::string sql = "SELECT count FROM 'balance' WHERE id=1;";
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        int res = sqlite3_step(stmt);
+        if (res != SQLITE_ROW) {
+            std::cerr << "Running SQL statement [\"" << sql << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
+            return false;
+        }
+        unspent = sqlite3_column_int64(stmt, 0);
+    }
+    if (unspent <= max_unspent) {
+        return true;
+    }
+
+    // Merging n outputs into one reduces the count by n-1, so don't take
+    // more than are needed to get back under the limit.
+    const size_t limit = std::min(k_max_replace_size, unspent - max_unspent + 1);
+    const std::string sql = absl::StrCat(
+        "SELECT ", k_output_columns, " "
+          "FROM 'output' "
+          "JOIN 'secret' ON secret.id=output.secret_id "
+         "WHERE output.spent=FALSE "
+           "AND NOT EXISTS(SELECT 1 FROM 'sweepqueue' WHERE output_id=output.id) "
+           "AND NOT EXISTS(SELECT 1 FROM 'consolidationinput' WHERE output_id=output.id) "
+         "ORDER BY output.amount,output.id "
+         "LIMIT ?1;");
+    {
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        try {
+            QueryOutputs(stmt, inputs, nullptr, SqlInteger(limit));
+        } catch (const std::runtime_error& e) {
+            inputs.clear();
+            return false;
+        }
+    }
+    if (inputs.size() < 2) {
+        inputs.clear();
+        return true;
+    }
+
+    Amount total = 0;
+    for (const WalletOutput& input : inputs) {
+        total += input.amount;
+    }
 
-    // Insert output record into the wallet db.
-    PublicWebcash pk(sk);
-    int output_id = AddOutputToWallet(now, pk, secret_id, false);
-    if (!output_id) {
-        std::cerr << "Error adding output to wallet; unable to proceed with insertion." << std::endl;
+    // Record the consolidation before making any request, so that it can be
+    // resumed if interrupted.
+    const absl::Time now = absl::Now();
+    Savepoint tx(*this, "start_consolidation");
+    // Same chain as the change for inserted secrets; see the FIXME in
+    // InsertMany().
+    WalletSecret change = ReserveSecret(now, /* mine = */ true, /* sweep = */ true);
+    {
+        const std::string sql =
+            "INSERT INTO consolidation ('timestamp','change_secret_id')"
+            "VALUES(?1,?2);";
+        if (!ExecuteSql(sql, SqlInteger(absl::ToUnixSeconds(now)), SqlInteger(change.id))) {
+            inputs.clear();
+            return false;
+        }
+        consolidation_id = sqlite3_last_insert_rowid(m_db);
+    }
+    for (const WalletOutput& input : inputs) {
+        const std::string sql =
+            "INSERT INTO consolidationinput ('consolidation_id','output_id')"
+            "VALUES(?1,?2);";
+        if (!ExecuteSql(sql, SqlInteger(consolidation_id), SqlInteger(input.id))) {
+            consolidation_id = 0;
+            inputs.clear();
+            return false;
+        }
+    }
+    if (!tx.Commit()) {
+        consolidation_id = 0;
+        inputs.clear();
         return false;
     }
 
-    WalletOutput woutput;
-    woutput.id = output_id;
-    woutput.timestamp = now;
-    woutput.hash = pk.pk;
-    woutput.secret = std::make_unique<WalletSecret>(wsecret);
-    woutput.amount = pk.amount;
-    woutput.spent = false;
-
-    // Generate change address.
-    // FIXME: This is breaking with webcash wallet standards; sweep shoud really
-    //        be false here.  The reason we do it this way is a bit of a
-    //        hack/workaround. Until webminer has full wallet support, it is
-    //        easiest for users to import their root key into webcasa and use
-    //        that as their wallet.  However any payments made in webcasa will
-    //        use change addresses, which could potentially result in webminer
-    //        insertions failing due to secret reuse.
-    //
-    //        The workaround is to use HashType::MINING for change addresses
-    //        when replacing secrets.  This is not what the HashType::MINING
-    //        chain code is meant to be used for.  It is meant to be the way in
-    //        which mining payload secrets are generated, hence why sweep=true.
-    //        However webminer currently uses random secrets for the mining
-    //        payload, and until a proper wallet is implemented this at least
-    //        achieves domain separation from webminer and webcasa.
-    //
-    //                                                         should be false <==>
-    WalletSecret wchange = ReserveSecret(now, /* mine = */ true, /* sweep = */ true);
-    SecretWebcash change(wchange.secret, sk.amount);
+    outputs.emplace_back(std::move(change), total);
+    return true;
+}
+
+void Wallet::ConsolidateOutputs(size_t max_unspent)
+{
+    using std::to_string;
 
+    // Finish an interrupted consolidation before starting a new one.
+    int consolidation_id = 0;
     std::vector<WalletOutput> inputs;
-    inputs.emplace_back(std::move(woutput));
-
     std::vector<std::pair<WalletSecret, Amount>> outputs;
-    outputs.emplace_back(wchange, change.amount);
+    {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        if (!LoadConsolidation(consolidation_id, inputs, outputs)) {
+            return;
+        }
+        if (!consolidation_id && !StartConsolidation(max_unspent, consolidation_id, inputs, outputs)) {
+            std::cerr << "Error selecting outputs to consolidate.  See error log for details." << std::endl;
+            return;
+        }
+    }
+    if (!consolidation_id) {
+        return;
+    }
+
+    // Talk to the server without holding the wallet lock.
+    const ReplaceResult result = inputs.empty() ? ReplaceResult::REJECTED : SubmitReplacement(inputs, outputs);
+    bool replaced = result == ReplaceResult::ACCEPTED;
+    bool abandon = false;
+    std::vector<OutputState> states;
+
+    // As with sweeps, a rejection might mean we already did this (and
+    // crashed before recording it), or that some of the inputs are gone.
+    if (result == ReplaceResult::REJECTED) {
+        std::vector<PublicWebcash> pks;
+        pks.reserve(inputs.size() + 1);
+        for (const WalletOutput& input : inputs) {
+            pks.emplace_back(input.hash, input.amount);
+        }
+        pks.emplace_back(SecretWebcash(outputs.front().first.secret, outputs.front().second));
+        if (CheckOutputs(pks, states)) {
+            if (states.back() != OutputState::UNKNOWN) {
+                replaced = true;
+            } else {
+                abandon = inputs.empty() || std::any_of(states.begin(), states.end() - 1, [](OutputState state) { return state != OutputState::UNSPENT; });
+            }
+        }
+    }
+    if (!replaced && !abandon) {
+        return;
+    }
+
+    // Record the outcome in a single transaction.
+    const std::lock_guard<std::mutex> lock(m_mut);
+    Savepoint tx(*this, "consolidate");
+    bool ok = true;
+    for (size_t i = 0; ok && i < inputs.size(); ++i) {
+        // An abandoned consolidation frees up its inputs, except for any which
+        // were spent elsewhere.
+        if (!replaced && states[i] == OutputState::UNSPENT) {
+            continue;
+        }
+        if (!replaced) {
+            std::cerr << "WARNING: Unable to consolidate " << to_string(PublicWebcash(inputs[i].hash, inputs[i].amount)) << " because it was already spent or never existed.  Removing it from the wallet." << std::endl;
+        }
+        const std::string sql = "UPDATE 'output' SET spent=TRUE WHERE id=?1;";
+        ok = ExecuteSql(sql, SqlInteger(inputs[i].id));
+    }
+    if (ok && replaced) {
+        const PublicWebcash change(SecretWebcash(outputs.front().first.secret, outputs.front().second));
+        ok = !!AddOutputToWallet(absl::Now(), change, outputs.front().first.id, false);
+    }
+    if (ok) {
+        const std::string sql =
+            "DELETE FROM 'consolidationinput' WHERE consolidation_id=?1;"
+            "DELETE FROM 'consolidation' WHERE id=?1;";
+        ok = ExecuteSql(sql, SqlInteger(consolidation_id));
+    }
+    if (!ok || !tx.Commit()) {
+        std::cerr << "Error recording consolidation in wallet database; will try again later.  See error log for details." << std::endl;
+    }
+}
+
+void Wallet::RunSweep()
+{
+    absl::Time next = absl::InfiniteFuture();
+    const bool queued = QueueUnsweptOutputs();
+    if (!SweepPending() || !queued) {
+        next = absl::Now() + k_sweep_retry_interval;
+    } else {
+        // Consolidation waits until everything has been swept, which is more
+        // urgent.
+        size_t max_unspent;
+        absl::Duration interval;
+        {
+            const std::lock_guard<std::mutex> lock(m_queue_mut);
+            max_unspent = m_consolidate_max_unspent;
+            interval = m_consolidate_interval;
+        }
+        if (max_unspent) {
+            if (m_next_consolidation <= absl::Now()) {
+                ConsolidateOutputs(max_unspent);
+                m_next_consolidation = absl::Now() + interval;
+            }
+            next = m_next_consolidation;
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock(m_queue_mut);
+    m_next_sweep = std::min(m_next_sweep, next);
+}
 
-    std::vector<std::pair<WalletSecret, int>> res = ReplaceWebcash(now, inputs, outputs);
-    if (res.size() != 1) {
-        std::cerr << "Error executing replacement on server; keys are secured in wallet, but assuming replacement did not go through." << std::endl;
+void Wallet::RequestSweep()
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        // One queued sweep picks up everything pending when it runs.
+        if (m_sweep_queued) {
+            return;
+        }
+        m_sweep_queued = true;
+    }
+    m_queue_cv.notify_all();
+}
+
+bool Wallet::InsertMany(const std::vector<SecretWebcash>& sks, bool mine)
+{
+    using std::to_string;
+
+    if (sks.empty()) {
+        return true;
+    }
+
+    // The change the secrets are replaced with can't be derived until the
+    // wallet has been recovered.
+    if (IsRecoveryPending()) {
+        std::cerr << "Wallet recovery is pending; unable to insert secrets until Recover() succeeds." << std::endl;
         return false;
     }
 
+    // The database records the timestamp of an insertion
+    const absl::Time now = absl::Now();
+    const int64_t timestamp = absl::ToUnixSeconds(now);
+
+    // First write the keys to the wallet recovery file.  This is done before
+    // taking the wallet lock, so that concurrent insertions can share a sync.
+    std::vector<std::string> lines;
+    lines.reserve(sks.size());
+    for (const SecretWebcash& sk : sks) {
+        lines.push_back(absl::StrCat(to_string(timestamp), " ", to_string(get_hash_type(mine, true)), " ", to_string(sk)));
+    }
+    bool logged = m_recovery_log.Append(lines);
+    if (!logged) {
+        std::cerr << "WARNING: Unable to write keys to wallet recovery file prior to insertion.  BACKUP THESE KEYS NOW TO AVOID DATA LOSS!" << std::endl;
+        for (const std::string& line : lines) {
+            std::cerr << line << std::endl;
+        }
+        // We still attempt to save the keys to the wallet database, but will
+        // not replace them until they are recoverable.  The sweeper writes
+        // them out and queues them once the recovery file is writable again.
+    }
+
+    // Then save the secrets, their outputs, and the change secrets they will
+    // be replaced with to the database, all in a single transaction.  Nothing
+    // here waits on the network, so the lock is held only briefly.
+    {
+        const std::lock_guard<std::mutex> lock(m_mut);
+        Savepoint tx(*this, "insert_many");
+        std::vector<int> output_ids;
+        output_ids.reserve(sks.size());
+        for (const SecretWebcash& sk : sks) {
+            // Insert secret into the wallet db.
+            int secret_id = AddSecretToWallet(now, sk.sk, mine, true);
+            if (!secret_id) {
+                std::cerr << "Error adding secret to wallet; unable to proceed with insertion." << std::endl;
+                return false;
+            }
+
+            // Insert output record into the wallet db.
+            PublicWebcash pk(sk);
+            int output_id = AddOutputToWallet(now, pk, secret_id, false);
+            if (!output_id) {
+                std::cerr << "Error adding output to wallet; unable to proceed with insertion." << std::endl;
+                return false;
+            }
+            output_ids.push_back(output_id);
+        }
+
+        // Secrets which couldn't be written to the recovery file are kept in
+        // the database, but not replaced until they are recoverable.
+        if (logged) {
+            // Generate change addresses.
+            // FIXME: This is breaking with webcash wallet standards; sweep shoud really
+            //        be false here.  The reason we do it this way is a bit of a
+            //        hack/workaround. Until webminer has full wallet support, it is
+            //        easiest for users to import their root key into webcasa and use
+            //        that as their wallet.  However any payments made in webcasa will
+            //        use change addresses, which could potentially result in webminer
+            //        insertions failing due to secret reuse.
+            //
+            //        The workaround is to use HashType::MINING for change addresses
+            //        when replacing secrets.  This is not what the HashType::MINING
+            //        chain code is meant to be used for.  It is meant to be the way in
+            //        which mining payload secrets are generated, hence why sweep=true.
+            //        However webminer currently uses random secrets for the mining
+            //        payload, and until a proper wallet is implemented this at least
+            //        achieves domain separation from webminer and webcasa.
+            //
+            //                                                        should be false <==>
+            std::vector<WalletSecret> change = ReserveSecrets(now, /* mine = */ true, /* sweep = */ true, sks.size());
+
+            // Queue each output to be replaced with change of the same amount,
+            // unless it has been already (e.g. if it was inserted before).
+            for (size_t i = 0; i < output_ids.size(); ++i) {
+                const std::string sql =
+                    "INSERT OR IGNORE INTO sweepqueue ('timestamp','output_id','change_secret_id')"
+                    "SELECT ?1,?2,?3 "
+                    "WHERE NOT EXISTS(SELECT 1 FROM 'output' WHERE id=?2 AND spent=TRUE);";
+                if (!ExecuteSql(sql, SqlInteger(timestamp), SqlInteger(output_ids[i]), SqlInteger(change[i].id))) {
+                    std::cerr << "Error queueing output for replacement; unable to proceed with insertion." << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        if (!tx.Commit()) {
+            std::cerr << "Error committing secrets to wallet; unable to proceed with insertion." << std::endl;
+            return false;
+        }
+    }
+
+    if (!logged) {
+        {
+            const std::lock_guard<std::mutex> lock(m_queue_mut);
+            m_unqueued_outputs = true;
+        }
+        RequestSweep();
+        return false;
+    }
+
+    // Hand the queued outputs off to the sweeper thread to be replaced.
+    RequestSweep();
     return true;
 }
 
-bool Wallet::HaveAcceptedTerms()
+bool Wallet::Insert(const SecretWebcash& sk, bool mine)
+{
+    return InsertMany({sk}, mine);
+}
+
+void Wallet::WriterThread()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mut);
+    while (true) {
+        m_queue_cv.wait(lock, [this]() { return m_shutdown || !m_queue.empty(); });
+        // Queued commands are drained before shutting down.
+        if (m_queue.empty()) {
+            break;
+        }
+        std::function<void()> cmd = std::move(m_queue.front());
+        m_queue.pop_front();
+        ++m_queue_running;
+        lock.unlock();
+        try {
+            cmd();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: wallet command failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+        --m_queue_running;
+        // Wake up anyone waiting in Flush().
+        m_queue_cv.notify_all();
+    }
+}
+
+void Wallet::SweeperThread()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mut);
+    while (true) {
+        // Once shutting down, wait for the writer thread to finish, then run
+        // any sweep it requested.  Retries scheduled for later are left for
+        // the next time the wallet is opened.
+        const auto writer_done = [this]() { return m_shutdown && m_queue.empty() && !m_queue_running; };
+        const auto ready = [this, &writer_done]() { return m_sweep_queued || writer_done() || (!m_shutdown && m_next_sweep <= absl::Now()); };
+        if (m_shutdown || m_next_sweep == absl::InfiniteFuture()) {
+            m_queue_cv.wait(lock, ready);
+        } else {
+            m_queue_cv.wait_until(lock, absl::ToChronoTime(m_next_sweep), ready);
+        }
+        if (!m_sweep_queued && writer_done()) {
+            break;
+        }
+        if (!m_sweep_queued && (m_shutdown || absl::Now() < m_next_sweep)) {
+            continue;
+        }
+        m_sweep_queued = false;
+        m_next_sweep = absl::InfiniteFuture();
+        m_sweep_running = true;
+        lock.unlock();
+        try {
+            RunSweep();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: wallet sweep failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+        m_sweep_running = false;
+        // Wake up anyone waiting in Flush().
+        m_queue_cv.notify_all();
+    }
+}
+
+void Wallet::QueueCommand(std::function<void()> cmd)
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        m_queue.push_back(std::move(cmd));
+    }
+    m_queue_cv.notify_all();
+}
+
+void Wallet::InsertAsync(const SecretWebcash& sk, bool mine, std::function<void(bool)> callback)
+{
+    QueueCommand([this, sk, mine, callback = std::move(callback)]() {
+        bool ok = false;
+        try {
+            ok = Insert(sk, mine);
+        } catch (const std::exception& e) {
+            std::cerr << "Error inserting secret into wallet: " << e.what() << std::endl;
+        }
+        if (callback) {
+            callback(ok);
+        }
+    });
+}
+
+void Wallet::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mut);
+    m_queue_cv.wait(lock, [this]() { return m_queue.empty() && !m_queue_running && !m_sweep_queued && !m_sweep_running; });
+}
+
+Amount Wallet::GetBalance()
 {
     const std::lock_guard<std::mutex> lock(m_mut);
-    static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms')";
-    sqlite3_stmt* have_any_terms;
-    int res = sqlite3_prepare_v2(m_db, stmt.c_str(), stmt.size(), &have_any_terms, nullptr);
-    if (res != SQLITE_OK) {
-        std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+    const std::string sql = "SELECT amount FROM 'balance' WHERE id=1;";
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    int res = sqlite3_step(stmt);
+    if (res != SQLITE_ROW) {
+        std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sql, "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
         std::cerr << msg << std::endl;
         throw std::runtime_error(msg);
     }
-    res = sqlite3_step(have_any_terms);
+    return Amount(sqlite3_column_int64(stmt, 0));
+}
+
+size_t Wallet::CountUnspent()
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    const std::string sql = "SELECT count FROM 'balance' WHERE id=1;";
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    int res = sqlite3_step(stmt);
     if (res != SQLITE_ROW) {
-        std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(have_any_terms), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+        std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sql, "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
         std::cerr << msg << std::endl;
-        sqlite3_finalize(have_any_terms);
         throw std::runtime_error(msg);
     }
-    bool any = !!sqlite3_column_int(have_any_terms, 0);
-    sqlite3_finalize(have_any_terms);
-    return any;
+    return sqlite3_column_int64(stmt, 0);
 }
 
-bool Wallet::AreTermsAccepted(const std::string& terms)
+std::vector<WalletOutput> Wallet::ListUnspent(size_t limit, int after_id)
 {
     const std::lock_guard<std::mutex> lock(m_mut);
-    static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms' WHERE body=?)";
-    sqlite3_stmt* have_terms;
-    int res = sqlite3_prepare_v2(m_db, stmt.c_str(), stmt.size(), &have_terms, nullptr);
-    if (res != SQLITE_OK) {
-        std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+    const std::string sql = absl::StrCat(
+        "SELECT ", k_output_columns, " "
+          "FROM 'output' "
+          "LEFT JOIN 'secret' ON secret.id=output.secret_id "
+         "WHERE output.spent=FALSE "
+           "AND output.id>?1 "
+         "ORDER BY output.id "
+         "LIMIT ?2;");
+    sqlite3_stmt* stmt = GetCachedStatement(sql);
+    const StatementReset reset(stmt);
+    std::vector<WalletOutput> ret;
+    QueryOutputs(stmt, ret, nullptr, SqlInteger(after_id), SqlInteger(limit));
+    return ret;
+}
+
+std::vector<WalletOutput> Wallet::SelectCoins(const Amount& target, size_t max_inputs)
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    std::vector<WalletOutput> ret;
+    if (target.i64 < 1 || max_inputs < 1) {
+        return ret;
+    }
+
+    // Prefer the smallest single output which covers the target, which is a
+    // single seek on the unspent-amount index.
+    {
+        const std::string sql = absl::StrCat(
+            "SELECT ", k_output_columns, " "
+              "FROM 'output' "
+              "JOIN 'secret' ON secret.id=output.secret_id "
+             "WHERE output.spent=FALSE "
+               "AND output.amount>=?1 "
+               "AND NOT EXISTS(SELECT 1 FROM 'sweepqueue' WHERE output_id=output.id) "
+               "AND NOT EXISTS(SELECT 1 FROM 'consolidationinput' WHERE output_id=output.id) "
+             "ORDER BY output.amount,output.id "
+             "LIMIT 1;");
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        QueryOutputs(stmt, ret, nullptr, SqlInteger(target.i64));
+        if (!ret.empty()) {
+            return ret;
+        }
+    }
+
+    // Otherwise take the largest outputs until the target is reached, which
+    // walks the same index backwards and stops as soon as it can.
+    {
+        const std::string sql = absl::StrCat(
+            "SELECT ", k_output_columns, " "
+              "FROM 'output' "
+              "JOIN 'secret' ON secret.id=output.secret_id "
+             "WHERE output.spent=FALSE "
+               "AND NOT EXISTS(SELECT 1 FROM 'sweepqueue' WHERE output_id=output.id) "
+               "AND NOT EXISTS(SELECT 1 FROM 'consolidationinput' WHERE output_id=output.id) "
+             "ORDER BY output.amount DESC,output.id DESC "
+             "LIMIT ?1;");
+        sqlite3_stmt* stmt = GetCachedStatement(sql);
+        const StatementReset reset(stmt);
+        Amount total = 0;
+        QueryOutputs(stmt, ret, [&](const WalletOutput& output) {
+            total += output.amount;
+            return total < target;
+        }, SqlInteger(max_inputs));
+        if (total < target) {
+            ret.clear();
+        }
+    }
+    return ret;
+}
+
+void Wallet::SetConsolidation(size_t max_unspent, absl::Duration interval)
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_queue_mut);
+        m_consolidate_max_unspent = max_unspent;
+        m_consolidate_interval = interval;
+    }
+    RequestSweep();
+}
+
+bool Wallet::IsRecoveryPending()
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    return RecoveryPending();
+}
+
+bool Wallet::RecoveryPending()
+{
+    static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'pendingrecovery')";
+    sqlite3_stmt* pending = GetCachedStatement(stmt);
+    const StatementReset reset(pending);
+    int res = sqlite3_step(pending);
+    if (res != SQLITE_ROW) {
+        std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(pending), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
         std::cerr << msg << std::endl;
         throw std::runtime_error(msg);
     }
-    res = sqlite3_bind_text(have_terms, 1, terms.c_str(), terms.size(), SQLITE_STATIC);
-    if (res != SQLITE_OK) {
-        std::string msg(absl::StrCat("Unable to bind parameter 1 in SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
+    return !!sqlite3_column_int(pending, 0);
+}
+
+bool Wallet::HaveAcceptedTerms()
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms')";
+    sqlite3_stmt* have_any_terms = GetCachedStatement(stmt);
+    const StatementReset reset(have_any_terms);
+    int res = sqlite3_step(have_any_terms);
+    if (res != SQLITE_ROW) {
+        std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(have_any_terms), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
         std::cerr << msg << std::endl;
-        sqlite3_finalize(have_terms);
         throw std::runtime_error(msg);
     }
-    res = sqlite3_step(have_terms);
+    return !!sqlite3_column_int(have_any_terms, 0);
+}
+
+bool Wallet::AreTermsAccepted(const std::string& terms)
+{
+    const std::lock_guard<std::mutex> lock(m_mut);
+    static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms' WHERE body=?1)";
+    sqlite3_stmt* have_terms = GetCachedStatement(stmt);
+    const StatementReset reset(have_terms);
+    if (!BindParameters(have_terms, SqlText(terms))) {
+        throw std::runtime_error("Unable to bind SQL parameters.  See error log for details.");
+    }
+    int res = sqlite3_step(have_terms);
     if (res != SQLITE_ROW) {
         std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(have_terms), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
         std::cerr << msg << std::endl;
-        sqlite3_finalize(have_terms);
         throw std::runtime_error(msg);
     }
-    bool have = !!sqlite3_column_int(have_terms, 0);
-    sqlite3_finalize(have_terms);
-    return have;
+    return !!sqlite3_column_int(have_terms, 0);
 }
 
 void Wallet::AcceptTerms(const std::string& terms)
@@ -926,12 +2371,9 @@ void Wallet::AcceptTerms(const std::string& terms)
         const std::lock_guard<std::mutex> lock(m_mut);
         static const std::string sql =
             "INSERT OR IGNORE INTO terms ('body','timestamp')"
-            "VALUES(:body,:timestamp)";
-        SqlParams params;
-        params["body"] = SqlText(terms);
+            "VALUES(?1,?2)";
         int64_t timestamp = absl::ToUnixSeconds(absl::Now());
-        params["timestamp"] = SqlInteger(timestamp);
-        if (!ExecuteSql(sql, params)) {
+        if (!ExecuteSql(sql, SqlText(terms), SqlInteger(timestamp))) {
             throw std::runtime_error("Unable to insert accepted terms into database.  See error log for details.");
         }
     }
@@ -9,12 +9,17 @@
 
 #include "webcash.h"
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
-#include <variant>
 #include <vector>
 
+#include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 
 #include "boost/filesystem.hpp"
@@ -22,6 +27,11 @@
 
 #include "sqlite3.h"
 
+// Parameters are bound to SQL statements by position: the first parameter
+// passed to Wallet::ExecuteSql is bound to ?1, the second to ?2, and so on.
+// Text and blob parameters refer to the caller's data rather than copying it,
+// so they must not outlive the value they were constructed from.
+
 struct SqlNull {
 };
 
@@ -47,22 +57,21 @@ struct SqlFloat {
 };
 
 struct SqlText {
-    std::string s;
+    const char* data;
+    size_t size;
 
-    template<typename... Args>
-    SqlText(Args&&... args) : s(std::forward<Args>(args)...) {}
+    SqlText(const absl::string_view& s) : data(s.data()), size(s.size()) {}
+    template<typename Alloc>
+    SqlText(const std::basic_string<char, std::char_traits<char>, Alloc>& s) : data(s.data()), size(s.size()) {}
 };
 
 struct SqlBlob {
-    std::vector<unsigned char> vch;
+    const unsigned char* data;
+    size_t size;
 
-    template<typename... Args>
-    SqlBlob(Args&&... args) : vch(std::forward<Args>(args)...) {}
+    SqlBlob(const unsigned char* begin, const unsigned char* end) : data(begin), size(end - begin) {}
 };
 
-typedef std::variant<SqlNull, SqlBool, SqlInteger, SqlFloat, SqlText, SqlBlob> SqlValue;
-typedef std::map<std::string, SqlValue> SqlParams;
-
 struct WalletSecret {
     int id;
     absl::Time timestamp;
@@ -80,33 +89,285 @@ struct WalletOutput {
     bool spent;
 };
 
+// How the wallet database is stored on disk.
+enum class WalletStorage {
+    // SQLite's default rollback journal, with every transaction synced to disk
+    // before it is considered committed.
+    ROLLBACK_JOURNAL,
+
+    // A write-ahead log with synchronous=NORMAL and memory-mapped reads.  A
+    // power loss can roll back the most recently committed transactions, but
+    // never corrupts the database.  Secrets remain recoverable regardless,
+    // because the wallet writes each secret (or the HD root it is derived
+    // from) to the recovery file before it is used.
+    WRITE_AHEAD_LOG,
+};
+
+// The wallet recovery file, to which secrets are appended before they are
+// used.  The file is kept open, and lines appended by concurrent callers are
+// written out and synced to disk together: the first caller to arrive waits
+// up to the durability window for others to join it, then writes and syncs
+// everything that has accumulated in one go.  Append() doesn't return until
+// its lines are on disk.
+class RecoveryLog {
+protected:
+    std::mutex m_mut;
+    std::condition_variable m_cv;
+    int m_fd;
+    absl::Duration m_window;
+
+    // Lines waiting to be written, which will go out as batch m_next_batch.
+    std::string m_buffer;
+    uint64_t m_next_batch;
+    // The most recent batches to be synced and to fail, respectively.
+    uint64_t m_synced_batch;
+    uint64_t m_failed_batch;
+    // Whether a caller is currently writing a batch.
+    bool m_writing;
+
+public:
+    explicit RecoveryLog(absl::Duration window = absl::ZeroDuration());
+    ~RecoveryLog();
+
+    // Non-copyable:
+    RecoveryLog(const RecoveryLog&) = delete;
+    RecoveryLog& operator=(const RecoveryLog&) = delete;
+
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    // Appends the lines to the file and syncs it.  Returns false if the lines
+    // might not have made it to disk.
+    bool Append(const std::vector<std::string>& lines);
+};
+
 class Wallet {
+public:
+    // The largest number of inputs submitted in a single replacement request.
+    static const size_t k_max_replace_size = 100;
+    // How many unused keys in a row end the scan of an HD chain on recovery.
+    static const size_t k_recover_gap_limit = 20;
+
 protected:
     std::mutex m_mut;
 
     boost::filesystem::path m_logfile;
+    RecoveryLog m_recovery_log;
     boost::interprocess::file_lock m_db_lock;
     sqlite3* m_db;
 
-    bool ExecuteSql(const std::string& sql, const SqlParams& params);
+    // Prepared statements, keyed by the SQL text they were compiled from.  A
+    // multi-statement SQL string maps to the sequence of statements it
+    // contains, in order.  Statements are reset and have their bindings
+    // cleared after each use, and are finalized when the wallet is closed.
+    std::map<std::string, std::vector<sqlite3_stmt*>> m_stmt_cache;
+
+    sqlite3_stmt* GetCachedStatement(const std::string& sql);
+    template<typename... Params>
+    bool ExecuteSql(const std::string& sql, const Params&... params);
+
+    // A database transaction scope, implemented with SQLite savepoints so
+    // that scopes can be nested.  Changes made within the scope are rolled
+    // back when it is exited, unless Commit() was called first.
+    class Savepoint {
+    protected:
+        Wallet& m_wallet;
+        std::string m_name;
+        bool m_active;
+
+    public:
+        Savepoint(Wallet& wallet, const std::string& name);
+        ~Savepoint();
+
+        // Non-copyable:
+        Savepoint(const Savepoint&) = delete;
+        Savepoint& operator=(const Savepoint&) = delete;
+
+        bool Commit();
+    };
 
     int m_hdroot_id;
     uint256 m_hdroot;
+    // Hasher state after absorbing the HD derivation tag.  The tag is written
+    // twice, which fills exactly one block, so this is a SHA256 midstate.
+    CSHA256 m_hdkey_hasher;
 
     void UpgradeDatabase();
     void GetOrCreateHDRoot();
 
+    // Look up the HD chain's id and the depth of the next unused key.  Throws
+    // if the chain doesn't exist.
+    void GetHDChain(int64_t chaincode, bool mine, bool sweep, int& hdchain_id, int64_t& depth);
+    // Derive the count consecutive secrets starting at depth, writing each
+    // 32-byte secret to out.  Doesn't touch the database.
+    void DeriveSecrets(int64_t chaincode, bool mine, bool sweep, int64_t depth, size_t count, unsigned char* out) const;
+    // Adds the secret and its position on the HD chain to the database.
+    // Returns the secret's id, or zero on error.
+    int AddHDKeyToWallet(absl::Time timestamp, int hdchain_id, int64_t depth, const absl::string_view& secret, bool mine, bool sweep);
+
+    // An HD key which the server has seen used.
+    struct RecoveredKey {
+        int64_t depth;
+        SecureString secret;
+        bool spent;
+        Amount amount;
+    };
+    // The result of scanning one HD chain for used keys.
+    struct HDChainScan {
+        bool mine;
+        bool sweep;
+        // One past the deepest used key, or zero if none were found.
+        int64_t depth;
+        std::vector<RecoveredKey> keys;
+    };
+    // Walks the chain in batches, asking the server about each batch with a
+    // single request, until gap_limit consecutive keys are found unused.
+    // Doesn't touch the database.
+    bool ScanHDChain(int64_t chaincode, bool mine, bool sweep, size_t gap_limit, HDChainScan& scan) const;
+    // Scans all four chains of the master secret concurrently.
+    bool ScanHDChains(size_t gap_limit, std::vector<HDChainScan>& scans) const;
+    // Saves the scan results.  The caller is responsible for holding m_mut
+    // and for the enclosing transaction.
+    bool RecordRecovery(const std::vector<HDChainScan>& scans);
+
+    // Is a recovery pending?  The caller is responsible for holding m_mut.
+    bool RecoveryPending();
+
+    // Derive and save count new secrets from the HD chain, in one transaction.
+    // Throws if a recovery is pending.
+    std::vector<WalletSecret> ReserveSecrets(absl::Time timestamp, bool mine, bool sweep, size_t count);
     WalletSecret ReserveSecret(absl::Time timestamp, bool mine, bool sweep);
-    int AddSecretToWallet(absl::Time timestamp, const SecretWebcash& sk, bool mine, bool sweep);
+    // Only adds the secret to the database.  The caller is responsible for
+    // first saving it to the recovery file, if necessary.
+    int AddSecretToWallet(absl::Time timestamp, const absl::string_view& secret, bool mine, bool sweep);
     int AddOutputToWallet(absl::Time timestamp, const PublicWebcash& pk, int secret_id, bool spent);
 
-    std::vector<std::pair<WalletSecret, int>> ReplaceWebcash(absl::Time timestamp, std::vector<WalletOutput>& inputs, const std::vector<std::pair<WalletSecret, Amount>>& outputs);
+    enum class ReplaceResult {
+        // The server accepted the replacement.
+        ACCEPTED,
+        // The server refused the replacement.  It might have gone through
+        // on an earlier attempt, or the inputs might have been spent
+        // elsewhere.
+        REJECTED,
+        // No response was received.  The replacement may or may not have
+        // gone through.
+        NETWORK_ERROR,
+    };
+
+    // Submits a replacement request to the server.  Doesn't touch the
+    // database, so m_mut need not (and should not) be held.
+    static ReplaceResult SubmitReplacement(const std::vector<WalletOutput>& inputs, const std::vector<std::pair<WalletSecret, Amount>>& outputs);
+
+    // Outputs awaiting replacement are recorded in the database, together
+    // with the change secret each is to be replaced with, in the same
+    // transaction in which they are inserted.  The sweeper thread works
+    // through this queue, only taking m_mut to read and update the database
+    // around each server request, so that insertions never wait on the
+    // network.  Anything left over from a previous run is picked up again
+    // when the wallet is opened.  The members below are guarded by
+    // m_queue_mut.
+    bool m_sweep_queued;
+    bool m_sweep_running;
+    absl::Time m_next_sweep;
+    // Set when there might be inserted outputs which were never queued for
+    // replacement, because their secrets couldn't be written to the recovery
+    // file at the time.  Also set when the wallet is opened, in case the
+    // wallet was closed before they could be queued.
+    bool m_unqueued_outputs;
+
+    // When enabled, each sweep also merges the smallest unspent outputs into
+    // one larger output, once per m_consolidate_interval, for as long as the
+    // wallet holds more than m_consolidate_max_unspent of them.  The chosen
+    // inputs and their change secret are recorded before the request is
+    // made, so an interrupted consolidation is finished on the next sweep.
+    size_t m_consolidate_max_unspent;
+    absl::Duration m_consolidate_interval;
+    // Only used by the sweeper thread:
+    absl::Time m_next_consolidation;
+
+    // Writes the secrets of any unqueued outputs to the recovery file, then
+    // queues the outputs for replacement.  Returns false if some couldn't be.
+    bool QueueUnsweptOutputs();
+    bool LoadSweepBatch(std::vector<int>& pending_ids, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs);
+    // Returns true once there is nothing left to sweep.
+    bool SweepPending();
+    bool LoadConsolidation(int& consolidation_id, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs);
+    bool StartConsolidation(size_t max_unspent, int& consolidation_id, std::vector<WalletOutput>& inputs, std::vector<std::pair<WalletSecret, Amount>>& outputs);
+    void ConsolidateOutputs(size_t max_unspent);
+    void RunSweep();
+    void RequestSweep();
+
+    // Commands queued to run on the writer thread, in FIFO order.  Each
+    // command is responsible for taking m_mut itself, if needed.
+    std::mutex m_queue_mut;
+    std::condition_variable m_queue_cv;
+    std::deque<std::function<void()>> m_queue;
+    size_t m_queue_running;
+    bool m_shutdown;
+    std::thread m_writer;
+    std::thread m_sweeper;
+
+    void ConfigureDatabase(WalletStorage storage);
+    void WriterThread();
+    void SweeperThread();
+    void QueueCommand(std::function<void()> cmd);
 
 public:
-    Wallet(const boost::filesystem::path& path);
+    // Secrets are synced to the recovery file before being used.  Concurrent
+    // insertions which arrive within recovery_window of each other share a
+    // single sync, at the cost of up to that much added latency.
+    Wallet(const boost::filesystem::path& path, WalletStorage storage = WalletStorage::ROLLBACK_JOURNAL, absl::Duration recovery_window = absl::ZeroDuration());
     ~Wallet();
 
     bool Insert(const SecretWebcash& sk, bool mine);
+    // Insert many secrets at once.  The secrets are saved to the wallet in a
+    // single transaction and queued for replacement with change, which the
+    // sweeper thread does in the background in batches of up to
+    // k_max_replace_size inputs per server request.  Returns true once the
+    // secrets are safely stored, without waiting for the replacement.
+    bool InsertMany(const std::vector<SecretWebcash>& sks, bool mine);
+    // Queue the secret to be inserted by the wallet's writer thread, so that
+    // the caller doesn't wait on disk or network access.  The callback, if
+    // any, is run on the writer thread with the result of the insertion.
+    void InsertAsync(const SecretWebcash& sk, bool mine, std::function<void(bool)> callback = nullptr);
+    // Wait for all queued commands to finish running, including any sweep of
+    // pending replacements.  Retries scheduled for later are not waited on.
+    void Flush();
+
+    // The total value of unspent outputs in the wallet, and how many of them
+    // there are.  Both are kept up to date by the database, so no scan of the
+    // outputs is required.
+    Amount GetBalance();
+    size_t CountUnspent();
+    // Up to limit unspent outputs, in the order they were added to the wallet,
+    // starting after the output with id after_id.
+    std::vector<WalletOutput> ListUnspent(size_t limit, int after_id = 0);
+    // Choose unspent outputs worth at least target in total, using no more
+    // than max_inputs of them.  Returns an empty vector if that isn't
+    // possible.  Outputs still waiting to be swept or consolidated are never
+    // selected.
+    std::vector<WalletOutput> SelectCoins(const Amount& target, size_t max_inputs = k_max_replace_size);
+
+    // Keep the number of unspent outputs in the wallet at or below
+    // max_unspent by merging the smallest of them together in the
+    // background, making at most one replacement request per interval.  Zero
+    // disables consolidation, which is the default.
+    void SetConsolidation(size_t max_unspent, absl::Duration interval = absl::Minutes(1));
+
+    // Rebuild the wallet's record of its HD keys and their outputs by asking
+    // the server which keys derived from the master secret have been used,
+    // stopping each chain after gap_limit unused keys in a row.  This must be
+    // done when the wallet database has been recreated from the recovery
+    // file, before any new keys are handed out, since otherwise they would
+    // repeat ones the server has already seen.  It is also useful if the
+    // master secret was used elsewhere.  Returns false if the server couldn't
+    // be reached or the results couldn't be saved, in which case the wallet
+    // is left unchanged.
+    bool Recover(size_t gap_limit = k_recover_gap_limit);
+    // Was the master secret restored from the recovery file, without a
+    // successful Recover() since?  While it is, no new keys are derived, so
+    // Insert() and InsertMany() fail and sweeps wait.
+    bool IsRecoveryPending();
 
     // Have *any* terms of service been accepted?
     bool HaveAcceptedTerms();
@@ -6,18 +6,57 @@
 
 #include "webcash.h"
 
+#include <algorithm>
+#include <limits>
 #include <string>
 
 #include <stdint.h>
+#include <string.h>
 
-#include "absl/numeric/int128.h"
+#include "absl/numeric/bits.h"
 
-#include "absl/strings/escaping.h"
-#include "absl/strings/str_cat.h"
-#include "absl/strings/str_join.h"
-#include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 
+#include "crypto/common.h"
+#include "util/hex.h"
+
+// Amounts have at most 8 fractional digits, so both parsing and formatting
+// work on groups of 8 decimal digits packed into a 64-bit word, with the first
+// digit in the least significant byte.
+static const uint64_t k_zeros8 = 0x3030303030303030;
+
+// Returns true if each of the 8 characters is a decimal digit.
+static inline bool is_digits8(uint64_t chars)
+{
+    return ((chars & 0xf0f0f0f0f0f0f0f0) | (((chars + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) == 0x3333333333333333;
+}
+
+// Returns the value of 8 decimal digits.
+static inline uint32_t parse_digits8(uint64_t chars)
+{
+    uint64_t v = chars - k_zeros8;
+    // Combine adjacent digits into 2-digit values, then those into the two
+    // 4-digit halves, then the halves into the result.
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000ff000000ff) * (100 + (1000000ULL << 32))) + (((v >> 16) & 0x000000ff000000ff) * (1 + (10000ULL << 32)))) >> 32;
+    return static_cast<uint32_t>(v);
+}
+
+// Returns the 8 decimal digits of v, which must be less than 100000000.
+static inline uint64_t format_digits8(uint32_t v)
+{
+    // Split into 4-digit halves, each in its own 32-bit lane, then into
+    // 2-digit values in 16-bit lanes, and then into digits in bytes.  The
+    // divisions are done by multiplying by a fixed-point reciprocal, which is
+    // exact over the range of values in each lane.
+    uint64_t x = (v / 10000) | (static_cast<uint64_t>(v % 10000) << 32);
+    uint64_t y = ((x * 10486) >> 20) & 0x0000007f0000007f;
+    y |= (x - y * 100) << 16;
+    uint64_t z = ((y * 103) >> 10) & 0x000f000f000f000f;
+    z |= (y - z * 10) << 8;
+    return z | k_zeros8;
+}
+
 // Requires an input that is a fractional-precision decimal with no more than 8
 // digits past the decimal point, with a leading minus sign if the value is
 // negative.  Extremely ficky parser that only values that could be output by
@@ -28,18 +67,16 @@ bool Amount::parse(const absl::string_view& str) {
         return false;
     }
     // Sanity: no embedded NUL characters allowed.
-    if (str.size() != strnlen(str.data(), str.size())) {
+    if (memchr(str.data(), '\0', str.size())) {
         return false;
     }
 
-    auto pos = str.begin();
-    auto end = str.end();
-    absl::int128 i = 0;
+    const char* pos = str.data();
+    const char* end = pos + str.size();
 
     if (*pos == '"') {
-        do {
-            --end;
-        } while (*end != '"');
+        // Everything after the last quote is ignored.
+        end = pos + str.rfind('"');
         // An opening quote and nothing else is not a valid encoding.
         if (pos == end) {
             return false;
@@ -57,58 +94,49 @@ bool Amount::parse(const absl::string_view& str) {
         }
     }
 
-    // A leading zero is required, even for fractional amounts.
-    if (!absl::ascii_isdigit(*pos)) {
+    // The integer part of the largest amount, 92233720368.54775807, has 11
+    // digits.  A leading zero is required, even for fractional amounts, but
+    // it must then be the only integer digit.
+    const char* dot = std::find(pos, end, '.');
+    const size_t int_len = dot - pos;
+    if (int_len == 0 || int_len > 11 || (*pos == '0' && int_len > 1)) {
         return false;
     }
-    // But in that case the next character must be a decimal point.
-    if (pos[0] == '0' && (pos + 1) != end && pos[1] != '.') {
+    // Right-align the integer digits in 16 zeros.
+    unsigned char buf[16];
+    memset(buf, '0', sizeof(buf));
+    memcpy(buf + sizeof(buf) - int_len, pos, int_len);
+    const uint64_t hi = ReadLE64(buf);
+    const uint64_t lo = ReadLE64(buf + 8);
+    if (!is_digits8(hi) || !is_digits8(lo)) {
         return false;
     }
-
-    for (; pos != end && absl::ascii_isdigit(*pos); ++pos) {
-        i *= 10;
-        i += (*pos - '0');
-        // Overflow check
-        if (i > std::numeric_limits<int64_t>::max()) {
-            return false;
-        }
-    }
+    // Cannot overflow, as there are at most 19 significant digits.
+    uint64_t u = (parse_digits8(hi) * UINT64_C(100000000) + parse_digits8(lo)) * UINT64_C(100000000);
 
     // Fractional digits are optional.
-    int j = 0;
-    if (pos != end) {
-        // Skip past the decimal point.
-        if (*pos != '.') {
+    if (dot != end) {
+        // If there is a decimal point, there must be between 1 and 8 digits,
+        // and then the end of the input.
+        const size_t frac_len = end - dot - 1;
+        if (frac_len == 0 || frac_len > 8) {
             return false;
         }
-        ++pos;
-        // If there is a decimal point, there must be at least one digit.
-        if (pos == end) {
+        // Left-align the fractional digits in 8 zeros.
+        memset(buf, '0', 8);
+        memcpy(buf, dot + 1, frac_len);
+        const uint64_t frac = ReadLE64(buf);
+        if (!is_digits8(frac)) {
             return false;
         }
-        // Read up to 8 digits
-        for (; j < 8 && pos != end; ++j, ++pos) {
-            if (!absl::ascii_isdigit(*pos)) {
-                return false;
-            }
-            i *= 10;
-            i += (*pos - '0');
-        }
-        // We must now be at the end of the input
-        if (pos != end) {
-            return false;
-        }
-    }
-    for (; j < 8; ++j) {
-        i *= 10;
+        u += parse_digits8(frac);
     }
     // Overflow check
-    if (i > std::numeric_limits<int64_t>::max()) {
+    if (u > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
         return false;
     }
 
-    i64 = static_cast<int64_t>(i);
+    i64 = static_cast<int64_t>(u);
     if (negative) {
         i64 = -i64;
     }
@@ -119,87 +147,181 @@ bool Amount::parse(const absl::string_view& str) {
 // digits, as per webcash tradition.  Any terminal zero fractional digits up to
 // and including the decimal place itself are not output.
 //     e.g. 3000000 is rendered as "0.03"
+char* to_chars(char* first, char* last, const Amount& amt) {
+    // Negate as unsigned, so that the most negative amount has a magnitude.
+    uint64_t u = static_cast<uint64_t>(amt.i64);
+    if (amt.i64 < 0) {
+        u = 0 - u;
+    }
+    const uint64_t quot = u / 100000000;
+    const uint32_t rem = static_cast<uint32_t>(u % 100000000);
+
+    // The integer part has at most 11 digits, so it is formatted as 16 digits
+    // with leading zeros, which are skipped over, leaving at least one digit.
+    unsigned char digits[16];
+    const uint64_t hi = format_digits8(static_cast<uint32_t>(quot / 100000000));
+    const uint64_t lo = format_digits8(static_cast<uint32_t>(quot % 100000000));
+    WriteLE64(digits, hi);
+    WriteLE64(digits + 8, lo);
+    size_t skip;
+    if (hi != k_zeros8) {
+        skip = absl::countr_zero(hi ^ k_zeros8) / 8;
+    } else {
+        skip = 8 + absl::countr_zero((lo ^ k_zeros8) | (UINT64_C(1) << 56)) / 8;
+    }
+    const size_t int_len = sizeof(digits) - skip;
+
+    // Trailing zero fractional digits are dropped.
+    unsigned char frac[8];
+    size_t frac_len = 0;
+    if (rem) {
+        const uint64_t f = format_digits8(rem);
+        WriteLE64(frac, f);
+        frac_len = 8 - absl::countl_zero(f ^ k_zeros8) / 8;
+    }
+
+    const size_t len = (amt.i64 < 0) + int_len + (frac_len ? 1 + frac_len : 0);
+    if (static_cast<size_t>(last - first) < len) {
+        return nullptr;
+    }
+    if (amt.i64 < 0) {
+        *first++ = '-';
+    }
+    first = std::copy(digits + skip, digits + sizeof(digits), first);
+    if (frac_len) {
+        *first++ = '.';
+        first = std::copy(frac, frac + frac_len, first);
+    }
+    return first;
+}
+
 std::string to_string(const Amount& amt) {
-    using std::to_string;
-    std::lldiv_t div = std::lldiv(std::abs(amt.i64), 100000000LL);
-    std::string res = (amt.i64 < 0) ? "-" : "";
-    res += to_string(div.quot);
-    if (div.rem) {
-        std::string frac = to_string(div.rem);
-        res.push_back('.');
-        res.insert(res.end(), 8 - frac.length(), '0');
-        res += frac;
-        while (res.back() == '0') {
-            res.pop_back();
-        }
+    char buf[k_max_amount_chars];
+    return std::string(buf, to_chars(buf, buf + sizeof(buf), amt));
+}
+
+// Strips the "e" (or "₩") prefix, if any, from the amount of a webcash string.
+static absl::string_view strip_amount_prefix(absl::string_view str, bool allow_won)
+{
+    if (!str.empty() && str[0] == 'e') {
+        str.remove_prefix(1);
+    } else if (allow_won && str.size() >= 3 && str[0] == '\xe2' && str[1] == '\x82' && str[2] == '\xa9') {
+        str.remove_prefix(3);
     }
-    return res;
+    return str;
 }
 
 bool SecretWebcash::parse(
     const absl::string_view& str
 ){
-    std::vector<std::string> parts = absl::StrSplit(str, ':');
-    if (parts.size() < 3 || parts[1] != "secret") {
+    // <amount>:secret:<secret>, where the secret itself may contain colons.
+    size_t colon = str.find(':');
+    if (colon == absl::string_view::npos) {
         return false;
     }
-    if (!parts[0].empty() && parts[0][0] == 'e') {
-        // Remove leading 'e', if present
-        parts[0].erase(parts[0].begin());
+    absl::string_view rest = str.substr(colon + 1);
+    static const absl::string_view type("secret:");
+    if (rest.substr(0, type.size()) != type) {
+        return false;
     }
-    if (!amount.parse(parts[0])) {
+    Amount _amount;
+    if (!_amount.parse(strip_amount_prefix(str.substr(0, colon), false))) {
         return false;
     }
-    sk = absl::StrJoin(parts.begin() + 2, parts.end(), ":");
+    rest.remove_prefix(type.size());
+    // Reuses the existing allocation, if it is large enough.
+    sk.assign(rest.data(), rest.size());
+    amount = _amount;
     return true;
 }
 
 bool PublicWebcash::parse(
     const absl::string_view& str
 ){
-    std::vector<std::string> parts = absl::StrSplit(str, ':');
-    if (parts.size() != 3 || parts[1] != "public") {
+    // <amount>:public:<64 hex digits>
+    size_t colon = str.find(':');
+    if (colon == absl::string_view::npos) {
+        return false;
+    }
+    absl::string_view rest = str.substr(colon + 1);
+    static const absl::string_view type("public:");
+    if (rest.substr(0, type.size()) != type) {
+        return false;
+    }
+    rest.remove_prefix(type.size());
+    if (rest.size() != 2 * pk.size()) {
         return false;
     }
     Amount _amount;
-    if (!parts[0].empty() && parts[0][0] == 'e') {
-        // Remove leading 'e', if present
-        parts[0].erase(0, 1);
-    } else if (parts[0].size() >= 3 && parts[0][0] == '\xe2' && parts[0][1] == '\x82' && parts[0][3] == '\xa9') {
-        // Remove leading '₩', if present
-        parts[0].erase(0, 3);
-    }
-    if (!_amount.parse(parts[0])) {
+    if (!_amount.parse(strip_amount_prefix(str.substr(0, colon), true))) {
         return false;
     }
-    if (!is_uint256(parts[2])) {
+    uint256 _pk;
+    if (!HexDecode32(_pk.begin(), rest.data())) {
         return false;
     }
-    std::string pk_str = absl::HexStringToBytes(parts[2]);
-    std::copy(pk_str.begin(), pk_str.end(), pk.begin());
+    pk = _pk;
     amount = _amount;
     return true;
 }
 
-template<class Str>
-static Str webcash_string(Amount amount, const absl::string_view& type, const Str& hex)
+// Writes "e<amount>:<type>:" and returns a pointer to where the key goes, or
+// nullptr if fewer than key_len characters would be left for it.
+static char* webcash_prefix(char* first, char* last, Amount amount, const absl::string_view& type, size_t key_len)
 {
-    using std::to_string;
     if (amount.i64 < 0) {
         amount.i64 = 0;
     }
-    return Str(absl::StrCat("e", to_string(amount), ":", type, ":", hex));
+    if (first == last) {
+        return nullptr;
+    }
+    *first++ = 'e';
+    first = to_chars(first, last, amount);
+    if (!first || static_cast<size_t>(last - first) < type.size() + 2 + key_len) {
+        return nullptr;
+    }
+    *first++ = ':';
+    first = std::copy(type.begin(), type.end(), first);
+    *first++ = ':';
+    return first;
+}
+
+char* to_chars(char* first, char* last, const SecretWebcash& esk)
+{
+    first = webcash_prefix(first, last, esk.amount, "secret", esk.sk.size());
+    if (!first) {
+        return nullptr;
+    }
+    return std::copy(esk.sk.begin(), esk.sk.end(), first);
 }
 
 SecureString to_string(const SecretWebcash& esk)
 {
-    return webcash_string(esk.amount, "secret", esk.sk);
+    // The prefix holds no secrets, so it can be built on the stack and only
+    // the result needs to live in secure memory.
+    char prefix[1 + k_max_amount_chars + 8];
+    char* end = webcash_prefix(prefix, prefix + sizeof(prefix), esk.amount, "secret", 0);
+    SecureString ret;
+    ret.reserve((end - prefix) + esk.sk.size());
+    ret.append(prefix, end);
+    ret.append(esk.sk);
+    return ret;
+}
+
+char* to_chars(char* first, char* last, const PublicWebcash& epk)
+{
+    first = webcash_prefix(first, last, epk.amount, "public", 2 * epk.pk.size());
+    if (!first) {
+        return nullptr;
+    }
+    HexEncode32(first, epk.pk.begin());
+    return first + 2 * epk.pk.size();
 }
 
 std::string to_string(const PublicWebcash& epk)
 {
-    std::string hex = absl::BytesToHexString(absl::string_view((const char*)epk.pk.data(), epk.pk.size()));
-    return webcash_string(epk.amount, "public", hex);
+    char buf[k_max_public_webcash_chars];
+    return std::string(buf, to_chars(buf, buf + sizeof(buf), epk));
 }
 
 
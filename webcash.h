@@ -43,6 +43,15 @@ inline Amount operator+(const Amount& lhs, const Amount& rhs) { return Amount(lh
 
 std::string to_string(const Amount& amt);
 
+// The longest output of to_string(const Amount&): a sign, 11 integer digits,
+// a decimal point and 8 fractional digits.
+static const size_t k_max_amount_chars = 21;
+
+// Writes the same characters as to_string() to [first, last), without
+// allocating.  Returns a pointer one past the last character written, or
+// nullptr if the buffer is too small.  No NUL terminator is written.
+char* to_chars(char* first, char* last, const Amount& amt);
+
 struct SecretWebcash {
     SecureString sk;
     Amount amount;
@@ -62,6 +71,7 @@ inline bool operator>=(const SecretWebcash& lhs, const SecretWebcash& rhs) { ret
 inline bool operator>(const SecretWebcash& lhs, const SecretWebcash& rhs) { return std::tie(lhs.amount, lhs.sk) > std::tie(rhs.amount, rhs.sk); }
 
 SecureString to_string(const SecretWebcash& esk);
+char* to_chars(char* first, char* last, const SecretWebcash& esk);
 
 struct PublicWebcash {
     uint256 pk;
@@ -89,6 +99,11 @@ inline bool operator>=(const PublicWebcash& lhs, const PublicWebcash& rhs) { ret
 inline bool operator>(const PublicWebcash& lhs, const PublicWebcash& rhs) { return std::tie(lhs.amount, lhs.pk) > std::tie(rhs.amount, rhs.pk); }
 
 std::string to_string(const PublicWebcash& epk);
+char* to_chars(char* first, char* last, const PublicWebcash& epk);
+
+// The longest output of to_string(const PublicWebcash&), which never has a
+// sign: "e", the amount, ":public:" and 64 hex digits.
+static const size_t k_max_public_webcash_chars = 1 + (k_max_amount_chars - 1) + 8 + 64;
 
 #endif // WEBCASH_H
 
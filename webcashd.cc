@@ -16,6 +16,7 @@
 #include "async.h"
 #include "crypto/sha256.h"
 #include "server.h"
+#include "util/hex.h"
 
 int main(int argc, char **argv)
 {
@@ -25,6 +26,8 @@ int main(int argc, char **argv)
 
     const std::string algo = SHA256AutoDetect();
     std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
+    const std::string hex_algo = HexAutoDetect();
+    std::cout << "Using hex algorithm '" << hex_algo << "'." << std::endl;
 
     // Configure the number of worker threads
     int num_workers = get_num_workers();
@@ -33,10 +33,14 @@
 #include <univalue.h>
 
 #include "async.h"
+#include "crypto/chacha20.h"
 #include "crypto/sha256.h"
+#include "crypto/sha512.h"
 #include "random.h"
 #include "support/cleanse.h"
 #include "uint256.h"
+#include "util/hex.h"
+#include "util/pow.h"
 #include "wallet.h"
 
 struct ProtocolSettings {
@@ -127,28 +131,6 @@ bool get_protocol_settings(const std::string& server, ProtocolSettings& settings
     return true;
 }
 
-bool check_proof_of_work(const uint256& hash, int difficulty)
-{
-    const unsigned char* ptr = hash.begin();
-    while (difficulty >= 8) {
-        if (*ptr != 0) {
-            return false;
-        }
-        ++ptr;
-        difficulty -= 8;
-    }
-    switch (difficulty) {
-        case 1: return (*ptr <= 0x7f);
-        case 2: return (*ptr <= 0x3f);
-        case 3: return (*ptr <= 0x1f);
-        case 4: return (*ptr <= 0x0f);
-        case 5: return (*ptr <= 0x07);
-        case 6: return (*ptr <= 0x03);
-        case 7: return (*ptr <= 0x01);
-    }
-    return true;
-}
-
 std::string get_speed_string(int64_t attempts, absl::Time begin, absl::Time end) {
     float speed = attempts / absl::ToDoubleSeconds(end - begin);
     if (speed < 2e3f)
@@ -216,6 +198,8 @@ ABSL_FLAG(std::string, webcashlog, "webcash.log", "filename to place generated w
 ABSL_FLAG(std::string, orphanlog, "orphans.log", "filename to place solved proof-of-works the server rejects, and their associated webcash claim codes");
 ABSL_FLAG(std::string, walletfile, "default_wallet", "base filename of wallet files");
 ABSL_FLAG(unsigned, maxdifficulty, 80, "disable mining above this difficulty");
+ABSL_FLAG(bool, recover, false, "rescan the server for outputs belonging to the wallet's master secret before mining");
+ABSL_FLAG(unsigned, walletmaxoutputs, 1000, "merge wallet outputs in the background to keep at most this many (0 to disable)");
 
 void update_thread_func()
 {
@@ -288,7 +272,7 @@ void update_thread_func()
                 std::cerr << "Stale mining report detected (" << apparent_difficulty << " < " << current_difficulty << "); skipping" << std::endl;
                 // Save the solution to the orphan log
                 std::ofstream orphan_log(orphan_log_filename, std::ofstream::app);
-                orphan_log << soln.preimage << ' ' << absl::BytesToHexString(absl::string_view((const char*)soln.hash.begin(), 32)) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
+                orphan_log << soln.preimage << ' ' << HexStr32(soln.hash.begin()) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
                 orphan_log.flush();
                 continue;
             }
@@ -332,7 +316,7 @@ void update_thread_func()
                 g_next_settings_fetch = absl::Now();
                 // Save the solution to the orphan log
                 std::ofstream orphan_log(orphan_log_filename, std::ofstream::app);
-                orphan_log << soln.preimage << ' ' << absl::BytesToHexString(absl::string_view((const char*)soln.hash.begin(), 32)) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
+                orphan_log << soln.preimage << ' ' << HexStr32(soln.hash.begin()) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
                 orphan_log.flush();
                 continue;
             }
@@ -347,14 +331,18 @@ void update_thread_func()
                 }
             }
 
-            // Claim the coin with our wallet
-            if (!g_wallet->Insert(soln.webcash, true)) {
-                // Save the successfully submitted webcash to the log, since we
-                // were unable to add it to the wallet.
-                std::ofstream webcash_log(webcash_log_filename, std::ofstream::app);
-                webcash_log << to_string(soln.webcash) << std::endl;
-                webcash_log.flush();
-            }
+            // Claim the coin with our wallet.  The insertion is performed by
+            // the wallet's writer thread, so that we can get back to
+            // submitting work without waiting on disk or network access.
+            g_wallet->InsertAsync(soln.webcash, true, [webcash_log_filename, webcash = soln.webcash](bool ok) {
+                if (!ok) {
+                    // Save the successfully submitted webcash to the log, since
+                    // we were unable to add it to the wallet.
+                    std::ofstream webcash_log(webcash_log_filename, std::ofstream::app);
+                    webcash_log << to_string(webcash) << std::endl;
+                    webcash_log.flush();
+                }
+            });
         }
 
         std::unique_lock<std::mutex> lock(g_state_mutex);
@@ -443,13 +431,17 @@ void mining_thread_func(int id)
         uint256 sk;
         SecretWebcash keep;
         keep.amount = g_mining_amount - g_subsidy_amount;
-        GetStrongRandBytes(sk.begin(), 32);
-        keep.sk = absl::BytesToHexString(absl::string_view((const char*)sk.begin(), sk.size()));
+        GetSecretRandBytes(sk.begin(), 32);
+        // Encode directly into the secure string, so no copy of the secret
+        // is left behind in unlocked memory.
+        keep.sk.resize(64);
+        HexEncode32(&keep.sk[0], sk.begin());
 
         SecretWebcash subsidy;
         subsidy.amount = g_subsidy_amount;
-        GetStrongRandBytes(sk.begin(), 32);
-        subsidy.sk = absl::BytesToHexString(absl::string_view((const char*)sk.begin(), sk.size()));
+        GetSecretRandBytes(sk.begin(), 32);
+        subsidy.sk.resize(64);
+        HexEncode32(&subsidy.sk[0], sk.begin());
         memory_cleanse(sk.begin(), 32);
 
         std::string subsidy_str = std::string(to_string(subsidy).c_str());
@@ -475,27 +467,23 @@ void mining_thread_func(int id)
                     midstate.WriteAndFinalize8((const unsigned char*)nonces + 4*i, (const unsigned char*)nonces + 4*(j+k), (const unsigned char*)final, hashes + k*32);
                 }
 
-                for (int k = 0; k < W; ++k) {
-                    if (!(*(const uint16_t*)(hashes + k*32))) {
-                        uint256 hash({hashes + k*32, hashes + k*32 + 32});
-                        if (check_proof_of_work(hash, g_difficulty)) {
-                            std::string work = absl::StrCat(prefix_b64, absl::string_view(nonces + 4*i, 4), absl::string_view(nonces + 4*j + 4*k, 4), final);
-                            std::cout << "GOT SOLUTION!!! " << work << " " << absl::StrCat("0x" + absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32))) << " " << to_string(keep) << std::endl;
-
-                            // Add solution to the queue, and wake up the server
-                            // communication thread.
-                            {
-                                const std::lock_guard<std::mutex> lock(g_state_mutex);
-                                g_solutions.emplace_back(hash, work, keep);
-                            }
-                            g_update_thread_cv.notify_all();
-
-                            // Generate new Webcash secrets, so that we don't
-                            // reuse a secret if we happen to generate two
-                            // solutions back-to-back.
-                            break;
-                        }
+                const size_t k = FindProofOfWork(hashes, W, g_difficulty);
+                if (k < W) {
+                    uint256 hash({hashes + k*32, hashes + k*32 + 32});
+                    std::string work = absl::StrCat(prefix_b64, absl::string_view(nonces + 4*i, 4), absl::string_view(nonces + 4*j + 4*k, 4), final);
+                    std::cout << "GOT SOLUTION!!! " << work << " " << absl::StrCat("0x" + HexStr32(hash.begin())) << " " << to_string(keep) << std::endl;
+
+                    // Add solution to the queue, and wake up the server
+                    // communication thread.
+                    {
+                        const std::lock_guard<std::mutex> lock(g_state_mutex);
+                        g_solutions.emplace_back(hash, work, keep);
                     }
+                    g_update_thread_cv.notify_all();
+
+                    // Only the first solution in each batch is taken, so
+                    // that we don't reuse a secret if we happen to generate
+                    // two solutions back-to-back.
                 }
             }
         }
@@ -509,6 +497,23 @@ int main(int argc, char **argv)
 
     const std::string server = absl::GetFlag(FLAGS_server);
 
+    // The wallet encodes secrets on its own writer thread, so the hex
+    // implementation must be chosen before it is opened.
+    const std::string hex_algo = HexAutoDetect();
+    std::cout << "Using hex algorithm '" << hex_algo << "'." << std::endl;
+    // Likewise the per-thread secret generators draw on ChaCha20, and the
+    // random subsystem below is seeded through SHA512.
+    const std::string chacha20_algo = ChaCha20AutoDetect();
+    std::cout << "Using ChaCha20 algorithm '" << chacha20_algo << "'." << std::endl;
+    const std::string sha512_algo = SHA512AutoDetect();
+    std::cout << "Using SHA512 algorithm '" << sha512_algo << "'." << std::endl;
+    // The wallet derives and hashes secrets with SHA256 on its own threads
+    // too, and the proof-of-work check is selected alongside it.
+    const std::string algo = SHA256AutoDetect();
+    std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
+    const std::string pow_algo = ProofOfWorkAutoDetect();
+    std::cout << "Using proof-of-work check '" << pow_algo << "'." << std::endl;
+
     // The random subsystem must be initialized before the wallet is created on
     // first use, or else generated secrets may not be secure.  The random
     // subsystem will auto-initialize itself on first invocation, but we do so
@@ -521,7 +526,7 @@ int main(int argc, char **argv)
 
     // Open the wallet file, which will throw an error if the walletfile
     // parameter is unusable.
-    g_wallet = std::unique_ptr<Wallet>(new Wallet(absl::GetFlag(FLAGS_walletfile)));
+    g_wallet = std::unique_ptr<Wallet>(new Wallet(absl::GetFlag(FLAGS_walletfile), WalletStorage::WRITE_AHEAD_LOG));
     if (!g_wallet) {
         std::cerr << "Error: Unable to open wallet." << std::endl;
         return 1;
@@ -555,6 +560,21 @@ int main(int argc, char **argv)
     }
     std::cout << "Terms of service" << (accepted ? " already" : "") << " accepted." << std::endl;
 
+    if (absl::GetFlag(FLAGS_recover) && !g_wallet->Recover()) {
+        std::cerr << "Error: Unable to recover wallet outputs from server." << std::endl;
+        return 1;
+    }
+    // Mining with a wallet restored from its recovery file would hand out
+    // keys the server may already have seen.
+    if (g_wallet->IsRecoveryPending()) {
+        std::cerr << "Error: Wallet was restored from its recovery file.  Run again with --recover to recover its outputs from the server." << std::endl;
+        return 1;
+    }
+
+    // Keep the number of outputs in the wallet bounded, since each mining
+    // success adds another.
+    g_wallet->SetConsolidation(absl::GetFlag(FLAGS_walletmaxoutputs));
+
     {
         // Touch the wallet file, which will create it if it doesn't
         // already exist.  The file locking primitives assume that the
@@ -572,9 +592,6 @@ int main(int argc, char **argv)
 
     int num_workers = get_num_workers();
 
-    const std::string algo = SHA256AutoDetect();
-    std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
-
     // Inform the user of the maximum difficulty setting.
     std::cout << "Setting maximum difficulty to " << absl::GetFlag(FLAGS_maxdifficulty) << "." << std::endl;
 